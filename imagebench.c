@@ -0,0 +1,380 @@
+/* -*- c-file-style: "Ellemtel" -*- */
+/* Copyright (C) 2022   Canada-France-Hawaii Telescope Corp.          */
+/* This program is distributed WITHOUT any warranty, and is under the */
+/* terms of the GNU General Public License, see the file COPYING      */
+/*!**********************************************************************
+ *
+ * DESCRIPTION
+ *
+ *    End to end benchmark of the Tau and ZWO camera servers.  It sends
+ *    the given setup commands, then takes images back to back the way
+ *    taugrab and zwograb do, throws the data away and reports the image
+ *    rate and the latency of each request.  Run it against a server
+ *    built with -DMOCK_CAMERA to measure the servers without a camera.
+ *
+ *********************************************************************!*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "sockio/sockclnt.h"
+#include "cfht/cfht.h"
+#include "cli/cli.h"
+
+#define IMAGE_CMD "image"
+#define ASYNC_ARG "async"
+#define BULK_CMD "bulk"
+#define LATEST_CMD "latest"
+#define FRAMES_CMD "frames"
+#define PREVIEW_CMD "preview"
+#define SUBSCRIBE_CMD "subscribe"
+#define COUNT_ARG "count="
+#define BULK_REPLY "BULK"
+#define BULK_RCVBUF (4 * 1024 * 1024)
+#define SOCKET_TIMEOUT 150
+#define DEFAULT_COUNT 20
+
+static void
+usage(void)
+{
+   fprintf(stderr, "usage: imagebench <host:port> [count=<n>] [etime=<sec>] [gain=<gain>] [bulk] [compress=rice|none] [video=on|off] [pipeline=on|off] [latest|frames=<n>|preview|subscribe]\n");
+}
+
+
+/*
+ * Get a monotonic timestamp for timing the requests
+ */
+static double
+benchClockTime(void) {
+
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (double)(ts.tv_sec + ts.tv_nsec / 1000000000.0);
+}
+
+
+/*
+ * Comparison function used by qsort to order the timings
+ */
+static int
+compareTimings(const void *a, const void *b)
+{
+   double x = *(const double *)a;
+   double y = *(const double *)b;
+
+   return (x > y) - (x < y);
+}
+
+
+/*
+ * Print the mean, p50, p99 and maximum of 'n' timings, in milliseconds.
+ * The timings are sorted in place.
+ */
+static void
+printTimings(const char *name, double *timing, int n)
+{
+   double sum = 0;
+   int i;
+
+   for (i = 0; i < n; i++) {
+      sum += timing[i];
+   }
+   qsort(timing, n, sizeof(double), compareTimings);
+   printf("%-8s mean %8.1f  p50 %8.1f  p99 %8.1f  max %8.1f ms\n", name,
+	  sum * 1000.0 / n, timing[(int)(0.50 * (n - 1) + 0.5)] * 1000.0,
+	  timing[(int)(0.99 * (n - 1) + 0.5)] * 1000.0,
+	  timing[n - 1] * 1000.0);
+}
+
+
+/*
+ * Open the bulk data connection negotiated with the bulk command and
+ * identify it to the camera server with the token from the reply.
+ */
+static int
+connectDataChannel(const char *host, const char *port, const char *token)
+{
+   struct addrinfo hints;
+   struct addrinfo *res;
+   char line[40];
+   int rcvbuf = BULK_RCVBUF;
+   int fd;
+   int rc;
+
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_INET;
+   hints.ai_socktype = SOCK_STREAM;
+   if ((rc = getaddrinfo(host, port, &hints, &res)) != 0) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		"(%s:%d) unable to resolve data port %s:%s : %s",
+		__FILE__, __LINE__, host, port, gai_strerror(rc));
+      return -1;
+   }
+   if ((fd = socket(res->ai_family, res->ai_socktype,
+		    res->ai_protocol)) == -1) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		"(%s:%d) unable to create data socket : %s (errno=%d)",
+		__FILE__, __LINE__, strerror(errno), errno);
+      freeaddrinfo(res);
+      return -1;
+   }
+   setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+   if (connect(fd, res->ai_addr, res->ai_addrlen) == -1) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		"(%s:%d) unable to connect to data port %s:%s : %s"
+		" (errno=%d)", __FILE__, __LINE__, host, port,
+		strerror(errno), errno);
+      close(fd);
+      freeaddrinfo(res);
+      return -1;
+   }
+   freeaddrinfo(res);
+
+   snprintf(line, sizeof(line), "%s\n", token);
+   if (write(fd, line, strlen(line)) != (ssize_t)strlen(line)) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		"(%s:%d) unable to send token on data connection : %s"
+		" (errno=%d)", __FILE__, __LINE__, strerror(errno), errno);
+      close(fd);
+      return -1;
+   }
+
+   return fd;
+}
+
+
+/*
+ * Read and throw away 'nbytes' of image data
+ */
+static PASSFAIL
+discardImage(int fd, int nbytes)
+{
+   char buf[65536];
+   int count = 0;
+   int nread;
+
+   while (count < nbytes) {
+      nread = nbytes - count;
+      if (nread > (int)sizeof(buf)) {
+	 nread = sizeof(buf);
+      }
+      nread = read(fd, buf, nread);
+      if (nread == 0) {
+	 cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		   "(%s:%d) unexpected EOF on socket read",
+		   __FILE__, __LINE__);
+	 return FAIL;
+      }
+      if (nread == -1) {
+	 if (errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN) {
+	    usleep(1000);
+	    continue;
+	 }
+	 cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		   "(%s:%d) read from socket failed : %s (errno=%d)",
+		   __FILE__, __LINE__, strerror(errno), errno);
+	 return FAIL;
+      }
+      count += nread;
+   }
+
+   return PASS;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+   sockclnt_t *sock;
+   const char *reply;
+   char host[80];
+   char *port;
+   char image_request[40];
+   char data_mode[20];
+   char data_format[20];
+   char status;
+   double *latency;
+   double *reply_latency;
+   double start_ts, request_ts, elapsed;
+   double total_bytes = 0;
+   int count = DEFAULT_COUNT;
+   int subscribed = 0;
+   int async = 1;
+   int one = 1;
+   int data_fd = -1;
+   int in_fd;
+   int nbytes;
+   int i, n;
+
+   if (argc < 2) {
+      usage();
+      exit(EXIT_FAILURE);
+   }
+
+   /* Set up the CFHT logging calls */
+   cfht_logv(CFHT_MAIN, CFHT_LOG_ID,
+             cfht_basename((char *)NULL, argv[0], (char *)NULL));
+   cfht_logv(CFHT_MAIN, CFHT_START,
+             "%s", cfht_argsToString(argc, argv));
+
+   strncpy(host, argv[1], sizeof(host) - 1);
+   host[sizeof(host) - 1] = '\0';
+   if ((port = strchr(host, ':')) == NULL) {
+      usage();
+      exit(EXIT_FAILURE);
+   }
+
+   /*
+    * Connect to the camera server.
+    */
+   if ((sock = sockclnt_create(argv[1], SOCKET_TIMEOUT)) == NULL) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		"(%s:%d) unable to connect to camera server at %s",
+		__FILE__, __LINE__, argv[1]);
+      exit(EXIT_FAILURE);
+   }
+   setsockopt(sock->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+   *port++ = '\0';
+
+   /*
+    * Send the setup commands given on the command line (see usage), the
+    * same way the grabbers do.  A latest, frames or preview argument
+    * replaces the image request itself instead, and after subscribe the
+    * images are pushed by the server without being requested at all.
+    */
+   strcpy(image_request, IMAGE_CMD " " ASYNC_ARG);
+   for (i = 2; i < argc; i++) {
+      char *arg;
+      char *equal;
+
+      if (!strncasecmp(argv[i], COUNT_ARG, strlen(COUNT_ARG))) {
+	 count = atoi(argv[i] + strlen(COUNT_ARG));
+	 continue;
+      }
+      arg = strdup(argv[i]);
+      if ((equal = strchr(arg, '=')) != NULL) {
+	 *equal = ' ';
+      }
+      if (!strcasecmp(arg, LATEST_CMD) || !strcasecmp(arg, PREVIEW_CMD) ||
+	  !strncasecmp(arg, FRAMES_CMD " ", strlen(FRAMES_CMD) + 1)) {
+	 snprintf(image_request, sizeof(image_request), "%s", arg);
+	 async = 0;
+	 free(arg);
+	 continue;
+      }
+
+      sockclnt_send(sock, arg);
+      reply = sockclnt_recv(sock);
+      if (!reply || *reply == '!') {
+	 cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		   "(%s:%d) error received from the camera server."
+		   "  Response = '%s'", __FILE__, __LINE__, reply);
+	 exit(EXIT_FAILURE);
+      }
+
+      if (!strcasecmp(arg, SUBSCRIBE_CMD)) {
+	 subscribed = 1;
+	 async = 0;
+	 strcpy(image_request, SUBSCRIBE_CMD);
+      }
+
+      /*
+       * A bulk reply carries the data port and token to connect with
+       */
+      if (!strcasecmp(arg, BULK_CMD)) {
+	 char data_port[20];
+	 char token[20];
+
+	 if (sscanf(reply, "%c %*s %19s %19s", &status, data_port,
+		    token) != 3 ||
+	     (data_fd = connectDataChannel(host, data_port, token)) == -1) {
+	    cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		      "(%s:%d) unable to set up bulk transfer."
+		      "  Response = '%s'", __FILE__, __LINE__, reply);
+	    exit(EXIT_FAILURE);
+	 }
+      }
+      free(arg);
+   }
+   if (count < 1) {
+      usage();
+      exit(EXIT_FAILURE);
+   }
+   latency = (double *)cli_malloc(count * sizeof(double));
+   reply_latency = (double *)cli_malloc(count * sizeof(double));
+
+   /*
+    * Take the images back to back
+    */
+   sockclnt_set_mode(sock, SOCKCLNT_MODE_BINARY);
+   start_ts = benchClockTime();
+   for (n = 0; n < count; n++) {
+      request_ts = benchClockTime();
+      if (!subscribed) {
+	 sockclnt_send(sock, image_request);
+      }
+      reply = sockclnt_recv(sock);
+
+      /*
+       * An IMAGE ASYNC is acknowledged before the image is announced
+       */
+      if (async && reply && (*reply != '!')) {
+	 reply = sockclnt_recv(sock);
+      }
+      reply_latency[n] = benchClockTime() - request_ts;
+
+      data_mode[0] = '\0';
+      data_format[0] = '\0';
+      if (!reply || sscanf(reply, "%c %d %19s %19s", &status, &nbytes,
+			   data_mode, data_format) < 2 ||
+	  status != '.') {
+	 cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		   "(%s:%d) error received from the camera server."
+		   "  Response = '%s'", __FILE__, __LINE__, reply);
+	 break;
+      }
+      in_fd = sock->fd;
+      if (!strcasecmp(data_mode, BULK_REPLY) && (data_fd != -1)) {
+	 in_fd = data_fd;
+      }
+      if (discardImage(in_fd, nbytes) != PASS) {
+	 break;
+      }
+      latency[n] = benchClockTime() - request_ts;
+      total_bytes += nbytes;
+   }
+   elapsed = benchClockTime() - start_ts;
+
+   /*
+    * Report
+    */
+   if (n == 0) {
+      printf("No images received\n");
+      exit(EXIT_FAILURE);
+   }
+   printf("%d x '%s' from %s: %.2f images/s, %.1f MB/s, %.0f bytes/image\n",
+	  n, image_request, argv[1], n / elapsed,
+	  total_bytes / elapsed / 1.0e6, total_bytes / n);
+   printTimings("reply", reply_latency, n);
+   printTimings("image", latency, n);
+
+   sockclnt_send(sock, "quit");
+   reply = sockclnt_recv(sock);
+   sockclnt_destroy(sock);
+   if (data_fd != -1) {
+      close(data_fd);
+   }
+
+   exit((n == count) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
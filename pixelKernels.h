@@ -0,0 +1,290 @@
+/* -*- c-file-style: "Ellemtel" -*- */
+/* Copyright (C) 2022   Canada-France-Hawaii Telescope Corp.          */
+/* This program is distributed WITHOUT any warranty, and is under the */
+/* terms of the GNU General Public License, see the file COPYING      */
+/*!**********************************************************************
+ *
+ * DESCRIPTION
+ *
+ *    Pixel loops shared by the camera servers: stacking frames, finding
+ *    the minimum of a stack and the median of a frame, and turning
+ *    camera or stacked pixels into mirrored, big-endian FITS pixels.
+ *    Everything is static inline and compiles as C or C++, so
+ *    zwocamServ.c, taucamServ.cc and taucamLocal.cc all use the same
+ *    code.  NEON handles eight pixels at a time on the Raspberry Pi.
+ *
+ *    Where a caller passes a constant, such as PIXEL_TAU_WIDTH or the
+ *    flip and byte order it always uses, the copy inlined there is
+ *    compiled for it: the row loop has a known trip count with no
+ *    scalar tail, and the branches on the flags are gone.
+ *
+ *********************************************************************!*/
+#ifndef PIXEL_KERNELS_H
+#define PIXEL_KERNELS_H
+
+#include <stddef.h>
+#include <string.h>
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#define PIXEL_TAU_WIDTH 640	/* Frames of the FLIR Tau 2 */
+#define PIXEL_TAU_HEIGHT 512
+#define PIXEL_IMX178_WIDTH 3096	/* Full frame of the ZWO ASI178MM */
+#define PIXEL_IMX178_HEIGHT 2080
+#define PIXEL_BZERO 0x8000	/* Offset of unsigned pixels in FITS */
+
+
+#ifdef __ARM_NEON
+/*
+ * Get the smallest of 'min_val' and the four lanes of 'v'
+ */
+static inline int
+pixelMinLanes(int32x4_t v, int min_val)
+{
+   int lane[4];
+   int i;
+
+   vst1q_s32(lane, v);
+   for (i = 0; i < 4; i++) {
+      if (lane[i] < min_val) {
+	 min_val = lane[i];
+      }
+   }
+
+   return min_val;
+}
+
+
+/*
+ * Store the eight pixels 'pix' found at column 'x' of a row 'width'
+ * pixels wide, mirrored to the other end of the row if 'flip' is set and
+ * offset by BZERO and swapped to big-endian if 'fits_order' is
+ */
+static inline void
+pixelStore8(unsigned short *dst, uint16x8_t pix, int x, int width, int flip,
+	    int fits_order)
+{
+   if (fits_order) {
+      pix = vreinterpretq_u16_u8(vrev16q_u8(vreinterpretq_u8_u16(
+	 veorq_u16(pix, vdupq_n_u16(PIXEL_BZERO)))));
+   }
+   if (flip) {
+      pix = vrev64q_u16(pix);
+      pix = vcombine_u16(vget_high_u16(pix), vget_low_u16(pix));
+      vst1q_u16(dst + width - x - 8, pix);
+   }
+   else {
+      vst1q_u16(dst + x, pix);
+   }
+}
+#endif
+
+
+/*
+ * Offset a pixel by BZERO and swap it to big-endian if 'fits_order' is set
+ */
+static inline unsigned short
+pixelOrder(unsigned short pix, int fits_order)
+{
+   if (fits_order) {
+      pix ^= PIXEL_BZERO;
+      pix = (unsigned short)((pix >> 8) | (pix << 8));
+   }
+
+   return pix;
+}
+
+
+/*
+ * Add the 'n' pixels of a frame, less 'offset', to the 32-bit sums of a
+ * stack.  A stack that keeps track of the offset itself passes 0.
+ */
+static inline void
+pixelAccumulate(int *stack, const unsigned short *frame, size_t n, int offset)
+{
+   size_t i = 0;
+
+#ifdef __ARM_NEON
+   const uint32x4_t voffset = vdupq_n_u32((unsigned int)offset);
+
+   for (; i + 8 <= n; i += 8) {
+      uint16x8_t pix = vld1q_u16(frame + i);
+      uint32x4_t lo = vreinterpretq_u32_s32(vld1q_s32(stack + i));
+      uint32x4_t hi = vreinterpretq_u32_s32(vld1q_s32(stack + i + 4));
+
+      lo = vaddw_u16(lo, vget_low_u16(pix));
+      hi = vaddw_u16(hi, vget_high_u16(pix));
+      if (offset != 0) {
+	 lo = vsubq_u32(lo, voffset);
+	 hi = vsubq_u32(hi, voffset);
+      }
+      vst1q_s32(stack + i, vreinterpretq_s32_u32(lo));
+      vst1q_s32(stack + i + 4, vreinterpretq_s32_u32(hi));
+   }
+#endif
+   for (; i < n; i++) {
+      stack[i] += frame[i] - offset;
+   }
+}
+
+
+/*
+ * Get the smallest of 'min_val' and the 'n' values of a stack
+ */
+static inline int
+pixelMin(const int *data, size_t n, int min_val)
+{
+   size_t i = 0;
+
+#ifdef __ARM_NEON
+   int32x4_t vmin = vdupq_n_s32(min_val);
+
+   for (; i + 8 <= n; i += 8) {
+      vmin = vminq_s32(vmin, vld1q_s32(data + i));
+      vmin = vminq_s32(vmin, vld1q_s32(data + i + 4));
+   }
+   min_val = pixelMinLanes(vmin, min_val);
+#endif
+   for (; i < n; i++) {
+      if (data[i] < min_val) {
+	 min_val = data[i];
+      }
+   }
+
+   return min_val;
+}
+
+
+/*
+ * Find the median of a 16-bit image with a two level histogram instead of
+ * partitioning a copy of it.  The first pass bins every m'th pixel by its
+ * high byte to find the block of 256 values holding the median, and the
+ * second pass bins only the pixels in that block by their low byte.  The
+ * array isn't modified and the result is the same element that the
+ * medianCalculation() of the Tau servers returns for the same 'n' and 'm'.
+ */
+static inline unsigned short
+pixelMedian(const unsigned short *arr, unsigned int n, unsigned int m)
+{
+   unsigned int coarse[4][256];
+   unsigned int fine[256];
+   unsigned int count, rank, total;
+   unsigned int high, low;
+   unsigned int i;
+
+   /* Reduce the number of elements in the array by the multiplying factor */
+   count = n / m;
+   if (count == 0) {
+      return 0;
+   }
+   rank = (count - 1) / 2;
+
+   /*
+    * Bin by the high byte.  Four interleaved histograms keep runs of equal
+    * pixels from serializing on the same counter.
+    */
+   memset(coarse, 0, sizeof(coarse));
+   for (i = 0; i + 4 <= count; i += 4) {
+      coarse[0][arr[i * m] >> 8]++;
+      coarse[1][arr[(i + 1) * m] >> 8]++;
+      coarse[2][arr[(i + 2) * m] >> 8]++;
+      coarse[3][arr[(i + 3) * m] >> 8]++;
+   }
+   for (; i < count; i++) {
+      coarse[0][arr[i * m] >> 8]++;
+   }
+   total = 0;
+   for (high = 0; high < 255; high++) {
+      unsigned int c = coarse[0][high] + coarse[1][high] + 
+	 coarse[2][high] + coarse[3][high];
+      if (total + c > rank) {
+	 break;
+      }
+      total += c;
+   }
+   rank -= total;
+
+   /*
+    * Bin the low byte of the pixels that fall in the median's block.  The
+    * comparison is added rather than branched on so the pass stays
+    * branch free.
+    */
+   memset(fine, 0, sizeof(fine));
+   for (i = 0; i < count; i++) {
+      unsigned short value = arr[i * m];
+      fine[value & 0xff] += ((unsigned int)(value >> 8) == high);
+   }
+   for (low = 0; low < 255; low++) {
+      if (fine[low] > rank) {
+	 break;
+      }
+      rank -= fine[low];
+   }
+
+   return (unsigned short)((high << 8) | low);
+}
+
+
+/*
+ * Turn a row of 'width' camera pixels into FITS pixels, mirrored if
+ * 'flip' is set, and offset and swapped for a FITS data unit if
+ * 'fits_order' is
+ */
+static inline void
+pixelRowFromFrame(unsigned short *dst, const unsigned short *src, int width,
+		  int flip, int fits_order)
+{
+   int x = 0;
+
+#ifdef __ARM_NEON
+   for (; x + 8 <= width; x += 8) {
+      pixelStore8(dst, vld1q_u16(src + x), x, width, flip, fits_order);
+   }
+#endif
+   for (; x < width; x++) {
+      dst[flip ? width - 1 - x : x] = pixelOrder(src[x], fits_order);
+   }
+}
+
+
+/*
+ * Turn a row of 'width' stacked values into FITS pixels the same way,
+ * after taking 'offset' off them, dividing them by 2^'shift' with
+ * rounding and clipping them to 16 bits
+ */
+static inline void
+pixelRowFromStack(unsigned short *dst, const int *src, int width, int offset,
+		  int shift, int flip, int fits_order)
+{
+   int x = 0;
+
+#ifdef __ARM_NEON
+   const int32x4_t voffset = vdupq_n_s32(offset);
+   const int32x4_t vshift = vdupq_n_s32(-shift);
+
+   for (; x + 8 <= width; x += 8) {
+      int32x4_t lo = vsubq_s32(vld1q_s32(src + x), voffset);
+      int32x4_t hi = vsubq_s32(vld1q_s32(src + x + 4), voffset);
+
+      if (shift > 0) {
+	 lo = vrshlq_s32(lo, vshift);
+	 hi = vrshlq_s32(hi, vshift);
+      }
+      pixelStore8(dst, vcombine_u16(vqmovun_s32(lo), vqmovun_s32(hi)), x,
+		  width, flip, fits_order);
+   }
+#endif
+   for (; x < width; x++) {
+      int value = src[x] - offset;
+      unsigned short pix;
+
+      if (shift > 0) {
+	 value = (value + (1 << (shift - 1))) >> shift;
+      }
+      pix = (value < 0) ? 0 : ((value > 65535) ? 65535 : value);
+      dst[flip ? width - 1 - x : x] = pixelOrder(pix, fits_order);
+   }
+}
+
+#endif
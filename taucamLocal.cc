@@ -41,6 +41,8 @@
 #include "ss/linked_list.h"
 #include "thermalgrabber/thermalgrabber.h"
 
+#include "pixelKernels.h"
+
 #define TAUSERV_PORT "915" /* Port name or number on which to listen */
 #define READOUT_TIMEOUT 15 /* Abort readout if client disappears for 15 sec. */
 #define EXPOSE_TIMEOUT 5   /* Amount beyond etime to wait before timeout */
@@ -384,7 +386,6 @@ medianCalculation(unsigned short *arr, unsigned int n, unsigned int m)
 static void 
 callbackTauImage(TauRawBitmap &bitmap, void *caller) {
 
-   unsigned short *image_copy;
    unsigned short median;
 
    /*
@@ -425,25 +426,17 @@ callbackTauImage(TauRawBitmap &bitmap, void *caller) {
    }
 
    /*
-    * Make a copy of the image and determine the median background
+    * Determine the median background straight from the camera buffer
     */
-   image_copy = (unsigned short *)cli_malloc(serv_info->width * 
-					     serv_info->height * 
-					     sizeof(unsigned short));
-   memcpy(image_copy, bitmap.data, serv_info->width * serv_info->height * 
-	  sizeof(unsigned short));
-   median = medianCalculation(image_copy, serv_info->width * serv_info->height,
-			      1);
-   free(image_copy);
+   median = pixelMedian(bitmap.data, serv_info->width * serv_info->height, 1);
       
    /*
     * Add the median subtracted pixels to the stacked image
     */
 //   pthread_mutex_lock(&lock);
    mtx.lock();
-   for (unsigned int i = 0; i < serv_info->width * serv_info->height; i++) {
-      serv_info->stack_data[i] += bitmap.data[i] - median;
-   }
+   pixelAccumulate(serv_info->stack_data, bitmap.data, 
+		   serv_info->width * serv_info->height, median);
    serv_info->frame_count++;
    mtx.unlock();
 
@@ -784,12 +777,8 @@ takeImage(const char *fileName, char *buffer)
     * Find the minimum pixel value of the stacked image and adjust the 
     * threshold of the image by this amount
     */
-   min_val = 65535;
-   for (i = 0; i < serv_info->width * serv_info->height; i++) {
-      if (serv_info->stack_data[i] < min_val) {
-	 min_val = serv_info->stack_data[i];
-      }
-   }
+   min_val = pixelMin(serv_info->stack_data, 
+		      serv_info->width * serv_info->height, 65535);
 
    /*
     * Take the stacked image and set it up to be saved with an offset bias
@@ -11,7 +11,7 @@
  *    receive images.
  *
  *********************************************************************!*/
-#include <mutex>
+#include <atomic>
 #include <sys/time.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,11 +24,27 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <ifaddrs.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/random.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <linux/i2c-dev.h>
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
 
 #include "cli/cli.h"
 #include "fh/fh.h"
@@ -39,12 +55,50 @@
 #include "ss/linked_list.h"
 #include "ssapi/ss_api.h"
 #include "ssapi/ss_error.h"
+#ifndef MOCK_CAMERA
 #include "thermalgrabber/thermalgrabber.h"
+#endif
+
+#include "pixelKernels.h"
 
 #define TAUSERV_PORT "916" /* Port name or number on which to listen */
 #define READOUT_TIMEOUT 15 /* Abort readout if client disappears for 15 sec. */
 #define EXPOSE_TIMEOUT 5   /* Amount beyond etime to wait before timeout */
 #define SEND_BUF_SIZE 5000 /* Number of pixels to send at a time */
+#define TAUSERV_DATA_PORT "926" /* Port for bulk image data connections */
+#define BULK_SNDBUF (4 * 1024 * 1024) /* Socket send buffer for bulk data */
+#define BULK_CONNECT_TIMEOUT 2 /* Wait for the bulk data connection */
+#define MAX_PENDING_DATA 4 /* Data connections waiting to be claimed */
+#define FRAME_RING_SLOTS 8 /* Camera frames buffered for the server loop */
+#define TAU_MAX_WIDTH 640  /* Largest frame of the Tau 2 cores */
+#define TAU_MAX_HEIGHT 512
+#define CAMERA_SILENCE 5   /* Seconds without a frame before reconnecting */
+#define CAMERA_SILENCE_MAX 60 /* Longest wait for frames after reconnecting */
+#define LOGON_RETRY_MIN 1  /* Seconds before retrying the Status Server */
+#define LOGON_RETRY_MAX 60 /* Longest wait between retries */
+#define MAX_SUBSCRIBERS 8  /* Clients sent every image as it is taken */
+#define SUBSCRIBE_RETRY 1  /* Seconds before exposing again after a failure */
+#define MAX_IMAGE_CLIENTS 16 /* Clients waiting for an image at once */
+#define MAX_SEQUENCES 8    /* Clients taking a sequence of images at once */
+#define EXPOSURE_POLL_INTERVAL 0.005 /* Frame wait between sockserv polls */
+#define WAKE_EVENTS 16     /* Events collected by one wait of the loop */
+#define REPLY_SIZE 256     /* Reply held back until an exposure is done */
+#define CALIB_DIR "/var/tmp/taucam-calib" /* Where the masters are kept */
+#define CALIB_PATH_SIZE 256 /* Longest path of a master dark or flat */
+#define MAX_MASTERS 8      /* Master darks and flats kept mapped at once */
+#define MAX_CALIB_FRAMES 1000 /* Most exposures averaged into a master */
+#define ARCHIVE_DIR "/dev/shm/taucam-archive" /* Where the images are kept */
+#define ARCHIVE_DIR_ENV "TAUCAM_ARCHIVE_DIR" /* Keep them there instead */
+#define ARCHIVE_SEGMENTS_ENV "TAUCAM_ARCHIVE_SEGMENTS" /* Segments to use */
+#define ARCHIVE_SEGMENTS 0 /* None unless asked for: no archive */
+#define ARCHIVE_MAX_SEGMENTS 64 /* Most segments it can be given */
+#define ARCHIVE_SEGMENT_SIZE (64L * 1024 * 1024) /* Bytes in each segment */
+#define ARCHIVE_ENTRIES 65536 /* Images the index has room for */
+#define ARCHIVE_HEADER_SIZE (16 * 2880) /* Room for the headers of an image */
+#define ARCHIVE_ALIGN 65536 /* Images start on a page, whatever its size */
+#define ARCHIVE_MAGIC 0x54415541 /* Marks an index laid out as below */
+#define ARCHIVE_PATH_SIZE 256 /* Longest path of the archive */
+#define ARCHIVE_FILE_SIZE 32 /* Room for the name of a file in it */
 
 #define SOCKSERV_IDLE_POLL_INTERVAL 1   /* Corresponds to 1 second */
 #define MAX_EXPOSURE_DELAY 100 /* Maximum exposure time */
@@ -56,19 +110,42 @@
 #define SQR(X) ((X)*(X))
 
 #define IMAGE_CMD "IMAGE"
+#define BULK_CMD "BULK"
 #define ETIME_CMD "ETIME"
 #define GAIN_CMD "GAIN"
+#define STACK_CMD "STACK"
+#define COMPRESS_CMD "COMPRESS"
+#define SUBSCRIBE_CMD "SUBSCRIBE"
+#define STATUS_CMD "STATUS"
+#define SEQUENCE_CMD "SEQUENCE"
+#define DARK_CMD "DARK"
+#define FLAT_CMD "FLAT"
+#define CALIBRATE_CMD "CALIBRATE"
+#define DIFF_CMD "DIFF"
+#define FETCH_CMD "FETCH"
+#define FETCH_SINCE_ARG "SINCE="
 #define QUIT_CMD "QUIT"
 #define BYE_CMD "BYE"
 #define EXIT_CMD "EXIT"
 #define LOGOUT_CMD "LOGOUT"
 #define PASS_CHAR '.'
 #define FAIL_CHAR '!'
-#define TEMP_FILE "/tmp/image.fits"
+#define IMAGE_MEMFD_NAME "taucam-image"
 #define GAIN_AUTO_STRING "AUTO"
 #define GAIN_HIGH_STRING "HIGH"
 #define GAIN_LOW_STRING "LOW"
 #define GAIN_MANUAL_STRING "MANUAL"
+#define STACK_SUM_STRING "SUM"
+#define STACK_MEAN_STRING "MEAN"
+#define STACK_CLIP_STRING "CLIP"
+#define COMPRESS_RICE_STRING "RICE"
+#define COMPRESS_NONE_STRING "NONE"
+#define CALIBRATE_ON_STRING "ON"
+#define CALIBRATE_OFF_STRING "OFF"
+#define DIFF_OFF_STRING "OFF"
+#define DIFF_PREVIOUS_STRING "PREVIOUS"
+#define DIFF_MEDIAN_STRING "MEDIAN"
+#define IMAGE_ASYNC_STRING "ASYNC"
 
 #define SS_PATH "/i/dualcam/IR"
 #define SS_ETIME SS_PATH"/etime"
@@ -77,17 +154,57 @@
 #define SS_IPADDRESS SS_PATH"/ipAddress"
 #define SS_PORT SS_PATH"/port"
 #define SS_SERVER_RUNNING SS_PATH"/serverRunning"
+#define SS_STACKMODE SS_PATH"/stackMode"
+#define SS_STATS SS_PATH"/stats"
+#define SS_SKY SS_PATH"/sky"
 #define SS_DOME_AZ "/t/status/domeAz"
 
 #define SS_TEMP SS_PATH"/temperature"
 #define SS_PRES SS_PATH"/pressure"
 #define SS_HUMID SS_PATH"/humidity"
+#define BME_FILE "BMEOUT.txt"	/* Left by the BME280 sensor script */
+#define METADATA_REFRESH 10	/* Seconds between header metadata refreshes */
+#define CLEANUP_LOCK_TRIES 100 /* Tries at ss_lock before exiting without it */
+#define CLEANUP_LOCK_WAIT 10000 /* Microseconds between the tries */
+#define METADATA_SIZE 80	/* Longest header metadata value */
+#define BME280_DEVICE "/dev/i2c-1" /* I2C bus the BME280 sensor is on */
+#define BME280_ADDRESS 0x76	/* I2C address of the BME280 */
+#define BME280_CHIP_ID 0x60	/* What the BME280 answers to its ID register */
+#define BME280_PERIOD 1		/* Seconds between BME280 samples */
+#define BME280_STALE 10		/* Seconds a BME280 sample stays good for */
 
 #define FLIR_MODEL "FLIR TAU 2 640x512"
 #define PIXEL_SIZE 17
 #define MIN_ETIME 0.1
 #define MAX_ETIME 600
 #define DEFAULT_ETIME 1
+#define CLIP_SIGMA 3.0       /* Rejection threshold for the clipped mean */
+#define CLIP_MIN_FRAMES 5    /* Frames needed before clipping starts */
+#define BACKGROUND_STRIDE 1  /* Pixel stride for the background median */
+#define RICE_CMPTYPE "RICE_1" /* ZCMPTYPE of Rice tile compression */
+#define RICE_BLOCKSIZE 32  /* Pixels per Rice block */
+#define RICE_FSBITS 4      /* Bits of the split point code for 16-bit data */
+#define RICE_FSMAX 14      /* Largest split point before sending raw */
+#define COMPRESS_THREADS 4 /* Threads that compress the tiles of an image */
+#define CONVERT_THREADS 4  /* Threads that turn the stack into FITS pixels */
+#define STATS_WINDOW 256   /* Images kept for the timing percentiles */
+#define STATS_PUBLISH_INTERVAL 10 /* Seconds between Status Server updates */
+#define POOL_ALIGN 64      /* Alignment of the buffers carved from the pool */
+#define SKY_TILE 32        /* Side of the tiles the sky is measured in */
+#define SKY_MAX_TILES \
+   ((TAU_MAX_WIDTH / SKY_TILE) * (TAU_MAX_HEIGHT / SKY_TILE))
+#define SKY_STAR_SIGMA 5.0 /* Threshold for a star, in background RMS */
+#define SKY_PUBLISH_INTERVAL 1 /* Seconds between sky metric updates */
+
+/*
+ * Worst case size of a Rice compressed row of 'n' pixels
+ */
+#define RICE_ROW_BOUND(n) ((n) * 2 + ((n) / RICE_BLOCKSIZE + 1) + 4)
+
+/*
+ * Size of a buffer once it is rounded up to the pool alignment
+ */
+#define POOL_ROUND(n) (((n) + POOL_ALIGN - 1) / POOL_ALIGN * POOL_ALIGN)
 
 /*
  * Fast element swap
@@ -96,9 +213,186 @@
 
 #define FLIP_X
 
+/*
+ * Column a pixel goes to in the FITS image
+ */
+#ifdef FLIP_X
+#define FLIP_COLUMN(x, width) ((width) - 1 - (x))
+#define FLIP_PIXELS 1
+#else
+#define FLIP_COLUMN(x, width) (x)
+#define FLIP_PIXELS 0
+#endif
+
 #define DEBUG
 
 
+#if defined(MOCK_CAMERA) || defined(BENCHMARK)
+
+#define MOCK_SIZE_ENV "MOCK_CAMERA_SIZE" /* Simulated frame size, WxH */
+#define MOCK_RATE_ENV "MOCK_CAMERA_RATE" /* Simulated frames per second */
+#define MOCK_WIDTH 640
+#define MOCK_HEIGHT 512
+#define MOCK_BITS 14	   /* Bit depth of the simulated sensor */
+#define MOCK_RATE 30.0	   /* Frame rate of the Tau 2 */
+#define MOCK_FRAMES 4	   /* Synthetic frames cycled through */
+
+/*
+ * Fill a frame with something that looks like a sky background: a gentle
+ * gradient plus noise and a sprinkling of hot pixels, clipped to the bit
+ * depth of the sensor.  Each 'seed' gives a different noise pattern.
+ */
+static void
+fillSyntheticFrame(unsigned short *frame, unsigned int width, 
+		   unsigned int height, int bits, unsigned int seed)
+{
+   unsigned int max_value = (1U << bits) - 1;
+   unsigned int x, y, value;
+
+   for (y = 0; y < height; y++) {
+      for (x = 0; x < width; x++) {
+	 value = (max_value / 4) + (x + y) * (max_value / 8) / (width + height)
+	    + (rand_r(&seed) % 64);
+	 if ((rand_r(&seed) % 1000) == 0) {
+	    value = max_value - (rand_r(&seed) % 256);
+	 }
+	 frame[y * width + x] = (unsigned short)((value > max_value) ? 
+	    max_value : value);
+      }
+   }
+}
+
+#endif
+
+#ifdef MOCK_CAMERA
+
+/*
+ * Stand-in for the thermalgrabber library so the server can be run and
+ * measured on a workstation.  Build with -DMOCK_CAMERA and without
+ * -lthermalgrabber; MOCK_CAMERA_SIZE and MOCK_CAMERA_RATE in the
+ * environment override the 640x512 frames at 30 frames/s.  The server
+ * only has buffers for frames up to the 640x512 of the Tau 2.
+ */
+namespace thermal_grabber {
+   enum GainMode { Automatic, LowGain, HighGain, Manual };
+}
+
+struct TauRawBitmap {
+   unsigned int width;
+   unsigned int height;
+   unsigned short *data;
+};
+
+class ThermalGrabber
+{
+public:
+   ThermalGrabber(void (*callback)(TauRawBitmap &, void *), void *caller);
+   ~ThermalGrabber();
+   void setGainMode(thermal_grabber::GainMode mode) { gain_mode = mode; }
+
+private:
+   static void *run(void *arg);
+
+   void (*callback)(TauRawBitmap &, void *);
+   void *caller;
+   thermal_grabber::GainMode gain_mode;
+   unsigned short *frames[MOCK_FRAMES];
+   TauRawBitmap bitmap;
+   double rate;
+   std::atomic<int> running;
+   pthread_t thread;
+};
+
+
+/*
+ * Generate the synthetic frames and start delivering them
+ */
+ThermalGrabber::ThermalGrabber(void (*callback)(TauRawBitmap &, void *),
+			       void *caller)
+   : callback(callback), caller(caller), gain_mode(thermal_grabber::Automatic),
+     running(1)
+{
+   const char *env;
+   unsigned int i;
+
+   bitmap.width = MOCK_WIDTH;
+   bitmap.height = MOCK_HEIGHT;
+   rate = MOCK_RATE;
+   if (((env = getenv(MOCK_SIZE_ENV)) != NULL) &&
+       ((sscanf(env, "%ux%u", &bitmap.width, &bitmap.height) != 2) ||
+	(bitmap.width == 0) || (bitmap.height == 0))) {
+      bitmap.width = MOCK_WIDTH;
+      bitmap.height = MOCK_HEIGHT;
+   }
+   if (((env = getenv(MOCK_RATE_ENV)) != NULL) && (atof(env) > 0)) {
+      rate = atof(env);
+   }
+   for (i = 0; i < MOCK_FRAMES; i++) {
+      frames[i] = (unsigned short *)
+	 cli_malloc(bitmap.width * bitmap.height * sizeof(unsigned short));
+      fillSyntheticFrame(frames[i], bitmap.width, bitmap.height, MOCK_BITS,
+			 i + 1);
+   }
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	     "(%s:%d) simulated camera: %ux%u frames at %.1f frames/s",
+	     __FILE__, __LINE__, bitmap.width, bitmap.height, rate);
+   if (pthread_create(&thread, NULL, run, this) != 0) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		"(%s:%d) unable to start the simulated camera",
+		__FILE__, __LINE__);
+      running = 0;
+   }
+}
+
+
+/*
+ * Stop delivering frames, as the library does when the grabber is deleted
+ */
+ThermalGrabber::~ThermalGrabber()
+{
+   unsigned int i;
+
+   if (running.exchange(0)) {
+      pthread_join(thread, NULL);
+   }
+   for (i = 0; i < MOCK_FRAMES; i++) {
+      free(frames[i]);
+   }
+}
+
+
+/*
+ * Hand a frame to the callback at the simulated frame rate, the same way
+ * the library does from its own thread
+ */
+void *
+ThermalGrabber::run(void *arg)
+{
+   ThermalGrabber *tgr = (ThermalGrabber *)arg;
+   long period = (long)(1000000000.0 / tgr->rate);
+   struct timespec next;
+   unsigned int count = 0;
+
+   clock_gettime(CLOCK_MONOTONIC, &next);
+   while (tgr->running.load()) {
+      next.tv_nsec += period;
+      while (next.tv_nsec >= 1000000000L) {
+	 next.tv_nsec -= 1000000000L;
+	 next.tv_sec++;
+      }
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL)
+	     == EINTR) {
+      }
+      tgr->bitmap.data = tgr->frames[count++ % MOCK_FRAMES];
+      tgr->callback(tgr->bitmap, tgr->caller);
+   }
+
+   return NULL;
+}
+
+#endif
+
+
 typedef enum {
    GAIN_AUTO,
    GAIN_HIGH,
@@ -106,21 +400,205 @@ typedef enum {
    GAIN_MANUAL
 } gain_t;
 
+/*
+ * Ways of combining the camera frames received during an exposure
+ */
+typedef enum {
+   STACK_SUM,			/* Co-added frames */
+   STACK_MEAN,			/* Average of the frames */
+   STACK_CLIP			/* Sigma-clipped average of the frames */
+} stack_mode_t;
+
+/*
+ * What the images are the difference against, in the differential mode
+ */
+typedef enum {
+   DIFF_OFF,			/* Plain images */
+   DIFF_PREVIOUS,		/* The previous exposure */
+   DIFF_MEDIAN			/* The running median of the frames */
+} diff_mode_t;
+
+/*
+ * How far along a client is in getting the image it asked for
+ */
+typedef enum {
+   IMAGE_NONE,			/* No image requested */
+   IMAGE_QUEUED,		/* Waiting for the next exposure */
+   IMAGE_EXPOSING		/* Waiting for the exposure under way */
+} image_wanted_t;
+
+/*
+ * Stages of taking and delivering an image that are timed
+ */
+typedef enum {
+   STAGE_EXPOSE,		/* Exposing on the camera */
+   STAGE_READOUT,		/* Getting the pixels off the camera */
+   STAGE_ENCODE,		/* Building the FITS image */
+   STAGE_IO,			/* Preparing and mapping the in-memory file */
+   STAGE_SEND,			/* Delivering the image to the client */
+   NUM_STAGES
+} stage_t;
+
+/*
+ * The most recent timings of one stage, in seconds
+ */
+typedef struct {
+   double sample[STATS_WINDOW];
+   unsigned int count;		/* Images timed since startup */
+} stage_stats_t;
+
+/*
+ * The sky as last measured in a raw frame, in counts
+ */
+typedef struct {
+   double background;		/* Median of the tile means */
+   double rms;			/* Median of the tile RMS */
+   unsigned int stars;		/* Local maxima SKY_STAR_SIGMA above it */
+   double sky_mean;		/* Mean, least, greatest and RMS of the */
+   double sky_min;		/* tile means, which follow the sky */
+   double sky_max;		/* temperature */
+   double sky_rms;
+} sky_metrics_t;
+
+/*
+ * Kind of calibration master, and the one being built if any
+ */
+typedef enum {
+   CALIB_NONE,			/* No master */
+   CALIB_DARK,			/* Mean of dark exposures */
+   CALIB_FLAT			/* Factors that even out a flat field */
+} calib_kind_t;
+
+/*
+ * A master dark or flat mapped from its file in CALIB_DIR.  The files
+ * are plain arrays of floats, one per pixel, in camera counts per frame.
+ */
+typedef struct {
+      char path[CALIB_PATH_SIZE];
+      float *data;		/* Mapping, or NULL if the slot is free */
+      size_t size;
+} master_t;
+
+/*
+ * Where one archived image is, and what it is of.  The index is kept in
+ * a file of its own, and an image's entry is found from its serial
+ * number, which counts the images archived.
+ */
+typedef struct {
+      uint64_t serial;		/* 0 if never used */
+      double timestamp;		/* UNIXTIME of the image */
+      double dome_az;		/* DOMEAZ, or NULL_DBL if not known */
+      int32_t nframes;		/* Frames stacked into it */
+      int32_t segment;		/* Segment file it is in */
+      int64_t offset;		/* Where it starts in the segment */
+      int64_t size;		/* Bytes of FITS */
+} archive_entry_t;
+
+typedef struct {
+      uint32_t magic;		/* ARCHIVE_MAGIC */
+      uint32_t nsegments;	/* Segments it was laid out for */
+      uint64_t first;		/* Serial of the oldest image kept */
+      uint64_t next;		/* Serial of the next image archived */
+      int32_t segment;		/* Segment being appended to */
+      int32_t unused;
+      int64_t offset;		/* Where the next image goes in it */
+      archive_entry_t entry[ARCHIVE_ENTRIES]; /* Indexed by serial */
+} archive_index_t;
+
+/*
+ * Rolling archive of the images taken, for clients to catch up from
+ */
+typedef struct {
+      char dir[ARCHIVE_PATH_SIZE];
+      int nsegments;
+      int segment_fd[ARCHIVE_MAX_SEGMENTS];
+      int readers[ARCHIVE_MAX_SEGMENTS]; /* Images being sent from each */
+      archive_index_t *index;	/* Mapping of the index, NULL if not kept */
+} archive_t;
+
+/*
+ * Arena that the frame, stack, FITS and compression buffers are carved
+ * out of.  It is sized for the largest Tau frame when the camera is
+ * connected, and nothing is ever given back, so taking images allocates
+ * nothing.
+ */
+typedef struct {
+      unsigned char *base;
+      size_t size;
+      size_t used;
+} buffer_pool_t;
+
+
 /*
  * Structure used to specify server specific information.
  */
 typedef struct {
       linked_list *client_list;
       sockserv_t *tau_serv;
-      ThermalGrabber *tgr;
+      ThermalGrabber *tgr;	/* NULL while the camera is reconnected */
+      ThermalGrabber *tgr_opened; /* Made in the background, not taken yet */
+      unsigned int camera_received; /* Frames received when last checked */
+      double camera_heard_ts;	/* When a frame last came in */
+      double camera_silence;	/* Seconds without one before reconnecting */
       int serv_done;
+      int data_listen_fd;
+      int pending_data_fd[MAX_PENDING_DATA];
+      unsigned int pending_data_token[MAX_PENDING_DATA];
+      struct in_addr pending_data_addr[MAX_PENDING_DATA]; /* Their peers */
+      int bulk_sends;		/* Bulk transfers under way */
       gain_t gain;
       double etime;
       unsigned int width;
       unsigned int height;
-      int *stack_data;
+      stack_mode_t stack_mode;
+      int *stack_data;		/* Per pixel sum of the stacked frames */
+      int64_t *stack_sumsq;	/* Per pixel sum of squares (STACK_CLIP) */
+      unsigned short *stack_count; /* Per pixel frames kept (STACK_CLIP) */
+      int64_t stack_bias;	/* Sum of the frame backgrounds */
+      int stack_final;		/* Stack already finalized for the image */
+      int stack_min;		/* Minimum of the finalized stack */
+      int stack_shift;		/* Image pixels are 2^stack_shift of it */
+      unsigned short *fits_image; /* Pixels of the last FITS image */
+      int *rice_row_size;	/* Compressed size of each row */
+      unsigned char *rice_heap;	/* Compressed rows of all the bands */
+      unsigned char *rice_table; /* Descriptors of the compressed rows */
+      unsigned int max_width;	/* Largest frame the buffers hold */
+      unsigned int max_height;
+      buffer_pool_t pool;
       unsigned int frame_count;
       double exp_start_ts;
+      double exp_stop_ts;	/* When the exposure under way is done */
+      int exposing;		/* An exposure is under way */
+      int exposure_subscribed;	/* It is also taken for the subscribers */
+      unsigned int commands;	/* Commands client_recv() has handled */
+      unsigned int commands_seen; /* How many the loop last slept after */
+      stage_stats_t stage_stats[NUM_STAGES];
+      unsigned int image_count;	/* Images delivered since startup */
+      unsigned int dropped_total; /* Camera frames dropped since startup */
+      unsigned int stats_frames; /* Camera frames at the last update */
+      double stats_ts;		/* When the stats were last published */
+      sky_metrics_t sky;
+      double sky_ts;		/* When the sky was last measured */
+      double subscribe_retry_ts; /* No exposures for subscribers before */
+      int calibrate;		/* Dark and flat correct the images */
+      int stack_calibrated;	/* The masters were applied to the stack */
+      char calib_dark[CALIB_PATH_SIZE]; /* Masters applied to it */
+      char calib_flat[CALIB_PATH_SIZE];
+      master_t master[MAX_MASTERS];
+      int master_next;		/* Slot the next master is mapped into */
+      calib_kind_t calib_kind;	/* Master being built, or CALIB_NONE */
+      gain_t calib_gain;	/* Gain mode it is taken with */
+      int calib_remaining;	/* Exposures still to take for it */
+      int calib_count;		/* Exposures summed into it so far */
+      float *calib_sum;		/* Sum of those exposures */
+      int exposure_calib;	/* The exposure is taken for the master */
+      diff_mode_t diff_mode;
+      float *diff_ref;		/* Previous exposure, in counts per frame */
+      int diff_ref_valid;	/* diff_ref holds an exposure */
+      unsigned short *diff_median; /* Running median of the frames */
+      unsigned int diff_median_frames; /* Frames folded into it */
+      int diff_done;		/* The stack was differenced, if it could be */
+      int stack_diff;		/* The stack holds a difference */
 } server_info_t;
 
 
@@ -128,7 +606,7 @@ typedef struct {
  * Per-client information.  Multiple clients can stay connected to the
  * server at once, although this is typically not the case.
  */
-typedef struct
+typedef struct client_info
 {
    char *hostname;
    unsigned char remote_ip[4];
@@ -136,23 +614,205 @@ typedef struct
    int send_data;
    int data_count;
    int total_count;
+   int image_fd;		/* memfd the FITS image is built in */
+   int data_fd;			/* Bulk data connection, or -1 */
+   unsigned int bulk_token;	/* Token handed out by BULK, or 0 */
+   int bulk_sending;		/* data_fd is in the wake_fd set */
+   double bulk_progress_ts;	/* When the bulk transfer last moved */
+   int compress;		/* Send Rice tile compressed images */
+   size_t image_size;		/* Size of the image_data mapping */
    unsigned char *image_data;
    unsigned int frame_count;
+   double send_start_ts;	/* When the reply to IMAGE went out */
+   int subscribed;		/* Sent every image taken for subscribers */
+   int image_wanted;		/* IMAGE_QUEUED or IMAGE_EXPOSING if waiting */
+   char reply[REPLY_SIZE];	/* Reply to send ahead of any image data */
+   int seq_remaining;		/* Images of a sequence still to be queued */
+   double seq_interval;		/* Seconds between the images of a sequence */
+   double seq_next_ts;		/* When the next one is due */
+   struct client_info *shared;	/* Shared image being sent, or NULL */
+   int refs;			/* Subscribers sending this shared image */
+   int archived;		/* The image is sent from the archive */
+   int archive_segment;		/* Segment it is in, and where */
+   off_t archive_offset;
+   uint64_t fetch_next;		/* Serial of the next FETCH image to send */
+   uint64_t fetch_end;		/* Serial after the last one asked for */
 } client_info_t;
 
 
+/*
+ * Rows of an image compressed by one thread
+ */
+typedef struct {
+   const unsigned short *image;	/* First row of the band */
+   int width;
+   int nrows;
+   unsigned char *data;		/* Compressed rows back to back */
+   size_t size;			/* Bytes used in data */
+   int *row_size;		/* Compressed size of each row */
+} rice_band_t;
+
+/*
+ * A Rice tile compressed image, one tile per row
+ */
+typedef struct {
+   rice_band_t band[COMPRESS_THREADS];
+   int *row_size;
+   int height;
+   int max_row_size;
+   size_t heap_size;
+} rice_image_t;
+
+/*
+ * Rows of the stacked image converted by one thread
+ */
+typedef struct {
+   unsigned int first_row;
+   unsigned int nrows;
+   int min_val;			/* Minimum of the band, then of the image */
+   int max_val;			/* Maximum of the band */
+   int shift;			/* Divide the pixels by 2^shift to fit */
+   int fits_order;		/* Big-endian BZERO pixels instead of native */
+   unsigned short *image;	/* Output image */
+   const float *dark;		/* Master dark to subtract, or NULL */
+   const float *flat;		/* Flat correction to multiply by, or NULL */
+   float scale;			/* Stack to counts per frame */
+   float bias;			/* Background taken out of the stack */
+} convert_band_t;
+
+
+/*
+ * Single producer, single consumer ring of camera frames between the
+ * thermalgrabber thread and the server loop.  The grabber thread fills the
+ * slot at 'head' and the server loop empties the one at 'tail'; each
+ * sequence number is only ever advanced by its own side, so neither side
+ * takes a lock.  The eventfd wakes the server loop when a frame arrives.
+ * It is in the wake_fd epoll set along with the command connections, so
+ * the loop also wakes as soon as a command comes in.
+ */
+typedef struct
+{
+   unsigned short *slot[FRAME_RING_SLOTS];
+   unsigned int width;
+   unsigned int height;
+   std::atomic<unsigned int> head; /* Next slot the grabber fills */
+   std::atomic<unsigned int> tail; /* Next slot the server empties */
+   std::atomic<int> exposing;	   /* Frames are wanted for an exposure */
+   std::atomic<int> sky_wanted;	   /* One is wanted to measure the sky */
+   std::atomic<unsigned int> dropped; /* Frames lost to a full ring */
+   std::atomic<unsigned int> received; /* Frames delivered by the camera */
+   int event_fd;
+   int wake_fd;			/* epoll set the server loop waits on */
+} frame_ring_t;
+
+
 /*
  * Server information structure instance
  */
 static server_info_t *serv_info = NULL;
 
 /*
- * Set up a C++ mutex since the libthermalgrabber C++ library uses a 
- * background thread when images are available
+ * Frames handed over from the background thread the libthermalgrabber C++
+ * library delivers images on.  Only the server loop touches the stack.
+ */
+static frame_ring_t frame_ring;
+
+#ifndef BENCHMARK
+/*
+ * Clients subscribed to every image, and the images taken for them: one
+ * uncompressed and one Rice compressed, each built only when a subscriber
+ * asked for that format.  The shared images are clients of their own so
+ * that they get an in-memory file like any other.
+ */
+static client_info_t *subscriber[MAX_SUBSCRIBERS];
+static client_info_t shared_image[2];
+
+/*
+ * Clients waiting for the image they asked for with IMAGE
+ */
+static client_info_t *image_client[MAX_IMAGE_CLIENTS];
+
+/*
+ * Clients taking a sequence of images with SEQUENCE
+ */
+static client_info_t *sequence_client[MAX_SEQUENCES];
+
+/*
+ * Client building a master dark or flat with DARK or FLAT
+ */
+static client_info_t *calib_client;
+#endif
+
+/*
+ * Archive of the images taken, and the index that finds them
+ */
+static archive_t archive;
+
+/*
+ * Header values that come from outside the server.  They are refreshed in
+ * the background, so writing an image never waits on the Status Server.
+ */
+typedef struct
+{
+   char dome_az[METADATA_SIZE];
+   char temp[METADATA_SIZE];
+   char pres[METADATA_SIZE];
+   char humid[METADATA_SIZE];
+} metadata_t;
+
+/*
+ * The header metadata last read and the lock guarding it.  ss_lock keeps
+ * the Status Server calls of the server loop and of the metadata refresh
+ * from crossing.
+ */
+static metadata_t metadata;
+static pthread_mutex_t metadata_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t ss_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifndef BENCHMARK
+/*
+ * Guards tgr_opened, which the camera thread hands the grabber over in
+ */
+static pthread_mutex_t camera_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/*
+ * Compensation parameters read out of the BME280, which turn its raw
+ * readings into temperature, pressure and humidity
+ */
+typedef struct
+{
+   int fd;
+   uint16_t dig_T1;
+   int16_t dig_T2, dig_T3;
+   uint16_t dig_P1;
+   int16_t dig_P2, dig_P3, dig_P4, dig_P5, dig_P6, dig_P7, dig_P8, dig_P9;
+   uint8_t dig_H1, dig_H3;
+   int16_t dig_H2, dig_H4, dig_H5;
+   int8_t dig_H6;
+} bme280_t;
+
+/*
+ * Latest BME280 sample, written by the sampler thread and read by the FITS
+ * header and the Status Server publishing without a lock.  The sampler
+ * makes 'seq' odd while it updates the values and even once they agree
+ * again, and a reader that saw it odd or changing reads them again.
  */
-std::mutex mtx;
-//static pthread_mutex_t lock;
+typedef struct
+{
+   std::atomic<unsigned int> seq;
+   std::atomic<double> temp;	/* Degrees C */
+   std::atomic<double> pres;	/* hPa */
+   std::atomic<double> humid;	/* Percent relative humidity */
+   std::atomic<double> sample_ts; /* When it was taken, 0 before the first */
+} bme280_slot_t;
+
+#ifndef BENCHMARK
+static bme280_t bme280;
+#endif
+static bme280_slot_t bme280_slot;
 
+#ifndef BENCHMARK
 /*
  * Utility function to return the IP address associated with the "eth0"
  * Ethernet interface.  Since this is currently running on a Raspberry PI
@@ -221,6 +881,54 @@ ssTouchState(void) {
       return FAIL;
    }
 
+   /*
+    * Perform a touch of the enclosure temperature
+    */
+   if (ssTouchObject(SS_TEMP,
+		     "Enclosure Temperature") != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
+		"(%s:%d) ssTouchObject of %s failed: %s", 
+		__FILE__, __LINE__, SS_TEMP, 
+		ssGetStrError());
+      return FAIL;
+   }
+
+   /*
+    * Perform a touch of the enclosure pressure
+    */
+   if (ssTouchObject(SS_PRES,
+		     "Enclosure Pressure") != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
+		"(%s:%d) ssTouchObject of %s failed: %s", 
+		__FILE__, __LINE__, SS_PRES, 
+		ssGetStrError());
+      return FAIL;
+   }
+
+   /*
+    * Perform a touch of the enclosure humidity
+    */
+   if (ssTouchObject(SS_HUMID,
+		     "Enclosure Humidity") != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
+		"(%s:%d) ssTouchObject of %s failed: %s", 
+		__FILE__, __LINE__, SS_HUMID, 
+		ssGetStrError());
+      return FAIL;
+   }
+
+   /*
+    * Perform a touch of the current stacking mode
+    */
+   if (ssTouchObject(SS_STACKMODE,
+		     "Frame Stacking Mode") != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
+		"(%s:%d) ssTouchObject of %s failed: %s", 
+		__FILE__, __LINE__, SS_STACKMODE, 
+		ssGetStrError());
+      return FAIL;
+   }
+
    /*
     * Perform a touch of the current exposure time
     */
@@ -319,6 +1027,7 @@ static char *
 trim(char *str) {
    return rtrim(ltrim(str));
 }
+#endif
 
 
 /*
@@ -339,45 +1048,427 @@ getClockTime(void) {
 }     
 
 
+#ifndef BENCHMARK
 /*
- * Perform a fast median calculation of the elements within an array.  The
- * following routine is faster than using the c qsort() function call.
- * The array that is passed in will be modified so it should not have the
- * original contents if there is a desire to have these preserved.
- * The size of the array is specified by 'n' and the multiplying factor
- * is specified by 'm'
+ * Read 'len' BME280 registers from 'reg' on
  */
-unsigned short
-medianCalculation(unsigned short *arr, unsigned int n, unsigned int m) 
+static PASSFAIL
+bme280Read(uint8_t reg, uint8_t *buf, int len)
 {
+   if ((write(bme280.fd, &reg, 1) != 1) ||
+       (read(bme280.fd, buf, len) != len)) {
+      return FAIL;
+   }
 
-   int low, high; 
-   int median; 
-   int middle, ll, hh;
+   return PASS;
+}
 
-   /* Reduce the number of elements in the array by the multiplying factor */
-   n /= m;
 
-   low = 0; high = n - 1; median = (low + high) / 2; 
-   for (;;) { 
-      
-      if (high <= low) { /* One element only */ 
-	 return arr[median * m];
-      }      
+/*
+ * Set a BME280 register
+ */
+static PASSFAIL
+bme280Write(uint8_t reg, uint8_t value)
+{
+   uint8_t buf[2] = { reg, value };
 
-      if (high == low + 1) { /* Two elements only */ 
-	 if (arr[low * m] > arr[high * m]) 
-	    ELEM_SWAP(arr[low * m], arr[high * m]);
-	 return arr[median * m];
-      } 
-      
-      /* Find median of low, middle and high items; swap into position low */ 
-      middle = (low + high) / 2; 
-      if (arr[middle * m] > arr[high * m]) 
-	 ELEM_SWAP(arr[middle * m], arr[high * m]);
-      if (arr[low * m] > arr[high * m]) 
-	 ELEM_SWAP(arr[low * m], arr[high * m]); 
-      if (arr[middle * m] > arr[low * m]) 
+   return (write(bme280.fd, buf, 2) == 2) ? PASS : FAIL;
+}
+
+
+/*
+ * Open the BME280, read its compensation parameters and set it sampling
+ * on its own, with the oversampling and standby the BME280 data sheet
+ * suggests for weather monitoring
+ */
+static PASSFAIL
+bme280Open(void)
+{
+   uint8_t id;
+   uint8_t c[26];
+   uint8_t h[7];
+
+   if ((bme280.fd = open(BME280_DEVICE, O_RDWR)) == -1) {
+      return FAIL;
+   }
+   if ((ioctl(bme280.fd, I2C_SLAVE, BME280_ADDRESS) == -1) ||
+       (bme280Read(0xD0, &id, 1) != PASS) || (id != BME280_CHIP_ID) ||
+       (bme280Read(0x88, c, sizeof(c)) != PASS) ||
+       (bme280Read(0xE1, h, sizeof(h)) != PASS)) {
+      close(bme280.fd);
+      bme280.fd = -1;
+      return FAIL;
+   }
+   bme280.dig_T1 = (uint16_t)(c[1] << 8 | c[0]);
+   bme280.dig_T2 = (int16_t)(c[3] << 8 | c[2]);
+   bme280.dig_T3 = (int16_t)(c[5] << 8 | c[4]);
+   bme280.dig_P1 = (uint16_t)(c[7] << 8 | c[6]);
+   bme280.dig_P2 = (int16_t)(c[9] << 8 | c[8]);
+   bme280.dig_P3 = (int16_t)(c[11] << 8 | c[10]);
+   bme280.dig_P4 = (int16_t)(c[13] << 8 | c[12]);
+   bme280.dig_P5 = (int16_t)(c[15] << 8 | c[14]);
+   bme280.dig_P6 = (int16_t)(c[17] << 8 | c[16]);
+   bme280.dig_P7 = (int16_t)(c[19] << 8 | c[18]);
+   bme280.dig_P8 = (int16_t)(c[21] << 8 | c[20]);
+   bme280.dig_P9 = (int16_t)(c[23] << 8 | c[22]);
+   bme280.dig_H1 = c[25];
+   bme280.dig_H2 = (int16_t)(h[1] << 8 | h[0]);
+   bme280.dig_H3 = h[2];
+   bme280.dig_H4 = (int16_t)((int8_t)h[3] * 16 | (h[4] & 0x0F));
+   bme280.dig_H5 = (int16_t)((int8_t)h[5] * 16 | (h[4] >> 4));
+   bme280.dig_H6 = (int8_t)h[6];
+
+   /*
+    * Humidity oversampling only takes effect once ctrl_meas is written.
+    * Then 1x oversampling of everything, 1 s standby, normal mode.
+    */
+   if ((bme280Write(0xF2, 0x01) != PASS) ||
+       (bme280Write(0xF5, 0xA0) != PASS) ||
+       (bme280Write(0xF4, 0x27) != PASS)) {
+      close(bme280.fd);
+      bme280.fd = -1;
+      return FAIL;
+   }
+
+   return PASS;
+}
+
+
+/*
+ * Read the last measurement the BME280 made and compensate it, with the
+ * floating point formulas of the BME280 data sheet
+ */
+static PASSFAIL
+bme280Sample(double *temp, double *pres, double *humid)
+{
+   uint8_t d[8];
+   double adc_T, adc_P, adc_H;
+   double var1, var2, t_fine, p, h;
+
+   if (bme280Read(0xF7, d, sizeof(d)) != PASS) {
+      return FAIL;
+   }
+   adc_P = (double)((d[0] << 12) | (d[1] << 4) | (d[2] >> 4));
+   adc_T = (double)((d[3] << 12) | (d[4] << 4) | (d[5] >> 4));
+   adc_H = (double)((d[6] << 8) | d[7]);
+
+   var1 = (adc_T / 16384.0 - bme280.dig_T1 / 1024.0) * bme280.dig_T2;
+   var2 = (adc_T / 131072.0 - bme280.dig_T1 / 8192.0) *
+      (adc_T / 131072.0 - bme280.dig_T1 / 8192.0) * bme280.dig_T3;
+   t_fine = var1 + var2;
+   *temp = t_fine / 5120.0;
+
+   var1 = t_fine / 2.0 - 64000.0;
+   var2 = var1 * var1 * bme280.dig_P6 / 32768.0;
+   var2 = var2 + var1 * bme280.dig_P5 * 2.0;
+   var2 = var2 / 4.0 + bme280.dig_P4 * 65536.0;
+   var1 = (bme280.dig_P3 * var1 * var1 / 524288.0 + 
+	   bme280.dig_P2 * var1) / 524288.0;
+   var1 = (1.0 + var1 / 32768.0) * bme280.dig_P1;
+   if (var1 == 0) {
+      return FAIL;
+   }
+   p = 1048576.0 - adc_P;
+   p = (p - var2 / 4096.0) * 6250.0 / var1;
+   var1 = bme280.dig_P9 * p * p / 2147483648.0;
+   var2 = p * bme280.dig_P8 / 32768.0;
+   *pres = (p + (var1 + var2 + bme280.dig_P7) / 16.0) / 100.0;
+
+   h = t_fine - 76800.0;
+   h = (adc_H - (bme280.dig_H4 * 64.0 + bme280.dig_H5 / 16384.0 * h)) *
+      (bme280.dig_H2 / 65536.0 * (1.0 + bme280.dig_H6 / 67108864.0 * h *
+				  (1.0 + bme280.dig_H3 / 67108864.0 * h)));
+   h = h * (1.0 - bme280.dig_H1 * h / 524288.0);
+   *humid = (h < 0) ? 0 : ((h > 100) ? 100 : h);
+
+   return PASS;
+}
+
+
+/*
+ * Sample the BME280 every BME280_PERIOD seconds into the slot.  A failed
+ * sample leaves the last one there to go stale.
+ */
+static void *
+bme280Thread(void *arg)
+{
+   double temp, pres, humid;
+   unsigned int seq;
+   int failing = FALSE;
+
+   for (;;) {
+      if (bme280Sample(&temp, &pres, &humid) == PASS) {
+	 seq = bme280_slot.seq.load(std::memory_order_relaxed);
+	 bme280_slot.seq.store(seq + 1, std::memory_order_relaxed);
+	 std::atomic_thread_fence(std::memory_order_release);
+	 bme280_slot.temp.store(temp, std::memory_order_relaxed);
+	 bme280_slot.pres.store(pres, std::memory_order_relaxed);
+	 bme280_slot.humid.store(humid, std::memory_order_relaxed);
+	 bme280_slot.sample_ts.store(getClockTime(), 
+				     std::memory_order_relaxed);
+	 bme280_slot.seq.store(seq + 2, std::memory_order_release);
+	 failing = FALSE;
+      }
+      else if (!failing) {
+	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		   "(%s:%d) unable to read the BME280 sensor : %s (errno=%d)",
+		   __FILE__, __LINE__, strerror(errno), errno);
+	 failing = TRUE;
+      }
+      sleep(BME280_PERIOD);
+   }
+
+   return NULL;
+}
+#endif
+
+
+/*
+ * Get the latest BME280 sample from the slot.  Returns FAIL if there is no
+ * sample taken in the last BME280_STALE seconds.
+ */
+static PASSFAIL
+readBME280(double *temp, double *pres, double *humid)
+{
+   unsigned int seq;
+   double sample_ts;
+
+   do {
+      seq = bme280_slot.seq.load(std::memory_order_acquire);
+      *temp = bme280_slot.temp.load(std::memory_order_relaxed);
+      *pres = bme280_slot.pres.load(std::memory_order_relaxed);
+      *humid = bme280_slot.humid.load(std::memory_order_relaxed);
+      sample_ts = bme280_slot.sample_ts.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+   } while ((seq & 1) || 
+	    (seq != bme280_slot.seq.load(std::memory_order_relaxed)));
+
+   if ((sample_ts == 0) || (getClockTime() - sample_ts > BME280_STALE)) {
+      return FAIL;
+   }
+
+   return PASS;
+}
+
+
+#ifndef BENCHMARK
+/*
+ * Start sampling the BME280 sensor if it is on the I2C bus.  Without it
+ * the environment comes from the sensor script or the Status Server.
+ */
+static void
+startBME280(void)
+{
+   pthread_t thread;
+
+   if (bme280Open() != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) no BME280 sensor at %s, address 0x%02x",
+		__FILE__, __LINE__, BME280_DEVICE, BME280_ADDRESS);
+      return;
+   }
+   if (pthread_create(&thread, NULL, bme280Thread, NULL) != 0) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		"(%s:%d) unable to start sampling the BME280 sensor",
+		__FILE__, __LINE__);
+      return;
+   }
+   pthread_detach(thread);
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	     "(%s:%d) sampling the BME280 sensor at %s every %d s",
+	     __FILE__, __LINE__, BME280_DEVICE, BME280_PERIOD);
+}
+#endif
+
+
+/*
+ * Put the BME280 readings in the form the sensor script writes them in
+ */
+static void
+formatBME280(double temp, double pres, double humid, metadata_t *meta)
+{
+   snprintf(meta->temp, sizeof(meta->temp), "%.2f C", temp);
+   snprintf(meta->pres, sizeof(meta->pres), "%.2f hPa", pres);
+   snprintf(meta->humid, sizeof(meta->humid), "%.2f %%", humid);
+}
+
+
+/*
+ * Read one header metadata value from the Status Server, keeping the one
+ * read before if it can't be had
+ */
+static void
+getMetadata(const char *path, char *value)
+{
+   char s[METADATA_SIZE];
+   PASSFAIL rc;
+
+   pthread_mutex_lock(&ss_lock);
+   if ((rc = ssGetString(path, s, sizeof(s) - 1)) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) ssGetString of %s failed: %s",
+		__FILE__, __LINE__, path, ssGetStrError());
+   }
+   pthread_mutex_unlock(&ss_lock);
+   if (rc != PASS) {
+      return;
+   }
+   s[sizeof(s) - 1] = '\0';
+
+   pthread_mutex_lock(&metadata_lock);
+   strcpy(value, s);
+   pthread_mutex_unlock(&metadata_lock);
+}
+
+
+/*
+ * Read the enclosure environment the BME280 sensor script leaves in
+ * BME_FILE.  Returns FAIL if it isn't there to be read.
+ */
+static PASSFAIL
+readBMEFile(char *temp, char *pres, char *humid)
+{
+   FILE *fp;
+   int n;
+
+   if ((fp = fopen(BME_FILE, "r")) == NULL) {
+      return FAIL;
+   }
+   fscanf(fp, "Chip ID     : %*s\n");
+   fscanf(fp, "Version     : %*s\n");
+   n = fscanf(fp, "Temperature : %79[^\n]%*c", temp);
+   n += fscanf(fp, "Pressure : %79[^\n]%*c", pres);
+   n += fscanf(fp, "Humidity : %79[^\n]%*c", humid);
+   fclose(fp);
+
+   return (n == 3) ? PASS : FAIL;
+}
+
+
+/*
+ * Refresh the header metadata: the dome azimuth from the Status Server,
+ * and the enclosure environment.  That comes from the BME280 sampled here,
+ * which is published in the Status Server with it, or else from the
+ * sensor script's file or the values taugrab publishes.
+ */
+static void
+refreshMetadata(void)
+{
+   metadata_t sample;
+   double t, p, h;
+   char temp[METADATA_SIZE];
+   char pres[METADATA_SIZE];
+   char humid[METADATA_SIZE];
+
+   getMetadata(SS_DOME_AZ, metadata.dome_az);
+   if (readBME280(&t, &p, &h) == PASS) {
+      formatBME280(t, p, h, &sample);
+      pthread_mutex_lock(&metadata_lock);
+      strcpy(metadata.temp, sample.temp);
+      strcpy(metadata.pres, sample.pres);
+      strcpy(metadata.humid, sample.humid);
+      pthread_mutex_unlock(&metadata_lock);
+
+      pthread_mutex_lock(&ss_lock);
+      if ((ssPutString(SS_TEMP, sample.temp) != PASS) ||
+	  (ssPutString(SS_PRES, sample.pres) != PASS) ||
+	  (ssPutString(SS_HUMID, sample.humid) != PASS)) {
+	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		   "(%s:%d) unable to publish the BME280 readings: %s",
+		   __FILE__, __LINE__, ssGetStrError());
+      }
+      pthread_mutex_unlock(&ss_lock);
+   }
+   else if (readBMEFile(temp, pres, humid) == PASS) {
+      pthread_mutex_lock(&metadata_lock);
+      strcpy(metadata.temp, temp);
+      strcpy(metadata.pres, pres);
+      strcpy(metadata.humid, humid);
+      pthread_mutex_unlock(&metadata_lock);
+   }
+   else {
+      getMetadata(SS_TEMP, metadata.temp);
+      getMetadata(SS_PRES, metadata.pres);
+      getMetadata(SS_HUMID, metadata.humid);
+   }
+}
+
+
+#ifndef BENCHMARK
+/*
+ * Refresh the header metadata every METADATA_REFRESH seconds
+ */
+static void *
+metadataThread(void *arg)
+{
+   for (;;) {
+      sleep(METADATA_REFRESH);
+      refreshMetadata();
+   }
+
+   return NULL;
+}
+
+
+/*
+ * Read the header metadata, then keep it fresh in the background
+ */
+static void
+startMetadata(void)
+{
+   pthread_t thread;
+
+   refreshMetadata();
+   if (pthread_create(&thread, NULL, metadataThread, NULL) != 0) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		"(%s:%d) unable to start the metadata refresh, the header"
+		" values will not be updated", __FILE__, __LINE__);
+      return;
+   }
+   pthread_detach(thread);
+}
+#endif
+
+
+/*
+ * Perform a fast median calculation of the elements within an array.  The
+ * following routine is faster than using the c qsort() function call.
+ * The array that is passed in will be modified so it should not have the
+ * original contents if there is a desire to have these preserved.
+ * The size of the array is specified by 'n' and the multiplying factor
+ * is specified by 'm'
+ */
+unsigned short
+medianCalculation(unsigned short *arr, unsigned int n, unsigned int m) 
+{
+
+   int low, high; 
+   int median; 
+   int middle, ll, hh;
+
+   /* Reduce the number of elements in the array by the multiplying factor */
+   n /= m;
+
+   low = 0; high = n - 1; median = (low + high) / 2; 
+   for (;;) { 
+      
+      if (high <= low) { /* One element only */ 
+	 return arr[median * m];
+      }      
+
+      if (high == low + 1) { /* Two elements only */ 
+	 if (arr[low * m] > arr[high * m]) 
+	    ELEM_SWAP(arr[low * m], arr[high * m]);
+	 return arr[median * m];
+      } 
+      
+      /* Find median of low, middle and high items; swap into position low */ 
+      middle = (low + high) / 2; 
+      if (arr[middle * m] > arr[high * m]) 
+	 ELEM_SWAP(arr[middle * m], arr[high * m]);
+      if (arr[low * m] > arr[high * m]) 
+	 ELEM_SWAP(arr[low * m], arr[high * m]); 
+      if (arr[middle * m] > arr[low * m]) 
 	 ELEM_SWAP(arr[middle * m], arr[low * m]); 
 			
       /* Swap low item (now in position middle) into position (low + 1) */ 
@@ -413,465 +1504,3969 @@ medianCalculation(unsigned short *arr, unsigned int n, unsigned int m)
 
 
 /*
- * Handle callbacks for image data received from the camera.  Take the 
- * data from the camera and if the clock time indicates that we're in an
- * exposing state, add the image to the stack
+ * Clear the stacked image and all of the per pixel statistics
  */
-static void 
-callbackTauImage(TauRawBitmap &bitmap, void *caller) {
-
-   unsigned short *image_copy;
-   unsigned short median;
+static void
+resetStack(void)
+{
+   unsigned int n = serv_info->width * serv_info->height;
 
-   /*
-    * Check if a new image needs to be allocated
-    */
+   serv_info->frame_count = 0;
+   serv_info->stack_bias = 0;
+   serv_info->stack_final = FALSE;
+   serv_info->stack_calibrated = FALSE;
+   serv_info->diff_done = FALSE;
+   serv_info->stack_diff = FALSE;
    if (serv_info->stack_data == NULL) {
-      serv_info->frame_count = 0;
-      serv_info->width = bitmap.width;
-      serv_info->height = bitmap.height;
-      serv_info->stack_data = (int *)cli_malloc(serv_info->width * 
-						serv_info->height * 
-						sizeof(int));
-      memset(serv_info->stack_data, 0, 
-	     serv_info->width * serv_info->height * sizeof(int));
-   }
-
-   /*
-    * Make sure that the size of the bitmap is consistent
-    */
-   if ((bitmap.width != serv_info->width) ||
-       (bitmap.height != serv_info->height)) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		"(%s:%d) inconsistency image size consistency"
-		" width = %d vs %d, height = %d vs %d", 
-		__FILE__, __LINE__, bitmap.width, serv_info->width,
-		bitmap.height, serv_info->height);
       return;
-   }	    
-   
-   /*
-    * If this is not received within the exposure sequence, reset the
-    * image buffer and count.
-    */
-   if (serv_info->exp_start_ts == 0) {
-      serv_info->frame_count = 0;
-      memset(serv_info->stack_data, 0, 
-	     serv_info->width * serv_info->height * sizeof(int));
    }
-
-   /*
-    * Make a copy of the image and determine the median background
-    */
-   image_copy = (unsigned short *)cli_malloc(serv_info->width * 
-					     serv_info->height * 
-					     sizeof(unsigned short));
-   memcpy(image_copy, bitmap.data, serv_info->width * serv_info->height * 
-	  sizeof(unsigned short));
-   median = medianCalculation(image_copy, serv_info->width * serv_info->height,
-			      1);
-   free(image_copy);
-      
-   /*
-    * Add the median subtracted pixels to the stacked image
-    */
-//   pthread_mutex_lock(&lock);
-   mtx.lock();
-   for (unsigned int i = 0; i < serv_info->width * serv_info->height; i++) {
-      //serv_info->stack_data[i] += bitmap.data[i] - median;
-      serv_info->stack_data[i] = bitmap.data[i];
+   memset(serv_info->stack_data, 0, n * sizeof(int));
+   if (serv_info->stack_mode == STACK_CLIP) {
+      memset(serv_info->stack_sumsq, 0, n * sizeof(int64_t));
+      memset(serv_info->stack_count, 0, n * sizeof(unsigned short));
    }
-   serv_info->frame_count++;
-   mtx.unlock();
-
-//   pthread_mutex_unlock(&lock);
 }
 
 
 /*
- * Set a new camera gain
+ * Add a background subtracted frame to the sigma-clipped stack.  Each
+ * pixel keeps its own running mean and variance of the samples accepted
+ * so far, and a sample further than CLIP_SIGMA from that mean (hot
+ * pixels, aircraft, satellites) is left out of the average.
  */
 static void
-applyGain(gain_t gain) {
+accumulateFrameClipped(const unsigned short *frame, int background,
+		       unsigned int n)
+{
+   int *sum = serv_info->stack_data;
+   int64_t *sumsq = serv_info->stack_sumsq;
+   unsigned short *count = serv_info->stack_count;
 
-   char gain_string[20];
+   for (unsigned int i = 0; i < n; i++) {
+      int value = (int)frame[i] - background;
 
-   switch(gain) {
-      case GAIN_AUTO:
-	 serv_info->tgr->setGainMode(thermal_grabber::Automatic);
-	 snprintf(gain_string, sizeof(gain_string)-1, "AUTO");
-	 break;
-      case GAIN_LOW:
-	 serv_info->tgr->setGainMode(thermal_grabber::LowGain);
-	 snprintf(gain_string, sizeof(gain_string)-1, "LOW");
+      if (count[i] >= CLIP_MIN_FRAMES) {
+	 double mean = (double)sum[i] / count[i];
+	 double var = (double)sumsq[i] / count[i] - mean * mean;
+	 double diff = value - mean;
+
+	 /* Don't let a flat pixel reject its own quantization noise */
+	 if (var < 1.0) {
+	    var = 1.0;
+	 }
+	 if (diff * diff > SQR(CLIP_SIGMA) * var) {
+	    continue;
+	 }
+      }
+      sum[i] += value;
+      sumsq[i] += (int64_t)value * value;
+      if (count[i] < 65535) {
+	 count[i]++;
+      }
+   }
+}
+
+
+/*
+ * Finalize the rows of one band of the stack and find their minimum
+ */
+static void *
+finalizeStackBand(void *arg)
+{
+   convert_band_t *band = (convert_band_t *)arg;
+   int *stack = serv_info->stack_data + (size_t)band->first_row * 
+      serv_info->width;
+   unsigned short *count = serv_info->stack_count + (size_t)band->first_row *
+      serv_info->width;
+   unsigned int n = band->nrows * serv_info->width;
+   int min_val = 65535;
+   unsigned int i;
+
+   switch (serv_info->stack_mode) {
+      case STACK_SUM:
+	 for (i = 0; i < n; i++) {
+	    stack[i] -= serv_info->stack_bias;
+	    if (stack[i] < min_val) {
+	       min_val = stack[i];
+	    }
+	 }
 	 break;
-      case GAIN_HIGH:
-	 serv_info->tgr->setGainMode(thermal_grabber::HighGain);
-	 snprintf(gain_string, sizeof(gain_string)-1, "HIGH");
+      case STACK_MEAN:
+	 for (i = 0; i < n; i++) {
+	    stack[i] = (int)lround((double)(stack[i] - serv_info->stack_bias) /
+				   serv_info->frame_count);
+	    if (stack[i] < min_val) {
+	       min_val = stack[i];
+	    }
+	 }
 	 break;
-      case GAIN_MANUAL:
-	 serv_info->tgr->setGainMode(thermal_grabber::Manual);
-	 snprintf(gain_string, sizeof(gain_string)-1, "MANUAL");
+      case STACK_CLIP:
+	 for (i = 0; i < n; i++) {
+	    if (count[i] != 0) {
+	       stack[i] = (int)lround((double)stack[i] / count[i]);
+	    }
+	    if (stack[i] < min_val) {
+	       min_val = stack[i];
+	    }
+	 }
 	 break;
    }
-   if (ssPutString(SS_GAIN, gain_string) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		"(%s:%d) ssPutString of %s with %s failed: %s",
-		__FILE__, __LINE__, SS_GAIN, gain_string, ssGetStrError());
-   }
+   band->min_val = min_val;
+
+   return NULL;
+}
+
+
+/*
+ * Find the maximum of the rows of one band of the finalized stack
+ */
+static void *
+rangeStackBand(void *arg)
+{
+   convert_band_t *band = (convert_band_t *)arg;
+   const int *stack = serv_info->stack_data + (size_t)band->first_row * 
+      serv_info->width;
+   unsigned int n = band->nrows * serv_info->width;
+   int max_val = INT_MIN;
+   unsigned int i;
+
+   for (i = 0; i < n; i++) {
+      if (stack[i] > max_val) {
+	 max_val = stack[i];
+      }
+   }
+   band->max_val = max_val;
+
+   return NULL;
+}
+
+
+/*
+ * Convert the rows of one band of the finalized stack to 16-bit pixels
+ * offset by the minimum of the whole image, and divided by 2^shift if
+ * that is what it takes to fit them, mirrored if FLIP_X is set.
+ * For a FITS data unit the pixels are also offset by BZERO and swapped
+ * to big-endian, so they can be written out as they are.  NEON narrows,
+ * mirrors and swaps eight pixels at a time on the Raspberry Pi.
+ */
+static void *
+convertStackBand(void *arg)
+{
+   convert_band_t *band = (convert_band_t *)arg;
+   unsigned int width = serv_info->width;
+   unsigned int y;
+
+   for (y = band->first_row; y < band->first_row + band->nrows; y++) {
+      const int *src = serv_info->stack_data + (size_t)y * width;
+      unsigned short *dst = band->image + (size_t)y * width;
+
+      if (width == PIXEL_TAU_WIDTH) {
+	 pixelRowFromStack(dst, src, PIXEL_TAU_WIDTH, band->min_val, 
+			   band->shift, FLIP_PIXELS, band->fits_order);
+      }
+      else {
+	 pixelRowFromStack(dst, src, width, band->min_val, band->shift,
+			   FLIP_PIXELS, band->fits_order);
+      }
+   }
+
+   return NULL;
+}
+
+
+/*
+ * Run one stage of the conversion on each band, one thread per band
+ */
+static void
+runConvertBands(void *(*stage)(void *), convert_band_t *band)
+{
+   pthread_t thread[CONVERT_THREADS];
+   int started[CONVERT_THREADS];
+   int i;
+
+   for (i = 0; i < CONVERT_THREADS; i++) {
+      started[i] = (pthread_create(&thread[i], NULL, stage, &band[i]) == 0);
+      if (!started[i]) {
+	 stage(&band[i]);
+      }
+   }
+   for (i = 0; i < CONVERT_THREADS; i++) {
+      if (started[i]) {
+	 pthread_join(thread[i], NULL);
+      }
+   }
+}
+
+
+/*
+ * Split the stack into the row bands the conversion works on, one for
+ * each of the CONVERT_THREADS threads
+ */
+static void
+splitBands(convert_band_t *band)
+{
+   unsigned int row = 0;
+   int i;
+
+   for (i = 0; i < CONVERT_THREADS; i++) {
+      memset(&band[i], 0, sizeof(band[i]));
+      band[i].first_row = row;
+      band[i].nrows = (serv_info->height - row) / (CONVERT_THREADS - i);
+      row += band[i].nrows;
+   }
+}
+
+
+/*
+ * Finalize the stack for the current stacking mode and find its minimum.
+ * This is only done once per exposure, so the same exposure can be
+ * converted again for the other format.
+ */
+static void
+finalizeStack(void)
+{
+   convert_band_t band[CONVERT_THREADS];
+   int min_val = 65535;
+   int i;
+
+   if (serv_info->stack_final) {
+      return;
+   }
+   splitBands(band);
+   runConvertBands(finalizeStackBand, band);
+   for (i = 0; i < CONVERT_THREADS; i++) {
+      if (band[i].min_val < min_val) {
+	 min_val = band[i].min_val;
+      }
+   }
+   serv_info->stack_min = min_val;
+   serv_info->stack_final = TRUE;
+}
+
+
+/*
+ * Get what turns the finalized stack back into camera counts per frame,
+ * the units the masters are kept in: a pixel of the stack times 'scale'
+ * plus 'bias'
+ */
+static void
+stackUnits(float *scale, float *bias)
+{
+   *scale = (serv_info->stack_mode == STACK_SUM) ? 
+      1.0f / serv_info->frame_count : 1.0f;
+   *bias = (float)serv_info->stack_bias / serv_info->frame_count;
+}
+
+
+/*
+ * Put the path of the master of 'kind' for images taken in 'gain' mode
+ * in 'path'
+ */
+static void
+masterPath(char *path, calib_kind_t kind, gain_t gain)
+{
+   const char *gain_string = GAIN_AUTO_STRING;
+
+   switch (gain) {
+      case GAIN_AUTO:
+	 gain_string = GAIN_AUTO_STRING;
+	 break;
+      case GAIN_HIGH:
+	 gain_string = GAIN_HIGH_STRING;
+	 break;
+      case GAIN_LOW:
+	 gain_string = GAIN_LOW_STRING;
+	 break;
+      case GAIN_MANUAL:
+	 gain_string = GAIN_MANUAL_STRING;
+	 break;
+   }
+   snprintf(path, CALIB_PATH_SIZE, "%s/%s_%s_%ux%u.f32", CALIB_DIR,
+	    (kind == CALIB_DARK) ? "dark" : "flat", gain_string,
+	    serv_info->width, serv_info->height);
+}
+
+
+/*
+ * Unmap a master, freeing its slot
+ */
+static void
+unmapMaster(master_t *master)
+{
+   if (master->data != NULL) {
+      munmap(master->data, master->size);
+      master->data = NULL;
+   }
+}
+
+
+/*
+ * Get the master saved in 'path', mapping it from its file the first time
+ * it is needed.  Returns NULL if there is no such master for an image of
+ * 'npixels' pixels.
+ */
+static const float *
+mapMaster(const char *path, size_t npixels)
+{
+   master_t *master;
+   struct stat st;
+   void *data;
+   int fd;
+   int i;
+
+   for (i = 0; i < MAX_MASTERS; i++) {
+      master = &serv_info->master[i];
+      if ((master->data != NULL) && !strcmp(master->path, path)) {
+	 return master->data;
+      }
+   }
+   if ((fd = open(path, O_RDONLY)) == -1) {
+      return NULL;
+   }
+   if ((fstat(fd, &st) == -1) || 
+       ((size_t)st.st_size != npixels * sizeof(float))) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+		"(%s:%d) %s is not a master for %ux%u images", 
+		__FILE__, __LINE__, path, serv_info->width,
+		serv_info->height);
+      close(fd);
+      return NULL;
+   }
+   data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED | MAP_POPULATE, 
+	       fd, 0);
+   close(fd);
+   if (data == MAP_FAILED) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+		"(%s:%d) unable to map %s : %s (errno=%d)", __FILE__, 
+		__LINE__, path, strerror(errno), errno);
+      return NULL;
+   }
+
+   /*
+    * It takes the place of the master mapped the longest ago
+    */
+   master = &serv_info->master[serv_info->master_next];
+   serv_info->master_next = (serv_info->master_next + 1) % MAX_MASTERS;
+   unmapMaster(master);
+   strcpy(master->path, path);
+   master->data = (float *)data;
+   master->size = st.st_size;
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	     "(%s:%d) mapped master %s", __FILE__, __LINE__, path);
+
+   return master->data;
+}
+
+
+#ifdef __ARM_NEON
+/*
+ * Round four floats half away from zero, like lround(), by adding a half
+ * of the same sign before truncating
+ */
+static int32x4_t
+roundLanes(float32x4_t x)
+{
+   const uint32x4_t sign = vdupq_n_u32(0x80000000);
+   const uint32x4_t half = vreinterpretq_u32_f32(vdupq_n_f32(0.5f));
+
+   return vcvtq_s32_f32(vaddq_f32(x, vreinterpretq_f32_u32(
+      vorrq_u32(vandq_u32(vreinterpretq_u32_f32(x), sign), half))));
+}
+#endif
+
+
+/*
+ * Apply the masters to the rows of one band of the finalized stack and
+ * find their new minimum.  Each pixel is brought back to counts per
+ * frame, has the dark subtracted and the flat correction multiplied in,
+ * and goes back to the units of the stack.  NEON does four pixels at a
+ * time on the Raspberry Pi.
+ */
+static void *
+calibrateStackBand(void *arg)
+{
+   convert_band_t *band = (convert_band_t *)arg;
+   size_t first = (size_t)band->first_row * serv_info->width;
+   int *stack = serv_info->stack_data + first;
+   const float *dark = band->dark ? band->dark + first : NULL;
+   const float *flat = band->flat ? band->flat + first : NULL;
+   unsigned int n = band->nrows * serv_info->width;
+   float unscale = 1.0f / band->scale;
+   int min_val = 65535;
+   unsigned int i = 0;
+
+#ifdef __ARM_NEON
+   const float32x4_t scale = vdupq_n_f32(band->scale);
+   const float32x4_t bias = vdupq_n_f32(band->bias);
+   const float32x4_t back = vdupq_n_f32(unscale);
+   int32x4_t vmin = vdupq_n_s32(min_val);
+
+   for (; i + 4 <= n; i += 4) {
+      float32x4_t level = vmlaq_f32(bias, vcvtq_f32_s32(vld1q_s32(stack + i)),
+				    scale);
+      int32x4_t value;
+
+      if (dark != NULL) {
+	 level = vsubq_f32(level, vld1q_f32(dark + i));
+      }
+      if (flat != NULL) {
+	 level = vmulq_f32(level, vld1q_f32(flat + i));
+      }
+      value = roundLanes(vmulq_f32(level, back));
+      vst1q_s32(stack + i, value);
+      vmin = vminq_s32(vmin, value);
+   }
+   min_val = pixelMinLanes(vmin, min_val);
+#endif
+   for (; i < n; i++) {
+      float level = stack[i] * band->scale + band->bias;
+
+      if (dark != NULL) {
+	 level -= dark[i];
+      }
+      if (flat != NULL) {
+	 level *= flat[i];
+      }
+      stack[i] = (int)lroundf(level * unscale);
+      if (stack[i] < min_val) {
+	 min_val = stack[i];
+      }
+   }
+   band->min_val = min_val;
+
+   return NULL;
+}
+
+
+/*
+ * Dark and flat correct the finalized stack in place with the masters for
+ * the current gain mode, once per exposure, and find its new minimum.
+ * writeFITSImage() notes the masters applied in the header.  Without
+ * either master the stack is left as it is.
+ */
+static void
+calibrateStack(void)
+{
+   char path[CALIB_PATH_SIZE];
+   size_t npixels = (size_t)serv_info->width * serv_info->height;
+   convert_band_t band[CONVERT_THREADS];
+   const float *dark;
+   const float *flat;
+   float scale, bias;
+   int min_val = 65535;
+   int i;
+
+   if (serv_info->stack_calibrated) {
+      return;
+   }
+   masterPath(path, CALIB_DARK, serv_info->gain);
+   dark = mapMaster(path, npixels);
+   strcpy(serv_info->calib_dark, 
+	  dark ? path + strlen(CALIB_DIR) + 1 : "NONE");
+   masterPath(path, CALIB_FLAT, serv_info->gain);
+   flat = mapMaster(path, npixels);
+   strcpy(serv_info->calib_flat, 
+	  flat ? path + strlen(CALIB_DIR) + 1 : "NONE");
+   if ((dark == NULL) && (flat == NULL)) {
+      return;
+   }
+
+   stackUnits(&scale, &bias);
+   splitBands(band);
+   for (i = 0; i < CONVERT_THREADS; i++) {
+      band[i].dark = dark;
+      band[i].flat = flat;
+      band[i].scale = scale;
+      band[i].bias = bias;
+   }
+   runConvertBands(calibrateStackBand, band);
+   for (i = 0; i < CONVERT_THREADS; i++) {
+      if (band[i].min_val < min_val) {
+	 min_val = band[i].min_val;
+      }
+   }
+   serv_info->stack_min = min_val;
+   serv_info->stack_calibrated = TRUE;
+}
+
+
+#ifndef BENCHMARK
+/*
+ * Forget the references of the differential mode, so that they are
+ * built up again from the next frames
+ */
+static void
+resetDifference(void)
+{
+   serv_info->diff_ref_valid = FALSE;
+   serv_info->diff_median_frames = 0;
+}
+#endif
+
+
+/*
+ * Move the running median of the frames one count towards each pixel of
+ * a new frame.  Over many frames each pixel settles on the median of its
+ * recent values, without keeping any of them.  NEON steps eight pixels
+ * at a time on the Raspberry Pi.
+ */
+static void
+updateMedian(const unsigned short *frame, unsigned int n)
+{
+   unsigned short *median = serv_info->diff_median;
+   unsigned int i = 0;
+
+   if (serv_info->diff_median_frames++ == 0) {
+      memcpy(median, frame, n * sizeof(unsigned short));
+      return;
+   }
+
+#ifdef __ARM_NEON
+   for (; i + 8 <= n; i += 8) {
+      uint16x8_t pix = vld1q_u16(frame + i);
+      uint16x8_t med = vld1q_u16(median + i);
+      uint16x8_t up = vshrq_n_u16(vcgtq_u16(pix, med), 15);
+      uint16x8_t down = vshrq_n_u16(vcltq_u16(pix, med), 15);
+
+      vst1q_u16(median + i, vsubq_u16(vaddq_u16(med, up), down));
+   }
+#endif
+   for (; i < n; i++) {
+      if (frame[i] > median[i]) {
+	 median[i]++;
+      }
+      else if (frame[i] < median[i]) {
+	 median[i]--;
+      }
+   }
+}
+
+
+/*
+ * Take the reference out of the rows of one band of the finalized stack
+ * and find their new minimum.  The difference is made in counts per
+ * frame and goes back to the units of the stack.  Against the previous
+ * exposure, this one becomes the reference on the way.
+ */
+static void *
+differenceStackBand(void *arg)
+{
+   convert_band_t *band = (convert_band_t *)arg;
+   size_t first = (size_t)band->first_row * serv_info->width;
+   int *stack = serv_info->stack_data + first;
+   float *ref = serv_info->diff_ref + first;
+   const unsigned short *median = serv_info->diff_median + first;
+   int previous = (serv_info->diff_mode == DIFF_PREVIOUS);
+   unsigned int n = band->nrows * serv_info->width;
+   float unscale = 1.0f / band->scale;
+   int min_val = 65535;
+   unsigned int i = 0;
+
+#ifdef __ARM_NEON
+   const float32x4_t scale = vdupq_n_f32(band->scale);
+   const float32x4_t bias = vdupq_n_f32(band->bias);
+   const float32x4_t back = vdupq_n_f32(unscale);
+   int32x4_t vmin = vdupq_n_s32(min_val);
+
+   for (; i + 4 <= n; i += 4) {
+      float32x4_t level = vmlaq_f32(bias, vcvtq_f32_s32(vld1q_s32(stack + i)),
+				    scale);
+      float32x4_t diff;
+      int32x4_t value;
+
+      if (previous) {
+	 diff = vsubq_f32(level, vld1q_f32(ref + i));
+	 vst1q_f32(ref + i, level);
+      }
+      else {
+	 diff = vsubq_f32(level,
+			  vcvtq_f32_u32(vmovl_u16(vld1_u16(median + i))));
+      }
+      value = roundLanes(vmulq_f32(diff, back));
+      vst1q_s32(stack + i, value);
+      vmin = vminq_s32(vmin, value);
+   }
+   min_val = pixelMinLanes(vmin, min_val);
+#endif
+   for (; i < n; i++) {
+      float level = stack[i] * band->scale + band->bias;
+      float diff;
+
+      if (previous) {
+	 diff = level - ref[i];
+	 ref[i] = level;
+      }
+      else {
+	 diff = level - median[i];
+      }
+      stack[i] = (int)lroundf(diff * unscale);
+      if (stack[i] < min_val) {
+	 min_val = stack[i];
+      }
+   }
+   band->min_val = min_val;
+
+   return NULL;
+}
+
+
+/*
+ * Turn the finalized stack into its difference against the reference of
+ * the DIFF mode, once per exposure, and find its new minimum.  The first
+ * exposure after the mode is set only becomes the reference for the next
+ * one, and is sent as it is.
+ */
+static void
+differenceStack(void)
+{
+   size_t npixels = (size_t)serv_info->width * serv_info->height;
+   convert_band_t band[CONVERT_THREADS];
+   float scale, bias;
+   int min_val = 65535;
+   size_t j;
+   int i;
+
+   if (serv_info->diff_done) {
+      return;
+   }
+   serv_info->diff_done = TRUE;
+   stackUnits(&scale, &bias);
+   if ((serv_info->diff_mode == DIFF_PREVIOUS) && !serv_info->diff_ref_valid) {
+      for (j = 0; j < npixels; j++) {
+	 serv_info->diff_ref[j] = serv_info->stack_data[j] * scale + bias;
+      }
+      serv_info->diff_ref_valid = TRUE;
+      return;
+   }
+   if ((serv_info->diff_mode == DIFF_MEDIAN) && 
+       (serv_info->diff_median_frames == 0)) {
+      return;
+   }
+
+   splitBands(band);
+   for (i = 0; i < CONVERT_THREADS; i++) {
+      band[i].scale = scale;
+      band[i].bias = bias;
+   }
+   runConvertBands(differenceStackBand, band);
+   for (i = 0; i < CONVERT_THREADS; i++) {
+      if (band[i].min_val < min_val) {
+	 min_val = band[i].min_val;
+      }
+   }
+   serv_info->stack_min = min_val;
+   serv_info->stack_diff = TRUE;
+}
+
+
+/*
+ * Turn the accumulated sums into the final 16-bit image for the current
+ * stacking mode, as a difference in the differential mode or else dark
+ * and flat corrected if calibration is on, and offset so that the
+ * faintest pixel is 0.  The work is split into row bands over
+ * CONVERT_THREADS threads: finalizeStack(), differenceStack() and
+ * calibrateStack() work on the stack in place and find the minimum, then
+ * the pixels are converted into the reused fits_image buffer.  The dark
+ * cancels out of a difference, so it isn't calibrated.  With 'fits_order'
+ * set the result is a FITS data unit ready to write; otherwise it holds
+ * native unsigned pixels for the Rice compressor.
+ */
+static unsigned short *
+convertStack(int fits_order)
+{
+   convert_band_t band[CONVERT_THREADS];
+   int64_t range;
+   int i;
+
+   finalizeStack();
+   if (serv_info->diff_mode != DIFF_OFF) {
+      differenceStack();
+   }
+   else if (serv_info->calibrate) {
+      calibrateStack();
+   }
+   /*
+    * A long SUM can range over more than the 16 bits of the image.  It is
+    * then divided by the smallest power of 2 that fits it, which BSCALE
+    * records, rather than clipped.
+    */
+   splitBands(band);
+   runConvertBands(rangeStackBand, band);
+   range = 0;
+   for (i = 0; i < CONVERT_THREADS; i++) {
+      if ((band[i].nrows > 0) && 
+	  ((int64_t)band[i].max_val - serv_info->stack_min > range)) {
+	 range = (int64_t)band[i].max_val - serv_info->stack_min;
+      }
+   }
+   serv_info->stack_shift = 0;
+   while ((range >> serv_info->stack_shift) >= 65535) {
+      serv_info->stack_shift++;
+   }
+
+   for (i = 0; i < CONVERT_THREADS; i++) {
+      band[i].fits_order = fits_order;
+      band[i].image = serv_info->fits_image;
+      band[i].min_val = serv_info->stack_min;
+      band[i].shift = serv_info->stack_shift;
+   }
+   runConvertBands(convertStackBand, band);
+
+   return serv_info->fits_image;
+}
+
+
+#ifndef BENCHMARK
+/*
+ * Handle callbacks for image data received from the camera.  This runs on
+ * the thermalgrabber thread, so while an exposure is in progress the frame
+ * is only copied into the next free slot of the frame ring and the server
+ * loop is woken up to stack it.  Nothing here waits on the server loop; if
+ * the ring is full the frame is dropped and counted.
+ */
+static void 
+callbackTauImage(TauRawBitmap &bitmap, void *caller) {
+
+   static int size_logged = FALSE; /* A bad frame size was logged */
+   unsigned int head, tail;
+   uint64_t event = 1;
+
+   /*
+    * Take the image size from the first frame, as long as it fits the
+    * buffers.  The frames of a camera that doesn't fit are all dropped,
+    * and that is only logged once.
+    */
+   if (frame_ring.width == 0) {
+      if ((bitmap.width > serv_info->max_width) ||
+	  (bitmap.height > serv_info->max_height)) {
+	 if (!size_logged) {
+	    cfht_logv(CFHT_MAIN, CFHT_WARN,
+		      "(%s:%d) %dx%d frames are larger than the %dx%d"
+		      " buffers, dropping them", __FILE__, __LINE__, 
+		      bitmap.width, bitmap.height, serv_info->max_width,
+		      serv_info->max_height);
+	    size_logged = TRUE;
+	 }
+	 return;
+      }
+      frame_ring.width = bitmap.width;
+      frame_ring.height = bitmap.height;
+   }
+
+   /*
+    * Make sure that the size of the bitmap is consistent
+    */
+   if ((bitmap.width != frame_ring.width) ||
+       (bitmap.height != frame_ring.height)) {
+      if (!size_logged) {
+	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		   "(%s:%d) inconsistency image size consistency"
+		   " width = %d vs %d, height = %d vs %d", 
+		   __FILE__, __LINE__, bitmap.width, frame_ring.width,
+		   bitmap.height, frame_ring.height);
+	 size_logged = TRUE;
+      }
+      return;
+   }	    
+   frame_ring.received.fetch_add(1, std::memory_order_relaxed);
+   
+   /*
+    * If this is not received within the exposure sequence, the frame
+    * isn't needed, unless the sky is due to be measured.
+    */
+   if (!frame_ring.exposing.load(std::memory_order_acquire) &&
+       !frame_ring.sky_wanted.exchange(0, std::memory_order_acq_rel)) {
+      return;
+   }
+
+   /*
+    * Copy the frame into the free slot and publish it to the server loop
+    */
+   head = frame_ring.head.load(std::memory_order_relaxed);
+   tail = frame_ring.tail.load(std::memory_order_acquire);
+   if (head - tail >= FRAME_RING_SLOTS) {
+      frame_ring.dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+   }
+   memcpy(frame_ring.slot[head % FRAME_RING_SLOTS], bitmap.data,
+	  frame_ring.width * frame_ring.height * sizeof(unsigned short));
+   frame_ring.head.store(head + 1, std::memory_order_release);
+   if (write(frame_ring.event_fd, &event, sizeof(event)) == -1) {
+      /* The counter only saturates if nobody has read it for ages */
+   }
+}
+#endif
+
+
+/*
+ * Add up the pixels of one SKY_TILE square tile of a frame and their
+ * squares.  NEON sums eight pixels at a time into 32-bit lanes, which a
+ * tile can't overflow, and their squares into 64-bit ones.
+ */
+static void
+skyTile(const unsigned short *tile, unsigned int width, uint64_t *sum, 
+	uint64_t *sumsq)
+{
+   uint64_t s = 0;
+   uint64_t sq = 0;
+   unsigned int x, y;
+
+   for (y = 0; y < SKY_TILE; y++) {
+      const unsigned short *row = tile + (size_t)y * width;
+
+      x = 0;
+#ifdef __ARM_NEON
+      {
+	 uint32x4_t vsum = vdupq_n_u32(0);
+	 uint64x2_t vsq = vdupq_n_u64(0);
+
+	 for (; x + 8 <= SKY_TILE; x += 8) {
+	    uint16x8_t pix = vld1q_u16(row + x);
+
+	    vsum = vpadalq_u16(vsum, pix);
+	    vsq = vpadalq_u32(vsq, vmull_u16(vget_low_u16(pix), 
+					     vget_low_u16(pix)));
+	    vsq = vpadalq_u32(vsq, vmull_u16(vget_high_u16(pix), 
+					     vget_high_u16(pix)));
+	 }
+	 s += (uint64_t)vgetq_lane_u32(vsum, 0) + vgetq_lane_u32(vsum, 1) +
+	    vgetq_lane_u32(vsum, 2) + vgetq_lane_u32(vsum, 3);
+	 sq += vgetq_lane_u64(vsq, 0) + vgetq_lane_u64(vsq, 1);
+      }
+#endif
+      for (; x < SKY_TILE; x++) {
+	 s += row[x];
+	 sq += (uint32_t)row[x] * row[x];
+      }
+   }
+   *sum = s;
+   *sumsq = sq;
+}
+
+
+/*
+ * Comparison function used by qsort to order the tile statistics
+ */
+static int
+compareTiles(const void *a, const void *b)
+{
+   double x = *(const double *)a;
+   double y = *(const double *)b;
+
+   return (x > y) - (x < y);
+}
+
+
+/*
+ * Count the stars in a frame, as the pixels above 'threshold' that are
+ * brighter than their neighbours.  NEON finds the runs of eight pixels with
+ * nothing above the threshold, which is nearly all of a frame, and only
+ * the rest are looked at one by one.
+ */
+static unsigned int
+skyStars(const unsigned short *frame, unsigned int width, unsigned int height,
+	 unsigned short threshold)
+{
+   unsigned int stars = 0;
+   unsigned int x, y, i;
+
+   for (y = 1; y + 1 < height; y++) {
+      const unsigned short *row = frame + (size_t)y * width;
+
+      x = 1;
+#ifdef __ARM_NEON
+      {
+	 const uint16x8_t thr = vdupq_n_u16(threshold);
+
+	 for (; x + 8 < width; x += 8) {
+	    uint64x2_t above = vreinterpretq_u64_u16(
+	       vcgtq_u16(vld1q_u16(row + x), thr));
+
+	    if ((vgetq_lane_u64(above, 0) | vgetq_lane_u64(above, 1)) == 0) {
+	       continue;
+	    }
+	    for (i = x; i < x + 8; i++) {
+	       unsigned short p = row[i];
+
+	       stars += (p > threshold) && (p > row[i - 1]) && 
+		  (p >= row[i + 1]) && (p > row[i - width]) && 
+		  (p >= row[i + width]);
+	    }
+	 }
+      }
+#endif
+      for (i = x; i + 1 < width; i++) {
+	 unsigned short p = row[i];
+
+	 stars += (p > threshold) && (p > row[i - 1]) && (p >= row[i + 1]) &&
+	    (p > row[i - width]) && (p >= row[i + width]);
+      }
+   }
+
+   return stars;
+}
+
+
+/*
+ * Publish one sky metric under SS_SKY
+ */
+static void
+putSky(const char *name, double value)
+{
+   char path[80];
+
+   snprintf(path, sizeof(path), "%s/%s", SS_SKY, name);
+   pthread_mutex_lock(&ss_lock);
+   if (ssPutPrintf(path, "%.2f", value) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) ssPutPrintf of %s with %.2f failed: %s",
+		__FILE__, __LINE__, path, value, ssGetStrError());
+   }
+   pthread_mutex_unlock(&ss_lock);
+}
+
+
+/*
+ * Measure the sky in a raw frame and publish it under SS_SKY, so that
+ * whether it is clear can be told from a handful of numbers instead of
+ * the images.  The frame is cut into SKY_TILE tiles: the background and
+ * noise are the medians of their means and RMS, which the stars in a few
+ * of them don't move, and the spread of the tile means, in the counts
+ * that follow the sky temperature, shows the patchiness of any cloud.
+ * Only one frame every SKY_PUBLISH_INTERVAL seconds is measured, since
+ * the Status Server isn't updated faster than that, and the time it was
+ * measured at is published with it.
+ */
+static void
+skyMetrics(const unsigned short *frame)
+{
+   static double tile_mean[SKY_MAX_TILES];
+   static double tile_rms[SKY_MAX_TILES];
+   sky_metrics_t *sky = &serv_info->sky;
+   unsigned int width = frame_ring.width;
+   unsigned int height = frame_ring.height;
+   unsigned int ntiles, tx, ty;
+   double now, mean, threshold;
+   double sum = 0;
+   double sumsq = 0;
+
+   now = getClockTime();
+   if (now - serv_info->sky_ts < SKY_PUBLISH_INTERVAL) {
+      return;
+   }
+   serv_info->sky_ts = now;
+
+   /*
+    * Reduce the frame to the mean and RMS of each tile
+    */
+   ntiles = 0;
+   sky->sky_min = 65535;
+   sky->sky_max = 0;
+   for (ty = 0; ty + SKY_TILE <= height; ty += SKY_TILE) {
+      for (tx = 0; tx + SKY_TILE <= width; tx += SKY_TILE) {
+	 uint64_t tsum, tsumsq;
+	 double var;
+
+	 skyTile(frame + (size_t)ty * width + tx, width, &tsum, &tsumsq);
+	 mean = (double)tsum / (SKY_TILE * SKY_TILE);
+	 var = (double)tsumsq / (SKY_TILE * SKY_TILE) - mean * mean;
+	 tile_mean[ntiles] = mean;
+	 tile_rms[ntiles] = (var > 0) ? sqrt(var) : 0;
+	 ntiles++;
+	 sum += mean;
+	 sumsq += mean * mean;
+	 if (mean < sky->sky_min) {
+	    sky->sky_min = mean;
+	 }
+	 if (mean > sky->sky_max) {
+	    sky->sky_max = mean;
+	 }
+      }
+   }
+   if (ntiles == 0) {
+      return;
+   }
+   sky->sky_mean = sum / ntiles;
+   sky->sky_rms = sumsq / ntiles - sky->sky_mean * sky->sky_mean;
+   sky->sky_rms = (sky->sky_rms > 0) ? sqrt(sky->sky_rms) : 0;
+   qsort(tile_mean, ntiles, sizeof(double), compareTiles);
+   qsort(tile_rms, ntiles, sizeof(double), compareTiles);
+   sky->background = tile_mean[(ntiles - 1) / 2];
+   sky->rms = tile_rms[(ntiles - 1) / 2];
+
+   /*
+    * Count what stands out of the background
+    */
+   threshold = sky->background + SKY_STAR_SIGMA * sky->rms;
+   sky->stars = skyStars(frame, width, height, 
+			 (threshold < 65535) ? (unsigned short)threshold : 
+			 65535);
+
+   putSky("background", sky->background);
+   putSky("rms", sky->rms);
+   putSky("stars", sky->stars);
+   putSky("skyTemp/mean", sky->sky_mean);
+   putSky("skyTemp/min", sky->sky_min);
+   putSky("skyTemp/max", sky->sky_max);
+   putSky("skyTemp/rms", sky->sky_rms);
+   putSky("unixtime", now);
+}
+
+
+/*
+ * Add one frame from the ring to the stacked image, sizing the stack the
+ * first time a frame comes through, and measure the sky in it when due.
+ */
+static void
+stackFrame(const unsigned short *frame)
+{
+   unsigned short median;
+   unsigned int n;
+
+   if (serv_info->width == 0) {
+      serv_info->width = frame_ring.width;
+      serv_info->height = frame_ring.height;
+      n = serv_info->width * serv_info->height;
+      memset(serv_info->stack_sumsq, 0, n * sizeof(int64_t));
+      memset(serv_info->stack_count, 0, n * sizeof(unsigned short));
+      memset(serv_info->stack_data, 0, n * sizeof(int));
+   }
+   n = serv_info->width * serv_info->height;
+
+   /*
+    * Determine the median background straight from the frame slot
+    */
+   median = pixelMedian(frame, n, BACKGROUND_STRIDE);
+      
+   /*
+    * Add the median subtracted pixels to the stacked image
+    */
+   if (serv_info->stack_mode == STACK_CLIP) {
+      accumulateFrameClipped(frame, median, n);
+   }
+   else {
+      pixelAccumulate(serv_info->stack_data, frame, n, 0);
+   }
+   serv_info->stack_bias += median;
+   serv_info->frame_count++;
+
+   /*
+    * Fold the frame into the running median for the differential mode
+    */
+   if (serv_info->diff_mode == DIFF_MEDIAN) {
+      updateMedian(frame, n);
+   }
+   skyMetrics(frame);
+}
+
+
+#ifndef BENCHMARK
+/*
+ * Empty the frame ring, stacking the frames if 'keep' is set or throwing
+ * them away otherwise.  The sky is measured in either, when due.  Each
+ * slot is handed back to the grabber thread as soon as it has been used.
+ */
+static void
+drainFrameRing(int keep)
+{
+   unsigned int tail = frame_ring.tail.load(std::memory_order_relaxed);
+   unsigned int head = frame_ring.head.load(std::memory_order_acquire);
+
+   for (; tail != head; tail++) {
+      if (keep) {
+	 stackFrame(frame_ring.slot[tail % FRAME_RING_SLOTS]);
+      }
+      else {
+	 skyMetrics(frame_ring.slot[tail % FRAME_RING_SLOTS]);
+      }
+      frame_ring.tail.store(tail + 1, std::memory_order_release);
+   }
+}
+
+
+/*
+ * Keep the sky measured between exposures.  The grabber thread only
+ * passes a frame on then when one is asked for, once the last
+ * measurement is SKY_PUBLISH_INTERVAL old, and it is measured as it is
+ * drained on a later pass of the server loop.
+ */
+static void
+watchSky(void)
+{
+   drainFrameRing(FALSE);
+   if (getClockTime() - serv_info->sky_ts >= SKY_PUBLISH_INTERVAL) {
+      frame_ring.sky_wanted.store(1, std::memory_order_release);
+   }
+}
+
+
+/*
+ * Sleep until the grabber thread publishes a frame, a command comes in, a
+ * bulk transfer can go on or 'timeout' seconds pass, whichever comes
+ * first.  Without 'commands' only the frames wake the loop.
+ */
+static void
+waitEvents(double timeout, int commands)
+{
+   struct epoll_event event[WAKE_EVENTS];
+   struct pollfd pfd;
+   uint64_t events;
+   int n, i;
+
+   if (timeout < 0) {
+      timeout = 0;
+   }
+
+   /*
+    * sockserv isn't run while takeImage() waits for a plain IMAGE, so
+    * the commands and bulk transfers are left for later then
+    */
+   if (!commands) {
+      pfd.fd = frame_ring.event_fd;
+      pfd.events = POLLIN;
+      if ((poll(&pfd, 1, (int)(timeout * 1000) + 1) > 0) &&
+	  (read(frame_ring.event_fd, &events, sizeof(events)) == -1)) {
+	 /* Nothing to collect, another wakeup already did */
+      }
+      return;
+   }
+
+   /*
+    * Go straight back to sockserv if the last pass handled a command,
+    * since more of them may be waiting behind it
+    */
+   if (serv_info->commands != serv_info->commands_seen) {
+      serv_info->commands_seen = serv_info->commands;
+      return;
+   }
+   n = epoll_wait(frame_ring.wake_fd, event, WAKE_EVENTS, 
+		  (int)(timeout * 1000) + 1);
+   for (i = 0; i < n; i++) {
+      if ((event[i].data.fd == frame_ring.event_fd) &&
+	  (read(frame_ring.event_fd, &events, sizeof(events)) == -1)) {
+	 /* Nothing to collect, another wakeup already did */
+      }
+   }
+}
+
+
+/*
+ * Add a command socket to the wake_fd set.  It is level triggered, so the
+ * loop doesn't go back to sleep while a command is left to read on it,
+ * and it leaves the set by itself once it is closed.  Returns FALSE if it
+ * was already in the set or can't be added.
+ */
+static int
+watchSocket(int fd)
+{
+   struct epoll_event event;
+
+   event.events = EPOLLIN;
+   event.data.fd = fd;
+   if (epoll_ctl(frame_ring.wake_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+      if (errno != EEXIST) {
+	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		   "(%s:%d) unable to watch command socket %d : %s"
+		   " (errno=%d)", __FILE__, __LINE__, fd, strerror(errno), 
+		   errno);
+      }
+      return FALSE;
+   }
+
+   return TRUE;
+}
+
+
+/*
+ * Add the command connection sockserv has just accepted from 'remote_ip'
+ * to the wake_fd set, with Nagle's algorithm turned off so the short
+ * replies go out at once.  sockserv doesn't hand out its descriptors, so
+ * every one open is looked at through /proc/self/fd, whatever its number,
+ * and the connection is the socket on TAUSERV_PORT with that peer that isn't
+ * in the set yet.  The ones adopted before it are all in the set already,
+ * and so is the listening socket once the first connection has been.  A
+ * connection that can't be found is logged: it is still served, but
+ * during an exposure its commands wait for the loop to wake up.
+ */
+static void
+adoptCommandSockets(const unsigned char *remote_ip)
+{
+   struct sockaddr_in addr;
+   struct dirent *entry;
+   socklen_t len;
+   int adopted = FALSE;
+   int one = 1;
+   DIR *dir;
+   int fd;
+
+   if ((dir = opendir("/proc/self/fd")) == NULL) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) unable to list the open descriptors : %s (errno=%d)",
+		__FILE__, __LINE__, strerror(errno), errno);
+      return;
+   }
+   while (!adopted && ((entry = readdir(dir)) != NULL)) {
+      if (!isdigit((unsigned char)entry->d_name[0]) ||
+	  ((fd = atoi(entry->d_name)) == dirfd(dir))) {
+	 continue;
+      }
+      len = sizeof(addr);
+      if ((getsockname(fd, (struct sockaddr *)&addr, &len) == -1) ||
+	  (addr.sin_family != AF_INET) || 
+	  (addr.sin_port != htons(atoi(TAUSERV_PORT)))) {
+	 continue;
+      }
+      len = sizeof(addr);
+      if (getpeername(fd, (struct sockaddr *)&addr, &len) == -1) {
+	 watchSocket(fd);
+      }
+      else if ((memcmp(&addr.sin_addr, remote_ip, 4) == 0) && 
+	       watchSocket(fd)) {
+	 setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	 adopted = TRUE;
+      }
+   }
+   closedir(dir);
+
+   if (!adopted) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+		"(%s:%d) no command socket found for %d.%d.%d.%d, its"
+		" commands are only read when the server loop wakes up",
+		__FILE__, __LINE__, remote_ip[0], remote_ip[1], remote_ip[2],
+		remote_ip[3]);
+   }
+}
+#endif
+
+
+/*
+ * Names the stage timings are published and logged under
+ */
+static const char *stage_name[NUM_STAGES] = {
+   "expose", "readout", "encode", "io", "send"
+};
+
+
+/*
+ * Record how long a stage of the current image took
+ */
+static void
+recordStage(stage_t stage, double seconds)
+{
+   stage_stats_t *stats = &serv_info->stage_stats[stage];
+
+   stats->sample[stats->count % STATS_WINDOW] = seconds;
+   stats->count++;
+}
+
+
+/*
+ * Comparison function used by qsort to order the timings
+ */
+static int
+compareTimings(const void *a, const void *b)
+{
+   double x = *(const double *)a;
+   double y = *(const double *)b;
+
+   return (x > y) - (x < y);
+}
+
+
+/*
+ * Publish one statistic under SS_STATS
+ */
+static void
+putStat(const char *name, const char *value)
+{
+   char path[80];
+
+   snprintf(path, sizeof(path), "%s/%s", SS_STATS, name);
+   pthread_mutex_lock(&ss_lock);
+   if (ssPutString(path, value) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) ssPutString of %s with %s failed: %s",
+		__FILE__, __LINE__, path, value, ssGetStrError());
+   }
+   pthread_mutex_unlock(&ss_lock);
+}
+
+
+/*
+ * Log the timings of the image just delivered along with the p50/p99 of
+ * the last STATS_WINDOW images, in milliseconds.  The same numbers go to
+ * the Status Server, but at most every STATS_PUBLISH_INTERVAL seconds so
+ * that a fast cadence doesn't turn into a stream of Status Server updates.
+ */
+static void
+publishStats(void)
+{
+   double sorted[STATS_WINDOW];
+   stage_stats_t *stats;
+   double now, last, p50, p99, fps;
+   char line[400];
+   char name[40];
+   char value[40];
+   unsigned int frames;
+   unsigned int n;
+   int publish;
+   int len;
+   int i;
+
+   now = getClockTime();
+   serv_info->image_count++;
+   publish = (now - serv_info->stats_ts >= STATS_PUBLISH_INTERVAL);
+
+   len = snprintf(line, sizeof(line), "image %u timing ms (last/p50/p99):",
+		  serv_info->image_count);
+   for (i = 0; i < NUM_STAGES; i++) {
+      stats = &serv_info->stage_stats[i];
+      if (stats->count == 0) {
+	 continue;
+      }
+      n = (stats->count < STATS_WINDOW) ? stats->count : STATS_WINDOW;
+      last = stats->sample[(stats->count - 1) % STATS_WINDOW] * 1000.0;
+      memcpy(sorted, stats->sample, n * sizeof(double));
+      qsort(sorted, n, sizeof(double), compareTimings);
+      p50 = sorted[(unsigned int)(0.50 * (n - 1) + 0.5)] * 1000.0;
+      p99 = sorted[(unsigned int)(0.99 * (n - 1) + 0.5)] * 1000.0;
+      if (len < (int)sizeof(line)) {
+	 len += snprintf(line + len, sizeof(line) - len, " %s %.1f/%.1f/%.1f",
+			 stage_name[i], last, p50, p99);
+      }
+      if (publish) {
+	 snprintf(name, sizeof(name), "%s/last", stage_name[i]);
+	 snprintf(value, sizeof(value), "%.1f", last);
+	 putStat(name, value);
+	 snprintf(name, sizeof(name), "%s/p50", stage_name[i]);
+	 snprintf(value, sizeof(value), "%.1f", p50);
+	 putStat(name, value);
+	 snprintf(name, sizeof(name), "%s/p99", stage_name[i]);
+	 snprintf(value, sizeof(value), "%.1f", p99);
+	 putStat(name, value);
+      }
+   }
+
+   /*
+    * The camera frame rate is measured over the time since the last update
+    */
+   frames = frame_ring.received.load(std::memory_order_relaxed);
+   fps = 0;
+   if (serv_info->stats_ts != 0) {
+      fps = (frames - serv_info->stats_frames) / (now - serv_info->stats_ts);
+   }
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY, "(%s:%d) %s fps %.1f dropped %u",
+	     __FILE__, __LINE__, line, fps, serv_info->dropped_total);
+   if (publish) {
+      snprintf(value, sizeof(value), "%.2f", fps);
+      putStat("fps", value);
+      snprintf(value, sizeof(value), "%u", serv_info->dropped_total);
+      putStat("dropped", value);
+      snprintf(value, sizeof(value), "%u", serv_info->image_count);
+      putStat("images", value);
+      serv_info->stats_frames = frames;
+      serv_info->stats_ts = now;
+   }
+}
+
+
+#ifndef BENCHMARK
+/*
+ * Set a new camera gain
+ */
+static void
+applyGain(gain_t gain) {
+
+   thermal_grabber::GainMode mode = thermal_grabber::Automatic;
+   char gain_string[20];
+
+   switch(gain) {
+      case GAIN_AUTO:
+	 mode = thermal_grabber::Automatic;
+	 snprintf(gain_string, sizeof(gain_string)-1, "AUTO");
+	 break;
+      case GAIN_LOW:
+	 mode = thermal_grabber::LowGain;
+	 snprintf(gain_string, sizeof(gain_string)-1, "LOW");
+	 break;
+      case GAIN_HIGH:
+	 mode = thermal_grabber::HighGain;
+	 snprintf(gain_string, sizeof(gain_string)-1, "HIGH");
+	 break;
+      case GAIN_MANUAL:
+	 mode = thermal_grabber::Manual;
+	 snprintf(gain_string, sizeof(gain_string)-1, "MANUAL");
+	 break;
+   }
+
+   /*
+    * While the camera is reconnected the gain is only kept, and set once
+    * it is back
+    */
+   if (serv_info->tgr != NULL) {
+      serv_info->tgr->setGainMode(mode);
+   }
+   pthread_mutex_lock(&ss_lock);
+   if (ssPutString(SS_GAIN, gain_string) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) ssPutString of %s with %s failed: %s",
+		__FILE__, __LINE__, SS_GAIN, gain_string, ssGetStrError());
+   }
+   pthread_mutex_unlock(&ss_lock);
+}
+
+
+/*
+ * Publish the stacking mode in the Status Server
+ */
+static void
+applyStackMode(stack_mode_t stack_mode) {
+
+   const char *mode_string = STACK_MEAN_STRING;
+
+   switch (stack_mode) {
+      case STACK_SUM:
+	 mode_string = STACK_SUM_STRING;
+	 break;
+      case STACK_MEAN:
+	 mode_string = STACK_MEAN_STRING;
+	 break;
+      case STACK_CLIP:
+	 mode_string = STACK_CLIP_STRING;
+	 break;
+   }
+   pthread_mutex_lock(&ss_lock);
+   if (ssPutString(SS_STACKMODE, mode_string) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) ssPutString of %s with %s failed: %s",
+		__FILE__, __LINE__, SS_STACKMODE, mode_string, 
+		ssGetStrError());
+   }
+   pthread_mutex_unlock(&ss_lock);
+}
+#endif
+
+
+/*
+ * Carve a buffer out of the pool.  The pool is sized for everything that
+ * is taken from it, so running out is a bug, but the server carries on
+ * with a heap buffer if it happens.
+ */
+static void *
+poolAlloc(size_t size)
+{
+   buffer_pool_t *pool = &serv_info->pool;
+   void *buf;
+
+   size = POOL_ROUND(size);
+   if (pool->used + size > pool->size) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+		"(%s:%d) buffer pool exhausted (%ld of %ld bytes used),"
+		" allocating %ld bytes", __FILE__, __LINE__, 
+		(long)pool->used, (long)pool->size, (long)size);
+      return cli_malloc(size);
+   }
+   buf = pool->base + pool->used;
+   pool->used += size;
+
+   return buf;
+}
+
+
+/*
+ * Set up the pool and every image buffer for frames of up to 'max_width'
+ * by 'max_height' pixels.  The frame size only becomes known with the
+ * first frame from the camera, so the buffers are sized for the largest.
+ */
+static void
+allocateBuffers(unsigned int max_width, unsigned int max_height)
+{
+   size_t n = (size_t)max_width * max_height;
+   size_t slot = POOL_ROUND(n * sizeof(unsigned short));
+   size_t stack = POOL_ROUND(n * sizeof(int)) + 
+      POOL_ROUND(n * sizeof(int64_t)) + POOL_ROUND(n * sizeof(unsigned short));
+   size_t row_size = POOL_ROUND(max_height * sizeof(int));
+   size_t heap = POOL_ROUND((size_t)max_height * RICE_ROW_BOUND(max_width) +
+			    COMPRESS_THREADS);
+   size_t table = POOL_ROUND((size_t)max_height * 8);
+   int i;
+
+   serv_info->pool.size = slot * (FRAME_RING_SLOTS + 2) + stack + 
+      POOL_ROUND(n * sizeof(float)) + row_size + heap + table + POOL_ALIGN;
+   serv_info->pool.base = (unsigned char *)cli_malloc(serv_info->pool.size);
+   serv_info->pool.used = POOL_ROUND((uintptr_t)serv_info->pool.base) - 
+      (uintptr_t)serv_info->pool.base;
+   serv_info->max_width = max_width;
+   serv_info->max_height = max_height;
+
+   for (i = 0; i < FRAME_RING_SLOTS; i++) {
+      frame_ring.slot[i] = (unsigned short *)poolAlloc(slot);
+   }
+   serv_info->stack_data = (int *)poolAlloc(n * sizeof(int));
+   serv_info->stack_sumsq = (int64_t *)poolAlloc(n * sizeof(int64_t));
+   serv_info->stack_count 
+      = (unsigned short *)poolAlloc(n * sizeof(unsigned short));
+   serv_info->fits_image = (unsigned short *)poolAlloc(slot);
+   serv_info->diff_ref = (float *)poolAlloc(n * sizeof(float));
+   serv_info->diff_median = (unsigned short *)poolAlloc(slot);
+   serv_info->rice_row_size = (int *)poolAlloc(row_size);
+   serv_info->rice_heap = (unsigned char *)poolAlloc(heap);
+   serv_info->rice_table = (unsigned char *)poolAlloc(table);
+
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	     "(%s:%d) %ld byte buffer pool for %ux%u frames",
+	     __FILE__, __LINE__, (long)serv_info->pool.size, max_width,
+	     max_height);
+}
+
+
+#ifndef BENCHMARK
+/*
+ * Background thread that lets go of the grabber that stopped delivering
+ * frames, if there is one, and makes a new one.  It is handed over to the
+ * server loop through tgr_opened.
+ */
+static void *
+cameraThread(void *arg)
+{
+   ThermalGrabber *tgr = (ThermalGrabber *)arg;
+   uint64_t event = 1;
+
+   if (tgr != NULL) {
+      delete tgr;
+   }
+   tgr = new ThermalGrabber(callbackTauImage, NULL);
+
+   pthread_mutex_lock(&camera_lock);
+   serv_info->tgr_opened = tgr;
+   pthread_mutex_unlock(&camera_lock);
+   if (write(frame_ring.event_fd, &event, sizeof(event)) == -1) {
+      /* The counter only saturates if nobody has read it for ages */
+   }
+
+   return NULL;
+}
+
+
+/*
+ * Replace the grabber 'old', or make the first one if it is NULL, in the
+ * background
+ */
+static void
+startCamera(ThermalGrabber *old)
+{
+   pthread_attr_t attr;
+   pthread_t thread;
+   int rc;
+
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   if ((rc = pthread_create(&thread, &attr, cameraThread, old)) != 0) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		"(%s:%d) unable to start the camera thread: %s",
+		__FILE__, __LINE__, strerror(rc));
+      exit(EXIT_FAILURE);
+   }
+   pthread_attr_destroy(&attr);
+}
+
+
+/*
+ * Initialize the camera connection.  The grabber is made in the
+ * background, and the gain is set once the server loop takes it up.
+ */
+static PASSFAIL
+initCameraConnection(void) {
+
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	     "Initializing Tau camera connection");
+
+   /*
+    * The frames are copied into the pool from the first callback on
+    */
+   if (serv_info->pool.base == NULL) {
+      allocateBuffers(TAU_MAX_WIDTH, TAU_MAX_HEIGHT);
+   }
+
+   /* 
+    * Set up a connection to the camera.  The way the API in the SDK is set
+    * up this request won't fail
+    */
+   serv_info->camera_silence = CAMERA_SILENCE;
+   startCamera(NULL);
+
+   return PASS;
+}
+
+
+/*
+ * Take up the grabber the camera thread has made, and reconnect the camera
+ * once it stops delivering frames.  The Tau streams frames all the time,
+ * whether an exposure is under way or not, so a quiet camera has gone
+ * away.  After each reconnection that doesn't bring the frames back the
+ * next one waits twice as long.  The clients stay connected throughout,
+ * and an exposure under way stacks the frames of the new grabber.
+ */
+static void
+checkCamera(void)
+{
+   ThermalGrabber *tgr;
+   unsigned int received;
+   double now = getClockTime();
+
+   pthread_mutex_lock(&camera_lock);
+   tgr = serv_info->tgr_opened;
+   serv_info->tgr_opened = NULL;
+   pthread_mutex_unlock(&camera_lock);
+   if (tgr != NULL) {
+      serv_info->tgr = tgr;
+      serv_info->camera_heard_ts = now;
+      applyGain(serv_info->gain);
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) connected to the Tau camera", __FILE__, __LINE__);
+      return;
+   }
+   if (serv_info->tgr == NULL) {
+      return;
+   }
+
+   received = frame_ring.received.load(std::memory_order_relaxed);
+   if (received != serv_info->camera_received) {
+      serv_info->camera_received = received;
+      serv_info->camera_heard_ts = now;
+      serv_info->camera_silence = CAMERA_SILENCE;
+   }
+   else if (now > serv_info->camera_heard_ts + serv_info->camera_silence) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+		"(%s:%d) no frames from the Tau camera for %.0f seconds,"
+		" reconnecting", __FILE__, __LINE__, 
+		now - serv_info->camera_heard_ts);
+      startCamera(serv_info->tgr);
+      serv_info->tgr = NULL;
+      serv_info->camera_silence *= 2;
+      if (serv_info->camera_silence > CAMERA_SILENCE_MAX) {
+	 serv_info->camera_silence = CAMERA_SILENCE_MAX;
+      }
+   }
+}
+#endif
+
+
+/*
+ * Release the mapping of the last FITS image built for a client.  The
+ * memfd behind it stays open so it can be reused for the next image.  A
+ * subscriber only drops its reference to the shared image it was sent,
+ * and an archived image lets go of its segment.
+ */
+static void
+releaseImageData(client_info_t *cinfo)
+{
+   if (cinfo->shared != NULL) {
+      cinfo->shared->refs--;
+      cinfo->shared = NULL;
+      cinfo->image_data = NULL;
+      cinfo->image_size = 0;
+      return;
+   }
+   if (cinfo->image_data != NULL) {
+      munmap(cinfo->image_data, cinfo->image_size);
+      cinfo->image_data = NULL;
+      cinfo->image_size = 0;
+   }
+   if (cinfo->archived) {
+      archive.readers[cinfo->archive_segment]--;
+      cinfo->archived = FALSE;
+   }
+}
+
+
+/*
+ * Get the in-memory file that a client's FITS image is built in, rewound
+ * to the start.  The file is created on the first image request and is
+ * then overwritten in place for every image after that, so the FITS data
+ * never goes to the SD card and the pages are reused from frame to frame.
+ */
+static int
+openImageFile(client_info_t *cinfo)
+{
+   releaseImageData(cinfo);
+
+   if (cinfo->image_fd == -1) {
+      if ((cinfo->image_fd = memfd_create(IMAGE_MEMFD_NAME, MFD_CLOEXEC))
+	  == -1) {
+	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		   "(%s:%d) unable to create in-memory image file.  %s"
+		   " (errno=%d)", __FILE__, __LINE__, strerror(errno), errno);
+	 return -1;
+      }
+   }
+   if (lseek(cinfo->image_fd, 0, SEEK_SET) == -1) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) unable to rewind in-memory image file.  %s"
+		" (errno=%d)", __FILE__, __LINE__, strerror(errno), errno);
+      return -1;
+   }
+
+   return cinfo->image_fd;
+}
+
+
+/*
+ * Map the FITS image just written to the client's in-memory file so it
+ * can be sent straight out of the page cache without another copy.
+ */
+static PASSFAIL
+mapImageFile(client_info_t *cinfo)
+{
+   off_t size;
+   void *data;
+
+   /*
+    * The file is overwritten in place, so the current offset is the size
+    * of this image.  Anything left over from a larger earlier image is
+    * never sent, and keeping it means the pages are not freed and faulted
+    * back in as the size of the compressed images goes up and down.
+    */
+   if ((size = lseek(cinfo->image_fd, 0, SEEK_CUR)) <= 0) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) unable to size in-memory image file.  %s"
+		" (errno=%d)", __FILE__, __LINE__, strerror(errno), errno);
+      return FAIL;
+   }
+
+   data = mmap(NULL, size, PROT_READ, MAP_SHARED, cinfo->image_fd, 0);
+   if (data == MAP_FAILED) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) unable to map in-memory image file.  %s"
+		" (errno=%d)", __FILE__, __LINE__, strerror(errno), errno);
+      return FAIL;
+   }
+   cinfo->image_data = (unsigned char *)data;
+   cinfo->image_size = size;
+
+   return PASS;
+}
+
+
+#ifndef BENCHMARK
+/*
+ * Create the listening socket for bulk image data connections.  A client
+ * that negotiates a bulk transfer with the BULK command connects here and
+ * receives each IMAGE reply as one kernel-driven transfer instead of
+ * through the sockserv chunks.
+ */
+static int
+createDataListener(const char *port)
+{
+   struct addrinfo hints;
+   struct addrinfo *res;
+   int fd;
+   int on = 1;
+   int rc;
+
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_INET;
+   hints.ai_socktype = SOCK_STREAM;
+   hints.ai_flags = AI_PASSIVE;
+   if ((rc = getaddrinfo(NULL, port, &hints, &res)) != 0) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) getaddrinfo for data port %s failed: %s",
+		__FILE__, __LINE__, port, gai_strerror(rc));
+      return -1;
+   }
+   if ((fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC,
+		    res->ai_protocol)) == -1) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) unable to create data socket: %s (errno=%d)",
+		__FILE__, __LINE__, strerror(errno), errno);
+      freeaddrinfo(res);
+      return -1;
+   }
+   setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+   if ((bind(fd, res->ai_addr, res->ai_addrlen) == -1) ||
+       (listen(fd, MAX_PENDING_DATA) == -1)) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) unable to listen on data port %s: %s (errno=%d)",
+		__FILE__, __LINE__, port, strerror(errno), errno);
+      close(fd);
+      freeaddrinfo(res);
+      return -1;
+   }
+   freeaddrinfo(res);
+
+   return fd;
+}
+
+
+/*
+ * Accept one connection on the data port and read the token the client
+ * was handed by the BULK command.  The connection is parked until the
+ * client that owns the token claims it.
+ */
+static void
+acceptDataConnection(void)
+{
+   struct sockaddr_in addr;
+   socklen_t addr_len = sizeof(addr);
+   struct pollfd pfd;
+   char token_buf[32];
+   unsigned int token;
+   int sndbuf = BULK_SNDBUF;
+   int one = 1;
+   int nread = 0;
+   int count;
+   int fd;
+   int i;
+
+   if ((fd = accept4(serv_info->data_listen_fd, (struct sockaddr *)&addr,
+		     &addr_len, SOCK_CLOEXEC | SOCK_NONBLOCK)) == -1) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) accept on data port failed: %s (errno=%d)",
+		__FILE__, __LINE__, strerror(errno), errno);
+      return;
+   }
+
+   /*
+    * The token is a single text line sent right after connecting
+    */
+   pfd.fd = fd;
+   pfd.events = POLLIN;
+   while ((nread < (int)sizeof(token_buf) - 1) &&
+	  (poll(&pfd, 1, BULK_CONNECT_TIMEOUT * 1000) == 1)) {
+      if ((count = read(fd, token_buf + nread, 
+			sizeof(token_buf) - 1 - nread)) <= 0) {
+	 break;
+      }
+      nread += count;
+      token_buf[nread] = '\0';
+      if (strchr(token_buf, '\n') != NULL) {
+	 break;
+      }
+   }
+   token_buf[nread] = '\0';
+   if ((nread == 0) || ((token = strtoul(token_buf, NULL, 10)) == 0)) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) data connection did not identify itself",
+		__FILE__, __LINE__);
+      close(fd);
+      return;
+   }
+
+   /*
+    * Set up the socket for large transfers, with the tail of each image
+    * sent without waiting for an acknowledgement.  It stays non-blocking,
+    * and sendImageBulk() gives up on a client that stops reading.
+    */
+   setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+   setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+   /*
+    * Park the connection, dropping the oldest one if all slots are used
+    */
+   for (i = 0; i < MAX_PENDING_DATA; i++) {
+      if (serv_info->pending_data_fd[i] == -1) {
+	 break;
+      }
+   }
+   if (i == MAX_PENDING_DATA) {
+      close(serv_info->pending_data_fd[0]);
+      memmove(&serv_info->pending_data_fd[0], &serv_info->pending_data_fd[1],
+	      (MAX_PENDING_DATA - 1) * sizeof(int));
+      memmove(&serv_info->pending_data_token[0],
+	      &serv_info->pending_data_token[1],
+	      (MAX_PENDING_DATA - 1) * sizeof(unsigned int));
+      memmove(&serv_info->pending_data_addr[0],
+	      &serv_info->pending_data_addr[1],
+	      (MAX_PENDING_DATA - 1) * sizeof(struct in_addr));
+      i = MAX_PENDING_DATA - 1;
+   }
+   serv_info->pending_data_fd[i] = fd;
+   serv_info->pending_data_token[i] = token;
+   serv_info->pending_data_addr[i] = addr.sin_addr;
+}
+
+
+/*
+ * Find the data connection that belongs to a client which negotiated a
+ * bulk transfer.  It has to carry the client's token and come from the
+ * same address as its command connection.  The client connects right
+ * after the BULK reply, so the connection is normally already waiting in
+ * the listen backlog.
+ */
+static PASSFAIL
+claimDataConnection(client_info_t *cinfo)
+{
+   struct pollfd pfd;
+   double stop_ts;
+   int remaining_ms;
+   int rc;
+   int i;
+
+   stop_ts = getClockTime() + BULK_CONNECT_TIMEOUT;
+   for (;;) {
+      for (i = 0; i < MAX_PENDING_DATA; i++) {
+	 if ((serv_info->pending_data_fd[i] != -1) &&
+	     (serv_info->pending_data_token[i] == cinfo->bulk_token) &&
+	     (memcmp(&serv_info->pending_data_addr[i], cinfo->remote_ip,
+		     sizeof(cinfo->remote_ip)) == 0)) {
+	    cinfo->data_fd = serv_info->pending_data_fd[i];
+	    serv_info->pending_data_fd[i] = -1;
+	    return PASS;
+	 }
+      }
+
+      remaining_ms = (int)((stop_ts - getClockTime()) * 1000);
+      if (remaining_ms <= 0) {
+	 break;
+      }
+      pfd.fd = serv_info->data_listen_fd;
+      pfd.events = POLLIN;
+      if ((rc = poll(&pfd, 1, remaining_ms)) == 1) {
+	 acceptDataConnection();
+      }
+      else if ((rc == 0) || (errno != EINTR)) {
+	 break;
+      }
+   }
+
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	     "(%s:%d) bulk data connection from %s never arrived, using"
+	     " chunked transfer", __FILE__, __LINE__, cinfo->hostname);
+   cinfo->bulk_token = 0;
+   return FAIL;
+}
+#endif
+
+
+/*
+ * Have a client's data connection wake the server loop whenever it can
+ * take more of the image, for as long as 'sending' is set
+ */
+static void
+watchBulkSend(client_info_t *cinfo, int sending)
+{
+   struct epoll_event event;
+
+   if (sending == cinfo->bulk_sending) {
+      return;
+   }
+   event.events = EPOLLOUT;
+   event.data.fd = cinfo->data_fd;
+   if (epoll_ctl(frame_ring.wake_fd, sending ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+		 cinfo->data_fd, &event) == -1) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) unable to watch data socket %d : %s (errno=%d)",
+		__FILE__, __LINE__, cinfo->data_fd, strerror(errno), errno);
+   }
+   cinfo->bulk_sending = sending;
+   serv_info->bulk_sends += sending ? 1 : -1;
+}
+
+
+/*
+ * Close a client's data connection, in the middle of a transfer or not
+ */
+static void
+closeDataConnection(client_info_t *cinfo)
+{
+   if (cinfo->data_fd != -1) {
+      watchBulkSend(cinfo, FALSE);
+      close(cinfo->data_fd);
+      cinfo->data_fd = -1;
+   }
+   cinfo->bulk_token = 0;
+}
+
+
+#ifndef BENCHMARK
+/*
+ * Negotiate a bulk transfer for the IMAGE replies to a client.  The reply
+ * tells the client which port to connect to and the token to send on it.
+ */
+static void
+negotiateBulk(client_info_t *cinfo, char *buffer)
+{
+   if (serv_info->data_listen_fd == -1) {
+      sprintf(buffer, "%c %s \"Bulk transfer not available\"",
+	      FAIL_CHAR, BULK_CMD);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+   if (cinfo->bulk_sending) {
+      sprintf(buffer, "%c %s \"An image is still on its way\"",
+	      FAIL_CHAR, BULK_CMD);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+
+   /*
+    * Drop any earlier data connection; the client is opening a new one.
+    * The token is all that ties the new one to this client, so it comes
+    * from the kernel's random source rather than anything guessable.
+    */
+   closeDataConnection(cinfo);
+   do {
+      if (getrandom(&cinfo->bulk_token, sizeof(cinfo->bulk_token), 0) !=
+	  (ssize_t)sizeof(cinfo->bulk_token)) {
+	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		   "(%s:%d) getrandom failed: %s (errno=%d)",
+		   __FILE__, __LINE__, strerror(errno), errno);
+	 cinfo->bulk_token = 0;
+	 sprintf(buffer, "%c %s \"Bulk transfer not available\"",
+		 FAIL_CHAR, BULK_CMD);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		   "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+   } while (cinfo->bulk_token == 0);
+
+   sprintf(buffer, "%c %s %s %u", PASS_CHAR, BULK_CMD, TAUSERV_DATA_PORT,
+	   cinfo->bulk_token);
+   cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	     "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+}
+#endif
+
+
+/*
+ * Send the next part of the FITS image to a client over its data
+ * connection, as much of it as the socket takes without blocking.  The
+ * image is handed to the kernel straight from the in-memory file, or
+ * from its archive segment, so there is no copy through user space.
+ * Until it is all out the data connection wakes the server loop as it
+ * drains, and the rest goes on the following passes.  A client that
+ * takes nothing for READOUT_TIMEOUT seconds loses its data connection.
+ */
+static PASSFAIL
+sendImageBulk(client_info_t *cinfo)
+{
+   int image_fd = (cinfo->shared != NULL) ? cinfo->shared->image_fd :
+      cinfo->image_fd;
+   off_t offset = 0;
+   size_t send_count;
+   ssize_t count;
+   double now = getClockTime();
+
+   if (cinfo->archived) {
+      image_fd = archive.segment_fd[cinfo->archive_segment];
+      offset = cinfo->archive_offset;
+   }
+   if (!cinfo->bulk_sending) {
+      watchBulkSend(cinfo, TRUE);
+      cinfo->bulk_progress_ts = now;
+   }
+
+   offset += cinfo->data_count;
+   send_count = cinfo->total_count - cinfo->data_count;
+   if (send_count > BULK_SNDBUF) {
+      send_count = BULK_SNDBUF;
+   }
+   count = sendfile(cinfo->data_fd, image_fd, &offset, send_count);
+   if (count > 0) {
+      cinfo->data_count += count;
+      cinfo->bulk_progress_ts = now;
+   }
+   else if ((count == 0) || 
+	    ((errno != EAGAIN) && (errno != EINTR)) ||
+	    (now - cinfo->bulk_progress_ts > READOUT_TIMEOUT)) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) bulk transfer to %s failed after %d of %d bytes:"
+		" %s (errno=%d)", __FILE__, __LINE__, cinfo->hostname,
+		cinfo->data_count, cinfo->total_count, 
+		(count == 0) ? "image cut short" : strerror(errno), errno);
+      closeDataConnection(cinfo);
+      return FAIL;
+   }
+
+   if (cinfo->data_count == cinfo->total_count) {
+      watchBulkSend(cinfo, FALSE);
+   }
+   return PASS;
+}
+
+
+/*
+ * Write all of a buffer to a file descriptor, picking up after partial
+ * writes
+ */
+static PASSFAIL
+writeAll(int fd, const void *buf, size_t len)
+{
+   const unsigned char *p = (const unsigned char *)buf;
+   ssize_t count;
+
+   while (len > 0) {
+      if ((count = write(fd, p, len)) == -1) {
+	 if (errno == EINTR) {
+	    continue;
+	 }
+	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		   "(%s:%d) write failed: %s (errno=%d)",
+		   __FILE__, __LINE__, strerror(errno), errno);
+	 return FAIL;
+      }
+      p += count;
+      len -= count;
+   }
+
+   return PASS;
+}
+
+
+/*
+ * Write a data unit that is already in FITS byte order, padded out to a
+ * full FITS block
+ */
+static PASSFAIL
+writeFITSData(int fd, const void *data, size_t size)
+{
+   static const unsigned char zeros[2880] = { 0 };
+
+   if (writeAll(fd, data, size) != PASS) {
+      return FAIL;
+   }
+   if ((size % 2880) != 0) {
+      return writeAll(fd, zeros, 2880 - (size % 2880));
+   }
+
+   return PASS;
+}
+
+
+/*
+ * Bit writer for the Rice coder.  Bits go out most significant first.
+ */
+typedef struct {
+   unsigned char *p;
+   uint64_t buffer;
+   int bits;
+} rice_bits_t;
+
+
+static void
+riceOutput(rice_bits_t *b, unsigned int value, int nbits)
+{
+   b->buffer = (b->buffer << nbits) | (value & ((1U << nbits) - 1));
+   b->bits += nbits;
+   while (b->bits >= 8) {
+      b->bits -= 8;
+      *b->p++ = (unsigned char)(b->buffer >> b->bits);
+   }
+}
+
+
+/*
+ * Rice compress one row of 16-bit pixels the way the RICE_1 tile
+ * compression in fpack/cfitsio does, with the first pixel written as is
+ * and every block of RICE_BLOCKSIZE differences coded with its own split
+ * point.  The pixels are coded as the signed values a BZERO = 32768 image
+ * holds.  Returns the number of bytes written to 'out'.
+ */
+static int
+riceCompressRow(const unsigned short *row, int n, unsigned char *out)
+{
+   unsigned int diff[RICE_BLOCKSIZE];
+   rice_bits_t b;
+   short lastpix, nextpix, pdiff;
+   unsigned int psum, top;
+   double pixelsum, dpsum;
+   int thisblock;
+   int fs;
+   int i, j;
+
+   b.p = out;
+   b.buffer = 0;
+   b.bits = 0;
+
+   lastpix = (short)(row[0] ^ 0x8000);
+   riceOutput(&b, (unsigned short)lastpix, 16);
+   for (i = 0; i < n; i += RICE_BLOCKSIZE) {
+      thisblock = (n - i < RICE_BLOCKSIZE) ? n - i : RICE_BLOCKSIZE;
+
+      /*
+       * Map the differences to unsigned values, small ones first
+       */
+      pixelsum = 0;
+      for (j = 0; j < thisblock; j++) {
+	 nextpix = (short)(row[i + j] ^ 0x8000);
+	 pdiff = (short)(nextpix - lastpix);
+	 diff[j] = (unsigned int)((pdiff < 0) ? ~(pdiff * 2) : (pdiff * 2));
+	 pixelsum += diff[j];
+	 lastpix = nextpix;
+      }
+
+      /*
+       * Pick the number of bits sent as is from the mean difference
+       */
+      dpsum = (pixelsum - (thisblock / 2) - 1) / thisblock;
+      if (dpsum < 0) {
+	 dpsum = 0;
+      }
+      psum = ((unsigned int)dpsum) >> 1;
+      for (fs = 0; psum > 0; fs++) {
+	 psum >>= 1;
+      }
+
+      if (fs >= RICE_FSMAX) {
+	 /* High entropy: send the differences without coding */
+	 riceOutput(&b, RICE_FSMAX + 1, RICE_FSBITS);
+	 for (j = 0; j < thisblock; j++) {
+	    riceOutput(&b, diff[j], 16);
+	 }
+      }
+      else if ((fs == 0) && (pixelsum == 0)) {
+	 /* Flat block: the code alone says every difference is zero */
+	 riceOutput(&b, 0, RICE_FSBITS);
+      }
+      else {
+	 riceOutput(&b, fs + 1, RICE_FSBITS);
+	 for (j = 0; j < thisblock; j++) {
+
+	    /* The top bits are sent as that many zeros and a one */
+	    top = diff[j] >> fs;
+	    while (top >= 16) {
+	       riceOutput(&b, 0, 16);
+	       top -= 16;
+	    }
+	    riceOutput(&b, 1, top + 1);
+	    if (fs > 0) {
+	       riceOutput(&b, diff[j], fs);
+	    }
+	 }
+      }
+   }
+   if (b.bits > 0) {
+      *b.p++ = (unsigned char)(b.buffer << (8 - b.bits));
+   }
+
+   return (int)(b.p - out);
+}
+
+
+/*
+ * Compress one band of rows.  This is the body of each compression thread.
+ */
+static void *
+riceCompressBand(void *arg)
+{
+   rice_band_t *band = (rice_band_t *)arg;
+   int i;
+
+   band->size = 0;
+   for (i = 0; i < band->nrows; i++) {
+      band->row_size[i] 
+	 = riceCompressRow(band->image + (size_t)i * band->width, 
+			   band->width, band->data + band->size);
+      band->size += band->row_size[i];
+   }
+
+   return NULL;
+}
+
+
+/*
+ * Rice compress a whole image with one tile per row.  The rows are split
+ * into COMPRESS_THREADS bands that are compressed in parallel, one per
+ * core of the Raspberry Pi.
+ */
+static PASSFAIL
+riceCompressImage(rice_image_t *rice, const unsigned short *image,
+		  int width, int height)
+{
+   pthread_t thread[COMPRESS_THREADS];
+   int started[COMPRESS_THREADS];
+   int row = 0;
+   int nrows;
+   int i;
+
+   memset(rice, 0, sizeof(*rice));
+   rice->height = height;
+   rice->row_size = serv_info->rice_row_size;
+   for (i = 0; i < COMPRESS_THREADS; i++) {
+      rice_band_t *band = &rice->band[i];
+
+      nrows = (height - row) / (COMPRESS_THREADS - i);
+      band->image = image + (size_t)row * width;
+      band->width = width;
+      band->nrows = nrows;
+      band->row_size = rice->row_size + row;
+      band->data = serv_info->rice_heap + (size_t)row * RICE_ROW_BOUND(width)
+	 + i;
+      row += nrows;
+
+      started[i] = (pthread_create(&thread[i], NULL, riceCompressBand, 
+				   band) == 0);
+      if (!started[i]) {
+	 riceCompressBand(band);
+      }
+   }
+   for (i = 0; i < COMPRESS_THREADS; i++) {
+      if (started[i]) {
+	 pthread_join(thread[i], NULL);
+      }
+      rice->heap_size += rice->band[i].size;
+   }
+   for (i = 0; i < height; i++) {
+      if (rice->row_size[i] > rice->max_row_size) {
+	 rice->max_row_size = rice->row_size[i];
+      }
+   }
+
+   return PASS;
+}
+
+
+/*
+ * Write the binary table of a tile compressed image: one descriptor per
+ * row pointing into the heap, the heap of compressed rows, and the
+ * padding out to a full FITS block.
+ */
+static PASSFAIL
+riceWriteTable(rice_image_t *rice, int fd)
+{
+   unsigned char *table;
+   size_t table_size = (size_t)rice->height * 8;
+   size_t total, offset = 0;
+   static const unsigned char zeros[2880] = { 0 };
+   int i;
+
+   /*
+    * Descriptors are big-endian 32-bit element count and heap offset
+    */
+   table = serv_info->rice_table;
+   for (i = 0; i < rice->height; i++) {
+      unsigned char *d = table + (size_t)i * 8;
+      uint32_t count = rice->row_size[i];
+      uint32_t start = offset;
+
+      d[0] = count >> 24; d[1] = count >> 16; d[2] = count >> 8; d[3] = count;
+      d[4] = start >> 24; d[5] = start >> 16; d[6] = start >> 8; d[7] = start;
+      offset += count;
+   }
+   if (writeAll(fd, table, table_size) != PASS) {
+      return FAIL;
+   }
+
+   for (i = 0; i < COMPRESS_THREADS; i++) {
+      if (writeAll(fd, rice->band[i].data, rice->band[i].size) != PASS) {
+	 return FAIL;
+      }
+   }
+
+   total = table_size + rice->heap_size;
+   if ((total % 2880) != 0) {
+      if (writeAll(fd, zeros, 2880 - (total % 2880)) != PASS) {
+	 return FAIL;
+      }
+   }
+
+   return PASS;
+}
+
+
+/*
+ * Fill in the binary table cards of a tile compressed image.  They have
+ * to come first in the header, and the caller adds the cards describing
+ * the image itself afterwards.
+ */
+static void
+riceSetHeader(HeaderUnit hu, rice_image_t *rice, int width, int height)
+{
+   char tform[FH_MAX_STRLEN];
+
+   fh_set_str(hu, FH_AUTO, "XTENSION", "BINTABLE", "Tile compressed image");
+   fh_set_int(hu, FH_AUTO, "BITPIX", 8, "8-bit bytes");
+   fh_set_int(hu, FH_AUTO, "NAXIS", 2, "2-dimensional binary table");
+   fh_set_int(hu, FH_AUTO, "NAXIS1", 8, "Width of table in bytes");
+   fh_set_int(hu, FH_AUTO, "NAXIS2", height, "Number of rows in table");
+   fh_set_int(hu, FH_AUTO, "PCOUNT", (int)rice->heap_size, 
+	      "Size of the heap");
+   fh_set_int(hu, FH_AUTO, "GCOUNT", 1, "Only one group");
+   fh_set_int(hu, FH_AUTO, "TFIELDS", 1, "Number of fields in each row");
+   fh_set_str(hu, FH_AUTO, "TTYPE1", "COMPRESSED_DATA", 
+	      "Label for field 1");
+   snprintf(tform, sizeof(tform), "1PB(%d)", rice->max_row_size);
+   fh_set_str(hu, FH_AUTO, "TFORM1", tform, "Data format of field");
+   fh_set_bool(hu, FH_AUTO, "ZIMAGE", FH_TRUE, "Extension holds a compressed image");
+   fh_set_int(hu, FH_AUTO, "ZBITPIX", 16, "16-bit data");
+   fh_set_int(hu, FH_AUTO, "ZNAXIS", 2, "Number of axes");
+   fh_set_int(hu, FH_AUTO, "ZNAXIS1", width, "Number of pixel columns");
+   fh_set_int(hu, FH_AUTO, "ZNAXIS2", height, "Number of pixel rows");
+   fh_set_int(hu, FH_AUTO, "ZTILE1", width, "Size of tiles in x");
+   fh_set_int(hu, FH_AUTO, "ZTILE2", 1, "Size of tiles in y");
+   fh_set_str(hu, FH_AUTO, "ZCMPTYPE", RICE_CMPTYPE, "Compression algorithm");
+   fh_set_str(hu, FH_AUTO, "ZNAME1", "BLOCKSIZE", "Compression block size");
+   fh_set_int(hu, FH_AUTO, "ZVAL1", RICE_BLOCKSIZE, "Pixels per block");
+   fh_set_str(hu, FH_AUTO, "ZNAME2", "BYTEPIX", "Bytes per pixel");
+   fh_set_int(hu, FH_AUTO, "ZVAL2", 2, "Bytes per pixel");
+}
+
+
+/*
+ * Write the empty primary header that a tile compressed image extension
+ * follows
+ */
+static PASSFAIL
+riceWritePrimary(int fd)
+{
+   HeaderUnit hu;
+   fh_result fh_error;
+
+   hu = fh_create();
+   fh_set_bool(hu, FH_AUTO, "SIMPLE", FH_TRUE, "Standard FITS");
+   fh_set_int(hu, FH_AUTO, "BITPIX", 16, "16-bit data");
+   fh_set_int(hu, FH_AUTO, "NAXIS", 0, "No data in the primary unit");
+   fh_set_bool(hu, FH_AUTO, "EXTEND", FH_TRUE, "Extensions follow");
+   if ((fh_error = fh_write(hu, fd)) != FH_SUCCESS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) unable to write FITS primary header"
+		" (fh_error = %d)", __FILE__, __LINE__, fh_error);
+      fh_destroy(hu);
+      return FAIL;
+   }
+   fh_destroy(hu);
+
+   return PASS;
+}
+
+
+/*
+ * Take a pointer to image data and create a FITS image using this data
+ * and send it to the specified file descriptor.  With 'compress' set it
+ * is written as a Rice tile compressed image.  The image is built in
+ * fits_image, rice_row_size and rice_heap, which there is only one of,
+ * so only the server thread may call this.
+ */
+static PASSFAIL
+writeFITSImage(int fd, int compress) 
+{
+   HeaderUnit hu;
+   time_t date = time(NULL);
+   char fitscard[FH_MAX_STRLEN];
+   fh_result fh_error;
+   unsigned short *image;
+   rice_image_t rice;
+   metadata_t meta;
+   double temp, pres, humid;
+
+   /*
+    * Take a snapshot of the header metadata kept by the refresh thread,
+    * with the latest reading of the BME280 if it is being sampled
+    */
+   pthread_mutex_lock(&metadata_lock);
+   meta = metadata;
+   pthread_mutex_unlock(&metadata_lock);
+   if (readBME280(&temp, &pres, &humid) == PASS) {
+      formatBME280(temp, pres, humid, &meta);
+   }
+
+   /*
+    * Make sure there is actually an image to send back to the client
+    */
+   if ((serv_info->frame_count == 0) || (serv_info->stack_data == NULL)) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) image data is not available to send to the"
+		" client", __FILE__, __LINE__);
+      return FAIL;
+   }
+
+   /*
+    * Combine the accumulated frames according to the stacking mode,
+    * calibrate them if asked to and offset the result by its minimum
+    * pixel value.  Uncompressed, the pixels come out ready to be written
+    * as the FITS data unit.
+    */
+   image = convertStack(!compress);
+
+   /*
+    * Create the header unit
+    */
+   hu = fh_create();
+
+   /*
+    * Populate the headers.  A compressed image goes in a binary table
+    * extension after an empty primary header, and the table has to be
+    * compressed first to know the size of its heap.
+    */
+   if (compress) {
+      riceCompressImage(&rice, image, serv_info->width, serv_info->height);
+      if (riceWritePrimary(fd) != PASS) {
+	 fh_destroy(hu);
+	 return FAIL;
+      }
+      riceSetHeader(hu, &rice, serv_info->width, serv_info->height);
+   }
+   else {
+      fh_set_bool(hu, FH_AUTO, "SIMPLE", FH_TRUE, "Standard FITS");
+      fh_set_int(hu, FH_AUTO, "BITPIX", 16, "16-bit data");
+      fh_set_int(hu, FH_AUTO, "NAXIS", 2, "Number of axes");
+      fh_set_int(hu, FH_AUTO, "NAXIS1", serv_info->width,
+		 "Number of pixel columns");
+      fh_set_int(hu, FH_AUTO, "NAXIS2", serv_info->height,
+		 "Number of pixel rows");
+      fh_set_int(hu, FH_AUTO, "PCOUNT", 0, "No 'random' parameters");
+      fh_set_int(hu, FH_AUTO, "GCOUNT", 1, "Only one group");
+   }
+   strftime(fitscard, sizeof (fitscard) - 1, "%Y-%m-%dT%T", gmtime(&date));
+   fh_set_str(hu, FH_AUTO, "DATE", fitscard, "UTC Date of file creation");
+   strftime(fitscard, sizeof (fitscard) - 1, "%a %b %d %H:%M:%S %Z %Y",
+	    localtime(&date));
+   fh_set_str(hu, FH_AUTO, "HSTTIME", fitscard, "Local time in Hawaii");
+   fh_set_flt(hu, FH_AUTO, "UNIXTIME", getClockTime(), 
+	      13, "Fractional UNIX timestamp when image was taken");
+   fh_set_str(hu, FH_AUTO, "ORIGIN", "CFHT",
+	      "Canada-France-Hawaii Telescope");
+   fh_set_flt(hu, FH_AUTO, "BZERO", 32768.0 * (1 << serv_info->stack_shift),
+	      6, "Zero factor");
+   fh_set_flt(hu, FH_AUTO, "BSCALE", (double)(1 << serv_info->stack_shift),
+	      2, "Scale factor");
+   fh_set_flt(hu, FH_AUTO, "ETIME", serv_info->etime, 2, "Exposure time");
+   fh_set_int(hu, FH_AUTO, "STACKCNT", serv_info->frame_count, 
+	      "Number of stacked subframes");
+   fh_set_int(hu, FH_AUTO, "NSTACK", serv_info->frame_count, 
+	      "Number of frames combined");
+   switch (serv_info->stack_mode) {
+      case STACK_SUM:
+	 fh_set_str(hu, FH_AUTO, "STACKMODE", STACK_SUM_STRING,
+		    "Frames co-added");
+	 break;
+      case STACK_MEAN:
+	 fh_set_str(hu, FH_AUTO, "STACKMODE", STACK_MEAN_STRING,
+		    "Mean of the frames");
+	 break;
+      case STACK_CLIP:
+	 fh_set_str(hu, FH_AUTO, "STACKMODE", STACK_CLIP_STRING,
+		    "Sigma-clipped mean of the frames");
+	 fh_set_flt(hu, FH_AUTO, "CLIPSIG", CLIP_SIGMA, 2,
+		    "Clipping threshold (sigma)");
+	 break;
+   }
+   switch (serv_info->gain) {
+      case GAIN_AUTO:
+	 fh_set_str(hu, FH_AUTO, "GAIN", "AUTO", "Camera Gain");
+	 break;
+      case GAIN_HIGH:
+	 fh_set_str(hu, FH_AUTO, "GAIN", "HIGH", "Camera Gain");
+	 break;
+      case GAIN_LOW:
+	 fh_set_str(hu, FH_AUTO, "GAIN", "LOW", "Camera Gain");
+	 break;
+      case GAIN_MANUAL:
+	 fh_set_str(hu, FH_AUTO, "GAIN", "MANUAL", "Camera Gain");
+	 break;
+   }
+   fh_set_str(hu, FH_AUTO, "DOMEAZ", meta.dome_az, "Dome Azimuth");
+   fh_set_str(hu, FH_AUTO, "TEMP", meta.temp, "Enclosure Temperature");
+   fh_set_str(hu, FH_AUTO, "PRESSURE", meta.pres, "Enclosure Pressure");
+   fh_set_str(hu, FH_AUTO, "HUMID", meta.humid, "Enclosure Humidity");
+   fh_set_str(hu, FH_AUTO, "CAMMODEL", FLIR_MODEL, "Camera Model");
+   if (serv_info->stack_calibrated) {
+      fh_set_str(hu, FH_AUTO, "DARKFILE", serv_info->calib_dark, 
+		 "Master dark subtracted");
+      fh_set_str(hu, FH_AUTO, "FLATFILE", serv_info->calib_flat, 
+		 "Master flat applied");
+   }
+   if (serv_info->stack_diff) {
+      fh_set_str(hu, FH_AUTO, "DIFFMODE", 
+		 (serv_info->diff_mode == DIFF_PREVIOUS) ? 
+		 DIFF_PREVIOUS_STRING : DIFF_MEDIAN_STRING,
+		 "Difference against this reference");
+   }
+
+   /* 
+    * Write out the FITS header 
+    */
+   if ((fh_error = fh_write(hu, fd)) != FH_SUCCESS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) unable to write FITS header"
+		" (fh_error = %d)", __FILE__, __LINE__,
+		fh_error);
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
+		"%s (errno=%d)", strerror(errno), errno);
+      fh_destroy(hu);
+      return FAIL;
+   }
+
+   /*
+    * Write out the compressed tiles
+    */
+   if (compress) {
+      if (riceWriteTable(&rice, fd) != PASS) {
+	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		   "(%s:%d) unable to write compressed FITS image data",
+		   __FILE__, __LINE__);
+	 fh_destroy(hu);
+	 return FAIL;
+      }
+   }
+
+   /*
+    * Write out the image data
+    */
+   else if (writeFITSData(fd, image, serv_info->width * serv_info->height *
+			  sizeof(unsigned short)) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) unable to write FITS image data",
+		__FILE__, __LINE__);
+      fh_destroy(hu);
+      return FAIL;
+   }
+   
+   /*
+    * Free up the memory for the FITS header
+    */
+   fh_destroy(hu);
+   
+   return PASS;
+}
+
+
+#ifndef BENCHMARK
+/*
+ * Start an exposure and return straight away: the frames from the camera
+ * are stacked by serveExposures() as they arrive, until the exposure time
+ * is up.  On failure the error reply for 'cmd' is left in 'buffer'.
+ */
+static PASSFAIL
+startExposure(char *buffer, const char *cmd)
+{
+   /*
+    * Make sure that a valid exposure time has been established
+    */
+   if (serv_info->etime < MIN_ETIME || serv_info->etime > MAX_ETIME) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) exposure time must be set before triggering an"
+		" image", __FILE__, __LINE__);
+      sprintf(buffer,
+	      "%c %s \"Exposure time isn't set\"", FAIL_CHAR, cmd);
+      return FAIL;
+   }
+
+   /*
+    * Start the capture of the exposure, throwing away anything left in the
+    * frame ring from before it
+    */
+   drainFrameRing(FALSE);
+   resetStack();
+   serv_info->exp_start_ts = getClockTime();
+   serv_info->exp_stop_ts = serv_info->exp_start_ts + serv_info->etime;
+   frame_ring.dropped.store(0, std::memory_order_relaxed);
+   frame_ring.exposing.store(1, std::memory_order_release);
+   serv_info->exposing = TRUE;
+
+   return PASS;
+}
+
+
+/*
+ * Stack the frames that arrived since the last call and check, without
+ * waiting, whether the exposure under way is done or has timed out
+ */
+static int
+exposureDone(void)
+{
+   double now;
+
+   drainFrameRing(TRUE);
+   now = getClockTime();
+   if (serv_info->frame_count == 0) {
+      return serv_info->exp_start_ts + EXPOSE_TIMEOUT < now;
+   }
+
+   return now >= serv_info->exp_stop_ts;
+}
+
+
+/*
+ * Finish the exposure once exposureDone() says so.  The stacked image is
+ * left in serv_info for writeFITSImage().  On failure the error reply for
+ * 'cmd' is left in 'buffer'.
+ */
+static PASSFAIL
+readExposure(char *buffer, const char *cmd)
+{
+   double start_ts;
+   unsigned int dropped;
+
+   /*
+    * Stop taking frames and stack the ones captured before the end of the
+    * exposure that haven't been picked up yet
+    */
+   frame_ring.exposing.store(0, std::memory_order_release);
+   serv_info->exposing = FALSE;
+   start_ts = getClockTime();
+   recordStage(STAGE_EXPOSE, start_ts - serv_info->exp_start_ts);
+   drainFrameRing(TRUE);
+
+   /*
+    * Handle an exception case where the exposure timed out
+    */
+   if (serv_info->frame_count == 0) {
+      serv_info->exp_start_ts = 0;
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		"(%s:%d) exposure timeout without receiving any frames"
+		" from the camera", __FILE__, __LINE__);
+      sprintf(buffer, "%c %s \"Exposure timeout\"", FAIL_CHAR, cmd);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return FAIL;
+   }
+
+   if ((dropped = frame_ring.dropped.load(std::memory_order_relaxed)) != 0) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) %u camera frames dropped from a full frame ring",
+		__FILE__, __LINE__, dropped);
+      serv_info->dropped_total += dropped;
+   }
+   recordStage(STAGE_READOUT, getClockTime() - start_ts);
+
+   return PASS;
+}
+
+
+/*
+ * Save a master to 'path'.  It is written next to it and renamed into
+ * place, so it never shows up half written, and any mapping of the one it
+ * replaces is dropped.
+ */
+static PASSFAIL
+writeMaster(const char *path, const float *data, size_t npixels)
+{
+   char tmp_path[CALIB_PATH_SIZE + 4];
+   int fd;
+   int i;
+
+   snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+   if ((fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		"(%s:%d) unable to create %s : %s (errno=%d)", __FILE__, 
+		__LINE__, tmp_path, strerror(errno), errno);
+      return FAIL;
+   }
+   if (writeAll(fd, data, npixels * sizeof(float)) != PASS) {
+      close(fd);
+      unlink(tmp_path);
+      return FAIL;
+   }
+   close(fd);
+   if (rename(tmp_path, path) == -1) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		"(%s:%d) unable to rename %s : %s (errno=%d)", __FILE__, 
+		__LINE__, tmp_path, strerror(errno), errno);
+      unlink(tmp_path);
+      return FAIL;
+   }
+   for (i = 0; i < MAX_MASTERS; i++) {
+      if ((serv_info->master[i].data != NULL) && 
+	  !strcmp(serv_info->master[i].path, path)) {
+	 unmapMaster(&serv_info->master[i]);
+      }
+   }
+
+   return PASS;
+}
+
+
+/*
+ * Drop the master being built
+ */
+static void
+endCalibration(void)
+{
+   free(serv_info->calib_sum);
+   serv_info->calib_sum = NULL;
+   serv_info->calib_kind = CALIB_NONE;
+   serv_info->calib_remaining = 0;
+   calib_client = NULL;
+}
+
+
+/*
+ * Give up on the master being built, telling the client that asked for
+ * it why
+ */
+static void
+abortCalibration(const char *reason)
+{
+   const char *cmd = (serv_info->calib_kind == CALIB_DARK) ? 
+      DARK_CMD : FLAT_CMD;
+
+   cfht_logv(CFHT_MAIN, CFHT_WARN, "(%s:%d) master %s not built: %s", 
+	     __FILE__, __LINE__, cmd, reason);
+   if (calib_client != NULL) {
+      snprintf(calib_client->reply, REPLY_SIZE, "%c %s \"%s\"", FAIL_CHAR, 
+	       cmd, reason);
+   }
+   endCalibration();
+}
+
+
+/*
+ * Turn the sum of the exposures into the master and save it.  A dark is
+ * their mean.  A flat is kept as the factors that even out the mean
+ * field, less the dark taken in the same gain mode, so that applying it
+ * takes a multiply instead of a divide.
+ */
+static void
+finishCalibration(void)
+{
+   const char *cmd = (serv_info->calib_kind == CALIB_DARK) ? 
+      DARK_CMD : FLAT_CMD;
+   char path[CALIB_PATH_SIZE];
+   size_t npixels = (size_t)serv_info->width * serv_info->height;
+   float *master = serv_info->calib_sum;
+   const float *dark;
+   double mean = 0;
+   size_t i;
+
+   for (i = 0; i < npixels; i++) {
+      master[i] /= serv_info->calib_count;
+   }
+   if (serv_info->calib_kind == CALIB_FLAT) {
+      masterPath(path, CALIB_DARK, serv_info->calib_gain);
+      dark = mapMaster(path, npixels);
+      for (i = 0; i < npixels; i++) {
+	 if (dark != NULL) {
+	    master[i] -= dark[i];
+	 }
+	 mean += master[i];
+      }
+      mean /= npixels;
+      if (mean <= 0) {
+	 abortCalibration("The flat field is empty");
+	 return;
+      }
+      for (i = 0; i < npixels; i++) {
+	 master[i] = (master[i] > 0) ? mean / master[i] : 1.0f;
+      }
+   }
+   masterPath(path, serv_info->calib_kind, serv_info->calib_gain);
+   if (writeMaster(path, master, npixels) != PASS) {
+      abortCalibration("Unable to save the master");
+      return;
+   }
+
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY, "(%s:%d) saved %s from %d exposures",
+	     __FILE__, __LINE__, path, serv_info->calib_count);
+   if (calib_client != NULL) {
+      snprintf(calib_client->reply, REPLY_SIZE, "%c %s DONE %s", PASS_CHAR,
+	       cmd, path + strlen(CALIB_DIR) + 1);
+   }
+   endCalibration();
+}
+
+
+/*
+ * Add the stack of an exposure taken for the master being built, in
+ * counts per frame, or give up on the master if the exposure failed or
+ * the gain mode changed under it.  The master is saved once the last
+ * exposure is in.  This has to come before the stack is calibrated for
+ * the images.
+ */
+static void
+addCalibrationFrame(int ok)
+{
+   size_t npixels = (size_t)serv_info->width * serv_info->height;
+   const int *stack = serv_info->stack_data;
+   float scale, bias;
+   size_t i;
+
+   if (!ok) {
+      abortCalibration("Exposure failed");
+      return;
+   }
+   if (serv_info->gain != serv_info->calib_gain) {
+      abortCalibration("Gain mode changed");
+      return;
+   }
+
+   /*
+    * The frame size is only known once the camera has sent a frame
+    */
+   if ((serv_info->calib_sum == NULL) &&
+       ((serv_info->calib_sum = (float *)calloc(npixels, 
+						sizeof(float))) == NULL)) {
+      abortCalibration("Not enough memory for the master");
+      return;
+   }
+
+   finalizeStack();
+   stackUnits(&scale, &bias);
+   for (i = 0; i < npixels; i++) {
+      serv_info->calib_sum[i] += stack[i] * scale + bias;
+   }
+   serv_info->calib_count++;
+   if (--serv_info->calib_remaining == 0) {
+      finishCalibration();
+   }
+}
+
+
+/*
+ * Forget the oldest archived images until there is room in the index for
+ * another, and all those in 'segment' if it is about to be written over
+ */
+static void
+forgetArchived(int segment)
+{
+   archive_index_t *index = archive.index;
+
+   while ((index->first < index->next) &&
+	  ((index->next - index->first >= ARCHIVE_ENTRIES) ||
+	   (index->entry[index->first % ARCHIVE_ENTRIES].segment == segment))) {
+      index->first++;
+   }
+}
+
+
+/*
+ * Set up the rolling archive of the images taken.  The images go into a
+ * ring of segment files allocated in full up front in ARCHIVE_DIR (or
+ * TAUCAM_ARCHIVE_DIR, a tmpfs or a USB disk, never the SD card), and the
+ * index that finds them is a memory mapped file next to them, so both
+ * outlive the server.  The segments take a lot of room, in memory for a
+ * tmpfs, so there is no archive unless TAUCAM_ARCHIVE_SEGMENTS asks for
+ * one.  Without it the images are still served, just not kept.
+ */
+static void
+startArchive(void)
+{
+   char path[ARCHIVE_PATH_SIZE + ARCHIVE_FILE_SIZE];
+   const char *env;
+   struct stat st;
+   void *data;
+   int nsegments = ARCHIVE_SEGMENTS;
+   int fd;
+   int rc;
+   int i;
+
+   if ((env = getenv(ARCHIVE_SEGMENTS_ENV)) != NULL) {
+      nsegments = atoi(env);
+   }
+   if (nsegments <= 0) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) the images are not archived, set %s to keep"
+		" them", __FILE__, __LINE__, ARCHIVE_SEGMENTS_ENV);
+      return;
+   }
+   if (nsegments > ARCHIVE_MAX_SEGMENTS) {
+      nsegments = ARCHIVE_MAX_SEGMENTS;
+   }
+   if ((env = getenv(ARCHIVE_DIR_ENV)) == NULL) {
+      env = ARCHIVE_DIR;
+   }
+   snprintf(archive.dir, sizeof(archive.dir), "%s", env);
+   if ((mkdir(archive.dir, 0775) == -1) && (errno != EEXIST)) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+		"(%s:%d) unable to create %s, the images are not archived :"
+		" %s (errno=%d)", __FILE__, __LINE__, archive.dir, 
+		strerror(errno), errno);
+      return;
+   }
+
+   /*
+    * Map the index, starting it over if it was laid out differently
+    */
+   snprintf(path, sizeof(path), "%s/index", archive.dir);
+   if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+		"(%s:%d) unable to open %s, the images are not archived :"
+		" %s (errno=%d)", __FILE__, __LINE__, path, strerror(errno),
+		errno);
+      return;
+   }
+   if ((fstat(fd, &st) == -1) || 
+       (((size_t)st.st_size != sizeof(archive_index_t)) &&
+	(ftruncate(fd, sizeof(archive_index_t)) == -1)) ||
+       ((data = mmap(NULL, sizeof(archive_index_t), PROT_READ | PROT_WRITE,
+		     MAP_SHARED, fd, 0)) == MAP_FAILED)) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+		"(%s:%d) unable to map %s, the images are not archived :"
+		" %s (errno=%d)", __FILE__, __LINE__, path, strerror(errno),
+		errno);
+      close(fd);
+      return;
+   }
+   close(fd);
+   archive.index = (archive_index_t *)data;
+   if ((archive.index->magic != ARCHIVE_MAGIC) ||
+       (archive.index->nsegments != (uint32_t)nsegments) ||
+       (archive.index->first > archive.index->next)) {
+      memset(archive.index, 0, sizeof(archive_index_t));
+      archive.index->magic = ARCHIVE_MAGIC;
+      archive.index->nsegments = nsegments;
+      archive.index->first = 1;
+      archive.index->next = 1;
+   }
+
+   /*
+    * Allocate the segments in full, so that archiving an image never
+    * runs out of room half way through
+    */
+   for (i = 0; i < nsegments; i++) {
+      snprintf(path, sizeof(path), "%s/segment%02d", archive.dir, i);
+      if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1) {
+	 rc = errno;
+      }
+      else if ((rc = posix_fallocate(fd, 0, ARCHIVE_SEGMENT_SIZE)) != 0) {
+	 close(fd);
+      }
+      if ((fd == -1) || (rc != 0)) {
+	 cfht_logv(CFHT_MAIN, CFHT_WARN,
+		   "(%s:%d) unable to allocate %s, the images are not"
+		   " archived : %s (errno=%d)", __FILE__, __LINE__, path,
+		   strerror(rc), rc);
+	 while (--i >= 0) {
+	    close(archive.segment_fd[i]);
+	 }
+	 munmap(archive.index, sizeof(archive_index_t));
+	 archive.index = NULL;
+	 return;
+      }
+      archive.segment_fd[i] = fd;
+   }
+   archive.nsegments = nsegments;
+
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	     "(%s:%d) archiving the images in %d segments of %s, %lu"
+	     " images kept so far", __FILE__, __LINE__, nsegments, 
+	     archive.dir, 
+	     (unsigned long)(archive.index->next - archive.index->first));
+}
+
+
+/*
+ * Add the image just stacked to the archive, Rice compressed whatever the
+ * clients asked for.  It is appended where the last one ended, or at the
+ * start of the next segment when it might not fit, writing over the
+ * oldest images.  A segment that an image is still being fetched from is
+ * not written over; the new images are dropped until it is free.
+ */
+static void
+archiveImage(void)
+{
+   archive_index_t *index = archive.index;
+   archive_entry_t *entry;
+   metadata_t meta;
+   double timestamp;
+   char *end;
+   off_t bound;
+   off_t offset;
+   off_t size;
+   int segment;
+   int fd;
+
+   if (index == NULL) {
+      return;
+   }
+
+   /*
+    * The compressed image is never more than a little past the raw pixels
+    */
+   bound = ARCHIVE_HEADER_SIZE + (off_t)serv_info->height * 
+      (8 + RICE_ROW_BOUND(serv_info->width));
+   segment = index->segment;
+   offset = index->offset;
+   if (offset + bound > ARCHIVE_SEGMENT_SIZE) {
+      segment = (segment + 1) % archive.nsegments;
+      if (archive.readers[segment] > 0) {
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		   "(%s:%d) archive segment %d is being fetched from, image"
+		   " not archived", __FILE__, __LINE__, segment);
+	 return;
+      }
+      forgetArchived(segment);
+      index->segment = segment;
+      index->offset = offset = 0;
+   }
+   forgetArchived(-1);
+
+   fd = archive.segment_fd[segment];
+   timestamp = getClockTime();
+   if ((lseek(fd, offset, SEEK_SET) == -1) ||
+       (writeFITSImage(fd, TRUE) != PASS) ||
+       ((size = lseek(fd, 0, SEEK_CUR) - offset) <= 0)) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+		"(%s:%d) unable to archive image in segment %d",
+		__FILE__, __LINE__, segment);
+      return;
+   }
+
+   /*
+    * Index it by time, frames stacked and where the dome was pointing.
+    * The entry is filled in before it is counted, so the index is never
+    * left pointing at half an image.
+    */
+   pthread_mutex_lock(&metadata_lock);
+   meta = metadata;
+   pthread_mutex_unlock(&metadata_lock);
+   entry = &index->entry[index->next % ARCHIVE_ENTRIES];
+   entry->serial = index->next;
+   entry->timestamp = timestamp;
+   entry->dome_az = strtod(meta.dome_az, &end);
+   if (end == meta.dome_az) {
+      entry->dome_az = NULL_DBL;
+   }
+   entry->nframes = serv_info->frame_count;
+   entry->segment = segment;
+   entry->offset = offset;
+   entry->size = size;
+   index->offset = (offset + size + ARCHIVE_ALIGN - 1) / ARCHIVE_ALIGN * 
+      ARCHIVE_ALIGN;
+   index->next++;
+}
+
+
+/*
+ * Start sending a client the archived images taken after 'since', oldest
+ * first.  The reply gives the number of images
+ * that follow, each announced like an IMAGE reply.  An image written over
+ * before it goes out is announced by an error reply in its place.
+ */
+static void
+startFetch(client_info_t *cinfo, char *buffer, double since)
+{
+   archive_index_t *index = archive.index;
+   uint64_t lo, hi, mid;
+
+   if (index == NULL) {
+      sprintf(buffer, "%c %s \"The images are not archived\"", FAIL_CHAR,
+	      FETCH_CMD);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+   if (cinfo->subscribed || (cinfo->image_wanted != IMAGE_NONE) ||
+       (cinfo->seq_remaining != 0) || (cinfo == calib_client) ||
+       (cinfo->fetch_next < cinfo->fetch_end)) {
+      sprintf(buffer, "%c %s \"An image is already on its way\"", 
+	      FAIL_CHAR, FETCH_CMD);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+   /*
+    * The images are archived in the order they were taken, so the first
+    * one after 'since' is found by bisecting the index
+    */
+   lo = index->first;
+   hi = index->next;
+   while (lo < hi) {
+      mid = lo + (hi - lo) / 2;
+      if (index->entry[mid % ARCHIVE_ENTRIES].timestamp <= since) {
+	 lo = mid + 1;
+      }
+      else {
+	 hi = mid;
+      }
+   }
+
+   /*
+    * Pick up the data connection now, since there won't be a request
+    * to do it with later
+    */
+   if ((cinfo->bulk_token != 0) && (cinfo->data_fd == -1)) {
+      claimDataConnection(cinfo);
+   }
+
+   cinfo->fetch_next = lo;
+   cinfo->fetch_end = index->next;
+   sprintf(buffer, "%c %s %lu", PASS_CHAR, FETCH_CMD, 
+	   (unsigned long)(cinfo->fetch_end - cinfo->fetch_next));
+   if (cinfo->data_fd != -1) {
+      strcat(buffer, " " BULK_CMD);
+   }
+   cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	     "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+}
+#endif
+
+
+/*
+ * Queue up the next image of a FETCH to be sent straight out of its
+ * archive segment, announced by the reply held for the client
+ */
+static void
+sendFetchedImage(client_info_t *cinfo)
+{
+   archive_index_t *index = archive.index;
+   archive_entry_t *entry;
+   uint64_t serial = cinfo->fetch_next++;
+   void *data;
+
+   if (serial < index->first) {
+      sprintf(cinfo->reply, "%c %s \"Image written over before it was"
+	      " sent\"", FAIL_CHAR, FETCH_CMD);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, cinfo->reply);
+      return;
+   }
+   entry = &index->entry[serial % ARCHIVE_ENTRIES];
+
+   releaseImageData(cinfo);
+   data = mmap(NULL, entry->size, PROT_READ, MAP_SHARED, 
+	       archive.segment_fd[entry->segment], entry->offset);
+   if (data == MAP_FAILED) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) unable to map archived image.  %s (errno=%d)",
+		__FILE__, __LINE__, strerror(errno), errno);
+      sprintf(cinfo->reply, "%c %s \"Unable to read archived image\"", 
+	      FAIL_CHAR, FETCH_CMD);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, cinfo->reply);
+      return;
+   }
+   cinfo->image_data = (unsigned char *)data;
+   cinfo->image_size = entry->size;
+   cinfo->archived = TRUE;
+   cinfo->archive_segment = entry->segment;
+   cinfo->archive_offset = entry->offset;
+   archive.readers[entry->segment]++;
+
+   cinfo->send_data = 1;
+   cinfo->data_count = 0;
+   cinfo->total_count = cinfo->image_size;
+   cinfo->send_start_ts = getClockTime();
+   sprintf(cinfo->reply, "%c %ld%s %s", PASS_CHAR, (long)cinfo->image_size,
+	   (cinfo->data_fd != -1) ? " " BULK_CMD : "", COMPRESS_RICE_STRING);
+   cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	     "(%s:%d) SEND> %s", __FILE__, __LINE__, cinfo->reply);
+}
+
+
+#ifndef BENCHMARK
+/*
+ * Put the reply announcing an image in 'buffer': the number of bytes of
+ * binary data that can be expected, whether they will arrive on the bulk
+ * data connection and whether they are Rice compressed.
+ */
+static void
+imageReply(client_info_t *cinfo, char *buffer)
+{
+   sprintf(buffer, "%c %ld", PASS_CHAR, (long)cinfo->image_size);
+   if (cinfo->data_fd != -1) {
+      strcat(buffer, " " BULK_CMD);
+   }
+   if (cinfo->compress) {
+      strcat(buffer, " " COMPRESS_RICE_STRING);
+   }
+}
+
+
+/*
+ * Check whether the subscribers are ready for another image: there are
+ * some, they are done sending the last one and no retry is pending
+ */
+static int
+subscribersReady(void)
+{
+   int i;
+
+   if ((shared_image[0].refs != 0) || (shared_image[1].refs != 0) ||
+       (getClockTime() < serv_info->subscribe_retry_ts)) {
+      return FALSE;
+   }
+   for (i = 0; i < MAX_SUBSCRIBERS; i++) {
+      if (subscriber[i] != NULL) {
+	 return TRUE;
+      }
+   }
+
+   return FALSE;
+}
+
+
+/*
+ * Start the next exposure if a client is waiting for an image, the
+ * subscribers are ready for one or a master is being built.  The clients
+ * queued up until now are the ones it is taken for.  On failure the error
+ * reply is left in 'buffer' and given to every one of them.
+ */
+static PASSFAIL
+startNextExposure(char *buffer)
+{
+   int queued = FALSE;
+   int calib = (serv_info->calib_remaining != 0);
+   int ready;
+   int i;
+
+   for (i = 0; i < MAX_IMAGE_CLIENTS; i++) {
+      if (image_client[i] != NULL) {
+	 queued = TRUE;
+      }
+   }
+   ready = subscribersReady();
+   if (!queued && !ready && !calib) {
+      return PASS;
+   }
+
+   if (startExposure(buffer, IMAGE_CMD) != PASS) {
+      for (i = 0; i < MAX_IMAGE_CLIENTS; i++) {
+	 if (image_client[i] != NULL) {
+	    strcpy(image_client[i]->reply, buffer);
+	    image_client[i]->image_wanted = IMAGE_NONE;
+	    image_client[i] = NULL;
+	 }
+      }
+      if (ready) {
+	 serv_info->subscribe_retry_ts = getClockTime() + SUBSCRIBE_RETRY;
+      }
+      if (calib) {
+	 abortCalibration("Unable to start exposure");
+      }
+      return FAIL;
+   }
+   for (i = 0; i < MAX_IMAGE_CLIENTS; i++) {
+      if (image_client[i] != NULL) {
+	 image_client[i]->image_wanted = IMAGE_EXPOSING;
+      }
+   }
+   serv_info->exposure_subscribed = ready;
+   serv_info->exposure_calib = calib;
+
+   return PASS;
+}
+
+
+/*
+ * Build the image a client asked for out of the stack and queue it up to
+ * be sent, announced by the reply held for the client
+ */
+static void
+deliverImage(client_info_t *cinfo)
+{
+   double now, start_ts, io_time;
+   int fd;
+
+   /*
+    * Rewind the in-memory file to build the FITS image in
+    */
+   start_ts = getClockTime();
+   fd = openImageFile(cinfo);
+   io_time = getClockTime() - start_ts;
+   if (fd == -1) {
+      sprintf(cinfo->reply,
+	      "%c %s \"Unable to create in-memory image on the camera"
+	      " server\"", FAIL_CHAR, IMAGE_CMD);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG, "(%s:%d) SEND> %s", __FILE__, __LINE__,
+		cinfo->reply);
+      return;
+   }
+
+   /*
+    * Create a FITS image from the pixel data and build it in the in-memory
+    * file
+    */
+   start_ts = getClockTime();
+   if (writeFITSImage(fd, cinfo->compress) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		"(%s:%d) unable to create FITS file", __FILE__, __LINE__);
+      sprintf(cinfo->reply, "%c %s \"Unable to create in-memory image on"
+	      " the camera server\"", FAIL_CHAR, IMAGE_CMD);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, cinfo->reply);
+      return;
+   }
+   now = getClockTime();
+   recordStage(STAGE_ENCODE, now - start_ts);
+   start_ts = now;
+
+   /*
+    * Map the FITS image so it can be sent directly from memory
+    */
+   if (mapImageFile(cinfo) != PASS) {
+      sprintf(cinfo->reply, "%c %s \"Unable to create in-memory image on"
+	      " the camera server\"", FAIL_CHAR, IMAGE_CMD);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, cinfo->reply);
+      return;
+   }
+   now = getClockTime();
+   recordStage(STAGE_IO, io_time + now - start_ts);
+
+   /*
+    * Set up the flags to trigger data being sent
+    */
+   cinfo->send_data = 1;
+   cinfo->data_count = 0;
+   cinfo->total_count = cinfo->image_size;
+   cinfo->send_start_ts = now;
+
+   /*
+    * Announce the number of bytes of binary data that can be expected to
+    * be received from the server
+    */
+   imageReply(cinfo, cinfo->reply);
+}
+
+
+/*
+ * Forget the images a client is waiting for, when it goes away
+ */
+static void
+dropImageRequest(client_info_t *cinfo)
+{
+   int i;
+
+   for (i = 0; i < MAX_IMAGE_CLIENTS; i++) {
+      if (image_client[i] == cinfo) {
+	 image_client[i] = NULL;
+      }
+   }
+   for (i = 0; i < MAX_SEQUENCES; i++) {
+      if (sequence_client[i] == cinfo) {
+	 sequence_client[i] = NULL;
+      }
+   }
+   cinfo->image_wanted = IMAGE_NONE;
+   cinfo->seq_remaining = 0;
+}
+
+
+/*
+ * Start a sequence of 'nimages' images for a client, one exposure every
+ * 'interval' seconds, or back to back if it is 0.  The images are sent
+ * one after the other over the connection, each announced by the usual
+ * IMAGE reply, with the settings the client has already made.
+ */
+static void
+startSequence(client_info_t *cinfo, char *buffer, int nimages, 
+	      double interval)
+{
+   int i;
+
+   if ((nimages < 1) || (interval < 0)) {
+      sprintf(buffer, "%c %s \"Use %s <n> [<interval>]\"", FAIL_CHAR, 
+	      SEQUENCE_CMD, SEQUENCE_CMD);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+   if (cinfo->subscribed || (cinfo->image_wanted != IMAGE_NONE) ||
+       (cinfo->seq_remaining != 0) || (cinfo == calib_client) ||
+       (cinfo->fetch_next < cinfo->fetch_end)) {
+      sprintf(buffer, "%c %s \"An image is already on its way\"", 
+	      FAIL_CHAR, SEQUENCE_CMD);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+   for (i = 0; (i < MAX_SEQUENCES) && (sequence_client[i] != NULL) &&
+	   (sequence_client[i] != cinfo); i++) {
+   }
+   if (i == MAX_SEQUENCES) {
+      sprintf(buffer, "%c %s \"Too many sequences\"", FAIL_CHAR, 
+	      SEQUENCE_CMD);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+
+   /*
+    * Pick up the data connection now, since there won't be a request
+    * to do it with later
+    */
+   if ((cinfo->bulk_token != 0) && (cinfo->data_fd == -1)) {
+      claimDataConnection(cinfo);
+   }
+
+   sequence_client[i] = cinfo;
+   cinfo->seq_remaining = nimages;
+   cinfo->seq_interval = interval;
+   cinfo->seq_next_ts = getClockTime();
+
+   sprintf(buffer, "%c %s %d %.3f", PASS_CHAR, SEQUENCE_CMD, nimages, 
+	   interval);
+   if (cinfo->data_fd != -1) {
+      strcat(buffer, " " BULK_CMD);
+   }
+   cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	     "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+}
+
+
+/*
+ * Queue up the sequence clients whose next image is due and who are done
+ * with the last one.  Returns TRUE if one of them is idle but its next
+ * image isn't due yet, so the server loop has to keep an eye on the time.
+ */
+static int
+queueSequences(void)
+{
+   double now = getClockTime();
+   int waiting = FALSE;
+   int i, j;
+
+   for (i = 0; i < MAX_SEQUENCES; i++) {
+      client_info_t *cinfo = sequence_client[i];
+
+      if ((cinfo == NULL) || (cinfo->seq_remaining == 0) ||
+	  (cinfo->image_wanted != IMAGE_NONE) || cinfo->send_data ||
+	  (cinfo->reply[0] != '\0')) {
+	 continue;
+      }
+      if (now < cinfo->seq_next_ts) {
+	 waiting = TRUE;
+	 continue;
+      }
+      for (j = 0; (j < MAX_IMAGE_CLIENTS) && (image_client[j] != NULL); 
+	   j++) {
+      }
+      if (j == MAX_IMAGE_CLIENTS) {
+	 break;
+      }
+      image_client[j] = cinfo;
+      cinfo->image_wanted = IMAGE_QUEUED;
+      if (--cinfo->seq_remaining == 0) {
+	 sequence_client[i] = NULL;
+	 continue;
+      }
+
+      /*
+       * Keep to the cadence, but don't try to catch up on images that
+       * couldn't be taken in time
+       */
+      cinfo->seq_next_ts += cinfo->seq_interval;
+      if (cinfo->seq_next_ts < now) {
+	 cinfo->seq_next_ts = now;
+      }
+   }
+
+   return waiting;
+}
+
+
+/*
+ * How long sockserv may wait for activity on each pass of the server
+ * loop: it is only polled while an exposure or a bulk transfer is under
+ * way, or while a sequence needs its next image within the idle poll
+ * interval
+ */
+static int
+loopTimeout(void)
+{
+   double soon = getClockTime() + SOCKSERV_IDLE_POLL_INTERVAL;
+   int i;
+
+   if (serv_info->exposing || (serv_info->bulk_sends > 0)) {
+      return 0;
+   }
+   for (i = 0; i < MAX_SEQUENCES; i++) {
+      if ((sequence_client[i] != NULL) && 
+	  (sequence_client[i]->seq_remaining != 0) &&
+	  (sequence_client[i]->seq_next_ts < soon)) {
+	 return 0;
+      }
+   }
+
+   return SOCKSERV_IDLE_POLL_INTERVAL;
 }
 
 
 /*
- * Initialize the camera connection.
+ * Start building a master dark or flat for the current gain mode out of
+ * the next 'nframes' exposures, stacked the way the images are.  Darks
+ * have to be taken with the lens capped and flats of an evenly lit
+ * field.  The request is acknowledged at once, and the client is told
+ * once the master has been saved, or why it couldn't be built.
  */
-static PASSFAIL
-initCameraConnection(void) {
+static void
+startCalibration(client_info_t *cinfo, char *buffer, calib_kind_t kind,
+		 int nframes)
+{
+   const char *cmd = (kind == CALIB_DARK) ? DARK_CMD : FLAT_CMD;
 
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	     "Initializing Tau camera connection");
+   if ((nframes < 1) || (nframes > MAX_CALIB_FRAMES)) {
+      sprintf(buffer, "%c %s \"Use %s <n>, with n up to %d\"", FAIL_CHAR, 
+	      cmd, cmd, MAX_CALIB_FRAMES);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+   if (serv_info->calib_kind != CALIB_NONE) {
+      sprintf(buffer, "%c %s \"A master is already being built\"", 
+	      FAIL_CHAR, cmd);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+   if (cinfo->subscribed || (cinfo->image_wanted != IMAGE_NONE) ||
+       (cinfo->seq_remaining != 0) || 
+       (cinfo->fetch_next < cinfo->fetch_end)) {
+      sprintf(buffer, "%c %s \"An image is already on its way\"", 
+	      FAIL_CHAR, cmd);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
 
-   /* 
-    * Set up a connection to the camera.  The way the API in the SDK is set
-    * up this request won't fail
-    */
-   serv_info->tgr = new ThermalGrabber(callbackTauImage, NULL);
+   serv_info->calib_kind = kind;
+   serv_info->calib_gain = serv_info->gain;
+   serv_info->calib_remaining = nframes;
+   serv_info->calib_count = 0;
+   calib_client = cinfo;
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	     "(%s:%d) building a master %s from %d exposures", 
+	     __FILE__, __LINE__, cmd, nframes);
 
-   /*
-    * Apply the default gain which is automatic
-    */
-   applyGain(serv_info->gain);
+   if (!serv_info->exposing && (startNextExposure(buffer) != PASS) &&
+       (calib_client != cinfo)) {
+      strcpy(buffer, cinfo->reply);
+      cinfo->reply[0] = '\0';
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
 
-   return PASS;
+   sprintf(buffer, "%c %s %d", PASS_CHAR, cmd, nframes);
+   cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	     "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
 }
 
 
 /*
- * Take a pointer to image data and create a FITS image using this data
- * and send it to the specified file descriptor
+ * Add a client to the subscribers, which are sent every image taken for
+ * them without asking.  Each image arrives as an IMAGE reply line followed
+ * by its data, and the subscription lasts until the client disconnects.
  */
-static PASSFAIL
-writeFITSImage(client_info_t *cinfo, int fd) 
+static void
+subscribe(client_info_t *cinfo, char *buffer)
 {
-   HeaderUnit hu;
-   time_t date = time(NULL);
-   char fitscard[FH_MAX_STRLEN];
-   fh_result fh_error;
-   unsigned short *image;
-   unsigned int i;
-   int min_val;
-   char dome_az[255];
-   char temp[255];
-   char pres[255];
-   char humid[255];
-
-   // Get SS Data 
-   if (ssGetString(SS_DOME_AZ, dome_az, sizeof(dome_az) - 1) == FAIL) {
-      fprintf(stderr, "ssGet `%s' failed: %s\n", SS_DOME_AZ, ssGetStrError());
-      exit(EXIT_FAILURE);
-   }
-   if (ssGetString(SS_TEMP, temp, sizeof(temp) - 1) == FAIL) {
-      fprintf(stderr, "ssGet `%s' failed: %s\n", SS_TEMP, ssGetStrError());
-      exit(EXIT_FAILURE);
-   }
-   if (ssGetString(SS_PRES, pres, sizeof(pres) - 1) == FAIL) {
-      fprintf(stderr, "ssGet `%s' failed: %s\n", SS_PRES, ssGetStrError());
-      exit(EXIT_FAILURE);
+   int i;
+
+   if (cinfo == calib_client) {
+      sprintf(buffer, "%c %s \"A master is being built\"", FAIL_CHAR, 
+	      SUBSCRIBE_CMD);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
    }
-   if (ssGetString(SS_HUMID, humid, sizeof(humid) - 1) == FAIL) {
-      fprintf(stderr, "ssGet `%s' failed: %s\n", SS_HUMID, ssGetStrError());
-      exit(EXIT_FAILURE);
+   if (cinfo->fetch_next < cinfo->fetch_end) {
+      sprintf(buffer, "%c %s \"Images are being fetched\"", FAIL_CHAR, 
+	      SUBSCRIBE_CMD);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
    }
-
-
-   /*
-    * Make sure there is actually an image to send back to the client
-    */
-   if ((serv_info->frame_count == 0) || (serv_info->stack_data == NULL)) {
+   if (!cinfo->subscribed) {
+      for (i = 0; (i < MAX_SUBSCRIBERS) && (subscriber[i] != NULL); i++) {
+      }
+      if (i == MAX_SUBSCRIBERS) {
+	 sprintf(buffer, "%c %s \"Too many subscribers\"", FAIL_CHAR, 
+		 SUBSCRIBE_CMD);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		   "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+      subscriber[i] = cinfo;
+      cinfo->subscribed = TRUE;
       cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		"(%s:%d) image data is not available to send to the"
-		" client", __FILE__, __LINE__);
-      return FAIL;
+		"(%s:%d) %s subscribed to the images",
+		__FILE__, __LINE__, cinfo->hostname);
    }
 
    /*
-    * Create the header unit
-    */
-   hu = fh_create();
-
-   /*
-    * Populate the headers 
+    * Pick up the data connection now, since there won't be a request
+    * to do it with later
     */
-   fh_set_bool(hu, FH_AUTO, "SIMPLE", FH_TRUE, "Standard FITS");
-   fh_set_int(hu, FH_AUTO, "BITPIX", 16, "16-bit data");
-   fh_set_int(hu, FH_AUTO, "NAXIS", 2, "Number of axes");
-   fh_set_int(hu, FH_AUTO, "NAXIS1", serv_info->width,
-	      "Number of pixel columns");
-   fh_set_int(hu, FH_AUTO, "NAXIS2", serv_info->height,
-	      "Number of pixel rows");
-   fh_set_int(hu, FH_AUTO, "PCOUNT", 0, "No 'random' parameters");
-   fh_set_int(hu, FH_AUTO, "GCOUNT", 1, "Only one group");
-   strftime(fitscard, sizeof (fitscard) - 1, "%Y-%m-%dT%T", gmtime(&date));
-   fh_set_str(hu, FH_AUTO, "DATE", fitscard, "UTC Date of file creation");
-   strftime(fitscard, sizeof (fitscard) - 1, "%a %b %d %H:%M:%S %Z %Y",
-	    localtime(&date));
-   fh_set_str(hu, FH_AUTO, "HSTTIME", fitscard, "Local time in Hawaii");
-   fh_set_flt(hu, FH_AUTO, "UNIXTIME", getClockTime(), 
-	      13, "Fractional UNIX timestamp when image was taken");
-   fh_set_str(hu, FH_AUTO, "ORIGIN", "CFHT",
-	      "Canada-France-Hawaii Telescope");
-   fh_set_flt(hu, FH_AUTO, "BZERO", 32768.0, 6, "Zero factor");
-   fh_set_flt(hu, FH_AUTO, "BSCALE", 1.0, 2, "Scale factor");
-   fh_set_flt(hu, FH_AUTO, "ETIME", serv_info->etime, 2, "Exposure time");
-   fh_set_int(hu, FH_AUTO, "STACKCNT", serv_info->frame_count, 
-	      "Number of stacked subframes");
-   switch (serv_info->gain) {
-      case GAIN_AUTO:
-	 fh_set_str(hu, FH_AUTO, "GAIN", "AUTO", "Camera Gain");
-	 break;
-      case GAIN_HIGH:
-	 fh_set_str(hu, FH_AUTO, "GAIN", "HIGH", "Camera Gain");
-	 break;
-      case GAIN_LOW:
-	 fh_set_str(hu, FH_AUTO, "GAIN", "LOW", "Camera Gain");
-	 break;
-      case GAIN_MANUAL:
-	 fh_set_str(hu, FH_AUTO, "GAIN", "MANUAL", "Camera Gain");
-	 break;
+   if ((cinfo->bulk_token != 0) && (cinfo->data_fd == -1)) {
+      claimDataConnection(cinfo);
    }
-   fh_set_str(hu, FH_AUTO, "DOMEAZ", dome_az, "Dome Azimuth");
-   fh_set_str(hu, FH_AUTO, "TEMP", temp, "Enclosure Temperature");
-   fh_set_str(hu, FH_AUTO, "PRESSURE", pres, "Enclosure Pressure");
-   fh_set_str(hu, FH_AUTO, "HUMID", humid, "Enclosure Humidity");
-   fh_set_str(hu, FH_AUTO, "CAMMODEL", FLIR_MODEL, "Camera Model");
 
-   /* 
-    * Write out the FITS header 
-    */
-   if ((fh_error = fh_write(hu, fd)) != FH_SUCCESS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		"(%s:%d) unable to write FITS header"
-		" (fh_error = %d)", __FILE__, __LINE__,
-		fh_error);
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-		"%s (errno=%d)", strerror(errno), errno);
-      fh_destroy(hu);
-      return FAIL;
+   sprintf(buffer, "%c %s", PASS_CHAR, SUBSCRIBE_CMD);
+   if (cinfo->data_fd != -1) {
+      strcat(buffer, " " BULK_CMD);
    }
+   cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	     "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+}
 
-//   pthread_mutex_lock(&lock);
-   mtx.lock();
 
-   /*
-    * Find the minimum pixel value of the stacked image and adjust the 
-    * threshold of the image by this amount
-    */
-   min_val = 65535;
-   for (i = 0; i < serv_info->width * serv_info->height; i++) {
-      if (serv_info->stack_data[i] < min_val) {
-	 min_val = serv_info->stack_data[i];
+/*
+ * Remove a client from the subscribers
+ */
+static void
+unsubscribe(client_info_t *cinfo)
+{
+   int i;
+
+   for (i = 0; i < MAX_SUBSCRIBERS; i++) {
+      if (subscriber[i] == cinfo) {
+	 subscriber[i] = NULL;
       }
    }
+   cinfo->subscribed = FALSE;
+}
 
-   /*
-    * Take the stacked image and set it up to be saved with an offset bias
-    */
-   image = (unsigned short *)cli_malloc(serv_info->width * serv_info->height * 
-					sizeof(unsigned short));
 
-   /*
-    * Adjust the image by the minimum stack value
-    */
-   for (i = 0; i < serv_info->width * serv_info->height; i++) {
-      if (serv_info->stack_data[i] - min_val > 65535) {
-	 image[i] = 65535;
+/*
+ * Send the subscribers the stack just finished.  It is built once for
+ * each format the subscribers asked for; every subscriber then sends the
+ * shared image from its own offset.
+ */
+static void
+serveSubscribers(void)
+{
+   double start_ts;
+   int wanted[2] = { FALSE, FALSE };
+   int built[2] = { FALSE, FALSE };
+   int fd;
+   int i;
+
+   for (i = 0; i < MAX_SUBSCRIBERS; i++) {
+      if (subscriber[i] != NULL) {
+	 wanted[subscriber[i]->compress ? 1 : 0] = TRUE;
       }
-      else {
-	 image[i] = serv_info->stack_data[i] - min_val;
+   }
+   for (i = 0; i < 2; i++) {
+      if (!wanted[i]) {
+	 continue;
+      }
+      start_ts = getClockTime();
+      if ((fd = openImageFile(&shared_image[i])) != -1) {
+	 built[i] = (writeFITSImage(fd, i) == PASS) &&
+	    (mapImageFile(&shared_image[i]) == PASS);
+      }
+      recordStage(STAGE_ENCODE, getClockTime() - start_ts);
+      if (!built[i]) {
+	 cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		   "(%s:%d) unable to create FITS file for the subscribers",
+		   __FILE__, __LINE__);
       }
    }
-   serv_info->exp_start_ts = 0;
-   mtx.unlock();
-//   pthread_mutex_unlock(&lock);
-   
+
    /*
-    * Write out the image data
+    * Queue the image up on every subscriber that isn't still busy with
+    * an image it asked for itself
     */
-   if ((fh_error = fh_write_padded_image(hu, fd,
-					 (unsigned short *)image, 
-					 serv_info->width * serv_info->height *
-					 sizeof(unsigned short), 
-					 FH_TYPESIZE_16U)) 
-       != FH_SUCCESS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		"(%s:%d) unable to write FITS image data"
-		" (fh_error = %d)", __FILE__, __LINE__,
-		fh_error);
-      free(image);
-      //fh_destroy(hu);
-      return FAIL;
+   start_ts = getClockTime();
+   for (i = 0; i < MAX_SUBSCRIBERS; i++) {
+      client_info_t *cinfo = subscriber[i];
+      client_info_t *shared;
+
+      if ((cinfo == NULL) || cinfo->send_data) {
+	 continue;
+      }
+      shared = &shared_image[cinfo->compress ? 1 : 0];
+      if (!built[shared->compress]) {
+	 continue;
+      }
+      releaseImageData(cinfo);
+      cinfo->shared = shared;
+      shared->refs++;
+      cinfo->image_data = shared->image_data;
+      cinfo->image_size = shared->image_size;
+      cinfo->send_data = 1;
+      cinfo->data_count = 0;
+      cinfo->total_count = cinfo->image_size;
+      cinfo->send_start_ts = start_ts;
+      imageReply(cinfo, cinfo->reply);
    }
-   
-   /*
-    * Free up the memory for the FITS header and image
-    */
-   fh_destroy(hu);
-   free(image);
-   
-   return PASS;
 }
 
 
 /*
- * Take an image and save the contents of the buffer into memory where it 
- * can be sent to the client at the first opportunity.
+ * Drive the exposures from the server loop, so that commands keep being
+ * answered while one is under way.  Frames are stacked as they arrive;
+ * once the exposure time is up the image is built for every client that
+ * asked for it and for the subscribers, and the next exposure is started
+ * if anyone is waiting for one.  'commands' is cleared when takeImage()
+ * drives them instead, and is passed on to waitEvents().
  */
 static void
-takeImage(client_info_t *cinfo, char *buffer)
+serveExposures(int commands)
 {
-   struct stat file_stat;
-   double stop_ts;
-   int fd;
-   int read_count;
-   int count;
-
-   /*
-    * Open up a temporary file to write the FITS image to
-    */
-   if ((fd = open(TEMP_FILE, O_CREAT | O_RDWR | O_TRUNC,
-		  S_IRUSR | S_IRGRP | S_IROTH | S_IWUSR | S_IWGRP | S_IWOTH))
-       == -1) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		"(%s:%d) unable to open temporary file %s.  %s (errno=%d)",
-		__FILE__, __LINE__, TEMP_FILE, strerror(errno), errno);
-      sprintf(buffer,
-	      "%c %s \"Unable to save temporary file on the camera"
-	      " server\"", FAIL_CHAR, IMAGE_CMD);
-      cfht_logv(CFHT_MAIN, CFHT_DEBUG, "(%s:%d) SEND> %s", __FILE__, __LINE__,
-		buffer);
-      return;
-   }
+   char reply[256];
+   double timeout;
+   int waiting;
+   int ok;
+   int i;
 
-   /*
-    * Make sure that a valid exposure time has been established
-    */
-   if (serv_info->etime < MIN_ETIME || serv_info->etime > MAX_ETIME) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		"(%s:%d) exposure time must be set before triggering an"
-		" image", __FILE__, __LINE__);
-      sprintf(buffer,
-	      "%c %s \"Exposure time isn't set\"", FAIL_CHAR, IMAGE_CMD);
-      return;
-   }
+   checkCamera();
+   waiting = queueSequences();
+   if (serv_info->exposing) {
+      if (!exposureDone()) {
+
+	 /*
+	  * The frames and the commands wake the loop, so it can sleep
+	  * until the exposure is due to end
+	  */
+	 timeout = serv_info->exp_stop_ts - getClockTime();
+	 waitEvents((timeout > EXPOSURE_POLL_INTERVAL) ? timeout : 
+		    EXPOSURE_POLL_INTERVAL, commands);
+	 return;
+      }
+      ok = (readExposure(reply, IMAGE_CMD) == PASS);
+      if (serv_info->exposure_calib && 
+	  (serv_info->calib_kind != CALIB_NONE)) {
+	 addCalibrationFrame(ok);
+      }
+      for (i = 0; i < MAX_IMAGE_CLIENTS; i++) {
+	 client_info_t *cinfo = image_client[i];
 
-   /*
-    * Start the capture of the exposure and sleep until the exposure is done
-    */
-   mtx.lock();
-   serv_info->frame_count = 0;
-   memset(serv_info->stack_data, 0, 
-	  serv_info->width * serv_info->height * sizeof(int));
-   serv_info->exp_start_ts = getClockTime();
-   stop_ts = getClockTime() + serv_info->etime;
-   mtx.unlock();
-   do {
-      usleep(100);
+	 if ((cinfo == NULL) || (cinfo->image_wanted != IMAGE_EXPOSING)) {
+	    continue;
+	 }
+	 if (!ok) {
+	    strcpy(cinfo->reply, reply);
+	 }
+	 else {
+	    deliverImage(cinfo);
+	 }
+	 cinfo->image_wanted = IMAGE_NONE;
+	 image_client[i] = NULL;
+      }
+      if (serv_info->exposure_subscribed) {
+	 if (!ok) {
+	    cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		      "(%s:%d) no image for the subscribers: %s",
+		      __FILE__, __LINE__, reply);
+	    serv_info->subscribe_retry_ts = getClockTime() + SUBSCRIBE_RETRY;
+	 }
+	 else {
+	    serveSubscribers();
+	 }
+      }
 
       /*
-       * Handle an exception case where the exposure is timing out
+       * Keep the image for clients that missed it, but not the exposures
+       * of a master
        */
-      if ((serv_info->frame_count == 0) && 
-	  (serv_info->exp_start_ts + EXPOSE_TIMEOUT < getClockTime())) {
-	 cfht_logv(CFHT_MAIN, CFHT_ERROR,
-		   "(%s:%d) exposure timeout without receiving any frames"
-		   " from the camera", __FILE__, __LINE__);
-	 sprintf(buffer, "%c %s \"Exposure timeout\"", FAIL_CHAR, IMAGE_CMD);
-	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
-		   "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
-	 close(fd);
-	 return;
+      if (ok && !serv_info->exposure_calib) {
+	 archiveImage();
       }
-   } while ((getClockTime() < stop_ts) || (serv_info->frame_count == 0));
 
-   /*
-    * After the sleep a stacked image should be available.  Create a FITS
-    * image from the pixel data and save it in the file
-    */
-   if (writeFITSImage(cinfo, fd) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_ERROR,
-		"(%s:%d) unable to create FITS file", __FILE__, __LINE__);
-      sprintf(buffer, "%c %s \"Unable to save temporary file on the guide"
-	      " server\"", FAIL_CHAR, IMAGE_CMD);
+      /*
+       * Reset the exposure start time.  This will reset the stacking of
+       * images
+       */
+      serv_info->exp_start_ts = 0;
+   }
+
+   startNextExposure(reply);
+   if (!serv_info->exposing) {
+      watchSky();
+   }
+   if (!serv_info->exposing && (waiting || (serv_info->bulk_sends > 0))) {
+      waitEvents(EXPOSURE_POLL_INTERVAL, commands);
+   }
+}
+
+
+/*
+ * Queue a client up for an image.  The exposure is started right away
+ * unless one is already under way, in which case the client gets the
+ * next one.  Either way the image is announced with the usual reply once
+ * it has been stacked.  With 'async' set (IMAGE ASYNC) the request is
+ * acknowledged at once and the reply follows on its own, like the images
+ * of a SEQUENCE; otherwise that reply is the answer to the request.
+ */
+static void
+takeImage(client_info_t *cinfo, char *buffer, int async)
+{
+   int i;
+
+   if (cinfo->subscribed || (cinfo->image_wanted != IMAGE_NONE) ||
+       (cinfo->seq_remaining != 0) || (cinfo == calib_client) ||
+       (cinfo->fetch_next < cinfo->fetch_end) || 
+       (cinfo->reply[0] != '\0')) {
+      sprintf(buffer, "%c %s \"An image is already on its way\"", 
+	      FAIL_CHAR, IMAGE_CMD);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+   for (i = 0; (i < MAX_IMAGE_CLIENTS) && (image_client[i] != NULL); i++) {
+   }
+   if (i == MAX_IMAGE_CLIENTS) {
+      sprintf(buffer, "%c %s \"Too many clients waiting for an image\"", 
+	      FAIL_CHAR, IMAGE_CMD);
       cfht_logv(CFHT_MAIN, CFHT_DEBUG,
 		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
-      close(fd);
-      serv_info->exp_start_ts = 0;
       return;
    }
 
    /*
-    * Reset the exposure start time.  This will reset the stacking of images
+    * Pick up the data connection if the client negotiated a bulk transfer.
+    * If it doesn't show up the image goes out through the chunked path.
     */
-   serv_info->exp_start_ts = 0;
+   if ((cinfo->bulk_token != 0) && (cinfo->data_fd == -1)) {
+      claimDataConnection(cinfo);
+   }
 
-   /*
-    * Take the FITS image that was written to disk and determine the size of
-    * it.
-    */
-   if (fstat(fd, &file_stat) == -1) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		"(%s:%d) unable to retrieve the size of the temporary FITS"
-		" file", __FILE__, __LINE__);
-      sprintf(buffer, "%c %s \"Unable to save temporary file on the guide"
-	      " server\"", FAIL_CHAR, IMAGE_CMD);
+   image_client[i] = cinfo;
+   cinfo->image_wanted = IMAGE_QUEUED;
+   if (!serv_info->exposing && (startNextExposure(buffer) != PASS)) {
+      cinfo->reply[0] = '\0';
       cfht_logv(CFHT_MAIN, CFHT_DEBUG,
 		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
-      close(fd);
       return;
    }
 
-   /*
-    * Copy the image data to the client structure
-    */
-   cinfo->image_data = (unsigned char *)cli_malloc(file_stat.st_size);
-   read_count = 0;
-   lseek(fd, 0, SEEK_SET);
-   while (read_count < file_stat.st_size) {
-      count = read(fd, cinfo->image_data + read_count,
-		   file_stat.st_size - read_count);
-      if (count < 0) {
-	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		   "(%s:%d) unable to retrieve FITS image data from tmpfs"
-		   " file.  %s (errno=%d)", __FILE__, __LINE__,
-		   strerror(errno), errno);
-	 sprintf(buffer, "%c %s \"Unable to retrieve FITS image data"
-		 " from tmpfs\"", FAIL_CHAR, IMAGE_CMD);
-	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
-		   "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
-	 close(fd);
-	 return;
-      }
-      read_count += count;
+   if (async) {
+      sprintf(buffer, "%c %s %s", PASS_CHAR, IMAGE_CMD, IMAGE_ASYNC_STRING);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
    }
 
    /*
-    * Set up the flags to trigger data being sent
+    * The clients that send a plain IMAGE expect nothing but the reply
+    * announcing the image.  sockserv answers a command as soon as it has
+    * been handled and an empty answer closes the connection, so for them
+    * the exposures are served from here, and other commands wait, until
+    * the image has been stacked.
     */
-   cinfo->send_data = 1;
-   cinfo->data_count = 0;
-   cinfo->total_count = file_stat.st_size;
+   while (cinfo->image_wanted != IMAGE_NONE) {
+      serveExposures(FALSE);
+   }
 
-   /*
-    * If we made it this far, send back a response with the number of bytes
-    * of binary data that can be expected to be received from the server.
-    */
-   sprintf(buffer, "%c %ld", PASS_CHAR, file_stat.st_size);
-   close(fd);
+   strcpy(buffer, cinfo->reply);
+   cinfo->reply[0] = '\0';
+}
 
-   return;
+
+/*
+ * Report the progress of the exposure under way, if any: how long it has
+ * been going, the frames stacked so far and how many clients are waiting
+ * for an image
+ */
+static void
+reportStatus(char *buffer)
+{
+   int waiting = 0;
+   int i;
+
+   for (i = 0; i < MAX_IMAGE_CLIENTS; i++) {
+      if (image_client[i] != NULL) {
+	 waiting++;
+      }
+   }
+   if (serv_info->exposing) {
+      sprintf(buffer, "%c %s EXPOSING elapsed=%.3f etime=%.3f frames=%u"
+	      " waiting=%d", PASS_CHAR, STATUS_CMD, 
+	      getClockTime() - serv_info->exp_start_ts, 
+	      serv_info->exp_stop_ts - serv_info->exp_start_ts,
+	      serv_info->frame_count, waiting);
+   }
+   else {
+      sprintf(buffer, "%c %s IDLE etime=%.3f", PASS_CHAR, STATUS_CMD,
+	      serv_info->etime);
+   }
+   if (serv_info->calib_kind != CALIB_NONE) {
+      sprintf(buffer + strlen(buffer), " %s=%d/%d",
+	      (serv_info->calib_kind == CALIB_DARK) ? "dark" : "flat",
+	      serv_info->calib_count, 
+	      serv_info->calib_count + serv_info->calib_remaining);
+   }
+   cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	     "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
 }
 
 
+
 /*
  * Handle a new client connection
  */
@@ -887,6 +5482,8 @@ client_add(unsigned char remote_ip[4])
    cinfo = (client_info_t *)cli_malloc(sizeof(*cinfo));
    memset(cinfo, 0, sizeof(client_info_t));
    memcpy(cinfo->remote_ip, remote_ip, sizeof (cinfo->remote_ip));
+   cinfo->image_fd = -1;
+   cinfo->data_fd = -1;
 
    /* 
     * Determine the hostname from the IP address 
@@ -913,6 +5510,11 @@ client_add(unsigned char remote_ip[4])
     */
    appendDataToList(cinfo, serv_info->client_list, cli_malloc);
 
+   /*
+    * Have its commands wake the server loop
+    */
+   adoptCommandSockets(remote_ip);
+
    return cinfo;
 }
 
@@ -928,12 +5530,19 @@ client_del(void *client, char *buffer)
    /*
     * Free up the memory allocated by the client
     */
+   unsubscribe(cinfo);
+   dropImageRequest(cinfo);
+   if (calib_client == cinfo) {
+      calib_client = NULL;
+   }
    if (cinfo->hostname != NULL) {
       free(cinfo->hostname);
    }
-   if (cinfo->image_data != NULL) {
-      free(cinfo->image_data);
+   releaseImageData(cinfo);
+   if (cinfo->image_fd != -1) {
+      close(cinfo->image_fd);
    }
+   closeDataConnection(cinfo);
    free(cinfo);
 }
 
@@ -950,6 +5559,8 @@ client_recv(void *client, char *buffer)
    char *buf_p;
    char *p;
 
+   serv_info->commands++;
+
    /* 
     * Advance past the command for argument parsing purposes.
     */
@@ -977,7 +5588,31 @@ client_recv(void *client, char *buffer)
        * Handle an image request from the client
        */
       if (!strcasecmp(buf_p, IMAGE_CMD)) {
-	 takeImage((client_info_t *)cinfo, buffer);
+	 takeImage((client_info_t *)cinfo, buffer, FALSE);
+	 return;
+      }
+
+      /*
+       * Handle a request to send images over a bulk data connection
+       */
+      if (!strcasecmp(buf_p, BULK_CMD)) {
+	 negotiateBulk(cinfo, buffer);
+	 return;
+      }
+
+      /*
+       * Handle a request to be sent every image as it is taken
+       */
+      if (!strcasecmp(buf_p, SUBSCRIBE_CMD)) {
+	 subscribe(cinfo, buffer);
+	 return;
+      }
+
+      /*
+       * Handle a request for the progress of the exposure
+       */
+      if (!strcasecmp(buf_p, STATUS_CMD)) {
+	 reportStatus(buffer);
 	 return;
       }
 
@@ -1004,6 +5639,52 @@ client_recv(void *client, char *buffer)
 	 return;
       }
 
+      /*
+       * Handle commands that were received without parameters specified.
+       */
+      if (!strcasecmp(buf_p, STACK_CMD)) {
+	 sprintf(buffer, "%c %s \"Argument not specified\"", 
+		 FAIL_CHAR, STACK_CMD);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		   "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+
+      /*
+       * Handle commands that were received without parameters specified.
+       */
+      if (!strcasecmp(buf_p, SEQUENCE_CMD)) {
+	 sprintf(buffer, "%c %s \"Argument not specified\"", 
+		 FAIL_CHAR, SEQUENCE_CMD);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		   "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+
+      /*
+       * Handle commands that were received without parameters specified.
+       */
+      if (!strcasecmp(buf_p, COMPRESS_CMD)) {
+	 sprintf(buffer, "%c %s \"Argument not specified\"", 
+		 FAIL_CHAR, COMPRESS_CMD);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		   "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+
+      /*
+       * Handle commands that were received without parameters specified.
+       */
+      if (!strcasecmp(buf_p, DARK_CMD) || !strcasecmp(buf_p, FLAT_CMD) ||
+	  !strcasecmp(buf_p, CALIBRATE_CMD) || !strcasecmp(buf_p, DIFF_CMD) ||
+	  !strcasecmp(buf_p, FETCH_CMD)) {
+	 sprintf(buffer, "%c %s \"Argument not specified\"", 
+		 FAIL_CHAR, buf_p);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		   "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+
       /*
        * If we made it this far, this is an unrecognized command request
        * from the client which doesn't have parameters.
@@ -1027,6 +5708,22 @@ client_recv(void *client, char *buffer)
    }
    cargv = cli_argv_quoted(&cargc, ++p);
 
+   /*
+    * Handle an image request that is acknowledged at once, with the image
+    * announced once it has been stacked
+    */
+   if (!strcasecmp(buf_p, IMAGE_CMD)) {
+      if ((cargc != 1) || strcasecmp(cargv[0], IMAGE_ASYNC_STRING)) {
+	 sprintf(buffer, "%c %s \"Invalid argument specified\"", 
+		 FAIL_CHAR, IMAGE_CMD);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		   "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+      takeImage(cinfo, buffer, TRUE);
+      return;
+   }
+
    /*
     * Handle an exposure time request from a client
     */
@@ -1045,92 +5742,359 @@ client_recv(void *client, char *buffer)
 	 return;
       }
 
-      /*
-       * Make sure the exposure time is valid
-       */
-      errno = 0;
-      etime = strtod(cargv[0], &stop_at);
-      
-      /* Make sure the exposure time is valid */
-      if ((errno == ERANGE) || (errno == EINVAL) || (*stop_at != '\0')) {
+      /*
+       * Make sure the exposure time is valid
+       */
+      errno = 0;
+      etime = strtod(cargv[0], &stop_at);
+      
+      /* Make sure the exposure time is valid */
+      if ((errno == ERANGE) || (errno == EINVAL) || (*stop_at != '\0')) {
+	 sprintf(buffer, "%c %s \"Invalid argument specified\"", 
+		 FAIL_CHAR, ETIME_CMD);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		   "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+      if (etime < MIN_ETIME || etime > MAX_ETIME) {
+	 sprintf(buffer, "%c %s \"Invalid exposure time specified\"", 
+		 FAIL_CHAR, ETIME_CMD);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		   "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+
+      /*
+       * Reset the exposure time fields.  An exposure under way keeps the
+       * exposure time it was started with.
+       */
+      serv_info->etime = etime;
+      if (!serv_info->exposing) {
+	 serv_info->frame_count = 0;
+	 serv_info->exp_start_ts = 0;
+      }
+      releaseImageData(cinfo);
+      pthread_mutex_lock(&ss_lock);
+      if (ssPutPrintf(SS_ETIME, "%.3f", serv_info->etime) != PASS) {
+	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		   "(%s:%d) ssPutPrintf of %s with %.3f failed: %s",
+		   __FILE__, __LINE__, SS_ETIME, serv_info->etime, 
+		   ssGetStrError());
+      }
+      pthread_mutex_unlock(&ss_lock);
+
+      sprintf(buffer, "%c %s", PASS_CHAR, ETIME_CMD);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+
+   /*
+    * Handle a gain request from a client
+    */
+   if (!strcasecmp(buf_p, GAIN_CMD)) {
+
+      /*
+       * Make sure that an argument was specified
+       */
+      if (cargc != 1) {
+	 sprintf(buffer, "%c %s \"Invalid argument specified\"", 
+		 FAIL_CHAR, GAIN_CMD);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		   "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+
+      /*
+       * Set the gain depending upon the argument specified
+       */
+      if (!strcasecmp(cargv[0], GAIN_AUTO_STRING)) {
+	 serv_info->gain = GAIN_AUTO;
+      } else if (!strcasecmp(cargv[0], GAIN_HIGH_STRING)) {
+	 serv_info->gain = GAIN_HIGH;
+      } else if (!strcasecmp(cargv[0], GAIN_LOW_STRING)) {
+	 serv_info->gain = GAIN_LOW;
+      } else if (!strcasecmp(cargv[0], GAIN_MANUAL_STRING)) {
+	 serv_info->gain = GAIN_MANUAL;
+      }
+      else {
+	 sprintf(buffer, "%c %s \"Invalid gain argument specified\"", 
+		 FAIL_CHAR, GAIN_CMD);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		   "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+
+      /*
+       * Apply the new gain.  The references of the differential mode are
+       * in the counts of the old one.
+       */
+      applyGain(serv_info->gain);
+      resetDifference();
+      sprintf(buffer, "%c %s", PASS_CHAR, GAIN_CMD);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+
+   /*
+    * Handle a stacking mode request from a client
+    */
+   if (!strcasecmp(buf_p, STACK_CMD)) {
+      stack_mode_t stack_mode;
+
+      /*
+       * Make sure that an argument was specified
+       */
+      if (cargc != 1) {
+	 sprintf(buffer, "%c %s \"Invalid argument specified\"", 
+		 FAIL_CHAR, STACK_CMD);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		   "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+
+      /*
+       * Set the stacking mode depending upon the argument specified
+       */
+      if (!strcasecmp(cargv[0], STACK_SUM_STRING)) {
+	 stack_mode = STACK_SUM;
+      } else if (!strcasecmp(cargv[0], STACK_MEAN_STRING)) {
+	 stack_mode = STACK_MEAN;
+      } else if (!strcasecmp(cargv[0], STACK_CLIP_STRING)) {
+	 stack_mode = STACK_CLIP;
+      }
+      else {
+	 sprintf(buffer, "%c %s \"Invalid stack argument specified\"", 
+		 FAIL_CHAR, STACK_CMD);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		   "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+
+      /*
+       * Switching modes throws away whatever has been stacked so far,
+       * so it has to wait for the exposure under way
+       */
+      if (serv_info->exposing) {
+	 sprintf(buffer, "%c %s \"An exposure is in progress\"", 
+		 FAIL_CHAR, STACK_CMD);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		   "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+      serv_info->stack_mode = stack_mode;
+      resetStack();
+      applyStackMode(serv_info->stack_mode);
+
+      sprintf(buffer, "%c %s", PASS_CHAR, STACK_CMD);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+
+   /*
+    * Handle a request from a client to change how its images are sent
+    */
+   if (!strcasecmp(buf_p, COMPRESS_CMD)) {
+
+      /*
+       * Make sure that an argument was specified
+       */
+      if (cargc != 1) {
+	 sprintf(buffer, "%c %s \"Invalid argument specified\"", 
+		 FAIL_CHAR, COMPRESS_CMD);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		   "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+
+      /*
+       * Rice tile compression or plain FITS for this client only
+       */
+      if (!strcasecmp(cargv[0], COMPRESS_RICE_STRING)) {
+	 cinfo->compress = TRUE;
+      } else if (!strcasecmp(cargv[0], COMPRESS_NONE_STRING)) {
+	 cinfo->compress = FALSE;
+      }
+      else {
+	 sprintf(buffer, "%c %s \"Invalid compress argument specified\"", 
+		 FAIL_CHAR, COMPRESS_CMD);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		   "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+
+      sprintf(buffer, "%c %s %s", PASS_CHAR, COMPRESS_CMD, 
+	      cinfo->compress ? COMPRESS_RICE_STRING : COMPRESS_NONE_STRING);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+
+   /*
+    * Handle a request for a sequence of images: the number of images and
+    * optionally the seconds between them
+    */
+   if (!strcasecmp(buf_p, SEQUENCE_CMD)) {
+      char *stop_at = NULL;   /* Location at which strtol may stop */
+      double interval = 0;
+      long nimages;
+
+      if ((cargc < 1) || (cargc > 2)) {
+	 sprintf(buffer, "%c %s \"Invalid argument specified\"", 
+		 FAIL_CHAR, SEQUENCE_CMD);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		   "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+      nimages = strtol(cargv[0], &stop_at, 10);
+      if ((*stop_at == '\0') && (cargc == 2)) {
+	 interval = strtod(cargv[1], &stop_at);
+      }
+      if (*stop_at != '\0') {
+	 sprintf(buffer, "%c %s \"Invalid argument specified\"", 
+		 FAIL_CHAR, SEQUENCE_CMD);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		   "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+      startSequence(cinfo, buffer, (int)nimages, interval);
+      return;
+   }
+
+   /*
+    * Handle a request for the archived images taken since a given time
+    */
+   if (!strcasecmp(buf_p, FETCH_CMD)) {
+      char *stop_at = NULL;   /* Location at which strtod may stop */
+      double since = 0;
+
+      if ((cargc == 1) && !strncasecmp(cargv[0], FETCH_SINCE_ARG, 
+				       strlen(FETCH_SINCE_ARG))) {
+	 since = strtod(cargv[0] + strlen(FETCH_SINCE_ARG), &stop_at);
+      }
+      if ((stop_at == NULL) || (stop_at == cargv[0] + strlen(FETCH_SINCE_ARG))
+	  || (*stop_at != '\0')) {
+	 sprintf(buffer, "%c %s \"Invalid argument specified\"", 
+		 FAIL_CHAR, FETCH_CMD);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		   "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+      startFetch(cinfo, buffer, since);
+      return;
+   }
+
+   /*
+    * Handle a request to build a master dark or flat out of the given
+    * number of exposures
+    */
+   if (!strcasecmp(buf_p, DARK_CMD) || !strcasecmp(buf_p, FLAT_CMD)) {
+      char *stop_at = NULL;   /* Location at which strtol may stop */
+      calib_kind_t kind = strcasecmp(buf_p, DARK_CMD) ? 
+	 CALIB_FLAT : CALIB_DARK;
+      long nframes;
+
+      if (cargc != 1) {
 	 sprintf(buffer, "%c %s \"Invalid argument specified\"", 
-		 FAIL_CHAR, ETIME_CMD);
+		 FAIL_CHAR, buf_p);
 	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
 		   "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
 	 return;
       }
-      if (etime < MIN_ETIME || etime > MAX_ETIME) {
-	 sprintf(buffer, "%c %s \"Invalid exposure time specified\"", 
-		 FAIL_CHAR, ETIME_CMD);
+      nframes = strtol(cargv[0], &stop_at, 10);
+      if (*stop_at != '\0') {
+	 sprintf(buffer, "%c %s \"Invalid argument specified\"", 
+		 FAIL_CHAR, buf_p);
 	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
 		   "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
 	 return;
       }
+      startCalibration(cinfo, buffer, kind, (int)nframes);
+      return;
+   }
+
+   /*
+    * Handle a request to dark and flat correct the images with the
+    * masters for the gain mode they are taken in.  Unlike compression
+    * this is done to the stack, so it holds for every client.
+    */
+   if (!strcasecmp(buf_p, CALIBRATE_CMD)) {
 
       /*
-       * Reset the exposure time fields
+       * Make sure that an argument was specified
        */
-      serv_info->etime = etime;
-      serv_info->frame_count = 0;
-      serv_info->exp_start_ts = 0;
-      if (cinfo->image_data != NULL) {
-	 free(cinfo->image_data);
-	 cinfo->image_data = NULL;
+      if (cargc != 1) {
+	 sprintf(buffer, "%c %s \"Invalid argument specified\"", 
+		 FAIL_CHAR, CALIBRATE_CMD);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		   "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
       }
-      if (ssPutPrintf(SS_ETIME, "%.3f", serv_info->etime) != PASS) {
-	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		   "(%s:%d) ssPutPrintf of %s with %.3f failed: %s",
-		   __FILE__, __LINE__, SS_ETIME, serv_info->etime, 
-		   ssGetStrError());
+      if (!strcasecmp(cargv[0], CALIBRATE_ON_STRING)) {
+	 serv_info->calibrate = TRUE;
+      } else if (!strcasecmp(cargv[0], CALIBRATE_OFF_STRING)) {
+	 serv_info->calibrate = FALSE;
+      }
+      else {
+	 sprintf(buffer, "%c %s \"Invalid calibrate argument specified\"", 
+		 FAIL_CHAR, CALIBRATE_CMD);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		   "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
       }
 
-      sprintf(buffer, "%c %s", PASS_CHAR, ETIME_CMD);
+      sprintf(buffer, "%c %s %s", PASS_CHAR, CALIBRATE_CMD, 
+	      serv_info->calibrate ? CALIBRATE_ON_STRING : 
+	      CALIBRATE_OFF_STRING);
       cfht_logv(CFHT_MAIN, CFHT_DEBUG,
 		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
       return;
    }
 
    /*
-    * Handle a gain request from a client
+    * Handle a request for the differential mode, where each image is the
+    * difference against the previous exposure or against the running
+    * median of the frames.  Like calibration this is done to the stack,
+    * so it holds for every client.
     */
-   if (!strcasecmp(buf_p, GAIN_CMD)) {
+   if (!strcasecmp(buf_p, DIFF_CMD)) {
+      static const char *diff_string[] = {
+	 DIFF_OFF_STRING, DIFF_PREVIOUS_STRING, DIFF_MEDIAN_STRING
+      };
 
       /*
        * Make sure that an argument was specified
        */
       if (cargc != 1) {
 	 sprintf(buffer, "%c %s \"Invalid argument specified\"", 
-		 FAIL_CHAR, GAIN_CMD);
+		 FAIL_CHAR, DIFF_CMD);
 	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
 		   "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
 	 return;
       }
-
-      /*
-       * Set the gain depending upon the argument specified
-       */
-      if (!strcasecmp(cargv[0], GAIN_AUTO_STRING)) {
-	 serv_info->gain = GAIN_AUTO;
-      } else if (!strcasecmp(cargv[0], GAIN_HIGH_STRING)) {
-	 serv_info->gain = GAIN_HIGH;
-      } else if (!strcasecmp(cargv[0], GAIN_LOW_STRING)) {
-	 serv_info->gain = GAIN_LOW;
-      } else if (!strcasecmp(cargv[0], GAIN_MANUAL_STRING)) {
-	 serv_info->gain = GAIN_MANUAL;
+      if (!strcasecmp(cargv[0], DIFF_OFF_STRING)) {
+	 serv_info->diff_mode = DIFF_OFF;
+      } else if (!strcasecmp(cargv[0], DIFF_PREVIOUS_STRING)) {
+	 serv_info->diff_mode = DIFF_PREVIOUS;
+      } else if (!strcasecmp(cargv[0], DIFF_MEDIAN_STRING)) {
+	 serv_info->diff_mode = DIFF_MEDIAN;
       }
       else {
-	 sprintf(buffer, "%c %s \"Invalid gain argument specified\"", 
-		 FAIL_CHAR, GAIN_CMD);
+	 sprintf(buffer, "%c %s \"Invalid diff argument specified\"", 
+		 FAIL_CHAR, DIFF_CMD);
 	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
 		   "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
 	 return;
       }
 
       /*
-       * Apply the new gain
+       * Start over with new references
        */
-      applyGain(serv_info->gain);
-      sprintf(buffer, "%c %s", PASS_CHAR, GAIN_CMD);
+      resetDifference();
+      sprintf(buffer, "%c %s %s", PASS_CHAR, DIFF_CMD, 
+	      diff_string[serv_info->diff_mode]);
       cfht_logv(CFHT_MAIN, CFHT_DEBUG,
 		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
       return;
@@ -1144,6 +6108,7 @@ client_recv(void *client, char *buffer)
    cfht_logv(CFHT_MAIN, CFHT_DEBUG,
 	     "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
 }
+#endif
 
 
 /*
@@ -1154,6 +6119,26 @@ client_send_binary(void *client, char *buffer, int *len)
 {
    client_info_t *cinfo = (client_info_t *)client;
 
+   /*
+    * The images of a FETCH are queued up one at a time, once the one
+    * before has gone out
+    */
+   if ((cinfo->fetch_next < cinfo->fetch_end) && !cinfo->send_data &&
+       (cinfo->reply[0] == '\0')) {
+      sendFetchedImage(cinfo);
+   }
+
+   /*
+    * A reply held back until an exposure was done goes out first, ahead
+    * of the image data it announces
+    */
+   if (cinfo->reply[0] != '\0') {
+      sprintf(buffer, "%s\n", cinfo->reply);
+      *len = strlen(buffer);
+      cinfo->reply[0] = '\0';
+      return;
+   }
+
    /*
     * Check whether this client has any data to be sent.
     */
@@ -1161,6 +6146,24 @@ client_send_binary(void *client, char *buffer, int *len)
 
       int send_count;
 
+      /*
+       * With a bulk data connection the image goes out on it a part at a
+       * time, and nothing is passed back through the sockserv buffer
+       */
+      if (cinfo->data_fd != -1) {
+	 *len = 0;
+	 if ((sendImageBulk(cinfo) == PASS) && 
+	     (cinfo->data_count < cinfo->total_count)) {
+	    return;
+	 }
+	 cinfo->send_data = 0;
+	 cinfo->data_count = 0;
+	 releaseImageData(cinfo);
+	 recordStage(STAGE_SEND, getClockTime() - cinfo->send_start_ts);
+	 publishStats();
+	 return;
+      }
+
       /* 
        * If all the data has been sent, send out a final summary 
        */
@@ -1168,10 +6171,9 @@ client_send_binary(void *client, char *buffer, int *len)
 	 *len = 0;
 	 cinfo->send_data = 0;
 	 cinfo->data_count = 0;
-	 if (cinfo->image_data != NULL) {
-	    free(cinfo->image_data);
-	    cinfo->image_data = NULL;
-	 }
+	 releaseImageData(cinfo);
+	 recordStage(STAGE_SEND, getClockTime() - cinfo->send_start_ts);
+	 publishStats();
 	 return;
       }
 
@@ -1189,6 +6191,25 @@ client_send_binary(void *client, char *buffer, int *len)
 }
 
 
+#ifndef BENCHMARK
+/*
+ * Block the termination signals in the calling thread, keeping the mask
+ * it had in 'saved'.  Worker threads are started with them blocked, so a
+ * signal is only ever taken by the server loop and never interrupts a
+ * thread holding ss_lock.
+ */
+static void
+blockSignals(sigset_t *saved) {
+
+   sigset_t signals;
+
+   sigemptyset(&signals);
+   sigaddset(&signals, SIGTERM);
+   sigaddset(&signals, SIGINT);
+   pthread_sigmask(SIG_BLOCK, &signals, saved);
+}
+
+
 /*
  * Handle a cleanup of the socket resources and make sure the shutter is 
  * closed.
@@ -1196,17 +6217,48 @@ client_send_binary(void *client, char *buffer, int *len)
 static void
 cleanup(void) {
 
+   static std::atomic_flag cleaned = ATOMIC_FLAG_INIT;
+   PASSFAIL rc;
+   int tries;
+
+   /*
+    * Only clean up once.  exit() runs this again through atexit(), and a
+    * signal may come in while it is already under way.
+    */
+   if (cleaned.test_and_set()) {
+      return;
+   }
+
    cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
 	     "(%s:%d) cleanup()", __FILE__, __LINE__);
 
    /*
-    * Mark the server as no longer running
+    * Mark the server as no longer running.  A Status Server call under way
+    * in another thread is given a moment to finish, but the lock is never
+    * waited on for good, and it is let go before exiting.
     */
-   if (ssPutBoolean(SS_SERVER_RUNNING, FALSE) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_ERROR,
-		"(%s:%d) ssPutBoolean on %s failed: %s",
-		__FILE__, __LINE__, SS_SERVER_RUNNING, ssGetStrError());
-      exit(EXIT_FAILURE);
+   for (tries = 0; tries < CLEANUP_LOCK_TRIES; tries++) {
+      if (pthread_mutex_trylock(&ss_lock) == 0) {
+	 break;
+      }
+      usleep(CLEANUP_LOCK_WAIT);
+   }
+   if (tries == CLEANUP_LOCK_TRIES) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+		"(%s:%d) Status Server busy, %s left as it is",
+		__FILE__, __LINE__, SS_SERVER_RUNNING);
+   }
+   else {
+      rc = ssPutBoolean(SS_SERVER_RUNNING, FALSE);
+      if (rc != PASS) {
+	 cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		   "(%s:%d) ssPutBoolean on %s failed: %s",
+		   __FILE__, __LINE__, SS_SERVER_RUNNING, ssGetStrError());
+      }
+      pthread_mutex_unlock(&ss_lock);
+      if (rc != PASS) {
+	 exit(EXIT_FAILURE);
+      }
    }
    
    /*
@@ -1216,16 +6268,262 @@ cleanup(void) {
       sockserv_destroy(serv_info->tau_serv);
       serv_info->tau_serv = NULL;
    }
+   if (serv_info->data_listen_fd != -1) {
+      close(serv_info->data_listen_fd);
+      serv_info->data_listen_fd = -1;
+   }
+   if (frame_ring.event_fd != -1) {
+      close(frame_ring.event_fd);
+      frame_ring.event_fd = -1;
+   }
+   if (frame_ring.wake_fd != -1) {
+      close(frame_ring.wake_fd);
+      frame_ring.wake_fd = -1;
+   }
+
+   exit(EXIT_SUCCESS);
+}
+#endif
+
+
+#ifdef BENCHMARK
+
+#define BENCH_LOOPS 50 /* Frames timed for each background estimator */
+#define BENCH_STACK_FRAMES 30 /* Frames stacked into each benchmark image */
+#define BENCH_IMAGES 10 /* Images encoded and sent for each benchmark */
+
+/*
+ * Get a monotonic timestamp for timing the benchmarks
+ */
+static double
+benchClockTime(void) {
+
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (double)(ts.tv_sec + ts.tv_nsec / 1000000000.0);
+}
+
+
+/*
+ * Time medianCalculation(), including the copy it needs to keep the frame
+ * intact, against pixelMedian() on one frame size.
+ */
+static void
+benchMedian(const char *name, unsigned int width, unsigned int height, 
+	    int bits, unsigned int m)
+{
+   unsigned short *frame, *frame_copy;
+   unsigned short select_median = 0, hist_median = 0;
+   unsigned int n = width * height;
+   double start, select_time, hist_time;
+   int i;
+
+   frame = (unsigned short *)cli_malloc(n * sizeof(unsigned short));
+   frame_copy = (unsigned short *)cli_malloc(n * sizeof(unsigned short));
+   fillSyntheticFrame(frame, width, height, bits, 1);
+
+   start = benchClockTime();
+   for (i = 0; i < BENCH_LOOPS; i++) {
+      memcpy(frame_copy, frame, n * sizeof(unsigned short));
+      select_median = medianCalculation(frame_copy, n, m);
+   }
+   select_time = (benchClockTime() - start) / BENCH_LOOPS;
+
+   start = benchClockTime();
+   for (i = 0; i < BENCH_LOOPS; i++) {
+      hist_median = pixelMedian(frame, n, m);
+   }
+   hist_time = (benchClockTime() - start) / BENCH_LOOPS;
+
+   printf("%-6s %4ux%-4u m=%u  select %8.3f ms  histogram %8.3f ms  "
+	  "(%.1fx) median %u/%u%s\n", name, width, height, m,
+	  select_time * 1000.0, hist_time * 1000.0, select_time / hist_time,
+	  select_median, hist_median, 
+	  (select_median == hist_median) ? "" : " MISMATCH");
+
+   free(frame);
+   free(frame_copy);
+}
+
+
+/*
+ * Set up the stack for synthetic frames of one size, the way the first
+ * frame from the camera does
+ */
+static void
+benchSetFrameSize(unsigned int width, unsigned int height)
+{
+   serv_info->width = 0;
+   frame_ring.width = width;
+   frame_ring.height = height;
+}
+
+
+/*
+ * Time the stack loop, background median included, for one frame size
+ * and stacking mode
+ */
+static void
+benchStack(const char *name, unsigned int width, unsigned int height, 
+	   stack_mode_t stack_mode)
+{
+   unsigned short *frames[MOCK_FRAMES];
+   double start, frame_time;
+   int i;
+
+   benchSetFrameSize(width, height);
+   for (i = 0; i < MOCK_FRAMES; i++) {
+      frames[i] = (unsigned short *)
+	 cli_malloc(width * height * sizeof(unsigned short));
+      fillSyntheticFrame(frames[i], width, height, MOCK_BITS, i + 1);
+   }
+
+   serv_info->stack_mode = stack_mode;
+   resetStack();
+   start = benchClockTime();
+   for (i = 0; i < BENCH_STACK_FRAMES; i++) {
+      stackFrame(frames[i % MOCK_FRAMES]);
+   }
+   frame_time = (benchClockTime() - start) / BENCH_STACK_FRAMES;
+
+   printf("%-6s %4ux%-4u stack %-4s %8.3f ms/frame  %8.1f frames/s\n",
+	  name, width, height, 
+	  (stack_mode == STACK_CLIP) ? STACK_CLIP_STRING : STACK_SUM_STRING,
+	  frame_time * 1000.0, 1.0 / frame_time);
+
+   for (i = 0; i < MOCK_FRAMES; i++) {
+      free(frames[i]);
+   }
+}
+
+
+/*
+ * Time writeFITSImage() on a stacked image, then pull the result through
+ * client_send_binary() in SEND_BUF_SIZE pieces the way sockserv does.
+ * The header metadata is read from the Status Server once beforehand.
+ */
+static void
+benchEncode(const char *name, unsigned int width, unsigned int height, 
+	    int compress)
+{
+   client_info_t cinfo;
+   unsigned short *frame;
+   char *buffer;
+   double start, encode_time = 0, send_time = 0;
+   long calls = 0;
+   int len;
+   int fd;
+   int i, j;
+
+   benchSetFrameSize(width, height);
+   frame = (unsigned short *)cli_malloc(width * height * sizeof(unsigned short));
+   fillSyntheticFrame(frame, width, height, MOCK_BITS, 1);
+   buffer = (char *)cli_malloc(SEND_BUF_SIZE);
+   memset(&cinfo, 0, sizeof(cinfo));
+   cinfo.image_fd = -1;
+   cinfo.data_fd = -1;
+   cinfo.compress = compress;
+
+   serv_info->stack_mode = STACK_SUM;
+   for (i = 0; i < BENCH_IMAGES; i++) {
+      resetStack();
+      for (j = 0; j < MOCK_FRAMES; j++) {
+	 stackFrame(frame);
+      }
+      if ((fd = openImageFile(&cinfo)) == -1) {
+	 break;
+      }
+      start = benchClockTime();
+      if (writeFITSImage(fd, cinfo.compress) != PASS) {
+	 break;
+      }
+      encode_time += benchClockTime() - start;
+      if (mapImageFile(&cinfo) != PASS) {
+	 break;
+      }
+
+      cinfo.send_data = 1;
+      cinfo.data_count = 0;
+      cinfo.total_count = cinfo.image_size;
+      start = benchClockTime();
+      while (cinfo.send_data) {
+	 client_send_binary(&cinfo, buffer, &len);
+	 calls++;
+      }
+      send_time += benchClockTime() - start;
+   }
+   if (i == 0) {
+      printf("%-6s %4ux%-4u encode failed\n", name, width, height);
+   }
+   else {
+      printf("%-6s %4ux%-4u encode %-4s %8.3f ms/image  send %8.3f ms/image"
+	     " (%ld calls)  %8.1f images/s\n", name, width, height,
+	     compress ? COMPRESS_RICE_STRING : COMPRESS_NONE_STRING,
+	     encode_time * 1000.0 / i, send_time * 1000.0 / i, calls / i,
+	     i / (encode_time + send_time));
+   }
+
+   releaseImageData(&cinfo);
+   if (cinfo.image_fd != -1) {
+      close(cinfo.image_fd);
+   }
+   free(frame);
+   free(buffer);
+}
 
+
+/*
+ * Micro-benchmarks of the image path.  Build the server with -DBENCHMARK
+ * to run these in place of the server itself.  The end to end benchmark
+ * is imagebench, run against a server built with -DMOCK_CAMERA.
+ */
+int
+main(int argc, const char* argv[])
+{
+   cfht_log(CFHT_MAIN, CFHT_LOG_ID, argv[0]);
+   cli_malloc_retry(TRUE);
+   serv_info = (server_info_t *)cli_malloc(sizeof(server_info_t));
+   memset(serv_info, 0, sizeof(server_info_t));
+   serv_info->data_listen_fd = -1;
+   frame_ring.event_fd = -1;
+   frame_ring.wake_fd = -1;
+   allocateBuffers(3096, 2080);
+
+   benchMedian("Tau", 640, 512, 14, 1);
+   benchMedian("Tau", 640, 512, 14, 4);
+   benchMedian("IMX178", 3096, 2080, 14, 1);
+   benchMedian("IMX178", 3096, 2080, 14, 4);
+
+   benchStack("Tau", 640, 512, STACK_SUM);
+   benchStack("Tau", 640, 512, STACK_CLIP);
+   benchStack("IMX178", 3096, 2080, STACK_SUM);
+   benchStack("IMX178", 3096, 2080, STACK_CLIP);
+
+   if (ssLogon(argv[0]) != PASS) {
+      printf("No Status Server, skipping writeFITSImage and"
+	     " client_send_binary: %s\n", ssGetStrError());
+      exit(EXIT_SUCCESS);
+   }
+   refreshMetadata();
+   benchEncode("Tau", 640, 512, FALSE);
+   benchEncode("Tau", 640, 512, TRUE);
+   benchEncode("IMX178", 3096, 2080, FALSE);
+   benchEncode("IMX178", 3096, 2080, TRUE);
    exit(EXIT_SUCCESS);
 }
 
+#else
 
 int
 main(int argc, const char* argv[])
 {
+   struct epoll_event wake_event;
+   sigset_t saved_signals;
    char hostname[255];
    const char *ip_address;
+   int wait;
+   int i;
 
    /*
     * Set up the environment variable used by the cfht_log system to 
@@ -1264,20 +6562,69 @@ main(int argc, const char* argv[])
     */
    serv_info = (server_info_t *)cli_malloc(sizeof(server_info_t));
    memset(serv_info, 0, sizeof(server_info_t));
+   serv_info->data_listen_fd = -1;
+   frame_ring.event_fd = -1;
+   frame_ring.wake_fd = -1;
    
    /*
     * Create a linked list to hold client entries
     */
    serv_info->client_list = createList(cli_malloc);
 
+   /*
+    * Set up the images shared by the subscribers
+    */
+   for (i = 0; i < 2; i++) {
+      shared_image[i].image_fd = -1;
+      shared_image[i].data_fd = -1;
+      shared_image[i].compress = i;
+   }
+
+   /*
+    * Set up the wakeup for frames handed over by the camera thread
+    */
+   if ((frame_ring.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR, 
+		"(%s:%d) unable to create the frame ring eventfd : %s"
+		" (errno=%d)", __FILE__, __LINE__, strerror(errno), errno);
+      exit(EXIT_FAILURE);
+   }
+   wake_event.events = EPOLLIN;
+   wake_event.data.fd = frame_ring.event_fd;
+   if (((frame_ring.wake_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) ||
+       (epoll_ctl(frame_ring.wake_fd, EPOLL_CTL_ADD, frame_ring.event_fd,
+		  &wake_event) == -1)) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR, 
+		"(%s:%d) unable to set up the server loop wakeups : %s"
+		" (errno=%d)", __FILE__, __LINE__, strerror(errno), errno);
+      exit(EXIT_FAILURE);
+   }
+
+   /*
+    * Start connecting to the camera in the background while the Status
+    * Server is connected to
+    */
+   blockSignals(&saved_signals);
+   if (initCameraConnection() != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR, 
+		"(%s:%d) Unable to establish connection to"
+		" the FLIR Tau camera", __FILE__, __LINE__);
+      exit(EXIT_FAILURE);
+   }
+   pthread_sigmask(SIG_SETMASK, &saved_signals, NULL);
+
    /* 
-    * Connect to the Status Server
+    * Connect to the Status Server, waiting twice as long after each
+    * failure
     */
+   wait = LOGON_RETRY_MIN;
    while (ssLogon(argv[0]) != PASS) {
       cfht_logv(CFHT_MAIN, CFHT_WARN,
 		"(%s:%d): connection to Status Server failed...retry in"
-		" progress: %s", __FILE__, __LINE__, ssGetStrError());
-      sleep(60);
+		" %d seconds: %s", __FILE__, __LINE__, wait, 
+		ssGetStrError());
+      sleep(wait);
+      wait = (wait * 2 < LOGON_RETRY_MAX) ? wait * 2 : LOGON_RETRY_MAX;
    }
 
    /*
@@ -1302,23 +6649,18 @@ main(int argc, const char* argv[])
 		__FILE__, __LINE__, SS_ETIME, serv_info->etime, 
 		ssGetStrError());
    }
-   
+
    /*
-    * Handle termination and interrupt signals
+    * Average the frames of an exposure unless a client asks otherwise
     */
-   cli_signal(SIGTERM, cleanup);
-   cli_signal(SIGINT, cleanup);
+   serv_info->stack_mode = STACK_MEAN;
+   applyStackMode(serv_info->stack_mode);
 
    /*
-    * Try to initialize the camera connection.  If the connection can not
-    * be established, exit.
+    * Handle termination and interrupt signals
     */
-   if (initCameraConnection() != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_ERROR, 
-		"(%s:%d) Unable to establish connection to"
-		" the FLIR Tau camera", __FILE__, __LINE__);
-      exit(EXIT_FAILURE);
-   }
+   cli_signal(SIGTERM, cleanup);
+   cli_signal(SIGINT, cleanup);
 
    /* 
     * Set up the server parameters
@@ -1331,6 +6673,21 @@ main(int argc, const char* argv[])
       exit(EXIT_FAILURE);
    }
 
+   /*
+    * Set up the port for bulk data connections.  Without it clients are
+    * still served through the chunked transfer.
+    */
+   for (int i = 0; i < MAX_PENDING_DATA; i++) {
+      serv_info->pending_data_fd[i] = -1;
+   }
+   if ((serv_info->data_listen_fd 
+	= createDataListener(TAUSERV_DATA_PORT)) == -1) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+		"(%s:%d) bulk data port %s unavailable, only chunked"
+		" transfers will be offered", __FILE__, __LINE__,
+		TAUSERV_DATA_PORT);
+   }
+
    /*
     * Establish the hostname where the server is currently running
     */
@@ -1375,6 +6732,29 @@ main(int argc, const char* argv[])
       exit(EXIT_FAILURE);
    }
 
+   /*
+    * Read the FITS header metadata from the Status Server, and keep it
+    * fresh from here on in the background
+    */
+   blockSignals(&saved_signals);
+   startBME280();
+   startMetadata();
+   pthread_sigmask(SIG_SETMASK, &saved_signals, NULL);
+
+   /*
+    * Make sure there is somewhere to keep the calibration masters
+    */
+   if ((mkdir(CALIB_DIR, 0775) == -1) && (errno != EEXIST)) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+		"(%s:%d) unable to create %s : %s (errno=%d)",
+		__FILE__, __LINE__, CALIB_DIR, strerror(errno), errno);
+   }
+
+   /*
+    * And the archive of the images taken
+    */
+   startArchive();
+
    /* 
     * Cleanup camera and socket resources before exiting 
     */
@@ -1393,17 +6773,22 @@ main(int argc, const char* argv[])
 	     __FILE__, __LINE__);
 
    /* 
-    * Go through a loop processing any commands sent by the client.
+    * Go through a loop processing any commands sent by the client.  While
+    * an exposure is under way or a sequence is about to need one sockserv
+    * is only polled, and the pacing is left to serveExposures().
     */
    for (;;) {
 
       cli_signal_block(SIGTERM);
       cli_signal_block(SIGINT);
 
-      sockserv_run(serv_info->tau_serv, SOCKSERV_IDLE_POLL_INTERVAL);
+      sockserv_run(serv_info->tau_serv, loopTimeout());
+      serveExposures(TRUE);
 
       cli_signal_unblock(SIGTERM);
       cli_signal_unblock(SIGINT);
    }
    exit(EXIT_SUCCESS);
 }
+
+#endif
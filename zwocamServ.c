@@ -10,6 +10,7 @@
  *    listens for client requests to receive images.
  *
  *********************************************************************!*/
+#define _GNU_SOURCE		/* memfd_create() */
 #include <sys/time.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -22,10 +23,26 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <ifaddrs.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/random.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <jpeglib.h>
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
 
 #include "cli/cli.h"
 #include "fh/fh.h"
@@ -39,10 +56,78 @@
 
 #include "ASICamera2.h"
 
+#include "pixelKernels.h"
+
 #define ZWOSERV_PORT "915" /* Port name or number on which to listen */
 #define READOUT_TIMEOUT 15 /* Abort readout if client disappears for 15 sec. */
 #define EXPOSE_TIMEOUT 30   /* Amount beyond etime to wait before timeout */
 #define SEND_BUF_SIZE 5000 /* Number of pixels to send at a time */
+#define ZWOSERV_DATA_PORT "925" /* Port for bulk image data connections */
+#define BULK_SNDBUF (4 * 1024 * 1024) /* Socket send buffer for bulk data */
+#define BULK_CONNECT_TIMEOUT 2 /* Wait for the bulk data connection */
+#define MAX_PENDING_DATA 4 /* Data connections waiting to be claimed */
+#define VIDEO_RING_SLOTS 4 /* Frames kept by the free-running capture */
+#define VIDEO_WAIT_MARGIN 500 /* Extra msec to wait for a video frame */
+#define PIPELINE_BUFFERS 2 /* Exposures read out ahead of the client */
+#define MAX_BIN 4          /* Largest binning factor offered */
+#define MAX_SUBSCRIBERS 8  /* Clients sent every image as it is taken */
+#define SUBSCRIBE_RETRY 1  /* Seconds before exposing again after a failure */
+#define MAX_IMAGE_CLIENTS 16 /* Clients waiting for an image at once */
+#define MAX_SEQUENCES 8    /* Clients taking a sequence of images at once */
+#define EXPOSURE_POLL_INTERVAL 0.005 /* Camera polling during an exposure */
+#define WAKE_EVENTS 16     /* Events collected by one wait of the loop */
+#define REPLY_SIZE 256     /* Reply held back until an exposure is done */
+#define TAU_IMAGE_MAX (1024 * 1024) /* Largest IR image taken by DUALIMAGE */
+#define TAU_SOCKET_TIMEOUT 5 /* Seconds to wait on a Tau server reply */
+#define TAU_IMAGE_TIMEOUT 660 /* Longest Tau exposure, with a margin */
+#define CALIB_DIR "/var/tmp/zwocam-calib" /* Where the masters are kept */
+#define CALIB_PATH_SIZE 256 /* Longest path of a master dark or flat */
+#define MAX_MASTERS 8      /* Master darks and flats kept mapped at once */
+#define MAX_CALIB_FRAMES 1000 /* Most exposures averaged into a master */
+#define CAMERA_CACHE CALIB_DIR "/camera" /* Capabilities of the camera */
+#define CAMERA_CACHE_MAGIC 0x5a574f43 /* Marks a cache laid out as below */
+#define MAX_CONTROLS 64    /* Controls kept in the capabilities cache */
+#define CAMERA_RETRY_MIN 1 /* Seconds before looking for the camera again */
+#define CAMERA_RETRY_MAX 60 /* Longest wait between looks */
+#define CAMERA_MAX_ERRORS 3 /* Failures in a row before reconnecting */
+#define LOGON_RETRY_MIN 1  /* Seconds before retrying the Status Server */
+#define LOGON_RETRY_MAX 60 /* Longest wait between retries */
+#define ARCHIVE_DIR "/dev/shm/zwocam-archive" /* Where the images are kept */
+#define ARCHIVE_DIR_ENV "ZWOCAM_ARCHIVE_DIR" /* Keep them there instead */
+#define ARCHIVE_SEGMENTS_ENV "ZWOCAM_ARCHIVE_SEGMENTS" /* Segments to use */
+#define ARCHIVE_SEGMENTS 0 /* None unless asked for: no archive */
+#define ARCHIVE_MAX_SEGMENTS 64 /* Most segments it can be given */
+#define ARCHIVE_SEGMENT_SIZE (128L * 1024 * 1024) /* Bytes in each segment */
+#define ARCHIVE_ENTRIES 65536 /* Images the index has room for */
+#define ARCHIVE_HEADER_SIZE (16 * 2880) /* Room for the headers of an image */
+#define ARCHIVE_ALIGN 65536 /* Images start on a page, whatever its size */
+#define ARCHIVE_MAGIC 0x5a574f41 /* Marks an index laid out as below */
+#define ARCHIVE_PATH_SIZE 256 /* Longest path of the archive */
+#define ARCHIVE_FILE_SIZE 32 /* Room for the name of a file in it */
+#define PREVIEW_SIZE 640   /* Longest side of a preview thumbnail */
+#define PREVIEW_QUALITY 80 /* JPEG quality of the previews */
+#define PREVIEW_BINS 4096  /* Histogram bins for the preview stretch */
+#define PREVIEW_BLACK 0.01 /* Fraction of the pixels shown black */
+#define PREVIEW_WHITE 0.999 /* Fraction of the pixels not shown white */
+#define RICE_CMPTYPE "RICE_1" /* ZCMPTYPE of Rice tile compression */
+#define RICE_BLOCKSIZE 32  /* Pixels per Rice block */
+#define RICE_FSBITS 4      /* Bits of the split point code for 16-bit data */
+#define RICE_FSMAX 14      /* Largest split point before sending raw */
+#define COMPRESS_THREADS 4 /* Threads that compress the tiles of an image */
+#define CONVERT_THREADS 4  /* Threads that turn an image into FITS pixels */
+#define STATS_WINDOW 256   /* Images kept for the timing percentiles */
+#define STATS_PUBLISH_INTERVAL 10 /* Seconds between Status Server updates */
+#define POOL_ALIGN 64      /* Alignment of the buffers carved from the pool */
+
+/*
+ * Worst case size of a Rice compressed row of 'n' pixels
+ */
+#define RICE_ROW_BOUND(n) ((n) * 2 + ((n) / RICE_BLOCKSIZE + 1) + 4)
+
+/*
+ * Size of a buffer once it is rounded up to the pool alignment
+ */
+#define POOL_ROUND(n) (((n) + POOL_ALIGN - 1) / POOL_ALIGN * POOL_ALIGN)
 
 #define SOCKSERV_IDLE_POLL_INTERVAL 1   /* Corresponds to 1 second */
 #define MAX_EXPOSURE_DELAY 100 /* Maximum exposure time */
@@ -50,13 +135,44 @@
 #define NULL_DBL -9999.9
 #define MIN_GAIN 0
 #define MAX_GAIN 510
+#define AUTO_MAX_ETIME 10.0 /* Longest automatic exposure before adding gain */
+#define AUTO_ETIME_STEP 0.001 /* Resolution of the automatic exposure time */
+#define AUTO_BINS 1024     /* Histogram bins over the 16-bit range */
+#define AUTO_STRIDE 7      /* Pixel stride for the histogram */
+#define AUTO_PERCENTILE 0.995 /* Bright end of the histogram that is set */
+#define AUTO_TARGET 40000.0 /* Level it is set to, well short of saturation */
+#define AUTO_SATURATED 60000.0 /* Level past which it can't be measured */
+#define AUTO_BLACK 1024.0  /* Level of an unexposed pixel */
+#define AUTO_MIN_SIGNAL 64.0 /* Signal too faint to scale from */
+#define AUTO_MAX_STEP 8.0  /* Largest change from one exposure to the next */
+#define AUTO_DEADBAND 0.1  /* Smallest relative change that is made */
 
 #define SQR(X) ((X)*(X))
 
 #define IMAGE_CMD "IMAGE"
+#define BULK_CMD "BULK"
+#define LATEST_CMD "LATEST"
+#define FRAMES_CMD "FRAMES"
+#define COMPRESS_CMD "COMPRESS"
+#define SUBSCRIBE_CMD "SUBSCRIBE"
+#define SEQUENCE_CMD "SEQUENCE"
+#define DUALIMAGE_CMD "DUALIMAGE"
+#define DARK_CMD "DARK"
+#define FLAT_CMD "FLAT"
+#define CALIBRATE_CMD "CALIBRATE"
+#define PREVIEW_CMD "PREVIEW"
+#define FETCH_CMD "FETCH"
+#define FETCH_SINCE_ARG "SINCE="
+#define COMPRESS_RICE_STRING "RICE"
+#define COMPRESS_NONE_STRING "NONE"
+#define CALIBRATE_ON_STRING "ON"
+#define CALIBRATE_OFF_STRING "OFF"
+#define PREVIEW_JPEG_STRING "JPEG"
+#define IMAGE_ASYNC_STRING "ASYNC"
+#define TAU_ASYNC_REPLY ". " IMAGE_CMD " " IMAGE_ASYNC_STRING
 #define PASS_CHAR '.'
 #define FAIL_CHAR '!'
-#define TEMP_FILE "/tmp/image.fits"
+#define IMAGE_MEMFD_NAME "zwocam-image"
 
 #define SS_PATH "/i/dualcam/visible"
 #define SS_ETIME SS_PATH"/etime"
@@ -65,7 +181,14 @@
 #define SS_IPADDRESS SS_PATH"/ipAddress"
 #define SS_PORT SS_PATH"/port"
 #define SS_SERVER_RUNNING SS_PATH"/serverRunning"
+#define SS_STATS SS_PATH"/stats"
 #define SS_DOME_AZ "/t/status/domeAz"
+#define SS_TAU_IPADDRESS "/i/dualcam/IR/ipAddress"
+#define SS_TAU_PORT "/i/dualcam/IR/port"
+#define METADATA_REFRESH 10	/* Seconds between header metadata refreshes */
+#define CLEANUP_LOCK_TRIES 100 /* Tries at ss_lock before exiting without it */
+#define CLEANUP_LOCK_WAIT 10000 /* Microseconds between the tries */
+#define METADATA_SIZE 80	/* Longest header metadata value */
 
 #define ZWO_MODEL "ZWO ASI178MM"
 #define CCD_SENSOR "Sony CMOS IMX178"
@@ -73,816 +196,6568 @@
 
 #define FLIP_X
 
+/*
+ * Column a pixel goes to in the FITS image
+ */
+#ifdef FLIP_X
+#define FLIP_COLUMN(x, width) ((width) - 1 - (x))
+#define FLIP_PIXELS 1
+#else
+#define FLIP_COLUMN(x, width) (x)
+#define FLIP_PIXELS 0
+#endif
+
 #define DEBUG
 
 
+#if defined(MOCK_CAMERA) || defined(BENCHMARK)
+
+#define MOCK_SIZE_ENV "MOCK_CAMERA_SIZE" /* Simulated sensor size, WxH */
+#define MOCK_RATE_ENV "MOCK_CAMERA_RATE" /* Simulated frames per second */
+#define MOCK_WIDTH 3096
+#define MOCK_HEIGHT 2080
+#define MOCK_BITS 14	   /* Bit depth of the simulated sensor */
+#define MOCK_RATE 30.0	   /* 16-bit full frame rate of the ASI178 */
+#define MOCK_FRAMES 4	   /* Synthetic frames cycled through */
+
 /*
- * Structure used to specify server specific information.
+ * Fill a frame with something that looks like a sky background: a gentle
+ * gradient plus noise and a sprinkling of hot pixels, clipped to the bit
+ * depth of the sensor.  Each 'seed' gives a different noise pattern.
  */
-typedef struct {
-      linked_list *client_list;
-      sockserv_t *zwo_serv;
-      ASI_CAMERA_INFO *asi_camera_info;
-      int serv_done;
-      double etime;	/* Exposure time in seconds */
-      int gain;
-      int image_width;
-      int image_height;
-      int frame_sequence;
-      double exp_start_ts;
-      double exp_readout_done_ts;
-      double exp_cycle_time;
-      time_t last_exp_completion;
-      unsigned char *image_data;
-      char *response_buffer;
-} server_info_t;
+static void
+fillSyntheticFrame(unsigned short *frame, unsigned int width, 
+		   unsigned int height, int bits, unsigned int seed)
+{
+   unsigned int max_value = (1U << bits) - 1;
+   unsigned int x, y, value;
+
+   for (y = 0; y < height; y++) {
+      for (x = 0; x < width; x++) {
+	 value = (max_value / 4) + (x + y) * (max_value / 8) / (width + height)
+	    + (rand_r(&seed) % 64);
+	 if ((rand_r(&seed) % 1000) == 0) {
+	    value = max_value - (rand_r(&seed) % 256);
+	 }
+	 frame[y * width + x] = (unsigned short)((value > max_value) ? 
+	    max_value : value);
+      }
+   }
+}
+
 
+#endif
+
+#ifdef MOCK_CAMERA
 
 /*
- * Per-client information.  Multiple clients can stay connected to the
- * server at once, although this is typically not the case.
+ * State of the simulated camera
  */
-typedef struct
-{
-   char *hostname;
-   unsigned char remote_ip[4];
-   time_t connect_ts;
-   int send_data;
-   int data_count;
-   int total_count;
-   int width;
-   int height;
-   unsigned char *image_data;
-} client_info_t;
+static struct {
+      unsigned short *frames[MOCK_FRAMES];
+      unsigned int next_frame;
+      int max_width;
+      int max_height;
+      int width;		/* ROI, in binned pixels */
+      int height;
+      int bin;
+      int start_x;		/* ROI start, in binned pixels */
+      int start_y;
+      long exposure;		/* Microseconds */
+      long gain;
+      double rate;		/* Fastest frame rate of the readout */
+      ASI_EXPOSURE_STATUS exp_status;
+      double exp_done_ts;	/* When the exposure in progress is read out */
+      int video;
+      double video_frame_ts;	/* When the next video frame is due */
+} mock_camera;
 
 
 /*
- * Server information structure instance
+ * Monotonic clock for the simulated exposures
  */
-static server_info_t *serv_info = NULL;
+static double
+mockClockTime(void) {
+
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (double)(ts.tv_sec + ts.tv_nsec / 1000000000.0);
+}
 
 
 /*
- * Case insensitive string occurance search
+ * Sleep for 'seconds', which may be fractional
  */
-static char *
-stristr(const char *str, const char *pattern) 
+static void
+mockSleep(double seconds)
 {
-   char *pptr, *sptr, *start;
-   unsigned int slen, plen;
-   
-   for (start = (char *)str, 
-	   pptr = (char *)pattern, 
-	   slen = strlen(str), 
-	   plen = strlen(pattern);
-	
-	/* while string length not shorter than pattern length */
-	slen >= plen;
-	start++, slen--) {
-      
-      /* find start of pattern in string */
-      while (toupper(*start) != toupper(*pattern)) {
-	 start++;
-	 slen--;
-	 
-	 /* if pattern longer than string */
-	 if (slen < plen)
-	    return(NULL);
-      }
-      sptr = start;
-      pptr = (char *)pattern;
-      
-      while (toupper(*sptr) == toupper(*pptr)) {
-	 sptr++;
-	 pptr++;
-	 
-	 /* if end of pattern then pattern was found */
-	 if (*pptr == '\0')
-	    return (start);
-      }
-   } 
-   return(NULL);
+   if (seconds > 0) {
+      usleep((useconds_t)(seconds * 1000000.0));
+   }
 }
 
 
 /*
- * Utility function to return the IP address associated with the "eth0"
- * Ethernet interface.  Since this is currently running on a Raspberry PI
- * the "eth0" interface is the correct interface to use for the IP address
+ * Copy the next synthetic frame, cut down to the ROI, into 'buf'.  Binned
+ * pixels are sampled rather than summed, which is all a benchmark needs.
+ * The 14-bit values are scaled up to 16 bits just as the camera does.
  */
-static const char *
-getIPAddress(void) {
-
-   struct ifaddrs *interface_array = NULL;
-   struct ifaddrs *if_ptr = NULL;
-   static char ip_address[20];
+static ASI_ERROR_CODE
+mockReadout(unsigned char *buf, long size)
+{
+   unsigned short *frame;
+   unsigned short *out = (unsigned short *)buf;
+   int x, y;
 
-   /* 
-    * Get the IP address
-    */
-   if (getifaddrs(&interface_array) != 0) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		"(%s:%d) getifaddrs call failed: %s (errno=%d)",
-		__FILE__, __LINE__, strerror(errno), errno);
-      return NULL;
+   if (size < (long)mock_camera.width * mock_camera.height * 2) {
+      return ASI_ERROR_INVALID_SIZE;
    }
-
-   /* 
-    * Iterate through the IP addresses and return the address associated 
-    * with eth0
-    */
-   if_ptr = interface_array;
-   while (if_ptr) {
-      if (if_ptr->ifa_addr && if_ptr->ifa_addr->sa_family == AF_INET) {
-	 struct sockaddr_in *p_addr = (struct sockaddr_in *)if_ptr->ifa_addr;
-	 if (strcasecmp(if_ptr->ifa_name, "eth0") == 0) {
-	    snprintf(ip_address, sizeof(ip_address), "%s", 
-		     inet_ntoa(p_addr->sin_addr));
-	    cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		      "(%s:%d) IP address = %s", __FILE__, __LINE__, 
-		      ip_address);
-	    return ip_address;
-	 }
+   frame = mock_camera.frames[mock_camera.next_frame++ % MOCK_FRAMES];
+   for (y = 0; y < mock_camera.height; y++) {
+      const unsigned short *row = frame +
+	 (long)(mock_camera.start_y + y) * mock_camera.bin * 
+	 mock_camera.max_width + mock_camera.start_x * mock_camera.bin;
+
+      for (x = 0; x < mock_camera.width; x++) {
+	 *out++ = row[x * mock_camera.bin] << (16 - MOCK_BITS);
       }
-      if_ptr = if_ptr->ifa_next;
    }
 
-   freeifaddrs(interface_array);
-
-   return NULL;
+   return ASI_SUCCESS;
 }
 
 
 /*
- * Perform a touch initialization of all the state parameters that are read
- * from the Status Server upon startup and updated in the Status Server 
- * whenever they are changed.
+ * Stand-ins for the ASICamera2 calls the server makes, so that it can be
+ * run and measured on a workstation.  Build with -DMOCK_CAMERA and without
+ * -lASICamera2; MOCK_CAMERA_SIZE and MOCK_CAMERA_RATE in the environment
+ * override the 3096x2080 sensor read out at up to 30 frames/s.
  */
-static PASSFAIL
-ssTouchState(void) {
+int
+ASIGetNumOfConnectedCameras(void)
+{
+   return 1;
+}
 
-   /*
-    * Perform a touch of the current exposure time
-    */
-   if (ssTouchObject(SS_ETIME,
-		     "Exposure Time") != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-		"(%s:%d) ssTouchObject of %s failed: %s", 
-		__FILE__, __LINE__, SS_ETIME, 
-		ssGetStrError());
-      return FAIL;
-   }
 
-   /*
-    * Perform a touch of the current gain
-    */
-   if (ssTouchObject(SS_GAIN,
-		     "Gain Value") != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-		"(%s:%d) ssTouchObject of %s failed: %s", 
-		__FILE__, __LINE__, SS_GAIN, 
-		ssGetStrError());
-      return FAIL;
+ASI_ERROR_CODE
+ASIGetCameraProperty(ASI_CAMERA_INFO *info, int index)
+{
+   const char *env;
+
+   mock_camera.max_width = MOCK_WIDTH;
+   mock_camera.max_height = MOCK_HEIGHT;
+   mock_camera.rate = MOCK_RATE;
+   if (((env = getenv(MOCK_SIZE_ENV)) != NULL) &&
+       ((sscanf(env, "%dx%d", &mock_camera.max_width, 
+		&mock_camera.max_height) != 2) ||
+	(mock_camera.max_width <= 0) || (mock_camera.max_height <= 0))) {
+      mock_camera.max_width = MOCK_WIDTH;
+      mock_camera.max_height = MOCK_HEIGHT;
    }
-
-   /*
-    * Perform a touch of the hostname
-    */
-   if (ssTouchObject(SS_HOSTNAME, "Server Host Name") != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		"(%s:%d) ssTouchObject of %s failed: %s",
-		__FILE__, __LINE__, SS_HOSTNAME, ssGetStrError());
-      return FAIL;
+   if (((env = getenv(MOCK_RATE_ENV)) != NULL) && (atof(env) > 0)) {
+      mock_camera.rate = atof(env);
    }
 
-   /*
-    * Perform a touch of the IP address
-    */
-   if (ssTouchObject(SS_IPADDRESS, "Server IP Address") != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		"(%s:%d) ssTouchObject of %s failed: %s",
-		__FILE__, __LINE__, SS_IPADDRESS, ssGetStrError());
-      return FAIL;
-   }
+   memset(info, 0, sizeof(*info));
+   snprintf(info->Name, sizeof(info->Name), "%s (simulated)", ZWO_MODEL);
+   info->CameraID = index;
+   info->MaxWidth = mock_camera.max_width;
+   info->MaxHeight = mock_camera.max_height;
+   info->SupportedBins[0] = 1;
+   info->SupportedBins[1] = 2;
+   info->SupportedBins[2] = 3;
+   info->SupportedBins[3] = 4;
+   info->PixelSize = PIXEL_SIZE;
+   info->IsUSB3Host = ASI_TRUE;
+   info->IsUSB3Camera = ASI_TRUE;
+   info->ElecPerADU = 1.0;
+   info->BitDepth = MOCK_BITS;
+
+   return ASI_SUCCESS;
+}
 
-   /*
-    * Perform a touch of the port
-    */
-   if (ssTouchObject(SS_PORT, "Command Server Port Number") != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		"(%s:%d) ssTouchObject of %s failed: %s",
-		__FILE__, __LINE__, SS_PORT, ssGetStrError());
-      return FAIL;
-   }
 
-   /*
-    * Perform a touch of the server running flag
-    */
-   if (ssTouchObject(SS_SERVER_RUNNING, 
-		     "Command Server Running Flag") != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		"(%s:%d) ssTouchObject of %s failed: %s",
-		__FILE__, __LINE__, SS_SERVER_RUNNING, ssGetStrError());
-      return FAIL;
+ASI_ERROR_CODE
+ASIOpenCamera(int id)
+{
+   int i;
+
+   if (mock_camera.frames[0] != NULL) {
+      return ASI_SUCCESS;
+   }
+   for (i = 0; i < MOCK_FRAMES; i++) {
+      mock_camera.frames[i] = (unsigned short *)
+	 cli_malloc((long)mock_camera.max_width * mock_camera.max_height *
+		    sizeof(unsigned short));
+      fillSyntheticFrame(mock_camera.frames[i], mock_camera.max_width,
+			 mock_camera.max_height, MOCK_BITS, i + 1);
    }
+   mock_camera.width = mock_camera.max_width;
+   mock_camera.height = mock_camera.max_height;
+   mock_camera.bin = 1;
+   mock_camera.exp_status = ASI_EXP_IDLE;
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	     "(%s:%d) simulated camera: %dx%d read out at up to %.1f"
+	     " frames/s", __FILE__, __LINE__, mock_camera.max_width,
+	     mock_camera.max_height, mock_camera.rate);
 
-   return PASS;
+   return ASI_SUCCESS;
 }
 
 
-/*
- * Get the current clock timestamp
- */
-static double
-getClockTime(void) {
+ASI_ERROR_CODE
+ASIInitCamera(int id)
+{
+   return ASI_SUCCESS;
+}
 
-   struct timespec ts;
 
-   if (clock_gettime(CLOCK_REALTIME, &ts) == -1) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-		"(%s:%d) unable to get clock timestamp : %s (errno=%d)",
-		__FILE__, __LINE__, strerror(errno), errno);
-      return 0;
+ASI_ERROR_CODE
+ASICloseCamera(int id)
+{
+   return ASI_SUCCESS;
+}
+
+
+ASI_ERROR_CODE
+ASIGetNumOfControls(int id, int *num_controls)
+{
+   *num_controls = 2;
+   return ASI_SUCCESS;
+}
+
+
+ASI_ERROR_CODE
+ASIGetControlCaps(int id, int index, ASI_CONTROL_CAPS *caps)
+{
+   memset(caps, 0, sizeof(*caps));
+   caps->IsWritable = ASI_TRUE;
+   switch (index) {
+      case 0:
+	 strcpy(caps->Name, "Gain");
+	 strcpy(caps->Description, "Gain");
+	 caps->MinValue = MIN_GAIN;
+	 caps->MaxValue = MAX_GAIN;
+	 caps->ControlType = ASI_GAIN;
+	 break;
+      case 1:
+	 strcpy(caps->Name, "Exposure");
+	 strcpy(caps->Description, "Exposure Time(us)");
+	 caps->MinValue = 32;
+	 caps->MaxValue = 2000000000;
+	 caps->DefaultValue = 10000;
+	 caps->ControlType = ASI_EXPOSURE;
+	 break;
+      default:
+	 return ASI_ERROR_INVALID_INDEX;
    }
-   return (double)(ts.tv_sec + ts.tv_nsec / 1000000000.0);
-}     
 
+   return ASI_SUCCESS;
+}
 
-/*
- * Initialize the camera connection.
- */
-static PASSFAIL
-initCameraConnection(void) {
 
-   int rc;
-   int num_cameras;
-   int num_controls;
-   ASI_CONTROL_CAPS *asi_control_caps;
-   int i;
+ASI_ERROR_CODE
+ASISetControlValue(int id, ASI_CONTROL_TYPE type, long value, ASI_BOOL is_auto)
+{
+   if (type == ASI_EXPOSURE) {
+      mock_camera.exposure = value;
+   }
+   else if (type == ASI_GAIN) {
+      mock_camera.gain = value;
+   }
 
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	     "Initializing ZWO camera connection");
+   return ASI_SUCCESS;
+}
 
-   /* 
-    * Read the number of connected cameras and make sure only one camera
-    * is found.
-    */
-   num_cameras = ASIGetNumOfConnectedCameras();
-   if (num_cameras != 1) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		"(%s:%d) Unable to detect a ZWO camera", __FILE__, __LINE__);
-      return FAIL;
+
+ASI_ERROR_CODE
+ASISetROIFormat(int id, int width, int height, int bin, ASI_IMG_TYPE type)
+{
+   if ((bin < 1) || (bin > 4) || (width <= 0) || (height <= 0) ||
+       (width * bin > mock_camera.max_width) || 
+       (height * bin > mock_camera.max_height)) {
+      return ASI_ERROR_INVALID_SIZE;
    }
+   mock_camera.width = width;
+   mock_camera.height = height;
+   mock_camera.bin = bin;
+   mock_camera.start_x = 0;
+   mock_camera.start_y = 0;
 
-   /*
-    * Get the camera properties
+   return ASI_SUCCESS;
+}
+
+
+ASI_ERROR_CODE
+ASIGetROIFormat(int id, int *width, int *height, int *bin, ASI_IMG_TYPE *type)
+{
+   *width = mock_camera.width;
+   *height = mock_camera.height;
+   *bin = mock_camera.bin;
+   *type = ASI_IMG_RAW16;
+
+   return ASI_SUCCESS;
+}
+
+
+ASI_ERROR_CODE
+ASISetStartPos(int id, int x, int y)
+{
+   if ((x < 0) || (y < 0) ||
+       ((x + mock_camera.width) * mock_camera.bin > mock_camera.max_width) ||
+       ((y + mock_camera.height) * mock_camera.bin > 
+	mock_camera.max_height)) {
+      return ASI_ERROR_OUTOF_BOUNDARY;
+   }
+   mock_camera.start_x = x;
+   mock_camera.start_y = y;
+
+   return ASI_SUCCESS;
+}
+
+
+ASI_ERROR_CODE
+ASIStartExposure(int id, ASI_BOOL is_dark)
+{
+   mock_camera.exp_status = ASI_EXP_WORKING;
+   mock_camera.exp_done_ts = mockClockTime() + 
+      mock_camera.exposure / 1000000.0 + 1.0 / mock_camera.rate;
+
+   return ASI_SUCCESS;
+}
+
+
+ASI_ERROR_CODE
+ASIStopExposure(int id)
+{
+   mock_camera.exp_status = ASI_EXP_IDLE;
+
+   return ASI_SUCCESS;
+}
+
+
+ASI_ERROR_CODE
+ASIGetExpStatus(int id, ASI_EXPOSURE_STATUS *status)
+{
+   if ((mock_camera.exp_status == ASI_EXP_WORKING) &&
+       (mockClockTime() >= mock_camera.exp_done_ts)) {
+      mock_camera.exp_status = ASI_EXP_SUCCESS;
+   }
+   *status = mock_camera.exp_status;
+
+   return ASI_SUCCESS;
+}
+
+
+ASI_ERROR_CODE
+ASIGetDataAfterExp(int id, unsigned char *buf, long size)
+{
+   if (mock_camera.exp_status != ASI_EXP_SUCCESS) {
+      return ASI_ERROR_TIMEOUT;
+   }
+   mock_camera.exp_status = ASI_EXP_IDLE;
+
+   return mockReadout(buf, size);
+}
+
+
+ASI_ERROR_CODE
+ASIStartVideoCapture(int id)
+{
+   mock_camera.video = 1;
+   mock_camera.video_frame_ts = mockClockTime();
+
+   return ASI_SUCCESS;
+}
+
+
+ASI_ERROR_CODE
+ASIStopVideoCapture(int id)
+{
+   mock_camera.video = 0;
+
+   return ASI_SUCCESS;
+}
+
+
+/*
+ * Frames come out one exposure time apart, but no faster than the
+ * readout allows.  Frames nobody asked for in time are dropped, as the
+ * camera's own buffer would.
+ */
+ASI_ERROR_CODE
+ASIGetVideoData(int id, unsigned char *buf, long size, int wait_ms)
+{
+   double period, now;
+
+   if (!mock_camera.video) {
+      return ASI_ERROR_TIMEOUT;
+   }
+   period = mock_camera.exposure / 1000000.0;
+   if (period < 1.0 / mock_camera.rate) {
+      period = 1.0 / mock_camera.rate;
+   }
+   now = mockClockTime();
+   if (mock_camera.video_frame_ts + period < now) {
+      mock_camera.video_frame_ts = now;
+   }
+   if ((wait_ms >= 0) && 
+       (mock_camera.video_frame_ts - now > wait_ms / 1000.0)) {
+      mockSleep(wait_ms / 1000.0);
+      return ASI_ERROR_TIMEOUT;
+   }
+   mockSleep(mock_camera.video_frame_ts - now);
+   mock_camera.video_frame_ts += period;
+
+   return mockReadout(buf, size);
+}
+
+#endif
+
+
+/*
+ * How far along a client is in getting the image it asked for
+ */
+typedef enum {
+   IMAGE_NONE,			/* No image requested */
+   IMAGE_QUEUED,		/* Waiting for the next exposure */
+   IMAGE_EXPOSING		/* Waiting for the exposure under way */
+} image_wanted_t;
+
+/*
+ * Stages of taking and delivering an image that are timed
+ */
+typedef enum {
+   STAGE_EXPOSE,		/* Exposing on the camera */
+   STAGE_READOUT,		/* Getting the pixels off the camera */
+   STAGE_ENCODE,		/* Building the FITS image */
+   STAGE_IO,			/* Preparing and mapping the in-memory file */
+   STAGE_SEND,			/* Delivering the image to the client */
+   NUM_STAGES
+} stage_t;
+
+/*
+ * The most recent timings of one stage, in seconds
+ */
+typedef struct {
+   double sample[STATS_WINDOW];
+   unsigned int count;		/* Images timed since startup */
+} stage_stats_t;
+
+
+/*
+ * One slot of the free-running capture ring.  A slot with a sequence
+ * number of 0 is empty or being filled; a slot with readers is being
+ * turned into a FITS image and won't be reused until they are done.
+ */
+typedef struct {
+      unsigned char *data;
+      double timestamp;		/* When the frame was read out */
+      unsigned int sequence;	/* Capture order, 0 if not valid */
+      int readers;		/* Clients encoding this frame */
+} video_frame_t;
+
+
+/*
+ * One image buffer of the exposure pipeline.  The pipeline thread only
+ * reads out into a buffer that isn't filled, and the server loop empties
+ * a filled one once it has been turned into a FITS image.
+ */
+typedef struct {
+      unsigned char *data;
+      int filled;
+      unsigned int sequence;	/* Readout order */
+      unsigned int generation;	/* Camera settings it was taken with */
+      double exp_start_ts;
+      double exp_done_ts;
+      double readout_done_ts;
+} exposure_buffer_t;
+
+
+/*
+ * Arena that the frame, FITS and compression buffers are carved out of.
+ * It is sized for a full unbinned frame once the camera is known, and
+ * nothing is ever given back, so taking images allocates nothing.
+ */
+typedef struct {
+      unsigned char *base;
+      size_t size;
+      size_t used;
+} buffer_pool_t;
+
+
+/*
+ * How far along the IR image taken from the Tau server for a DUALIMAGE
+ * exposure is
+ */
+typedef enum {
+   TAU_IDLE,			/* No IR image on its way */
+   TAU_EXPOSING,		/* Waiting for it to be announced */
+   TAU_RECEIVING,		/* Reading in its data */
+   TAU_DONE,			/* It is in tau_image */
+   TAU_FAILED			/* None this time, tau_error says why */
+} tau_state_t;
+
+
+/*
+ * Kind of calibration master, and the one being built if any
+ */
+typedef enum {
+   CALIB_NONE,			/* No master */
+   CALIB_DARK,			/* Mean of dark exposures */
+   CALIB_FLAT			/* Factors that even out a flat field */
+} calib_kind_t;
+
+
+/*
+ * Settings an exposure was taken with, noted when it is read out so that
+ * every image built from it carries the same ones
+ */
+typedef struct {
+      int seqnum;		/* SEQNUM */
+      double etime;		/* Exposure time in seconds */
+      int gain;
+} exposure_info_t;
+
+
+/*
+ * A master dark or flat mapped from its file in CALIB_DIR.  The files
+ * are plain arrays of floats, one per pixel of the image.
+ */
+typedef struct {
+      char path[CALIB_PATH_SIZE];
+      float *data;		/* Mapping, or NULL if the slot is free */
+      size_t size;
+} master_t;
+
+
+/*
+ * Where one archived image is, and what it is of.  The index is kept in
+ * a file of its own, and an image's entry is found from its serial
+ * number, which counts the images archived.
+ */
+typedef struct {
+      uint64_t serial;		/* 0 if never used */
+      double timestamp;		/* UNIXTIME of the image */
+      double dome_az;		/* DOMEAZ, or NULL_DBL if not known */
+      int32_t seqnum;		/* SEQNUM */
+      int32_t segment;		/* Segment file it is in */
+      int64_t offset;		/* Where it starts in the segment */
+      int64_t size;		/* Bytes of FITS */
+} archive_entry_t;
+
+typedef struct {
+      uint32_t magic;		/* ARCHIVE_MAGIC */
+      uint32_t nsegments;	/* Segments it was laid out for */
+      uint64_t first;		/* Serial of the oldest image kept */
+      uint64_t next;		/* Serial of the next image archived */
+      int32_t segment;		/* Segment being appended to */
+      int32_t unused;
+      int64_t offset;		/* Where the next image goes in it */
+      archive_entry_t entry[ARCHIVE_ENTRIES]; /* Indexed by serial */
+} archive_index_t;
+
+
+/*
+ * Rolling archive of the images taken, for clients to catch up from
+ */
+typedef struct {
+      char dir[ARCHIVE_PATH_SIZE];
+      int nsegments;
+      int segment_fd[ARCHIVE_MAX_SEGMENTS];
+      int readers[ARCHIVE_MAX_SEGMENTS]; /* Images being sent from each */
+      archive_index_t *index;	/* Mapping of the index, NULL if not kept */
+} archive_t;
+
+
+/*
+ * Where the connection to the camera is.  The camera is looked for in
+ * the background, and only the server loop takes it from CAMERA_OPENED
+ * to CAMERA_READY, by loading the settings into it.
+ */
+typedef enum {
+   CAMERA_LOST,			/* Not connected, being looked for */
+   CAMERA_OPENED,		/* Opened, the settings not loaded yet */
+   CAMERA_READY			/* Taking images */
+} camera_state_t;
+
+
+/*
+ * Capabilities of the camera last opened, kept in CAMERA_CACHE so that
+ * the server can start before the camera is found, and the camera isn't
+ * asked for its controls every time it is opened
+ */
+typedef struct {
+      uint32_t magic;		/* CAMERA_CACHE_MAGIC */
+      int32_t num_controls;
+      ASI_CAMERA_INFO info;
+      ASI_CONTROL_CAPS caps[MAX_CONTROLS];
+} camera_cache_t;
+
+
+/*
+ * Structure used to specify server specific information.
+ */
+typedef struct {
+      linked_list *client_list;
+      sockserv_t *zwo_serv;
+      ASI_CAMERA_INFO *asi_camera_info;
+      pthread_mutex_t camera_lock; /* Protects camera_state, camera_failed */
+      pthread_cond_t camera_cond;  /* Signalled when the camera is opened */
+      _Atomic camera_state_t camera_state; /* Also read without the lock */
+      int camera_failed;	/* The camera looks gone, reconnect it */
+      atomic_int camera_errors;	/* Calls to the camera failed in a row */
+      int camera_video;		/* Video to restart once it is back */
+      int camera_pipeline;	/* Pipeline to restart once it is back */
+      int serv_done;
+      int data_listen_fd;
+      int pending_data_fd[MAX_PENDING_DATA];
+      unsigned int pending_data_token[MAX_PENDING_DATA];
+      struct in_addr pending_data_addr[MAX_PENDING_DATA]; /* Their peers */
+      int bulk_sends;		/* Bulk transfers under way */
+      double etime;	/* Exposure time in seconds */
+      int gain;
+      int auto_exposure;	/* Set etime and gain from each image */
+      double auto_max_etime;	/* Longest exposure before gain is added */
+      int image_width;		/* Size of the image sent to clients */
+      int image_height;
+      int readout_width;	/* Size of the frame read from the camera */
+      int readout_height;
+      int bin;			/* Binning factor */
+      int soft_bin;		/* Binning is done by binFrame() */
+      int roi_x;		/* Region read out, in unbinned pixels */
+      int roi_y;
+      int roi_width;
+      int roi_height;
+      int roi_asked_x;		/* Region asked for, before it was trimmed */
+      int roi_asked_y;		/* for the binning */
+      int roi_asked_width;
+      int roi_asked_height;
+      int frame_sequence;
+      exposure_info_t exposure_info; /* Of the image being built */
+      double exp_start_ts;
+      double exp_done_ts;
+      double exp_readout_done_ts;
+      double exp_cycle_time;
+      time_t last_exp_completion;
+      unsigned char *image_data;
+      unsigned short *flip_image; /* Mirrored pixels for the Rice coder */
+      int *rice_row_size;	/* Compressed size of each row */
+      unsigned char *rice_heap;	/* Compressed rows of all the bands */
+      unsigned char *rice_table; /* Descriptors of the compressed rows */
+      buffer_pool_t pool;
+      char *response_buffer;
+      pthread_t video_thread;
+      pthread_mutex_t video_lock; /* Protects the video_ring bookkeeping */
+      int video_running;
+      unsigned int video_sequence;
+      video_frame_t video_ring[VIDEO_RING_SLOTS];
+      pthread_t pipeline_thread;
+      pthread_mutex_t pipeline_lock; /* Protects the exposure buffers */
+      pthread_cond_t pipeline_cond;  /* Signalled when a buffer changes */
+      int pipeline_running;
+      unsigned int pipeline_sequence;
+      unsigned int pipeline_generation; /* Bumped on etime/gain changes */
+      exposure_buffer_t exposure_buffer[PIPELINE_BUFFERS];
+      stage_stats_t stage_stats[NUM_STAGES];
+      unsigned int image_count;	/* Images delivered since startup */
+      double stats_ts;		/* When the stats were last published */
+      exposure_buffer_t *exposure_held; /* Pipeline buffer being encoded */
+      double subscribe_retry_ts; /* No exposures for subscribers before */
+      int exposing;		/* An exposure is under way */
+      double exposure_ts;	/* When it was started */
+      int exposure_subscribed;	/* It is also taken for the subscribers */
+      int exposure_dual;	/* The Tau server takes an IR image with it */
+      unsigned int commands;	/* Commands client_recv() has handled */
+      unsigned int commands_seen; /* How many the loop last slept after */
+      sockclnt_t *tau_sock;	/* Connection to the Tau server, or NULL */
+      int event_fd;		/* Wakes the server loop for a new image */
+      int wake_fd;		/* epoll set the server loop waits on */
+      tau_state_t tau_state;
+      unsigned char *tau_image;	/* IR FITS image read from the Tau server */
+      long tau_size;
+      long tau_count;		/* Bytes of it read in so far */
+      double tau_request_ts;	/* When it was asked for */
+      const char *tau_error;	/* Why there is no IR image */
+      calib_kind_t calib_kind;	/* Master being built, or CALIB_NONE */
+      int calib_remaining;	/* Exposures still to take for it */
+      int calib_count;		/* Exposures summed into it so far */
+      float *calib_sum;		/* Sum of those exposures */
+      char calib_path[CALIB_PATH_SIZE]; /* File the master is saved to */
+      char calib_key[CALIB_PATH_SIZE]; /* Dark for the settings it uses */
+      int exposure_calib;	/* The exposure is taken for the master */
+      master_t master[MAX_MASTERS];
+      int master_next;		/* Slot the next master is mapped into */
+      unsigned short *calib_image; /* Calibrated pixels of the exposure */
+      unsigned short *calib_pixels; /* Pixels calibrated for it, or NULL */
+      char calib_dark[CALIB_PATH_SIZE]; /* Masters applied to them */
+      char calib_flat[CALIB_PATH_SIZE];
+} server_info_t;
+
+
+/*
+ * Per-client information.  Multiple clients can stay connected to the
+ * server at once, although this is typically not the case.
+ */
+typedef struct client_info
+{
+   char *hostname;
+   unsigned char remote_ip[4];
+   time_t connect_ts;
+   int send_data;
+   int data_count;
+   int total_count;
+   int width;
+   int height;
+   int image_fd;		/* memfd the FITS image is built in */
+   int data_fd;			/* Bulk data connection, or -1 */
+   unsigned int bulk_token;	/* Token handed out by BULK, or 0 */
+   int bulk_sending;		/* data_fd is in the wake_fd set */
+   double bulk_progress_ts;	/* When the bulk transfer last moved */
+   int compress;		/* Send Rice tile compressed images */
+   int calibrate;		/* Send images dark and flat corrected */
+   size_t image_size;		/* Size of the image_data mapping */
+   unsigned char *image_data;
+   double io_time;		/* Time spent on the in-memory file so far */
+   double send_start_ts;	/* When the image reply went out */
+   int subscribed;		/* Sent every image taken for subscribers */
+   int image_wanted;		/* IMAGE_QUEUED or IMAGE_EXPOSING if waiting */
+   int dual;			/* The image wanted is a DUALIMAGE */
+   char reply[REPLY_SIZE];	/* Reply to send ahead of any image data */
+   int seq_remaining;		/* Images of a sequence still to be queued */
+   double seq_interval;		/* Seconds between the images of a sequence */
+   double seq_next_ts;		/* When the next one is due */
+   struct client_info *shared;	/* Shared image being sent, or NULL */
+   int refs;			/* Subscribers sending this shared image */
+   int archived;		/* The image is sent from the archive */
+   int archive_segment;		/* Segment it is in, and where */
+   off_t archive_offset;
+   uint64_t fetch_next;		/* Serial of the next FETCH image to send */
+   uint64_t fetch_end;		/* Serial after the last one asked for */
+} client_info_t;
+
+
+/*
+ * Rows of an image compressed by one thread
+ */
+typedef struct {
+   const unsigned short *image;	/* First row of the band */
+   int width;
+   int nrows;
+   unsigned char *data;		/* Compressed rows back to back */
+   size_t size;			/* Bytes used in data */
+   int *row_size;		/* Compressed size of each row */
+} rice_band_t;
+
+/*
+ * A Rice tile compressed image, one tile per row
+ */
+typedef struct {
+   rice_band_t band[COMPRESS_THREADS];
+   int *row_size;
+   int height;
+   int max_row_size;
+   size_t heap_size;
+} rice_image_t;
+
+
+/*
+ * Rows of an image converted to FITS pixels by one thread
+ */
+typedef struct {
+   const unsigned short *src;
+   unsigned short *dst;
+   int width;
+   int first_row;
+   int nrows;
+   int fits_order;		/* Offset by BZERO and swap to big-endian */
+} convert_band_t;
+
+
+/*
+ * Pixels of an image calibrated by one thread
+ */
+typedef struct {
+   const unsigned short *src;
+   unsigned short *dst;
+   const float *dark;		/* Master dark to subtract, or NULL */
+   const float *flat;		/* Flat correction to multiply by, or NULL */
+   size_t first;
+   size_t count;
+} calib_band_t;
+
+
+/*
+ * Thumbnail of the last image taken, and the JPEG made of it for PREVIEW
+ */
+typedef struct {
+   pthread_mutex_t lock;	/* Protects the hand-over and the JPEG */
+   pthread_cond_t cond;		/* Signalled when a thumbnail is pending */
+   unsigned int *row_sum;	/* Column sums of a block of rows */
+   unsigned short *thumb;	/* Binned image, before the stretch */
+   unsigned char *pixels;	/* Stretched thumbnail for the encoder */
+   int width;			/* Size of the thumbnail */
+   int height;
+   int pending;			/* The encoder has the thumbnail to do */
+   unsigned char *jpeg;		/* Latest preview, or NULL */
+   unsigned long jpeg_size;
+} preview_t;
+
+
+/*
+ * Server information structure instance
+ */
+static server_info_t *serv_info = NULL;
+
+#ifndef BENCHMARK
+/*
+ * Clients subscribed to every image, and the images taken for them: one
+ * uncompressed and one Rice compressed, each built only when a subscriber
+ * asked for that format.  The shared images are clients of their own so
+ * that they get an in-memory file like any other.
+ */
+static client_info_t *subscriber[MAX_SUBSCRIBERS];
+static client_info_t shared_image[2];
+
+/*
+ * Clients waiting for the image they asked for with IMAGE
+ */
+static client_info_t *image_client[MAX_IMAGE_CLIENTS];
+
+/*
+ * Clients taking a sequence of images with SEQUENCE
+ */
+static client_info_t *sequence_client[MAX_SEQUENCES];
+
+/*
+ * Client building a master dark or flat with DARK or FLAT
+ */
+static client_info_t *calib_client;
+
+/*
+ * Preview of the last image, and its encoder
+ */
+static preview_t preview;
+#endif
+
+/*
+ * Archive of the images taken, and the index that finds them
+ */
+static archive_t archive;
+
+#ifndef BENCHMARK
+/*
+ * Capabilities of the camera, as cached or as last asked for
+ */
+static camera_cache_t camera_cache;
+#endif
+
+/*
+ * Header values that come from outside the server.  They are refreshed in
+ * the background, so writing an image never waits on the Status Server.
+ */
+typedef struct
+{
+   char dome_az[METADATA_SIZE];
+} metadata_t;
+
+/*
+ * The header metadata last read and the lock guarding it.  ss_lock keeps
+ * the Status Server calls of the server loop and of the metadata refresh
+ * from crossing.
+ */
+static metadata_t metadata;
+static pthread_mutex_t metadata_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t ss_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+#ifndef BENCHMARK
+/*
+ * Case insensitive string occurance search
+ */
+static char *
+stristr(const char *str, const char *pattern) 
+{
+   char *pptr, *sptr, *start;
+   unsigned int slen, plen;
+   
+   for (start = (char *)str, 
+	   pptr = (char *)pattern, 
+	   slen = strlen(str), 
+	   plen = strlen(pattern);
+	
+	/* while string length not shorter than pattern length */
+	slen >= plen;
+	start++, slen--) {
+      
+      /* find start of pattern in string */
+      while (toupper(*start) != toupper(*pattern)) {
+	 start++;
+	 slen--;
+	 
+	 /* if pattern longer than string */
+	 if (slen < plen)
+	    return(NULL);
+      }
+      sptr = start;
+      pptr = (char *)pattern;
+      
+      while (toupper(*sptr) == toupper(*pptr)) {
+	 sptr++;
+	 pptr++;
+	 
+	 /* if end of pattern then pattern was found */
+	 if (*pptr == '\0')
+	    return (start);
+      }
+   } 
+   return(NULL);
+}
+
+
+/*
+ * Utility function to return the IP address associated with the "eth0"
+ * Ethernet interface.  Since this is currently running on a Raspberry PI
+ * the "eth0" interface is the correct interface to use for the IP address
+ */
+static const char *
+getIPAddress(void) {
+
+   struct ifaddrs *interface_array = NULL;
+   struct ifaddrs *if_ptr = NULL;
+   static char ip_address[20];
+
+   /* 
+    * Get the IP address
+    */
+   if (getifaddrs(&interface_array) != 0) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) getifaddrs call failed: %s (errno=%d)",
+		__FILE__, __LINE__, strerror(errno), errno);
+      return NULL;
+   }
+
+   /* 
+    * Iterate through the IP addresses and return the address associated 
+    * with eth0
+    */
+   if_ptr = interface_array;
+   while (if_ptr) {
+      if (if_ptr->ifa_addr && if_ptr->ifa_addr->sa_family == AF_INET) {
+	 struct sockaddr_in *p_addr = (struct sockaddr_in *)if_ptr->ifa_addr;
+	 if (strcasecmp(if_ptr->ifa_name, "eth0") == 0) {
+	    snprintf(ip_address, sizeof(ip_address), "%s", 
+		     inet_ntoa(p_addr->sin_addr));
+	    cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		      "(%s:%d) IP address = %s", __FILE__, __LINE__, 
+		      ip_address);
+	    return ip_address;
+	 }
+      }
+      if_ptr = if_ptr->ifa_next;
+   }
+
+   freeifaddrs(interface_array);
+
+   return NULL;
+}
+
+
+/*
+ * Perform a touch initialization of all the state parameters that are read
+ * from the Status Server upon startup and updated in the Status Server 
+ * whenever they are changed.
+ */
+static PASSFAIL
+ssTouchState(void) {
+
+   /*
+    * Perform a touch of the current exposure time
+    */
+   if (ssTouchObject(SS_ETIME,
+		     "Exposure Time") != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
+		"(%s:%d) ssTouchObject of %s failed: %s", 
+		__FILE__, __LINE__, SS_ETIME, 
+		ssGetStrError());
+      return FAIL;
+   }
+
+   /*
+    * Perform a touch of the current gain
+    */
+   if (ssTouchObject(SS_GAIN,
+		     "Gain Value") != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
+		"(%s:%d) ssTouchObject of %s failed: %s", 
+		__FILE__, __LINE__, SS_GAIN, 
+		ssGetStrError());
+      return FAIL;
+   }
+
+   /*
+    * Perform a touch of the hostname
+    */
+   if (ssTouchObject(SS_HOSTNAME, "Server Host Name") != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) ssTouchObject of %s failed: %s",
+		__FILE__, __LINE__, SS_HOSTNAME, ssGetStrError());
+      return FAIL;
+   }
+
+   /*
+    * Perform a touch of the IP address
+    */
+   if (ssTouchObject(SS_IPADDRESS, "Server IP Address") != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) ssTouchObject of %s failed: %s",
+		__FILE__, __LINE__, SS_IPADDRESS, ssGetStrError());
+      return FAIL;
+   }
+
+   /*
+    * Perform a touch of the port
+    */
+   if (ssTouchObject(SS_PORT, "Command Server Port Number") != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) ssTouchObject of %s failed: %s",
+		__FILE__, __LINE__, SS_PORT, ssGetStrError());
+      return FAIL;
+   }
+
+   /*
+    * Perform a touch of the server running flag
+    */
+   if (ssTouchObject(SS_SERVER_RUNNING, 
+		     "Command Server Running Flag") != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) ssTouchObject of %s failed: %s",
+		__FILE__, __LINE__, SS_SERVER_RUNNING, ssGetStrError());
+      return FAIL;
+   }
+
+   return PASS;
+}
+#endif
+
+
+/*
+ * Read one header metadata value from the Status Server, keeping the one
+ * read before if it can't be had
+ */
+static void
+getMetadata(const char *path, char *value)
+{
+   char s[METADATA_SIZE];
+   PASSFAIL rc;
+
+   pthread_mutex_lock(&ss_lock);
+   if ((rc = ssGetString(path, s, sizeof(s) - 1)) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) ssGetString of %s failed: %s",
+		__FILE__, __LINE__, path, ssGetStrError());
+   }
+   pthread_mutex_unlock(&ss_lock);
+   if (rc != PASS) {
+      return;
+   }
+   s[sizeof(s) - 1] = '\0';
+
+   pthread_mutex_lock(&metadata_lock);
+   strcpy(value, s);
+   pthread_mutex_unlock(&metadata_lock);
+}
+
+
+/*
+ * Refresh the header metadata from the Status Server
+ */
+static void
+refreshMetadata(void)
+{
+   getMetadata(SS_DOME_AZ, metadata.dome_az);
+}
+
+
+#ifndef BENCHMARK
+/*
+ * Refresh the header metadata every METADATA_REFRESH seconds
+ */
+static void *
+metadataThread(void *arg)
+{
+   for (;;) {
+      sleep(METADATA_REFRESH);
+      refreshMetadata();
+   }
+
+   return NULL;
+}
+
+
+/*
+ * Read the header metadata, then keep it fresh in the background
+ */
+static void
+startMetadata(void)
+{
+   pthread_t thread;
+
+   refreshMetadata();
+   if (pthread_create(&thread, NULL, metadataThread, NULL) != 0) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		"(%s:%d) unable to start the metadata refresh, the header"
+		" values will not be updated", __FILE__, __LINE__);
+      return;
+   }
+   pthread_detach(thread);
+}
+#endif
+
+
+/*
+ * Get the current clock timestamp
+ */
+static double
+getClockTime(void) {
+
+   struct timespec ts;
+
+   if (clock_gettime(CLOCK_REALTIME, &ts) == -1) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
+		"(%s:%d) unable to get clock timestamp : %s (errno=%d)",
+		__FILE__, __LINE__, strerror(errno), errno);
+      return 0;
+   }
+   return (double)(ts.tv_sec + ts.tv_nsec / 1000000000.0);
+}     
+
+
+/*
+ * Names the stage timings are published and logged under
+ */
+static const char *stage_name[NUM_STAGES] = {
+   "expose", "readout", "encode", "io", "send"
+};
+
+
+/*
+ * Record how long a stage of the current image took
+ */
+static void
+recordStage(stage_t stage, double seconds)
+{
+   stage_stats_t *stats = &serv_info->stage_stats[stage];
+
+   stats->sample[stats->count % STATS_WINDOW] = seconds;
+   stats->count++;
+}
+
+
+/*
+ * Comparison function used by qsort to order the timings
+ */
+static int
+compareTimings(const void *a, const void *b)
+{
+   double x = *(const double *)a;
+   double y = *(const double *)b;
+
+   return (x > y) - (x < y);
+}
+
+
+/*
+ * Publish one statistic under SS_STATS
+ */
+static void
+putStat(const char *name, const char *value)
+{
+   char path[80];
+
+   snprintf(path, sizeof(path), "%s/%s", SS_STATS, name);
+   pthread_mutex_lock(&ss_lock);
+   if (ssPutString(path, value) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) ssPutString of %s with %s failed: %s",
+		__FILE__, __LINE__, path, value, ssGetStrError());
+   }
+   pthread_mutex_unlock(&ss_lock);
+}
+
+
+/*
+ * Log the timings of the image just delivered along with the p50/p99 of
+ * the last STATS_WINDOW images, in milliseconds.  The same numbers go to
+ * the Status Server, but at most every STATS_PUBLISH_INTERVAL seconds so
+ * that a fast cadence doesn't turn into a stream of Status Server updates.
+ */
+static void
+publishStats(void)
+{
+   double sorted[STATS_WINDOW];
+   stage_stats_t *stats;
+   double now, last, p50, p99;
+   char line[400];
+   char name[40];
+   char value[40];
+   unsigned int n;
+   int publish;
+   int len;
+   int i;
+
+   now = getClockTime();
+   serv_info->image_count++;
+   publish = (now - serv_info->stats_ts >= STATS_PUBLISH_INTERVAL);
+
+   len = snprintf(line, sizeof(line), "image %u timing ms (last/p50/p99):",
+		  serv_info->image_count);
+   for (i = 0; i < NUM_STAGES; i++) {
+      stats = &serv_info->stage_stats[i];
+      if (stats->count == 0) {
+	 continue;
+      }
+      n = (stats->count < STATS_WINDOW) ? stats->count : STATS_WINDOW;
+      last = stats->sample[(stats->count - 1) % STATS_WINDOW] * 1000.0;
+      memcpy(sorted, stats->sample, n * sizeof(double));
+      qsort(sorted, n, sizeof(double), compareTimings);
+      p50 = sorted[(unsigned int)(0.50 * (n - 1) + 0.5)] * 1000.0;
+      p99 = sorted[(unsigned int)(0.99 * (n - 1) + 0.5)] * 1000.0;
+      if (len < (int)sizeof(line)) {
+	 len += snprintf(line + len, sizeof(line) - len, " %s %.1f/%.1f/%.1f",
+			 stage_name[i], last, p50, p99);
+      }
+      if (publish) {
+	 snprintf(name, sizeof(name), "%s/last", stage_name[i]);
+	 snprintf(value, sizeof(value), "%.1f", last);
+	 putStat(name, value);
+	 snprintf(name, sizeof(name), "%s/p50", stage_name[i]);
+	 snprintf(value, sizeof(value), "%.1f", p50);
+	 putStat(name, value);
+	 snprintf(name, sizeof(name), "%s/p99", stage_name[i]);
+	 snprintf(value, sizeof(value), "%.1f", p99);
+	 putStat(name, value);
+      }
+   }
+
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY, "(%s:%d) %s cycle %.1f",
+	     __FILE__, __LINE__, line, serv_info->exp_cycle_time * 1000.0);
+   if (publish) {
+      snprintf(value, sizeof(value), "%.3f", serv_info->exp_cycle_time);
+      putStat("cycleTime", value);
+      snprintf(value, sizeof(value), "%.3f", serv_info->exp_readout_done_ts);
+      putStat("readoutDone", value);
+      snprintf(value, sizeof(value), "%u", serv_info->image_count);
+      putStat("images", value);
+      serv_info->stats_ts = now;
+   }
+}
+
+
+/*
+ * Carve a buffer out of the pool.  The pool is sized for everything that
+ * is taken from it, so running out is a bug, but the server carries on
+ * with a heap buffer if it happens.
+ */
+static void *
+poolAlloc(size_t size)
+{
+   buffer_pool_t *pool = &serv_info->pool;
+   void *buf;
+
+   size = POOL_ROUND(size);
+   if (pool->used + size > pool->size) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+		"(%s:%d) buffer pool exhausted (%ld of %ld bytes used),"
+		" allocating %ld bytes", __FILE__, __LINE__, 
+		(long)pool->used, (long)pool->size, (long)size);
+      return cli_malloc(size);
+   }
+   buf = pool->base + pool->used;
+   pool->used += size;
+
+   return buf;
+}
+
+
+/*
+ * Set up the pool and every image buffer for frames of up to 'max_width'
+ * by 'max_height' pixels.  Binned and ROI readouts are smaller than that,
+ * so the same buffers serve every readout format.
+ */
+static void
+allocateBuffers(int max_width, int max_height)
+{
+   size_t frame = POOL_ROUND((size_t)max_width * max_height * 
+			     sizeof(uint16_t));
+   size_t row_size = POOL_ROUND(max_height * sizeof(int));
+   size_t heap = POOL_ROUND((size_t)max_height * RICE_ROW_BOUND(max_width) +
+			    COMPRESS_THREADS);
+   size_t table = POOL_ROUND((size_t)max_height * 8);
+   int i;
+
+   serv_info->pool.size = frame * (3 + VIDEO_RING_SLOTS + PIPELINE_BUFFERS) +
+      row_size + heap + table + POOL_ROUND(TAU_IMAGE_MAX) + POOL_ALIGN;
+   serv_info->pool.base = (unsigned char *)cli_malloc(serv_info->pool.size);
+   serv_info->pool.used = POOL_ROUND((uintptr_t)serv_info->pool.base) - 
+      (uintptr_t)serv_info->pool.base;
+
+   serv_info->image_data = (unsigned char *)poolAlloc(frame);
+   serv_info->flip_image = (unsigned short *)poolAlloc(frame);
+   serv_info->calib_image = (unsigned short *)poolAlloc(frame);
+   for (i = 0; i < VIDEO_RING_SLOTS; i++) {
+      serv_info->video_ring[i].data = (unsigned char *)poolAlloc(frame);
+   }
+   for (i = 0; i < PIPELINE_BUFFERS; i++) {
+      serv_info->exposure_buffer[i].data = (unsigned char *)poolAlloc(frame);
+   }
+   serv_info->rice_row_size = (int *)poolAlloc(row_size);
+   serv_info->rice_heap = (unsigned char *)poolAlloc(heap);
+   serv_info->rice_table = (unsigned char *)poolAlloc(table);
+   serv_info->tau_image = (unsigned char *)poolAlloc(TAU_IMAGE_MAX);
+
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	     "(%s:%d) %ld byte buffer pool for %dx%d frames",
+	     __FILE__, __LINE__, (long)serv_info->pool.size, max_width,
+	     max_height);
+}
+
+
+#ifndef BENCHMARK
+/*
+ * Read the capabilities of the camera last opened from CAMERA_CACHE, so
+ * the buffers can be sized before the camera is found
+ */
+static PASSFAIL
+loadCameraCache(void)
+{
+   ssize_t n;
+   int fd;
+
+   if ((fd = open(CAMERA_CACHE, O_RDONLY | O_CLOEXEC)) == -1) {
+      return FAIL;
+   }
+   n = read(fd, &camera_cache, sizeof(camera_cache));
+   close(fd);
+   if ((n != sizeof(camera_cache)) || 
+       (camera_cache.magic != CAMERA_CACHE_MAGIC) ||
+       (camera_cache.num_controls < 0) || 
+       (camera_cache.num_controls > MAX_CONTROLS) ||
+       (camera_cache.info.MaxWidth <= 0) || 
+       (camera_cache.info.MaxHeight <= 0)) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) ignoring the camera cache %s",
+		__FILE__, __LINE__, CAMERA_CACHE);
+      memset(&camera_cache, 0, sizeof(camera_cache));
+      return FAIL;
+   }
+   *serv_info->asi_camera_info = camera_cache.info;
+
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	     "(%s:%d) cached camera %s, %dx%d with %d controls",
+	     __FILE__, __LINE__, camera_cache.info.Name, 
+	     camera_cache.info.MaxWidth, camera_cache.info.MaxHeight,
+	     camera_cache.num_controls);
+   return PASS;
+}
+
+
+/*
+ * Write the capabilities of the camera just opened to CAMERA_CACHE.  The
+ * file is replaced in one go, so a server starting meanwhile never reads
+ * half of it.
+ */
+static void
+saveCameraCache(void)
+{
+   const char *path = CAMERA_CACHE ".new";
+   int fd;
+
+   if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 
+		  0664)) == -1) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) unable to create %s : %s (errno=%d)",
+		__FILE__, __LINE__, path, strerror(errno), errno);
+      return;
+   }
+   if ((write(fd, &camera_cache, sizeof(camera_cache)) != 
+	sizeof(camera_cache)) || (close(fd) == -1) ||
+       (rename(path, CAMERA_CACHE) == -1)) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) unable to write %s : %s (errno=%d)",
+		__FILE__, __LINE__, CAMERA_CACHE, strerror(errno), errno);
+      unlink(path);
+   }
+}
+
+
+/*
+ * Set the image size and the buffers for the camera in asi_camera_info.
+ * Start out reading the full, unbinned frame.
+ */
+static void
+setCameraSize(void)
+{
+   serv_info->image_width = serv_info->asi_camera_info->MaxWidth;
+   serv_info->image_height = serv_info->asi_camera_info->MaxHeight;
+   serv_info->readout_width = serv_info->image_width;
+   serv_info->readout_height = serv_info->image_height;
+   serv_info->bin = 1;
+   serv_info->soft_bin = FALSE;
+   serv_info->roi_x = 0;
+   serv_info->roi_y = 0;
+   serv_info->roi_width = serv_info->image_width;
+   serv_info->roi_height = serv_info->image_height;
+   serv_info->roi_asked_x = 0;
+   serv_info->roi_asked_y = 0;
+   serv_info->roi_asked_width = serv_info->roi_width;
+   serv_info->roi_asked_height = serv_info->roi_height;
+
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	     "(%s:%d) width=%d, height=%d",
+	     __FILE__, __LINE__, serv_info->image_width, 
+	     serv_info->image_height);
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	      "(%s:%d) bit depth=%d",
+	      __FILE__, __LINE__, serv_info->asi_camera_info->BitDepth);
+
+   /*
+    * All of the image buffers come from a pool sized for the full frame
+    */
+   if (serv_info->pool.base == NULL) {
+      allocateBuffers(serv_info->image_width, serv_info->image_height);
+   }
+}
+
+
+/*
+ * Find and open the camera.  Only the SDK is talked to here, since this
+ * runs in the background; the server loop loads the settings into the
+ * camera once it is open.  The controls are only asked for when the
+ * camera isn't the one cached.
+ */
+static PASSFAIL
+openCamera(void)
+{
+   ASI_CAMERA_INFO info;
+   int num_controls;
+   int rc;
+   int i;
+
+   /* 
+    * Read the number of connected cameras and make sure only one camera
+    * is found.
+    */
+   if (ASIGetNumOfConnectedCameras() != 1) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) Unable to detect a ZWO camera", __FILE__, __LINE__);
+      return FAIL;
+   }
+
+   /*
+    * Get the camera properties.  A camera of another size than the
+    * buffers were made for is cached all the same, and configureCamera()
+    * makes them over for it.
+    */
+   if ((rc = ASIGetCameraProperty(&info, 0)) != ASI_SUCCESS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) ASIGetCameraProperty() failed: rc=%d", 
+		__FILE__, __LINE__, rc);
+      return FAIL;
+   }
+
+   /*
+    * Open the camera connection
+    */
+   if ((rc = ASIOpenCamera(info.CameraID)) != ASI_SUCCESS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) ASIOpenCamera() failed: rc=%d",
+		__FILE__, __LINE__, rc);
+      return FAIL;
+   }
+
+   /*
+    * Initialize the camera 
+    */
+   if ((rc = ASIInitCamera(info.CameraID)) != ASI_SUCCESS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) ASIInitCamera() failed: rc=%d",
+		__FILE__, __LINE__, rc);
+      ASICloseCamera(info.CameraID);
+      return FAIL;
+   }
+
+   /*
+    * Get the camera controls, unless they are cached
+    */
+   if ((camera_cache.magic != CAMERA_CACHE_MAGIC) ||
+       strcmp(camera_cache.info.Name, info.Name) ||
+       (camera_cache.info.MaxWidth != info.MaxWidth) ||
+       (camera_cache.info.MaxHeight != info.MaxHeight)) {
+      num_controls = 0;
+      if (ASIGetNumOfControls(info.CameraID, &num_controls) != ASI_SUCCESS) {
+	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		   "(%s:%d) Error getting number of controls of camera #0",
+		   __FILE__, __LINE__);
+	 ASICloseCamera(info.CameraID);
+	 return FAIL;
+      }
+      if (num_controls > MAX_CONTROLS) {
+	 num_controls = MAX_CONTROLS;
+      }
+      memset(&camera_cache, 0, sizeof(camera_cache));
+      for (i = 0; i < num_controls; i++) {
+	 if ((rc = ASIGetControlCaps(info.CameraID, i, 
+				     &camera_cache.caps[i])) == ASI_SUCCESS) {
+	    
+	    /*
+	     * Print out the camera properties
+	     */
+	    cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		      "(%s:%d) Property %s: [%ld, %ld] = %ld%s - %s",
+		      __FILE__, __LINE__,
+		      camera_cache.caps[i].Name,
+		      camera_cache.caps[i].MinValue,
+		      camera_cache.caps[i].MaxValue,
+		      camera_cache.caps[i].DefaultValue,
+		      camera_cache.caps[i].IsWritable == 1 ? " (set)" : "",
+		      camera_cache.caps[i].Description
+	       );
+	 }
+      }
+      camera_cache.magic = CAMERA_CACHE_MAGIC;
+      camera_cache.num_controls = num_controls;
+      camera_cache.info = info;
+      saveCameraCache();
+   }
+
+   /*
+    * Hand the camera over, under the lock that the server loop and main()
+    * check the state with
+    */
+   pthread_mutex_lock(&serv_info->camera_lock);
+   if (serv_info->pool.base == NULL) {
+      *serv_info->asi_camera_info = info;
+   }
+   serv_info->asi_camera_info->CameraID = info.CameraID;
+   serv_info->camera_state = CAMERA_OPENED;
+   pthread_cond_broadcast(&serv_info->camera_cond);
+   pthread_mutex_unlock(&serv_info->camera_lock);
+
+   return PASS;
+}
+
+
+/*
+ * Background thread that looks for the camera until it is found, waiting
+ * twice as long after each miss, up to CAMERA_RETRY_MAX seconds
+ */
+static void *
+cameraThread(void *arg)
+{
+   uint64_t event = 1;
+   int wait = CAMERA_RETRY_MIN;
+
+   while (openCamera() != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+		"(%s:%d) no ZWO camera, looking again in %d seconds",
+		__FILE__, __LINE__, wait);
+      sleep(wait);
+      wait = (wait * 2 < CAMERA_RETRY_MAX) ? wait * 2 : CAMERA_RETRY_MAX;
+   }
+
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	     "(%s:%d) opened %s", __FILE__, __LINE__, 
+	     serv_info->asi_camera_info->Name);
+   if (write(serv_info->event_fd, &event, sizeof(event)) == -1) {
+      /* The counter only saturates if nobody has read it for ages */
+   }
+
+   return NULL;
+}
+
+
+/*
+ * Start looking for the camera in the background
+ */
+static void
+startCamera(void)
+{
+   pthread_attr_t attr;
+   pthread_t thread;
+   int rc;
+
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   if ((rc = pthread_create(&thread, &attr, cameraThread, NULL)) != 0) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		"(%s:%d) unable to start the camera thread: %s",
+		__FILE__, __LINE__, strerror(rc));
+      exit(EXIT_FAILURE);
+   }
+   pthread_attr_destroy(&attr);
+}
+
+
+/*
+ * Note a failed call to the camera, with the error the SDK gave or
+ * ASI_SUCCESS if it only said the exposure failed.  The camera is
+ * reconnected when the SDK says it is gone, or after CAMERA_MAX_ERRORS
+ * failures in a row, which is how a camera dropping off the USB bus in
+ * the middle of an exposure usually shows up.
+ */
+static void
+cameraError(int rc)
+{
+   uint64_t event = 1;
+   int failed;
+
+   pthread_mutex_lock(&serv_info->camera_lock);
+   if ((rc == ASI_ERROR_CAMERA_REMOVED) || (rc == ASI_ERROR_CAMERA_CLOSED) ||
+       (rc == ASI_ERROR_INVALID_ID) || 
+       (++serv_info->camera_errors >= CAMERA_MAX_ERRORS)) {
+      serv_info->camera_failed = TRUE;
+   }
+   failed = serv_info->camera_failed;
+   pthread_mutex_unlock(&serv_info->camera_lock);
+   if (failed && (write(serv_info->event_fd, &event, sizeof(event)) == -1)) {
+      /* The counter only saturates if nobody has read it for ages */
+   }
+}
+
+
+/*
+ * Load the current exposure time and gain into the camera.  In video mode
+ * this takes effect from the next frame on.
+ */
+static PASSFAIL
+applyExposureControls(void)
+{
+   int rc;
+
+   /*
+    * Without a camera the settings are only kept, and loaded once it is
+    * back
+    */
+   if (serv_info->camera_state == CAMERA_LOST) {
+      return PASS;
+   }
+
+   /*
+    * Set the exposure time
+    */
+   if ((rc = ASISetControlValue(serv_info->asi_camera_info->CameraID,
+				ASI_EXPOSURE, 
+				(long)(serv_info->etime * 1000000),
+				ASI_FALSE)) != ASI_SUCCESS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) Unable to set exposure time to %f seconds: rc=%d",
+		__FILE__, __LINE__, serv_info->etime, rc);
+      cameraError(rc);
+      return FAIL;
+   }
+
+   /*
+    * Set the gain value
+    */
+   if ((rc = ASISetControlValue(serv_info->asi_camera_info->CameraID,
+				ASI_GAIN, serv_info->gain,
+				ASI_FALSE)) != ASI_SUCCESS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) Unable to set gain to be %d: rc=%d",
+		__FILE__, __LINE__, serv_info->gain, rc);
+      cameraError(rc);
+      return FAIL;
+   }
+
+   return PASS;
+}
+#endif
+
+
+/*
+ * Bin a frame, in place, from the readout size down to the image size
+ * when the camera can't bin by the requested factor itself.  Each output
+ * pixel is the average of its bin x bin block so the result keeps the
+ * 16-bit range of the camera.
+ */
+static void
+binFrame(unsigned short *frame)
+{
+   int n = serv_info->bin;
+   unsigned int sum;
+   int x, y, i, j;
+
+   if (!serv_info->soft_bin) {
+      return;
+   }
+
+   /*
+    * Output pixels are always written behind the input still to be read,
+    * so the frame can be reduced in place
+    */
+   for (y = 0; y < serv_info->image_height; y++) {
+      for (x = 0; x < serv_info->image_width; x++) {
+	 const unsigned short *block 
+	    = frame + (y * n) * serv_info->readout_width + x * n;
+
+	 sum = 0;
+	 for (j = 0; j < n; j++) {
+	    for (i = 0; i < n; i++) {
+	       sum += block[j * serv_info->readout_width + i];
+	    }
+	 }
+	 frame[y * serv_info->image_width + x] 
+	    = (unsigned short)((sum + (n * n) / 2) / (n * n));
+      }
+   }
+}
+
+
+#ifndef BENCHMARK
+/*
+ * Background thread for the free-running capture.  Each frame the camera
+ * streams is read into the oldest slot of the ring that no client is
+ * reading, so a request for the latest frames never waits on an exposure.
+ */
+static void *
+videoCaptureThread(void *arg)
+{
+   video_frame_t *frame;
+   long size;
+   int wait_ms;
+   int rc;
+   int i;
+
+   size = (long)serv_info->readout_width * serv_info->readout_height * 
+      sizeof(uint16_t);
+   for (;;) {
+
+      /*
+       * Pick the slot to fill while nobody can pin it
+       */
+      pthread_mutex_lock(&serv_info->video_lock);
+      if (!serv_info->video_running) {
+	 pthread_mutex_unlock(&serv_info->video_lock);
+	 break;
+      }
+      frame = NULL;
+      for (i = 0; i < VIDEO_RING_SLOTS; i++) {
+	 if ((serv_info->video_ring[i].readers == 0) &&
+	     ((frame == NULL) || 
+	      (serv_info->video_ring[i].sequence < frame->sequence))) {
+	    frame = &serv_info->video_ring[i];
+	 }
+      }
+      if (frame != NULL) {
+	 frame->sequence = 0;
+      }
+      wait_ms = (int)(serv_info->etime * 2000) + VIDEO_WAIT_MARGIN;
+      pthread_mutex_unlock(&serv_info->video_lock);
+
+      if (frame == NULL) {
+	 usleep(5000);
+	 continue;
+      }
+
+      /*
+       * Read the next frame out of the camera and publish it
+       */
+      rc = ASIGetVideoData(serv_info->asi_camera_info->CameraID, 
+			   frame->data, size, wait_ms);
+      if (rc == ASI_SUCCESS) {
+	 binFrame((unsigned short *)frame->data);
+      }
+      pthread_mutex_lock(&serv_info->video_lock);
+      if (rc == ASI_SUCCESS) {
+	 frame->timestamp = getClockTime();
+	 frame->sequence = ++(serv_info->video_sequence);
+      }
+      pthread_mutex_unlock(&serv_info->video_lock);
+
+      /*
+       * The wait covers two exposures, so a camera that times out again
+       * and again has gone away too
+       */
+      if (rc == ASI_SUCCESS) {
+	 serv_info->camera_errors = 0;
+      }
+      else {
+	 cameraError(rc);
+      }
+      if ((rc != ASI_SUCCESS) && (rc != ASI_ERROR_TIMEOUT)) {
+	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		   "(%s:%d) ASIGetVideoData() failed: rc=%d",
+		   __FILE__, __LINE__, rc);
+	 usleep(100000);
+      }
+   }
+
+   return NULL;
+}
+
+
+/*
+ * Put the camera in video mode and start filling the capture ring
+ */
+static PASSFAIL
+startVideoCapture(void)
+{
+   int rc;
+   int i;
+
+   if (serv_info->video_running) {
+      return PASS;
+   }
+
+   /*
+    * Empty the ring
+    */
+   for (i = 0; i < VIDEO_RING_SLOTS; i++) {
+      serv_info->video_ring[i].sequence = 0;
+      serv_info->video_ring[i].readers = 0;
+   }
+
+   if (applyExposureControls() != PASS) {
+      return FAIL;
+   }
+   if ((rc = ASIStartVideoCapture(serv_info->asi_camera_info->CameraID)) 
+       != ASI_SUCCESS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) ASIStartVideoCapture() failed: rc=%d",
+		__FILE__, __LINE__, rc);
+      return FAIL;
+   }
+
+   serv_info->video_running = 1;
+   if ((rc = pthread_create(&serv_info->video_thread, NULL,
+			    videoCaptureThread, NULL)) != 0) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) unable to start video capture thread: %s",
+		__FILE__, __LINE__, strerror(rc));
+      serv_info->video_running = 0;
+      ASIStopVideoCapture(serv_info->asi_camera_info->CameraID);
+      return FAIL;
+   }
+
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	     "(%s:%d) video capture started", __FILE__, __LINE__);
+   return PASS;
+}
+
+
+/*
+ * Stop the free-running capture and take the camera out of video mode
+ */
+static void
+stopVideoCapture(void)
+{
+   if (!serv_info->video_running) {
+      return;
+   }
+
+   pthread_mutex_lock(&serv_info->video_lock);
+   serv_info->video_running = 0;
+   pthread_mutex_unlock(&serv_info->video_lock);
+   pthread_join(serv_info->video_thread, NULL);
+   ASIStopVideoCapture(serv_info->asi_camera_info->CameraID);
+
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	     "(%s:%d) video capture stopped", __FILE__, __LINE__);
+}
+
+
+/*
+ * Background thread for pipelined exposures.  As soon as one exposure has
+ * been read out the next one is started, so the camera keeps exposing
+ * while the server loop encodes and sends the previous image.  The thread
+ * only stalls when both buffers are waiting for the client.
+ */
+static void *
+pipelineThread(void *arg)
+{
+   ASI_EXPOSURE_STATUS asi_exp_status;
+   exposure_buffer_t *buf;
+   uint64_t event = 1;
+   unsigned int generation;
+   unsigned int applied = 0;
+   double start_ts, done_ts;
+   long size;
+   int rc;
+   int i;
+
+   size = (long)serv_info->readout_width * serv_info->readout_height * 
+      sizeof(uint16_t);
+   for (;;) {
+
+      /*
+       * Wait for a buffer to read the next exposure into
+       */
+      pthread_mutex_lock(&serv_info->pipeline_lock);
+      buf = NULL;
+      while (serv_info->pipeline_running) {
+	 for (i = 0; i < PIPELINE_BUFFERS; i++) {
+	    if (!serv_info->exposure_buffer[i].filled) {
+	       buf = &serv_info->exposure_buffer[i];
+	       break;
+	    }
+	 }
+	 if (buf != NULL) {
+	    break;
+	 }
+	 pthread_cond_wait(&serv_info->pipeline_cond, 
+			   &serv_info->pipeline_lock);
+      }
+      generation = serv_info->pipeline_generation;
+      pthread_mutex_unlock(&serv_info->pipeline_lock);
+      if (buf == NULL) {
+	 break;
+      }
+
+      /*
+       * Load new settings into the camera between exposures only
+       */
+      if ((generation != applied) && (applyExposureControls() == PASS)) {
+	 applied = generation;
+      }
+
+      /*
+       * Expose and read out
+       */
+      start_ts = getClockTime();
+      if ((rc = ASIStartExposure(serv_info->asi_camera_info->CameraID, 
+				 ASI_FALSE)) != ASI_SUCCESS) {
+	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		   "(%s:%d) Unable to start exposure: rc=%d",
+		   __FILE__, __LINE__, rc);
+	 cameraError(rc);
+	 usleep(100000);
+	 continue;
+      }
+      ASIGetExpStatus(serv_info->asi_camera_info->CameraID, &asi_exp_status);
+      while ((asi_exp_status == ASI_EXP_WORKING) && 
+	     serv_info->pipeline_running) {
+	 usleep(5000);
+	 ASIGetExpStatus(serv_info->asi_camera_info->CameraID, 
+			 &asi_exp_status);
+      }
+      if (asi_exp_status == ASI_EXP_WORKING) {
+	 ASIStopExposure(serv_info->asi_camera_info->CameraID);
+	 break;
+      }
+      if (asi_exp_status != ASI_EXP_SUCCESS) {
+	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		   "(%s:%d) Pipelined exposure failed: status=%d",
+		   __FILE__, __LINE__, asi_exp_status);
+	 cameraError(ASI_SUCCESS);
+	 usleep(100000);
+	 continue;
+      }
+      done_ts = getClockTime();
+      if ((rc = ASIGetDataAfterExp(serv_info->asi_camera_info->CameraID, 
+				   buf->data, size)) != ASI_SUCCESS) {
+	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		   "(%s:%d) Unable to read out image: rc=%d",
+		   __FILE__, __LINE__, rc);
+	 cameraError(rc);
+	 usleep(100000);
+	 continue;
+      }
+      serv_info->camera_errors = 0;
+
+      binFrame((unsigned short *)buf->data);
+
+      /*
+       * Hand the image over to the server loop
+       */
+      pthread_mutex_lock(&serv_info->pipeline_lock);
+      buf->exp_start_ts = start_ts;
+      buf->exp_done_ts = done_ts;
+      buf->readout_done_ts = getClockTime();
+      buf->generation = applied;
+      buf->sequence = ++(serv_info->pipeline_sequence);
+      buf->filled = 1;
+      pthread_cond_broadcast(&serv_info->pipeline_cond);
+      pthread_mutex_unlock(&serv_info->pipeline_lock);
+      if (write(serv_info->event_fd, &event, sizeof(event)) == -1) {
+	 /* The counter only saturates if nobody has read it for ages */
+      }
+   }
+
+   return NULL;
+}
+
+
+/*
+ * Start exposing back to back through the double-buffered pipeline
+ */
+static PASSFAIL
+startPipeline(void)
+{
+   int rc;
+   int i;
+
+   if (serv_info->pipeline_running) {
+      return PASS;
+   }
+
+   /*
+    * Empty the buffers
+    */
+   for (i = 0; i < PIPELINE_BUFFERS; i++) {
+      serv_info->exposure_buffer[i].filled = 0;
+   }
+
+   /*
+    * Make the thread load the current settings before its first exposure
+    */
+   serv_info->pipeline_generation++;
+   serv_info->pipeline_running = 1;
+   if ((rc = pthread_create(&serv_info->pipeline_thread, NULL,
+			    pipelineThread, NULL)) != 0) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) unable to start exposure pipeline thread: %s",
+		__FILE__, __LINE__, strerror(rc));
+      serv_info->pipeline_running = 0;
+      return FAIL;
+   }
+
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	     "(%s:%d) exposure pipeline started", __FILE__, __LINE__);
+   return PASS;
+}
+
+
+/*
+ * Stop the exposure pipeline, aborting the exposure in progress
+ */
+static void
+stopPipeline(void)
+{
+   if (!serv_info->pipeline_running) {
+      return;
+   }
+
+   pthread_mutex_lock(&serv_info->pipeline_lock);
+   serv_info->pipeline_running = 0;
+   pthread_cond_broadcast(&serv_info->pipeline_cond);
+   pthread_mutex_unlock(&serv_info->pipeline_lock);
+   pthread_join(serv_info->pipeline_thread, NULL);
+
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	     "(%s:%d) exposure pipeline stopped", __FILE__, __LINE__);
+}
+
+
+/*
+ * Let the pipeline know the exposure time or gain changed.  Images that
+ * were taken with the old settings are thrown away.
+ */
+static void
+updatePipeline(void)
+{
+   pthread_mutex_lock(&serv_info->pipeline_lock);
+   serv_info->pipeline_generation++;
+   pthread_mutex_unlock(&serv_info->pipeline_lock);
+}
+
+
+/*
+ * Pick the exposure time and gain for the next exposure from the
+ * histogram of the image just read out.  The sensor is linear, so the
+ * level of its bright end, AUTO_PERCENTILE up the histogram, is scaled
+ * onto AUTO_TARGET in a single step instead of being searched for.  Only
+ * a saturated or an empty image, which don't say by how much, are moved
+ * by AUTO_MAX_STEP, and a change within AUTO_DEADBAND is left alone so
+ * the settings don't dither.  The exposure time goes up to the longest
+ * one allowed before any gain is added.
+ */
+static void
+autoExposure(const unsigned short *pixels)
+{
+   unsigned int histogram[AUTO_BINS];
+   size_t npixels = (size_t)serv_info->image_width * serv_info->image_height;
+   size_t count = 0;
+   size_t rank, i;
+   double level, factor, exposure, etime;
+   int gain;
+   int bin;
+
+   memset(histogram, 0, sizeof(histogram));
+   for (i = 0; i < npixels; i += AUTO_STRIDE) {
+      histogram[pixels[i] * AUTO_BINS / 65536]++;
+      count++;
+   }
+   if (count == 0) {
+      return;
+   }
+   rank = (size_t)(count * AUTO_PERCENTILE);
+   for (bin = 0; bin < AUTO_BINS - 1; bin++) {
+      if (histogram[bin] > rank) {
+	 break;
+      }
+      rank -= histogram[bin];
+   }
+   level = (bin + 0.5) * 65536 / AUTO_BINS;
+
+   if (level >= AUTO_SATURATED) {
+      factor = 1.0 / AUTO_MAX_STEP;
+   }
+   else if (level - AUTO_BLACK < AUTO_MIN_SIGNAL) {
+      factor = AUTO_MAX_STEP;
+   }
+   else {
+      factor = (AUTO_TARGET - AUTO_BLACK) / (level - AUTO_BLACK);
+      if (factor > AUTO_MAX_STEP) {
+	 factor = AUTO_MAX_STEP;
+      }
+      if (factor < 1.0 / AUTO_MAX_STEP) {
+	 factor = 1.0 / AUTO_MAX_STEP;
+      }
+   }
+   if (fabs(factor - 1.0) < AUTO_DEADBAND) {
+      return;
+   }
+
+   /*
+    * The gain is in 0.1 dB, so it multiplies the signal by 10^(gain/200)
+    */
+   exposure = serv_info->etime * pow(10.0, serv_info->gain / 200.0) * factor;
+   if (exposure <= serv_info->auto_max_etime) {
+      etime = exposure;
+      gain = MIN_GAIN;
+   }
+   else {
+      etime = serv_info->auto_max_etime;
+      gain = (int)(200.0 * log10(exposure / etime) + 0.5);
+      if (gain > MAX_GAIN) {
+	 gain = MAX_GAIN;
+      }
+   }
+   etime = (int)(etime / AUTO_ETIME_STEP + 0.5) * AUTO_ETIME_STEP;
+   if (etime < AUTO_ETIME_STEP) {
+      etime = AUTO_ETIME_STEP;
+   }
+   if ((fabs(etime - serv_info->etime) < 0.0001) && 
+       (gain == serv_info->gain)) {
+      return;
+   }
+
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	     "(%s:%d) auto exposure: level %.0f, etime %.3f -> %.3f,"
+	     " gain %d -> %d", __FILE__, __LINE__, level, serv_info->etime,
+	     etime, serv_info->gain, gain);
+   serv_info->etime = etime;
+   serv_info->gain = gain;
+   if (serv_info->video_running) {
+      applyExposureControls();
+   }
+   if (serv_info->pipeline_running) {
+      updatePipeline();
+   }
+
+   pthread_mutex_lock(&ss_lock);
+   if (ssPutPrintf(SS_ETIME, "%.4f", serv_info->etime) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
+		"(%s:%d) ssPutPrintf of %s failed: %s", 
+		__FILE__, __LINE__, SS_ETIME, ssGetStrError());
+   }
+   if (ssPutPrintf(SS_GAIN, "%d", serv_info->gain) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
+		"(%s:%d) ssPutPrintf of %s failed: %s", 
+		__FILE__, __LINE__, SS_GAIN, ssGetStrError());
+   }
+   pthread_mutex_unlock(&ss_lock);
+}
+
+
+/*
+ * Set the exposure time
+ */
+static PASSFAIL
+com_etime(const char *arg)
+{
+   double new_etime;
+   char *s = cli_arg1(arg);
+   char *colon = strchr(s, ':');
+   double tgt_min = 0.001, tgt_max = 600.0, tgt_stp = 0.001;
+
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	     "(%s:%d) com_etime (args=%s)", __FILE__, __LINE__, arg);
+
+   if (colon) {
+      new_etime = atoi(s) * 60.0 + atof(colon+1);
+   }
+   else {
+      new_etime = atof(s);
+   }
+   free(s);
+
+   if (new_etime != 0) {
+
+      /*
+       * Round to nearest tgt_stp
+       */
+      new_etime += tgt_stp/2.;
+      new_etime = (int)(new_etime / tgt_stp) * tgt_stp;
+      if (new_etime > tgt_max) new_etime = tgt_max;
+      if (new_etime < tgt_min) new_etime = tgt_min;
+
+      if (fabs(serv_info->etime - new_etime) > 0.0001) {
+	 serv_info->etime = new_etime;
+      }
+   }
+
+   if (serv_info->video_running) {
+      applyExposureControls();
+   }
+   if (serv_info->pipeline_running) {
+      updatePipeline();
+   }
+
+   pthread_mutex_lock(&ss_lock);
+   if (ssPutPrintf(SS_ETIME, 
+		   "%.4f", serv_info->etime) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
+		"(%s:%d) ssPutPrintf of %s failed: %s", 
+		__FILE__, __LINE__, SS_ETIME, 
+		ssGetStrError());
+   }
+   pthread_mutex_unlock(&ss_lock);
+
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	     "(%s:%d) etime set to %.3f", 
+	     __FILE__, __LINE__, serv_info->etime);
+
+   sprintf(serv_info->response_buffer, ". etime %.3f", serv_info->etime);
+
+   return PASS;
+}
+
+
+/*
+ * Set the gain value
+ */
+static PASSFAIL
+com_gain(const char *arg)
+{
+   char *s = cli_arg1(arg);
+   int gain = 0;
+
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	     "(%s:%d) com_gain (args=%s)", __FILE__, __LINE__, arg);
+
+   gain = atoi(s);
+   if (gain < MIN_GAIN || gain > MAX_GAIN) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) Invalid gain specified: %s should be between %d and"
+		" %d", __FILE__, __LINE__, s, MIN_GAIN, MAX_GAIN);
+      free(s);
+      sprintf(serv_info->response_buffer, "! gain \"invalid value\"");
+      return PASS;
+   }
+   free(s);
+   serv_info->gain = gain;
+   if (serv_info->video_running) {
+      applyExposureControls();
+   }
+   if (serv_info->pipeline_running) {
+      updatePipeline();
+   }
+
+   /*
+    * Store the new gain value in the Status Server
+    */
+   pthread_mutex_lock(&ss_lock);
+   if (ssPutPrintf(SS_GAIN, 
+		   "%d", serv_info->gain) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
+	 	"(%s:%d) ssPutPrintf of %s failed: %s", 
+		__FILE__, __LINE__, SS_GAIN, 
+		ssGetStrError());
+   }
+   pthread_mutex_unlock(&ss_lock);
+
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	     "(%s:%d) gain set to %d", 
+	     __FILE__, __LINE__, serv_info->gain);
+
+   sprintf(serv_info->response_buffer, ". gain %d", serv_info->gain);
+
+   return PASS;
+}
+
+
+/*
+ * Turn the automatic exposure on or off.  With it on, the exposure time
+ * and gain are set from each image taken for the next one, with
+ * exposures up to the optional <sec> before gain is added.
+ */
+static PASSFAIL
+com_auto(const char *arg)
+{
+   char mode[8];
+   double max_etime;
+   int nargs;
+
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	     "(%s:%d) com_auto (args=%s)", __FILE__, __LINE__, arg);
+
+   nargs = (arg == NULL) ? 0 : sscanf(arg, "%7s %lf", mode, &max_etime);
+   if ((nargs >= 1) && !strcasecmp(mode, "on")) {
+      if (nargs == 2) {
+	 if ((max_etime < AUTO_ETIME_STEP) || 
+	     (max_etime > MAX_EXPOSURE_DELAY)) {
+	    sprintf(serv_info->response_buffer, 
+		    "! auto \"longest exposure must be %g to %d seconds\"",
+		    AUTO_ETIME_STEP, MAX_EXPOSURE_DELAY);
+	    return PASS;
+	 }
+	 serv_info->auto_max_etime = max_etime;
+      }
+      serv_info->auto_exposure = TRUE;
+   }
+   else if ((nargs == 1) && !strcasecmp(mode, "off")) {
+      serv_info->auto_exposure = FALSE;
+   }
+   else {
+      sprintf(serv_info->response_buffer, "! auto \"use on [sec] or off\"");
+      return PASS;
+   }
+
+   if (serv_info->auto_exposure) {
+      sprintf(serv_info->response_buffer, ". auto on %.3f", 
+	      serv_info->auto_max_etime);
+   }
+   else {
+      sprintf(serv_info->response_buffer, ". auto off");
+   }
+
+   return PASS;
+}
+
+
+/*
+ * Turn the free-running capture on or off
+ */
+static PASSFAIL
+com_video(const char *arg)
+{
+   char *s = cli_arg1(arg);
+
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	     "(%s:%d) com_video (args=%s)", __FILE__, __LINE__, arg);
+
+   if (serv_info->exposing) {
+      free(s);
+      sprintf(serv_info->response_buffer, 
+	      "! video \"an exposure is in progress\"");
+      return PASS;
+   }
+
+   if (!strcasecmp(s, "on")) {
+      free(s);
+      if (serv_info->camera_state != CAMERA_READY) {
+	 sprintf(serv_info->response_buffer, 
+		 "! video \"the camera is reconnecting\"");
+	 return PASS;
+      }
+      stopPipeline();
+      if (startVideoCapture() != PASS) {
+	 sprintf(serv_info->response_buffer, 
+		 "! video \"unable to start video capture\"");
+	 return PASS;
+      }
+   }
+   else if (!strcasecmp(s, "off")) {
+      free(s);
+      stopVideoCapture();
+      serv_info->camera_video = FALSE;
+   }
+   else {
+      free(s);
+      sprintf(serv_info->response_buffer, "! video \"use on or off\"");
+      return PASS;
+   }
+
+   sprintf(serv_info->response_buffer, ". video %s", 
+	   serv_info->video_running ? "on" : "off");
+
+   return PASS;
+}
+
+
+/*
+ * Turn pipelined back to back exposures on or off
+ */
+static PASSFAIL
+com_pipeline(const char *arg)
+{
+   char *s = cli_arg1(arg);
+
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	     "(%s:%d) com_pipeline (args=%s)", __FILE__, __LINE__, arg);
+
+   if (serv_info->exposing) {
+      free(s);
+      sprintf(serv_info->response_buffer, 
+	      "! pipeline \"an exposure is in progress\"");
+      return PASS;
+   }
+
+   if (!strcasecmp(s, "on")) {
+      free(s);
+      if (serv_info->camera_state != CAMERA_READY) {
+	 sprintf(serv_info->response_buffer, 
+		 "! pipeline \"the camera is reconnecting\"");
+	 return PASS;
+      }
+      stopVideoCapture();
+      if (startPipeline() != PASS) {
+	 sprintf(serv_info->response_buffer, 
+		 "! pipeline \"unable to start the exposure pipeline\"");
+	 return PASS;
+      }
+   }
+   else if (!strcasecmp(s, "off")) {
+      free(s);
+      stopPipeline();
+      serv_info->camera_pipeline = FALSE;
+   }
+   else {
+      free(s);
+      sprintf(serv_info->response_buffer, "! pipeline \"use on or off\"");
+      return PASS;
+   }
+
+   sprintf(serv_info->response_buffer, ". pipeline %s", 
+	   serv_info->pipeline_running ? "on" : "off");
+
+   return PASS;
+}
+
+
+/*
+ * Load a readout format into the camera: the region read out, which it
+ * takes in binned pixels when 'hw_bin' is set, and the binning factor.
+ * Returns the error from the SDK.
+ */
+static int
+loadReadoutFormat(int bin, int hw_bin, int x, int y, int readout_width,
+		  int readout_height)
+{
+   ASI_CAMERA_INFO *info = serv_info->asi_camera_info;
+   int rc;
+
+   if ((rc = ASISetROIFormat(info->CameraID, readout_width, readout_height,
+			     hw_bin ? bin : 1, ASI_IMG_RAW16)) != ASI_SUCCESS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) ASISetROIFormat() failed: rc=%d", 
+		__FILE__, __LINE__, rc);
+   }
+   else if ((rc = ASISetStartPos(info->CameraID, hw_bin ? x / bin : x,
+				 hw_bin ? y / bin : y)) != ASI_SUCCESS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) ASISetStartPos() failed: rc=%d", 
+		__FILE__, __LINE__, rc);
+   }
+
+   return rc;
+}
+
+
+/*
+ * Switch the camera to a new binning factor and region of interest.  The
+ * region is in unbinned sensor pixels and is trimmed to what the camera
+ * can read out; the region asked for is kept as well, so that another
+ * binning factor later is fitted to it rather than to the trimmed one.
+ * Binning factors the camera doesn't support are done in software from
+ * an unbinned readout.  If the camera won't take the new format it is
+ * put back to the one it had.
+ */
+static PASSFAIL
+setReadoutFormat(int bin, int x, int y, int width, int height)
+{
+   ASI_CAMERA_INFO *info = serv_info->asi_camera_info;
+   int was_video = serv_info->video_running;
+   int was_pipeline = serv_info->pipeline_running;
+   int asked_x = x, asked_y = y;
+   int asked_width = width, asked_height = height;
+   int hw_bin = FALSE;
+   int readout_width, readout_height;
+   int rc;
+   int i;
+
+   /*
+    * The camera wants the binned width to be a multiple of 8 and the
+    * binned height a multiple of 2
+    */
+   x -= x % bin;
+   y -= y % bin;
+   width -= width % (8 * bin);
+   height -= height % (2 * bin);
+   if ((x < 0) || (y < 0) || (width <= 0) || (height <= 0) ||
+       (x + width > info->MaxWidth) || (y + height > info->MaxHeight)) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) invalid region %d %d %d %d for bin %d",
+		__FILE__, __LINE__, x, y, width, height, bin);
+      return FAIL;
+   }
+   for (i = 0; (i < 16) && (info->SupportedBins[i] != 0); i++) {
+      if (info->SupportedBins[i] == bin) {
+	 hw_bin = TRUE;
+      }
+   }
+   readout_width = hw_bin ? width / bin : width;
+   readout_height = hw_bin ? height / bin : height;
+
+   /*
+    * The background capture has to stop while the format changes
+    */
+   stopVideoCapture();
+   stopPipeline();
+
+   /*
+    * Set the format in the camera.  Without a camera it is only kept, and
+    * set once it is back.  If the camera refuses it, the format it had
+    * is loaded again and the capture carries on with that.
+    */
+   if ((serv_info->camera_state != CAMERA_LOST) &&
+       (loadReadoutFormat(bin, hw_bin, x, y, readout_width, 
+			  readout_height) != ASI_SUCCESS)) {
+      if ((rc = loadReadoutFormat(serv_info->bin, !serv_info->soft_bin,
+				  serv_info->roi_x, serv_info->roi_y,
+				  serv_info->readout_width,
+				  serv_info->readout_height)) != ASI_SUCCESS) {
+	 cameraError(rc);
+      }
+      if (was_video) {
+	 startVideoCapture();
+      }
+      if (was_pipeline) {
+	 startPipeline();
+      }
+      return FAIL;
+   }
+
+   serv_info->bin = bin;
+   serv_info->soft_bin = (bin > 1) && !hw_bin;
+   serv_info->roi_x = x;
+   serv_info->roi_y = y;
+   serv_info->roi_width = width;
+   serv_info->roi_height = height;
+   serv_info->roi_asked_x = asked_x;
+   serv_info->roi_asked_y = asked_y;
+   serv_info->roi_asked_width = asked_width;
+   serv_info->roi_asked_height = asked_height;
+   serv_info->readout_width = readout_width;
+   serv_info->readout_height = readout_height;
+   serv_info->image_width = width / bin;
+   serv_info->image_height = height / bin;
+
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	     "(%s:%d) readout %dx%d at %d,%d bin %d (%s), image %dx%d",
+	     __FILE__, __LINE__, width, height, x, y, bin, 
+	     serv_info->soft_bin ? "software" : "hardware",
+	     serv_info->image_width, serv_info->image_height);
+
+   /*
+    * Pick up where the background capture left off
+    */
+   if (was_video) {
+      startVideoCapture();
+   }
+   if (was_pipeline) {
+      startPipeline();
+   }
+
+   return PASS;
+}
+
+
+/*
+ * Give up on the camera once it has gone away, and start looking for it
+ * again in the background.  The clients stay connected, and get an error
+ * for any image they ask for until it is back.
+ */
+static void
+lostCamera(void)
+{
+   cfht_logv(CFHT_MAIN, CFHT_WARN,
+	     "(%s:%d) lost the ZWO camera, reconnecting", 
+	     __FILE__, __LINE__);
+
+   serv_info->camera_video = serv_info->video_running;
+   serv_info->camera_pipeline = serv_info->pipeline_running;
+   stopVideoCapture();
+   stopPipeline();
+   ASICloseCamera(serv_info->asi_camera_info->CameraID);
+
+   pthread_mutex_lock(&serv_info->camera_lock);
+   serv_info->camera_state = CAMERA_LOST;
+   serv_info->camera_failed = FALSE;
+   serv_info->camera_errors = 0;
+   pthread_mutex_unlock(&serv_info->camera_lock);
+   startCamera();
+}
+
+
+/*
+ * Take on a camera of another size than the one the buffers were made
+ * for, such as one swapped in for the camera in CAMERA_CACHE.  Nothing
+ * uses the buffers while a camera is being configured, so they are made
+ * over for it, and it starts out reading its full frame.
+ */
+static void
+resizeCamera(void)
+{
+   int camera_id = serv_info->asi_camera_info->CameraID;
+
+   cfht_logv(CFHT_MAIN, CFHT_WARN,
+	     "(%s:%d) %s is %dx%d, not %dx%d; resizing the buffers for it",
+	     __FILE__, __LINE__, camera_cache.info.Name, 
+	     camera_cache.info.MaxWidth, camera_cache.info.MaxHeight,
+	     serv_info->asi_camera_info->MaxWidth,
+	     serv_info->asi_camera_info->MaxHeight);
+   *serv_info->asi_camera_info = camera_cache.info;
+   serv_info->asi_camera_info->CameraID = camera_id;
+   free(serv_info->pool.base);
+   serv_info->pool.base = NULL;
+   setCameraSize();
+   if (preview.row_sum != NULL) {
+      free(preview.row_sum);
+      preview.row_sum = (unsigned int *)
+	 cli_malloc(serv_info->image_width * sizeof(unsigned int));
+   }
+}
+
+
+/*
+ * Load the settings into the camera just opened, and pick up the
+ * background capture where it was left off when the camera was lost
+ */
+static void
+configureCamera(void)
+{
+   int rc;
+
+   if ((camera_cache.info.MaxWidth != serv_info->asi_camera_info->MaxWidth) ||
+       (camera_cache.info.MaxHeight != 
+	serv_info->asi_camera_info->MaxHeight)) {
+      resizeCamera();
+   }
+
+   if (setReadoutFormat(serv_info->bin, serv_info->roi_asked_x, 
+			serv_info->roi_asked_y, serv_info->roi_asked_width,
+			serv_info->roi_asked_height) != PASS) {
+      lostCamera();
+      return;
+   }
+
+   /*
+    * Set the high speed mode to be off
+    */
+   if ((rc = ASISetControlValue(serv_info->asi_camera_info->CameraID,
+				ASI_HIGH_SPEED_MODE, 0,
+				ASI_FALSE)) != ASI_SUCCESS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) Unable to set high speed mode to be 0: rc=%d",
+		__FILE__, __LINE__, rc);
+      lostCamera();
+      return;
+   }
+   if (applyExposureControls() != PASS) {
+      lostCamera();
+      return;
+   }
+
+   pthread_mutex_lock(&serv_info->camera_lock);
+   serv_info->camera_state = CAMERA_READY;
+   serv_info->camera_failed = FALSE;
+   serv_info->camera_errors = 0;
+   pthread_mutex_unlock(&serv_info->camera_lock);
+   if (serv_info->camera_video) {
+      startVideoCapture();
+   }
+   if (serv_info->camera_pipeline) {
+      startPipeline();
+   }
+   serv_info->camera_video = FALSE;
+   serv_info->camera_pipeline = FALSE;
+
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	     "(%s:%d) Camera is ready to take images", __FILE__, __LINE__);
+}
+
+
+/*
+ * Reconnect the camera if it has gone, and put it back in service once
+ * the background thread has opened it again
+ */
+static void
+checkCamera(void)
+{
+   camera_state_t state;
+   int failed;
+
+   pthread_mutex_lock(&serv_info->camera_lock);
+   state = serv_info->camera_state;
+   failed = serv_info->camera_failed;
+   pthread_mutex_unlock(&serv_info->camera_lock);
+   if (state == CAMERA_OPENED) {
+      configureCamera();
+   }
+   else if ((state == CAMERA_READY) && failed) {
+      lostCamera();
+   }
+}
+
+
+/*
+ * Set the binning factor
+ */
+static PASSFAIL
+com_bin(const char *arg)
+{
+   char *s = cli_arg1(arg);
+   int bin;
+
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	     "(%s:%d) com_bin (args=%s)", __FILE__, __LINE__, arg);
+
+   if (serv_info->exposing) {
+      free(s);
+      sprintf(serv_info->response_buffer, 
+	      "! bin \"an exposure is in progress\"");
+      return PASS;
+   }
+
+   bin = atoi(s);
+   free(s);
+   if ((bin < 1) || (bin > MAX_BIN)) {
+      sprintf(serv_info->response_buffer, 
+	      "! bin \"binning must be between 1 and %d\"", MAX_BIN);
+      return PASS;
+   }
+   if (setReadoutFormat(bin, serv_info->roi_asked_x, serv_info->roi_asked_y,
+			serv_info->roi_asked_width, 
+			serv_info->roi_asked_height) != PASS) {
+      sprintf(serv_info->response_buffer, "! bin \"unable to set binning\"");
+      return PASS;
+   }
+
+   sprintf(serv_info->response_buffer, ". bin %d %s", serv_info->bin,
+	   serv_info->soft_bin ? "software" : "hardware");
+
+   return PASS;
+}
+
+
+/*
+ * Set the region of interest in unbinned sensor pixels.  Without
+ * arguments the full sensor is read out again.
+ */
+static PASSFAIL
+com_roi(const char *arg)
+{
+   int x, y, width, height;
+
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	     "(%s:%d) com_roi (args=%s)", __FILE__, __LINE__, arg);
+
+   if (serv_info->exposing) {
+      sprintf(serv_info->response_buffer, 
+	      "! roi \"an exposure is in progress\"");
+      return PASS;
+   }
+
+   if ((arg == NULL) || (*arg == '\0')) {
+      x = 0;
+      y = 0;
+      width = serv_info->asi_camera_info->MaxWidth;
+      height = serv_info->asi_camera_info->MaxHeight;
+   }
+   else if (sscanf(arg, "%d %d %d %d", &x, &y, &width, &height) != 4) {
+      sprintf(serv_info->response_buffer, "! roi \"use roi x y w h\"");
+      return PASS;
+   }
+   if (setReadoutFormat(serv_info->bin, x, y, width, height) != PASS) {
+      sprintf(serv_info->response_buffer, "! roi \"invalid region\"");
+      return PASS;
+   }
+
+   sprintf(serv_info->response_buffer, ". roi %d %d %d %d", 
+	   serv_info->roi_x, serv_info->roi_y, 
+	   serv_info->roi_width, serv_info->roi_height);
+
+   return PASS;
+}
+#endif
+
+
+/*
+ * Release the mapping of the last FITS image built for a client.  The
+ * memfd behind it stays open so it can be reused for the next image.  A
+ * subscriber only drops its reference to the shared image it was sent,
+ * and an archived image lets go of its segment.
+ */
+static void
+releaseImageData(client_info_t *cinfo)
+{
+   if (cinfo->shared != NULL) {
+      cinfo->shared->refs--;
+      cinfo->shared = NULL;
+      cinfo->image_data = NULL;
+      cinfo->image_size = 0;
+      return;
+   }
+   if (cinfo->image_data != NULL) {
+      munmap(cinfo->image_data, cinfo->image_size);
+      cinfo->image_data = NULL;
+      cinfo->image_size = 0;
+   }
+   if (cinfo->archived) {
+      archive.readers[cinfo->archive_segment]--;
+      cinfo->archived = FALSE;
+   }
+}
+
+
+/*
+ * Get the in-memory file that a client's FITS image is built in, rewound
+ * to the start.  The file is created on the first image request and is
+ * then overwritten in place for every image after that, so the FITS data
+ * never goes to the SD card and the pages are reused from frame to frame.
+ */
+static int
+openImageFile(client_info_t *cinfo)
+{
+   releaseImageData(cinfo);
+
+   if (cinfo->image_fd == -1) {
+      if ((cinfo->image_fd = memfd_create(IMAGE_MEMFD_NAME, MFD_CLOEXEC))
+	  == -1) {
+	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		   "(%s:%d) unable to create in-memory image file.  %s"
+		   " (errno=%d)", __FILE__, __LINE__, strerror(errno), errno);
+	 return -1;
+      }
+   }
+   if (lseek(cinfo->image_fd, 0, SEEK_SET) == -1) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) unable to rewind in-memory image file.  %s"
+		" (errno=%d)", __FILE__, __LINE__, strerror(errno), errno);
+      return -1;
+   }
+
+   return cinfo->image_fd;
+}
+
+
+/*
+ * Map the FITS image just written to the client's in-memory file so it
+ * can be sent straight out of the page cache without another copy.
+ */
+static PASSFAIL
+mapImageFile(client_info_t *cinfo)
+{
+   off_t size;
+   void *data;
+
+   /*
+    * The file is overwritten in place, so the current offset is the size
+    * of this image.  Anything left over from a larger earlier image is
+    * never sent, and keeping it means the pages are not freed and faulted
+    * back in as the size of the compressed images goes up and down.
+    */
+   if ((size = lseek(cinfo->image_fd, 0, SEEK_CUR)) <= 0) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) unable to size in-memory image file.  %s"
+		" (errno=%d)", __FILE__, __LINE__, strerror(errno), errno);
+      return FAIL;
+   }
+
+   data = mmap(NULL, size, PROT_READ, MAP_SHARED, cinfo->image_fd, 0);
+   if (data == MAP_FAILED) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) unable to map in-memory image file.  %s"
+		" (errno=%d)", __FILE__, __LINE__, strerror(errno), errno);
+      return FAIL;
+   }
+   cinfo->image_data = (unsigned char *)data;
+   cinfo->image_size = size;
+
+   return PASS;
+}
+
+
+#ifndef BENCHMARK
+/*
+ * Create the listening socket for bulk image data connections.  A client
+ * that negotiates a bulk transfer with the BULK command connects here and
+ * receives each IMAGE reply as one kernel-driven transfer instead of
+ * through the sockserv chunks.
+ */
+static int
+createDataListener(const char *port)
+{
+   struct addrinfo hints;
+   struct addrinfo *res;
+   int fd;
+   int on = 1;
+   int rc;
+
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_INET;
+   hints.ai_socktype = SOCK_STREAM;
+   hints.ai_flags = AI_PASSIVE;
+   if ((rc = getaddrinfo(NULL, port, &hints, &res)) != 0) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) getaddrinfo for data port %s failed: %s",
+		__FILE__, __LINE__, port, gai_strerror(rc));
+      return -1;
+   }
+   if ((fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC,
+		    res->ai_protocol)) == -1) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) unable to create data socket: %s (errno=%d)",
+		__FILE__, __LINE__, strerror(errno), errno);
+      freeaddrinfo(res);
+      return -1;
+   }
+   setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+   if ((bind(fd, res->ai_addr, res->ai_addrlen) == -1) ||
+       (listen(fd, MAX_PENDING_DATA) == -1)) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) unable to listen on data port %s: %s (errno=%d)",
+		__FILE__, __LINE__, port, strerror(errno), errno);
+      close(fd);
+      freeaddrinfo(res);
+      return -1;
+   }
+   freeaddrinfo(res);
+
+   return fd;
+}
+
+
+/*
+ * Accept one connection on the data port and read the token the client
+ * was handed by the BULK command.  The connection is parked until the
+ * client that owns the token claims it.
+ */
+static void
+acceptDataConnection(void)
+{
+   struct sockaddr_in addr;
+   socklen_t addr_len = sizeof(addr);
+   struct pollfd pfd;
+   char token_buf[32];
+   unsigned int token;
+   int sndbuf = BULK_SNDBUF;
+   int one = 1;
+   int nread = 0;
+   int count;
+   int fd;
+   int i;
+
+   if ((fd = accept4(serv_info->data_listen_fd, (struct sockaddr *)&addr,
+		     &addr_len, SOCK_CLOEXEC | SOCK_NONBLOCK)) == -1) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) accept on data port failed: %s (errno=%d)",
+		__FILE__, __LINE__, strerror(errno), errno);
+      return;
+   }
+
+   /*
+    * The token is a single text line sent right after connecting
+    */
+   pfd.fd = fd;
+   pfd.events = POLLIN;
+   while ((nread < (int)sizeof(token_buf) - 1) &&
+	  (poll(&pfd, 1, BULK_CONNECT_TIMEOUT * 1000) == 1)) {
+      if ((count = read(fd, token_buf + nread, 
+			sizeof(token_buf) - 1 - nread)) <= 0) {
+	 break;
+      }
+      nread += count;
+      token_buf[nread] = '\0';
+      if (strchr(token_buf, '\n') != NULL) {
+	 break;
+      }
+   }
+   token_buf[nread] = '\0';
+   if ((nread == 0) || ((token = strtoul(token_buf, NULL, 10)) == 0)) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) data connection did not identify itself",
+		__FILE__, __LINE__);
+      close(fd);
+      return;
+   }
+
+   /*
+    * Set up the socket for large transfers, with the tail of each image
+    * sent without waiting for an acknowledgement.  It stays non-blocking,
+    * and sendImageBulk() gives up on a client that stops reading.
+    */
+   setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+   setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+   /*
+    * Park the connection, dropping the oldest one if all slots are used
+    */
+   for (i = 0; i < MAX_PENDING_DATA; i++) {
+      if (serv_info->pending_data_fd[i] == -1) {
+	 break;
+      }
+   }
+   if (i == MAX_PENDING_DATA) {
+      close(serv_info->pending_data_fd[0]);
+      memmove(&serv_info->pending_data_fd[0], &serv_info->pending_data_fd[1],
+	      (MAX_PENDING_DATA - 1) * sizeof(int));
+      memmove(&serv_info->pending_data_token[0],
+	      &serv_info->pending_data_token[1],
+	      (MAX_PENDING_DATA - 1) * sizeof(unsigned int));
+      memmove(&serv_info->pending_data_addr[0],
+	      &serv_info->pending_data_addr[1],
+	      (MAX_PENDING_DATA - 1) * sizeof(struct in_addr));
+      i = MAX_PENDING_DATA - 1;
+   }
+   serv_info->pending_data_fd[i] = fd;
+   serv_info->pending_data_token[i] = token;
+   serv_info->pending_data_addr[i] = addr.sin_addr;
+}
+
+
+/*
+ * Find the data connection that belongs to a client which negotiated a
+ * bulk transfer.  It has to carry the client's token and come from the
+ * same address as its command connection.  The client connects right
+ * after the BULK reply, so the connection is normally already waiting in
+ * the listen backlog.
+ */
+static PASSFAIL
+claimDataConnection(client_info_t *cinfo)
+{
+   struct pollfd pfd;
+   double stop_ts;
+   int remaining_ms;
+   int rc;
+   int i;
+
+   stop_ts = getClockTime() + BULK_CONNECT_TIMEOUT;
+   for (;;) {
+      for (i = 0; i < MAX_PENDING_DATA; i++) {
+	 if ((serv_info->pending_data_fd[i] != -1) &&
+	     (serv_info->pending_data_token[i] == cinfo->bulk_token) &&
+	     (memcmp(&serv_info->pending_data_addr[i], cinfo->remote_ip,
+		     sizeof(cinfo->remote_ip)) == 0)) {
+	    cinfo->data_fd = serv_info->pending_data_fd[i];
+	    serv_info->pending_data_fd[i] = -1;
+	    return PASS;
+	 }
+      }
+
+      remaining_ms = (int)((stop_ts - getClockTime()) * 1000);
+      if (remaining_ms <= 0) {
+	 break;
+      }
+      pfd.fd = serv_info->data_listen_fd;
+      pfd.events = POLLIN;
+      if ((rc = poll(&pfd, 1, remaining_ms)) == 1) {
+	 acceptDataConnection();
+      }
+      else if ((rc == 0) || (errno != EINTR)) {
+	 break;
+      }
+   }
+
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	     "(%s:%d) bulk data connection from %s never arrived, using"
+	     " chunked transfer", __FILE__, __LINE__, cinfo->hostname);
+   cinfo->bulk_token = 0;
+   return FAIL;
+}
+#endif
+
+
+/*
+ * Have a client's data connection wake the server loop whenever it can
+ * take more of the image, for as long as 'sending' is set
+ */
+static void
+watchBulkSend(client_info_t *cinfo, int sending)
+{
+   struct epoll_event event;
+
+   if (sending == cinfo->bulk_sending) {
+      return;
+   }
+   event.events = EPOLLOUT;
+   event.data.fd = cinfo->data_fd;
+   if (epoll_ctl(serv_info->wake_fd, sending ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+		 cinfo->data_fd, &event) == -1) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) unable to watch data socket %d : %s (errno=%d)",
+		__FILE__, __LINE__, cinfo->data_fd, strerror(errno), errno);
+   }
+   cinfo->bulk_sending = sending;
+   serv_info->bulk_sends += sending ? 1 : -1;
+}
+
+
+/*
+ * Close a client's data connection, in the middle of a transfer or not
+ */
+static void
+closeDataConnection(client_info_t *cinfo)
+{
+   if (cinfo->data_fd != -1) {
+      watchBulkSend(cinfo, FALSE);
+      close(cinfo->data_fd);
+      cinfo->data_fd = -1;
+   }
+   cinfo->bulk_token = 0;
+}
+
+
+#ifndef BENCHMARK
+/*
+ * Negotiate a bulk transfer for the IMAGE replies to a client.  The reply
+ * tells the client which port to connect to and the token to send on it.
+ */
+static void
+negotiateBulk(client_info_t *cinfo, char *buffer)
+{
+   if (serv_info->data_listen_fd == -1) {
+      sprintf(buffer, "%c %s \"Bulk transfer not available\"",
+	      FAIL_CHAR, BULK_CMD);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+   if (cinfo->bulk_sending) {
+      sprintf(buffer, "%c %s \"An image is still on its way\"",
+	      FAIL_CHAR, BULK_CMD);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+
+   /*
+    * Drop any earlier data connection; the client is opening a new one.
+    * The token is all that ties the new one to this client, so it comes
+    * from the kernel's random source rather than anything guessable.
+    */
+   closeDataConnection(cinfo);
+   do {
+      if (getrandom(&cinfo->bulk_token, sizeof(cinfo->bulk_token), 0) !=
+	  (ssize_t)sizeof(cinfo->bulk_token)) {
+	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		   "(%s:%d) getrandom failed: %s (errno=%d)",
+		   __FILE__, __LINE__, strerror(errno), errno);
+	 cinfo->bulk_token = 0;
+	 sprintf(buffer, "%c %s \"Bulk transfer not available\"",
+		 FAIL_CHAR, BULK_CMD);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		   "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+   } while (cinfo->bulk_token == 0);
+
+   sprintf(buffer, "%c %s %s %u", PASS_CHAR, BULK_CMD, ZWOSERV_DATA_PORT,
+	   cinfo->bulk_token);
+   cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	     "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+}
+#endif
+
+
+/*
+ * Send the next part of the FITS image to a client over its data
+ * connection, as much of it as the socket takes without blocking.  The
+ * image is handed to the kernel straight from the in-memory file, or
+ * from its archive segment, so there is no copy through user space.
+ * Until it is all out the data connection wakes the server loop as it
+ * drains, and the rest goes on the following passes.  A client that
+ * takes nothing for READOUT_TIMEOUT seconds loses its data connection.
+ */
+static PASSFAIL
+sendImageBulk(client_info_t *cinfo)
+{
+   int image_fd = (cinfo->shared != NULL) ? cinfo->shared->image_fd :
+      cinfo->image_fd;
+   off_t offset = 0;
+   size_t send_count;
+   ssize_t count;
+   double now = getClockTime();
+
+   if (cinfo->archived) {
+      image_fd = archive.segment_fd[cinfo->archive_segment];
+      offset = cinfo->archive_offset;
+   }
+   if (!cinfo->bulk_sending) {
+      watchBulkSend(cinfo, TRUE);
+      cinfo->bulk_progress_ts = now;
+   }
+
+   offset += cinfo->data_count;
+   send_count = cinfo->total_count - cinfo->data_count;
+   if (send_count > BULK_SNDBUF) {
+      send_count = BULK_SNDBUF;
+   }
+   count = sendfile(cinfo->data_fd, image_fd, &offset, send_count);
+   if (count > 0) {
+      cinfo->data_count += count;
+      cinfo->bulk_progress_ts = now;
+   }
+   else if ((count == 0) || 
+	    ((errno != EAGAIN) && (errno != EINTR)) ||
+	    (now - cinfo->bulk_progress_ts > READOUT_TIMEOUT)) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) bulk transfer to %s failed after %d of %d bytes:"
+		" %s (errno=%d)", __FILE__, __LINE__, cinfo->hostname,
+		cinfo->data_count, cinfo->total_count, 
+		(count == 0) ? "image cut short" : strerror(errno), errno);
+      closeDataConnection(cinfo);
+      return FAIL;
+   }
+
+   if (cinfo->data_count == cinfo->total_count) {
+      watchBulkSend(cinfo, FALSE);
+   }
+   return PASS;
+}
+
+
+/*
+ * Write all of a buffer to a file descriptor, picking up after partial
+ * writes
+ */
+static PASSFAIL
+writeAll(int fd, const void *buf, size_t len)
+{
+   const unsigned char *p = (const unsigned char *)buf;
+   ssize_t count;
+
+   while (len > 0) {
+      if ((count = write(fd, p, len)) == -1) {
+	 if (errno == EINTR) {
+	    continue;
+	 }
+	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		   "(%s:%d) write failed: %s (errno=%d)",
+		   __FILE__, __LINE__, strerror(errno), errno);
+	 return FAIL;
+      }
+      p += count;
+      len -= count;
+   }
+
+   return PASS;
+}
+
+
+/*
+ * Convert the rows of one band of a camera image to FITS pixels, mirrored
+ * if FLIP_X is set.  For a FITS data unit the pixels are also offset by
+ * BZERO and swapped to big-endian, so they can be sent as they are.  NEON
+ * mirrors and swaps eight pixels at a time on the Raspberry Pi.
+ */
+static void *
+convertImageBand(void *arg)
+{
+   convert_band_t *band = (convert_band_t *)arg;
+   int width = band->width;
+   int y;
+
+   for (y = band->first_row; y < band->first_row + band->nrows; y++) {
+      const unsigned short *src = band->src + (size_t)y * width;
+      unsigned short *dst = band->dst + (size_t)y * width;
+
+      if (width == PIXEL_IMX178_WIDTH) {
+	 pixelRowFromFrame(dst, src, PIXEL_IMX178_WIDTH, FLIP_PIXELS,
+			   band->fits_order);
+      }
+      else {
+	 pixelRowFromFrame(dst, src, width, FLIP_PIXELS, band->fits_order);
+      }
+   }
+
+   return NULL;
+}
+
+
+/*
+ * Convert a whole image into 'dst', split into row bands over
+ * CONVERT_THREADS threads.  'dst' must not overlap the image.
+ */
+static void
+convertImage(unsigned short *dst, const unsigned short *image, int width,
+	     int height, int fits_order)
+{
+   pthread_t thread[CONVERT_THREADS];
+   int started[CONVERT_THREADS];
+   convert_band_t band[CONVERT_THREADS];
+   int row = 0;
+   int i;
+
+   for (i = 0; i < CONVERT_THREADS; i++) {
+      band[i].src = image;
+      band[i].dst = dst;
+      band[i].width = width;
+      band[i].first_row = row;
+      band[i].nrows = (height - row) / (CONVERT_THREADS - i);
+      band[i].fits_order = fits_order;
+      row += band[i].nrows;
+
+      started[i] = (pthread_create(&thread[i], NULL, convertImageBand, 
+				   &band[i]) == 0);
+      if (!started[i]) {
+	 convertImageBand(&band[i]);
+      }
+   }
+   for (i = 0; i < CONVERT_THREADS; i++) {
+      if (started[i]) {
+	 pthread_join(thread[i], NULL);
+      }
+   }
+}
+
+
+/*
+ * Write the data unit of an uncompressed image to the client's in-memory
+ * file.  The file is grown and mapped at the current offset, and the
+ * pixels are converted straight into the pages that will be sent, so the
+ * image takes a single pass on its way out instead of a byte swap into a
+ * scratch buffer and a copy into the file.
+ */
+static PASSFAIL
+writeFITSPixels(int fd, const unsigned short *image)
+{
+   size_t size = (size_t)serv_info->image_width * serv_info->image_height * 
+      sizeof(uint16_t);
+   size_t padded = (size + 2879) / 2880 * 2880;
+   long page_size = sysconf(_SC_PAGESIZE);
+   struct stat st;
+   off_t offset, map_offset;
+   unsigned char *data;
+
+   if (((offset = lseek(fd, 0, SEEK_CUR)) == -1) || 
+       (fstat(fd, &st) == -1) ||
+       ((st.st_size < offset + (off_t)padded) && 
+	(ftruncate(fd, offset + padded) == -1))) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) unable to size in-memory image file.  %s"
+		" (errno=%d)", __FILE__, __LINE__, strerror(errno), errno);
+      return FAIL;
+   }
+
+   /*
+    * The header is a whole number of FITS blocks, which needn't be a
+    * whole number of pages
+    */
+   map_offset = offset - (offset % page_size);
+   data = (unsigned char *)mmap(NULL, offset - map_offset + padded, 
+				PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+				map_offset);
+   if (data == MAP_FAILED) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) unable to map in-memory image file.  %s"
+		" (errno=%d)", __FILE__, __LINE__, strerror(errno), errno);
+      return FAIL;
+   }
+
+   convertImage((unsigned short *)(data + (offset - map_offset)), image,
+		serv_info->image_width, serv_info->image_height, TRUE);
+   memset(data + (offset - map_offset) + size, 0, padded - size);
+   munmap(data, offset - map_offset + padded);
+
+   if (lseek(fd, offset + padded, SEEK_SET) == -1) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) unable to seek in-memory image file.  %s"
+		" (errno=%d)", __FILE__, __LINE__, strerror(errno), errno);
+      return FAIL;
+   }
+
+   return PASS;
+}
+
+
+/*
+ * Bit writer for the Rice coder.  Bits go out most significant first.
+ */
+typedef struct {
+   unsigned char *p;
+   uint64_t buffer;
+   int bits;
+} rice_bits_t;
+
+
+static void
+riceOutput(rice_bits_t *b, unsigned int value, int nbits)
+{
+   b->buffer = (b->buffer << nbits) | (value & ((1U << nbits) - 1));
+   b->bits += nbits;
+   while (b->bits >= 8) {
+      b->bits -= 8;
+      *b->p++ = (unsigned char)(b->buffer >> b->bits);
+   }
+}
+
+
+/*
+ * Rice compress one row of 16-bit pixels the way the RICE_1 tile
+ * compression in fpack/cfitsio does, with the first pixel written as is
+ * and every block of RICE_BLOCKSIZE differences coded with its own split
+ * point.  The pixels are coded as the signed values a BZERO = 32768 image
+ * holds.  Returns the number of bytes written to 'out'.
+ */
+static int
+riceCompressRow(const unsigned short *row, int n, unsigned char *out)
+{
+   unsigned int diff[RICE_BLOCKSIZE];
+   rice_bits_t b;
+   short lastpix, nextpix, pdiff;
+   unsigned int psum, top;
+   double pixelsum, dpsum;
+   int thisblock;
+   int fs;
+   int i, j;
+
+   b.p = out;
+   b.buffer = 0;
+   b.bits = 0;
+
+   lastpix = (short)(row[0] ^ 0x8000);
+   riceOutput(&b, (unsigned short)lastpix, 16);
+   for (i = 0; i < n; i += RICE_BLOCKSIZE) {
+      thisblock = (n - i < RICE_BLOCKSIZE) ? n - i : RICE_BLOCKSIZE;
+
+      /*
+       * Map the differences to unsigned values, small ones first
+       */
+      pixelsum = 0;
+      for (j = 0; j < thisblock; j++) {
+	 nextpix = (short)(row[i + j] ^ 0x8000);
+	 pdiff = (short)(nextpix - lastpix);
+	 diff[j] = (unsigned int)((pdiff < 0) ? ~(pdiff * 2) : (pdiff * 2));
+	 pixelsum += diff[j];
+	 lastpix = nextpix;
+      }
+
+      /*
+       * Pick the number of bits sent as is from the mean difference
+       */
+      dpsum = (pixelsum - (thisblock / 2) - 1) / thisblock;
+      if (dpsum < 0) {
+	 dpsum = 0;
+      }
+      psum = ((unsigned int)dpsum) >> 1;
+      for (fs = 0; psum > 0; fs++) {
+	 psum >>= 1;
+      }
+
+      if (fs >= RICE_FSMAX) {
+	 /* High entropy: send the differences without coding */
+	 riceOutput(&b, RICE_FSMAX + 1, RICE_FSBITS);
+	 for (j = 0; j < thisblock; j++) {
+	    riceOutput(&b, diff[j], 16);
+	 }
+      }
+      else if ((fs == 0) && (pixelsum == 0)) {
+	 /* Flat block: the code alone says every difference is zero */
+	 riceOutput(&b, 0, RICE_FSBITS);
+      }
+      else {
+	 riceOutput(&b, fs + 1, RICE_FSBITS);
+	 for (j = 0; j < thisblock; j++) {
+
+	    /* The top bits are sent as that many zeros and a one */
+	    top = diff[j] >> fs;
+	    while (top >= 16) {
+	       riceOutput(&b, 0, 16);
+	       top -= 16;
+	    }
+	    riceOutput(&b, 1, top + 1);
+	    if (fs > 0) {
+	       riceOutput(&b, diff[j], fs);
+	    }
+	 }
+      }
+   }
+   if (b.bits > 0) {
+      *b.p++ = (unsigned char)(b.buffer << (8 - b.bits));
+   }
+
+   return (int)(b.p - out);
+}
+
+
+/*
+ * Compress one band of rows.  This is the body of each compression thread.
+ */
+static void *
+riceCompressBand(void *arg)
+{
+   rice_band_t *band = (rice_band_t *)arg;
+   int i;
+
+   band->size = 0;
+   for (i = 0; i < band->nrows; i++) {
+      band->row_size[i] 
+	 = riceCompressRow(band->image + (size_t)i * band->width, 
+			   band->width, band->data + band->size);
+      band->size += band->row_size[i];
+   }
+
+   return NULL;
+}
+
+
+/*
+ * Rice compress a whole image with one tile per row.  The rows are split
+ * into COMPRESS_THREADS bands that are compressed in parallel, one per
+ * core of the Raspberry Pi.
+ */
+static PASSFAIL
+riceCompressImage(rice_image_t *rice, const unsigned short *image,
+		  int width, int height)
+{
+   pthread_t thread[COMPRESS_THREADS];
+   int started[COMPRESS_THREADS];
+   int row = 0;
+   int nrows;
+   int i;
+
+   memset(rice, 0, sizeof(*rice));
+   rice->height = height;
+   rice->row_size = serv_info->rice_row_size;
+   for (i = 0; i < COMPRESS_THREADS; i++) {
+      rice_band_t *band = &rice->band[i];
+
+      nrows = (height - row) / (COMPRESS_THREADS - i);
+      band->image = image + (size_t)row * width;
+      band->width = width;
+      band->nrows = nrows;
+      band->row_size = rice->row_size + row;
+      band->data = serv_info->rice_heap + (size_t)row * RICE_ROW_BOUND(width)
+	 + i;
+      row += nrows;
+
+      started[i] = (pthread_create(&thread[i], NULL, riceCompressBand, 
+				   band) == 0);
+      if (!started[i]) {
+	 riceCompressBand(band);
+      }
+   }
+   for (i = 0; i < COMPRESS_THREADS; i++) {
+      if (started[i]) {
+	 pthread_join(thread[i], NULL);
+      }
+      rice->heap_size += rice->band[i].size;
+   }
+   for (i = 0; i < height; i++) {
+      if (rice->row_size[i] > rice->max_row_size) {
+	 rice->max_row_size = rice->row_size[i];
+      }
+   }
+
+   return PASS;
+}
+
+
+/*
+ * Write the binary table of a tile compressed image: one descriptor per
+ * row pointing into the heap, the heap of compressed rows, and the
+ * padding out to a full FITS block.
+ */
+static PASSFAIL
+riceWriteTable(rice_image_t *rice, int fd)
+{
+   unsigned char *table;
+   size_t table_size = (size_t)rice->height * 8;
+   size_t total, offset = 0;
+   static const unsigned char zeros[2880] = { 0 };
+   int i;
+
+   /*
+    * Descriptors are big-endian 32-bit element count and heap offset
+    */
+   table = serv_info->rice_table;
+   for (i = 0; i < rice->height; i++) {
+      unsigned char *d = table + (size_t)i * 8;
+      uint32_t count = rice->row_size[i];
+      uint32_t start = offset;
+
+      d[0] = count >> 24; d[1] = count >> 16; d[2] = count >> 8; d[3] = count;
+      d[4] = start >> 24; d[5] = start >> 16; d[6] = start >> 8; d[7] = start;
+      offset += count;
+   }
+   if (writeAll(fd, table, table_size) != PASS) {
+      return FAIL;
+   }
+
+   for (i = 0; i < COMPRESS_THREADS; i++) {
+      if (writeAll(fd, rice->band[i].data, rice->band[i].size) != PASS) {
+	 return FAIL;
+      }
+   }
+
+   total = table_size + rice->heap_size;
+   if ((total % 2880) != 0) {
+      if (writeAll(fd, zeros, 2880 - (total % 2880)) != PASS) {
+	 return FAIL;
+      }
+   }
+
+   return PASS;
+}
+
+
+/*
+ * Fill in the binary table cards of a tile compressed image.  They have
+ * to come first in the header, and the caller adds the cards describing
+ * the image itself afterwards.
+ */
+static void
+riceSetHeader(HeaderUnit hu, rice_image_t *rice, int width, int height)
+{
+   char tform[FH_MAX_STRLEN];
+
+   fh_set_str(hu, FH_AUTO, "XTENSION", "BINTABLE", "Tile compressed image");
+   fh_set_int(hu, FH_AUTO, "BITPIX", 8, "8-bit bytes");
+   fh_set_int(hu, FH_AUTO, "NAXIS", 2, "2-dimensional binary table");
+   fh_set_int(hu, FH_AUTO, "NAXIS1", 8, "Width of table in bytes");
+   fh_set_int(hu, FH_AUTO, "NAXIS2", height, "Number of rows in table");
+   fh_set_int(hu, FH_AUTO, "PCOUNT", (int)rice->heap_size, 
+	      "Size of the heap");
+   fh_set_int(hu, FH_AUTO, "GCOUNT", 1, "Only one group");
+   fh_set_int(hu, FH_AUTO, "TFIELDS", 1, "Number of fields in each row");
+   fh_set_str(hu, FH_AUTO, "TTYPE1", "COMPRESSED_DATA", 
+	      "Label for field 1");
+   snprintf(tform, sizeof(tform), "1PB(%d)", rice->max_row_size);
+   fh_set_str(hu, FH_AUTO, "TFORM1", tform, "Data format of field");
+   fh_set_bool(hu, FH_AUTO, "ZIMAGE", FH_TRUE, "Extension holds a compressed image");
+   fh_set_int(hu, FH_AUTO, "ZBITPIX", 16, "16-bit data");
+   fh_set_int(hu, FH_AUTO, "ZNAXIS", 2, "Number of axes");
+   fh_set_int(hu, FH_AUTO, "ZNAXIS1", width, "Number of pixel columns");
+   fh_set_int(hu, FH_AUTO, "ZNAXIS2", height, "Number of pixel rows");
+   fh_set_int(hu, FH_AUTO, "ZTILE1", width, "Size of tiles in x");
+   fh_set_int(hu, FH_AUTO, "ZTILE2", 1, "Size of tiles in y");
+   fh_set_str(hu, FH_AUTO, "ZCMPTYPE", RICE_CMPTYPE, "Compression algorithm");
+   fh_set_str(hu, FH_AUTO, "ZNAME1", "BLOCKSIZE", "Compression block size");
+   fh_set_int(hu, FH_AUTO, "ZVAL1", RICE_BLOCKSIZE, "Pixels per block");
+   fh_set_str(hu, FH_AUTO, "ZNAME2", "BYTEPIX", "Bytes per pixel");
+   fh_set_int(hu, FH_AUTO, "ZVAL2", 2, "Bytes per pixel");
+}
+
+
+/*
+ * Write the empty primary header that a tile compressed image extension
+ * follows
+ */
+static PASSFAIL
+riceWritePrimary(int fd)
+{
+   HeaderUnit hu;
+   fh_result fh_error;
+
+   hu = fh_create();
+   fh_set_bool(hu, FH_AUTO, "SIMPLE", FH_TRUE, "Standard FITS");
+   fh_set_int(hu, FH_AUTO, "BITPIX", 16, "16-bit data");
+   fh_set_int(hu, FH_AUTO, "NAXIS", 0, "No data in the primary unit");
+   fh_set_bool(hu, FH_AUTO, "EXTEND", FH_TRUE, "Extensions follow");
+   if ((fh_error = fh_write(hu, fd)) != FH_SUCCESS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) unable to write FITS primary header"
+		" (fh_error = %d)", __FILE__, __LINE__, fh_error);
+      fh_destroy(hu);
+      return FAIL;
+   }
+   fh_destroy(hu);
+
+   return PASS;
+}
+
+
+#ifndef BENCHMARK
+/*
+ * Write the data-less primary header that starts a multi-extension FITS
+ * file holding 'nextend' image extensions.
+ */
+static PASSFAIL
+writeFITSPrimary(int nextend, int fd)
+{
+   HeaderUnit hu;
+   time_t date = time(NULL);
+   char fitscard[FH_MAX_STRLEN];
+   fh_result fh_error;
+
+   hu = fh_create();
+   fh_set_bool(hu, FH_AUTO, "SIMPLE", FH_TRUE, "Standard FITS");
+   fh_set_int(hu,  FH_AUTO, "BITPIX", 16,"16-bit data");
+   fh_set_int(hu,  FH_AUTO, "NAXIS",  0, "No data in the primary unit");
+   fh_set_bool(hu, FH_AUTO, "EXTEND", FH_TRUE, "Extensions follow");
+   fh_set_int(hu,  FH_AUTO, "NEXTEND", nextend, "Number of extensions");
+   strftime(fitscard, sizeof(fitscard)-1, "%Y-%m-%dT%T", gmtime(&date));
+   fh_set_str(hu, FH_AUTO, "DATE", fitscard, "UTC Date of file creation");
+   fh_set_str(hu, FH_AUTO, "ORIGIN", "CFHT", "Canada-France-Hawaii Telescope");
+   fh_set_str(hu, FH_AUTO, "INSTRUME", "ZWOCam", "Instrument Name");
+   fh_set_str(hu, FH_AUTO, "CAMMODEL", ZWO_MODEL, "Camera Model");
+
+   if ((fh_error = fh_write(hu, fd)) != FH_SUCCESS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) unable to write FITS primary header"
+		" (fh_error = %d)", __FILE__, __LINE__,
+		fh_error);
+      fh_destroy(hu);
+      return FAIL;
+   }
+   fh_destroy(hu);
+
+   return PASS;
+}
+#endif
+
+
+/*
+ * Take a pointer to image data and create a FITS image using this data
+ * and send it to the specified file descriptor.  'timestamp' is when the
+ * image was read out of the camera.  With 'extension' set the image is
+ * written as an extension following a writeFITSPrimary() header.  With
+ * 'compress' set it is written as a Rice tile compressed image.  Pixels
+ * from calibratePixels() get the masters applied to them in the header.
+ * The exposure time, gain and SEQNUM are those noteExposure() kept for
+ * the image.
+ */
+static PASSFAIL
+writeFITSImage(unsigned short *image_p, int fd, double timestamp,
+	       int extension, int compress) 
+{
+
+   HeaderUnit hu;
+   rice_image_t rice;
+   time_t date = time(NULL);
+   char fitscard[FH_MAX_STRLEN];
+   struct timeval tv;
+   struct timezone tz;
+   fh_result fh_error;
+   metadata_t meta;
+   int calibrated = (image_p == serv_info->calib_image);
+
+   /*
+    * Take a snapshot of the header metadata kept by the refresh thread
+    */
+   pthread_mutex_lock(&metadata_lock);
+   meta = metadata;
+   pthread_mutex_unlock(&metadata_lock);
+
+   /*
+    * Create the header unit
+    */
+   hu = fh_create();
+
+   /*
+    * Populate the headers.  A compressed image goes in a binary table
+    * extension, after an empty primary header unless it is already part
+    * of a multi-extension file, and the table has to be compressed first
+    * to know the size of its heap.
+    */
+   if (compress) {
+#ifdef FLIP_X
+      convertImage(serv_info->flip_image, image_p, serv_info->image_width,
+		   serv_info->image_height, FALSE);
+      image_p = serv_info->flip_image;
+#endif
+      riceCompressImage(&rice, image_p, serv_info->image_width,
+			serv_info->image_height);
+      if (!extension && (riceWritePrimary(fd) != PASS)) {
+	 fh_destroy(hu);
+	 return FAIL;
+      }
+      riceSetHeader(hu, &rice, serv_info->image_width, 
+		    serv_info->image_height);
+   }
+   else {
+      if (extension) {
+	 fh_set_str(hu, FH_AUTO, "XTENSION", "IMAGE", "Image extension");
+      }
+      else {
+	 fh_set_bool(hu, FH_AUTO, "SIMPLE", FH_TRUE, "Standard FITS");
+      }
+      fh_set_int(hu,  FH_AUTO, "BITPIX", 16,"16-bit data");
+      fh_set_int(hu,  FH_AUTO, "NAXIS",  2, "Number of axes");
+      fh_set_int(hu,  FH_AUTO, "NAXIS1", serv_info->image_width, 
+		 "Number of pixel columns");
+      fh_set_int(hu,  FH_AUTO, "NAXIS2", serv_info->image_height, 
+		 "Number of pixel rows");
+      fh_set_int(hu,  FH_AUTO, "PCOUNT", 0, "No 'random' parameters");
+      fh_set_int(hu,  FH_AUTO, "GCOUNT", 1, "Only one group");
+   }
+
+   strftime(fitscard, sizeof(fitscard)-1, "%Y-%m-%dT%T", gmtime(&date));
+   fh_set_str(hu, FH_AUTO, "DATE", fitscard, "UTC Date of file creation");
+   strftime(fitscard, sizeof(fitscard)-1, "%a %b %d %H:%M:%S %Z %Y", 
+	 localtime(&date));
+   fh_set_str(hu, FH_AUTO, "HSTTIME", fitscard, "Local time in Hawaii");
+   gettimeofday(&tv, &tz);
+   fh_set_flt(hu, FH_AUTO, "UNIXTIME", timestamp, 
+	 13, "Fractional UNIX timestamp when image was taken");
+   fh_set_str(hu, FH_AUTO, "ORIGIN", "CFHT", "Canada-France-Hawaii Telescope");
+   fh_set_str(hu, FH_AUTO, "INSTRUME", "ZWOCam", "Instrument Name");
+   fh_set_flt(hu, FH_AUTO, "BZERO", 32768.0, 6,	"Zero factor");
+   fh_set_flt(hu, FH_AUTO, "BSCALE", 1.0, 2, "Scale factor");
+
+   fh_set_str(hu, FH_AUTO, "DOMEAZ", meta.dome_az, "Dome Azimuth");
+   fh_set_str(hu, FH_AUTO, "CAMMODEL", ZWO_MODEL, "Camera Model");
+   fh_set_str(hu, FH_AUTO, "CCDNAME", CCD_SENSOR, "CCD Sensor");
+   fh_set_flt(hu, FH_AUTO, "ETIME", serv_info->exposure_info.etime, 5, 
+	      "Integration time");
+   fh_set_int(hu, FH_AUTO, "GAIN", serv_info->exposure_info.gain, 
+	      "Camera Gain [0..510]");
+   fh_set_bool(hu, FH_AUTO, "AUTOEXP", 
+	       serv_info->auto_exposure ? FH_TRUE : FH_FALSE,
+	       "Exposure time and gain set automatically");
+   fh_set_flt(hu, FH_AUTO, "PIXSIZE", PIXEL_SIZE, 5, "Pixel size (micron)");
+   fh_set_int(hu, FH_AUTO, "XBINNING", serv_info->bin, "Binning factor in x");
+   fh_set_int(hu, FH_AUTO, "YBINNING", serv_info->bin, "Binning factor in y");
+   fh_set_str(hu, FH_AUTO, "BINMODE", 
+	      serv_info->soft_bin ? "SOFTWARE" : "HARDWARE", 
+	      "Where the pixels were binned");
+   snprintf(fitscard, sizeof(fitscard), "[1:%d,1:%d]", 
+	    serv_info->image_width, serv_info->image_height);
+   fh_set_str(hu, FH_AUTO, "DATASEC", fitscard, "Image area of the data");
+   snprintf(fitscard, sizeof(fitscard), "[%d:%d,%d:%d]", 
+	    serv_info->roi_x + 1, serv_info->roi_x + serv_info->roi_width,
+	    serv_info->roi_y + 1, serv_info->roi_y + serv_info->roi_height);
+   fh_set_str(hu, FH_AUTO, "DETSEC", fitscard, 
+	      "Unbinned sensor area read out");
+   fh_set_int(hu, FH_AUTO, "SEQNUM", serv_info->exposure_info.seqnum, 
+	 "Frame sequence number");
+   if (calibrated) {
+      fh_set_str(hu, FH_AUTO, "DARKFILE", serv_info->calib_dark, 
+		 "Master dark subtracted");
+      fh_set_str(hu, FH_AUTO, "FLATFILE", serv_info->calib_flat, 
+		 "Master flat applied");
+   }
+
+   /* 
+    * Add space to allow for additional headers 
+    */
+   if ((fh_error = fh_reserve(hu, 220)) != FH_SUCCESS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	      "(%s:%d) unable to add padding to FITS header:"
+		" (fh_error=%d)", __FILE__, __LINE__, fh_error);
+      fh_destroy(hu);
+      return FAIL;
+   }
+
+   /* 
+    * Write out the FITS header 
+    */
+   if ((fh_error = fh_write(hu, fd)) != FH_SUCCESS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) unable to write FITS header"
+		" (fh_error = %d)", __FILE__, __LINE__,
+		fh_error);
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
+		"%s (errno=%d)", strerror(errno), errno);
+      fh_destroy(hu);
+      return FAIL;
+   }
+   
+   /*
+    * Write out the compressed tiles
+    */
+   if (compress) {
+      if (riceWriteTable(&rice, fd) != PASS) {
+	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		   "(%s:%d) unable to write compressed FITS image data",
+		   __FILE__, __LINE__);
+	 fh_destroy(hu);
+	 return FAIL;
+      }
+   }
+
+   /*
+    * Write out the image data
+    */
+   else if (writeFITSPixels(fd, image_p) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) unable to write FITS image data",
+		__FILE__, __LINE__);
+      fh_destroy(hu);
+      return FAIL;
+   }
+   
+   /*
+    * Free up the memory for the FITS header
+    */
+   fh_destroy(hu);
+   
+   return PASS;
+}
+
+
+#ifndef BENCHMARK
+/*
+ * Put the reply announcing an image in 'buffer': the number of bytes of
+ * binary data that can be expected, whether they will arrive on the bulk
+ * data connection and whether they are Rice compressed.
+ */
+static void
+imageReply(client_info_t *cinfo, char *buffer)
+{
+   sprintf(buffer, "%c %ld", PASS_CHAR, (long)cinfo->image_size);
+   if (cinfo->data_fd != -1) {
+      strcat(buffer, " " BULK_CMD);
+   }
+   if (cinfo->compress) {
+      strcat(buffer, " " COMPRESS_RICE_STRING);
+   }
+}
+
+
+/*
+ * Map the FITS image just built in the client's in-memory file, set up
+ * the flags to trigger it being sent and put the reply in 'buffer'.
+ */
+static void
+replyWithImage(client_info_t *cinfo, char *buffer, const char *cmd)
+{
+   double start_ts = getClockTime();
+
+   /*
+    * Map the FITS image so it can be sent directly from memory
+    */
+   if (mapImageFile(cinfo) != PASS) {
+      sprintf(buffer, "%c %s \"Unable to create in-memory image on the"
+	      " camera server\"", FAIL_CHAR, cmd);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+   cinfo->send_start_ts = getClockTime();
+   recordStage(STAGE_IO, cinfo->io_time + cinfo->send_start_ts - start_ts);
+
+   /*
+    * Pick up the data connection if the client negotiated a bulk transfer
+    * and it hasn't been claimed yet
+    */
+   if ((cinfo->bulk_token != 0) && (cinfo->data_fd == -1)) {
+      claimDataConnection(cinfo);
+   }
+
+   /*
+    * Set up the flags to trigger data being sent
+    */
+   cinfo->send_data = 1;
+   cinfo->data_count = 0;
+   cinfo->total_count = cinfo->image_size;
+   cinfo->width = serv_info->image_width;
+   cinfo->height = serv_info->image_height;
+
+   /*
+    * If we made it this far, send back a response with the number of bytes
+    * of binary data that can be expected to be received from the server
+    */
+   imageReply(cinfo, buffer);
+}
+
+
+/*
+ * Find the oldest image in the exposure pipeline taken with the current
+ * settings, throwing away any taken before they last changed.  Called
+ * with the pipeline lock held.
+ */
+static exposure_buffer_t *
+pipelinedBuffer(void)
+{
+   exposure_buffer_t *buf = NULL;
+   int i;
+
+   for (i = 0; i < PIPELINE_BUFFERS; i++) {
+      if (!serv_info->exposure_buffer[i].filled) {
+	 continue;
+      }
+      if (serv_info->exposure_buffer[i].generation != 
+	  serv_info->pipeline_generation) {
+	 serv_info->exposure_buffer[i].filled = 0;
+	 pthread_cond_broadcast(&serv_info->pipeline_cond);
+	 continue;
+      }
+      if ((buf == NULL) || 
+	  (serv_info->exposure_buffer[i].sequence < buf->sequence)) {
+	 buf = &serv_info->exposure_buffer[i];
+      }
+   }
+
+   return buf;
+}
+
+
+/*
+ * Pick up the oldest image in the exposure pipeline taken with the current
+ * settings.  The pipeline thread is by then already exposing again.
+ */
+static unsigned short *
+takePipelinedExposure(char *buffer, const char *cmd, double *timestamp)
+{
+   exposure_buffer_t *buf;
+
+   pthread_mutex_lock(&serv_info->pipeline_lock);
+   buf = pipelinedBuffer();
+   pthread_mutex_unlock(&serv_info->pipeline_lock);
+   if (buf == NULL) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) no image from the exposure pipeline",
+		__FILE__, __LINE__);
+      sprintf(buffer, "%c %s \"Exposure timeout\"", FAIL_CHAR, cmd);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return NULL;
+   }
+
+   /*
+    * The buffer stays filled, so the pipeline thread won't touch it while
+    * it is encoded
+    */
+   serv_info->exposure_held = buf;
+   *timestamp = buf->readout_done_ts;
+   serv_info->exp_start_ts = buf->exp_start_ts;
+   serv_info->exp_done_ts = buf->exp_done_ts;
+   serv_info->exp_readout_done_ts = buf->readout_done_ts;
+   serv_info->exp_cycle_time 
+      = serv_info->exp_readout_done_ts - serv_info->exp_start_ts;
+   time(&(serv_info->last_exp_completion));
+   recordStage(STAGE_EXPOSE, 
+	       serv_info->exp_done_ts - serv_info->exp_start_ts);
+   recordStage(STAGE_READOUT, 
+	       serv_info->exp_readout_done_ts - serv_info->exp_done_ts);
+
+   return (unsigned short *)buf->data;
+}
+
+
+/*
+ * Start an exposure and return straight away; serveExposures() picks it
+ * up once the camera is done.  With the pipeline running the image is
+ * already being exposed in the background.  On failure the error reply
+ * for 'cmd' is left in 'buffer'.
+ */
+static PASSFAIL
+startExposure(char *buffer, const char *cmd)
+{
+   int rc;
+
+   if (serv_info->camera_state != CAMERA_READY) {
+      sprintf(buffer, "%c %s \"The camera is reconnecting\"", 
+	      FAIL_CHAR, cmd);
+      return FAIL;
+   }
+   if (!serv_info->pipeline_running) {
+
+      /*
+       * A single exposure can't be taken while the camera is streaming
+       * video
+       */
+      stopVideoCapture();
+
+      /*
+       * Set the exposure time and gain
+       */
+      if (applyExposureControls() != PASS) {
+	 sprintf(buffer, "%c %s \"Unable to set exposure time or gain\"",
+		 FAIL_CHAR, cmd);
+	 return FAIL;
+      }
+
+      /*
+       * Trigger the exposure
+       */
+      serv_info->exp_start_ts = getClockTime();
+      if ((rc = ASIStartExposure(serv_info->asi_camera_info->CameraID, 
+				 ASI_FALSE)) != ASI_SUCCESS) {
+	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		   "(%s:%d) Unable to start exposure: rc=%d",
+		   __FILE__, __LINE__, rc);
+	 cameraError(rc);
+	 sprintf(buffer,
+		 "%c %s \"Unable to start exposure\"", FAIL_CHAR, cmd);
+	 return FAIL;
+      }
+   }
+   serv_info->exposure_ts = getClockTime();
+   serv_info->exposing = TRUE;
+
+   return PASS;
+}
+
+
+/*
+ * Check, without waiting, whether the exposure under way is done: read
+ * out by the camera, ready in the pipeline, or given up on
+ */
+static int
+exposureDone(void)
+{
+   ASI_EXPOSURE_STATUS asi_exp_status;
+   exposure_buffer_t *buf;
+   double now = getClockTime();
+
+   if (serv_info->camera_state != CAMERA_READY) {
+      return TRUE;
+   }
+   if (serv_info->pipeline_running) {
+      pthread_mutex_lock(&serv_info->pipeline_lock);
+      buf = pipelinedBuffer();
+      pthread_mutex_unlock(&serv_info->pipeline_lock);
+      return (buf != NULL) || 
+	 (now > serv_info->exposure_ts + 
+	  serv_info->etime * PIPELINE_BUFFERS + EXPOSE_TIMEOUT);
+   }
+
+   ASIGetExpStatus(serv_info->asi_camera_info->CameraID, &asi_exp_status);
+   return (asi_exp_status != ASI_EXP_WORKING) || 
+      (now > serv_info->exposure_ts + serv_info->etime + EXPOSE_TIMEOUT);
+}
+#endif
+
+
+/*
+ * Give the image about to be built the next SEQNUM, and note the settings
+ * it was taken with.  They are kept apart from the current ones, which
+ * autoExposure() may already change for the next exposure while the
+ * images of this one are still being written.
+ */
+static void
+noteExposure(void)
+{
+   serv_info->exposure_info.seqnum = ++(serv_info->frame_sequence);
+   serv_info->exposure_info.etime = serv_info->etime;
+   serv_info->exposure_info.gain = serv_info->gain;
+}
+
+
+#ifndef BENCHMARK
+/*
+ * Read out the exposure once exposureDone() says so, and return its
+ * pixels and the time it was read out.  The pixels stay put until
+ * releaseExposure().  On failure NULL is returned with the error reply
+ * for 'cmd' in 'buffer'.
+ */
+static unsigned short *
+readExposure(char *buffer, const char *cmd, double *timestamp)
+{
+   ASI_EXPOSURE_STATUS asi_exp_status;
+   unsigned short *pixels;
+   int rc;
+   int size;
+
+   serv_info->exposing = FALSE;
+   if (serv_info->camera_state != CAMERA_READY) {
+      sprintf(buffer, "%c %s \"The camera was lost\"", FAIL_CHAR, cmd);
+      return NULL;
+   }
+   if (serv_info->pipeline_running) {
+      if ((pixels = takePipelinedExposure(buffer, cmd, timestamp)) != NULL) {
+	 noteExposure();
+      }
+      return pixels;
+   }
+
+   ASIGetExpStatus(serv_info->asi_camera_info->CameraID, &asi_exp_status);
+   if (asi_exp_status != ASI_EXP_SUCCESS) {
+      if (asi_exp_status == ASI_EXP_WORKING) {
+	 ASIStopExposure(serv_info->asi_camera_info->CameraID);
+      }
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) Exposure request failed: status=%d",
+		__FILE__, __LINE__, asi_exp_status);
+      cameraError(ASI_SUCCESS);
+      sprintf(buffer,
+	      "%c %s \"Exposure request failed\"", FAIL_CHAR, cmd);
+      return NULL;
+   }
+   serv_info->exp_done_ts = getClockTime();
+
+   /*
+    * Read out the image
+    */
+   size = serv_info->readout_width * serv_info->readout_height * 
+      sizeof(short);
+   if ((rc = ASIGetDataAfterExp(serv_info->asi_camera_info->CameraID, 
+				serv_info->image_data, size)) != ASI_SUCCESS) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) Unable to read out image: rc=%d",
+		__FILE__, __LINE__, rc);
+      cameraError(rc);
+      sprintf(buffer,
+	      "%c %s \"Unable to read out image\"", FAIL_CHAR, cmd);
+      return NULL;
+   }
+   serv_info->camera_errors = 0;
+
+   binFrame((unsigned short *)serv_info->image_data);
+
+   /*
+    * Set the time for when the exposure was completed
+    */
+   serv_info->exp_readout_done_ts = getClockTime();
+   serv_info->exp_cycle_time 
+      = serv_info->exp_readout_done_ts - serv_info->exp_start_ts;
+   time(&(serv_info->last_exp_completion));
+   recordStage(STAGE_EXPOSE, 
+	       serv_info->exp_done_ts - serv_info->exp_start_ts);
+   recordStage(STAGE_READOUT, 
+	       serv_info->exp_readout_done_ts - serv_info->exp_done_ts);
+
+   *timestamp = serv_info->exp_readout_done_ts;
+   noteExposure();
+
+   return (unsigned short *)serv_info->image_data;
+}
+
+
+/*
+ * Hand the buffer of an exposure back to the pipeline thread
+ */
+static void
+releaseExposure(void)
+{
+   if (serv_info->exposure_held != NULL) {
+      pthread_mutex_lock(&serv_info->pipeline_lock);
+      serv_info->exposure_held->filled = 0;
+      serv_info->exposure_held = NULL;
+      pthread_cond_broadcast(&serv_info->pipeline_cond);
+      pthread_mutex_unlock(&serv_info->pipeline_lock);
+   }
+}
+
+
+/*
+ * Put the path of the master of 'kind' for the current camera settings in
+ * 'path'.  Darks are kept for each exposure time and gain, and flats for
+ * each readout format only.
+ */
+static void
+masterPath(char *path, calib_kind_t kind)
+{
+   int len;
+
+   len = snprintf(path, CALIB_PATH_SIZE, "%s/%s_%dx%d+%d+%d_bin%d", 
+		  CALIB_DIR, (kind == CALIB_DARK) ? "dark" : "flat",
+		  serv_info->image_width, serv_info->image_height,
+		  serv_info->roi_x, serv_info->roi_y, serv_info->bin);
+   if (kind == CALIB_DARK) {
+      snprintf(path + len, CALIB_PATH_SIZE - len, "_%gs_gain%d.f32",
+	       serv_info->etime, serv_info->gain);
+   }
+   else {
+      snprintf(path + len, CALIB_PATH_SIZE - len, ".f32");
+   }
+}
+
+
+/*
+ * Unmap a master, freeing its slot
+ */
+static void
+unmapMaster(master_t *master)
+{
+   if (master->data != NULL) {
+      munmap(master->data, master->size);
+      master->data = NULL;
+   }
+}
+
+
+/*
+ * Get the master saved in 'path', mapping it from its file the first time
+ * it is needed.  Returns NULL if there is no such master for an image of
+ * 'npixels' pixels.
+ */
+static const float *
+mapMaster(const char *path, size_t npixels)
+{
+   master_t *master;
+   struct stat st;
+   void *data;
+   int fd;
+   int i;
+
+   for (i = 0; i < MAX_MASTERS; i++) {
+      master = &serv_info->master[i];
+      if ((master->data != NULL) && !strcmp(master->path, path)) {
+	 return master->data;
+      }
+   }
+   if ((fd = open(path, O_RDONLY)) == -1) {
+      return NULL;
+   }
+   if ((fstat(fd, &st) == -1) || 
+       ((size_t)st.st_size != npixels * sizeof(float))) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+		"(%s:%d) %s is not a master for %dx%d images", 
+		__FILE__, __LINE__, path, serv_info->image_width,
+		serv_info->image_height);
+      close(fd);
+      return NULL;
+   }
+   data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED | MAP_POPULATE, 
+	       fd, 0);
+   close(fd);
+   if (data == MAP_FAILED) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+		"(%s:%d) unable to map %s : %s (errno=%d)", __FILE__, 
+		__LINE__, path, strerror(errno), errno);
+      return NULL;
+   }
+
+   /*
+    * It takes the place of the master mapped the longest ago
+    */
+   master = &serv_info->master[serv_info->master_next];
+   serv_info->master_next = (serv_info->master_next + 1) % MAX_MASTERS;
+   unmapMaster(master);
+   strcpy(master->path, path);
+   master->data = (float *)data;
+   master->size = st.st_size;
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	     "(%s:%d) mapped master %s", __FILE__, __LINE__, path);
+
+   return master->data;
+}
+
+
+/*
+ * Save a master to 'path'.  It is written next to it and renamed into
+ * place, so it never shows up half written, and any mapping of the one it
+ * replaces is dropped.
+ */
+static PASSFAIL
+writeMaster(const char *path, const float *data, size_t npixels)
+{
+   char tmp_path[CALIB_PATH_SIZE + 4];
+   int fd;
+   int i;
+
+   snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+   if ((fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		"(%s:%d) unable to create %s : %s (errno=%d)", __FILE__, 
+		__LINE__, tmp_path, strerror(errno), errno);
+      return FAIL;
+   }
+   if (writeAll(fd, data, npixels * sizeof(float)) != PASS) {
+      close(fd);
+      unlink(tmp_path);
+      return FAIL;
+   }
+   close(fd);
+   if (rename(tmp_path, path) == -1) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		"(%s:%d) unable to rename %s : %s (errno=%d)", __FILE__, 
+		__LINE__, tmp_path, strerror(errno), errno);
+      unlink(tmp_path);
+      return FAIL;
+   }
+   for (i = 0; i < MAX_MASTERS; i++) {
+      if ((serv_info->master[i].data != NULL) && 
+	  !strcmp(serv_info->master[i].path, path)) {
+	 unmapMaster(&serv_info->master[i]);
+      }
+   }
+
+   return PASS;
+}
+
+
+/*
+ * Subtract the dark from and multiply the flat correction into a band of
+ * pixels, rounding and clipping the result to 16 bits
+ */
+static void *
+calibrateBand(void *arg)
+{
+   calib_band_t *band = (calib_band_t *)arg;
+   const unsigned short *src = band->src + band->first;
+   unsigned short *dst = band->dst + band->first;
+   const float *dark = band->dark ? band->dark + band->first : NULL;
+   const float *flat = band->flat ? band->flat + band->first : NULL;
+   size_t i = 0;
+
+#ifdef __ARM_NEON
+   const float32x4_t half = vdupq_n_f32(0.5f);
+   const float32x4_t zero = vdupq_n_f32(0.0f);
+
+   for (; i + 8 <= band->count; i += 8) {
+      uint16x8_t pix = vld1q_u16(src + i);
+      float32x4_t lo = vcvtq_f32_u32(vmovl_u16(vget_low_u16(pix)));
+      float32x4_t hi = vcvtq_f32_u32(vmovl_u16(vget_high_u16(pix)));
+
+      if (dark != NULL) {
+	 lo = vsubq_f32(lo, vld1q_f32(dark + i));
+	 hi = vsubq_f32(hi, vld1q_f32(dark + i + 4));
+      }
+      if (flat != NULL) {
+	 lo = vmulq_f32(lo, vld1q_f32(flat + i));
+	 hi = vmulq_f32(hi, vld1q_f32(flat + i + 4));
+      }
+      lo = vmaxq_f32(vaddq_f32(lo, half), zero);
+      hi = vmaxq_f32(vaddq_f32(hi, half), zero);
+      vst1q_u16(dst + i, vcombine_u16(vqmovn_u32(vcvtq_u32_f32(lo)),
+				      vqmovn_u32(vcvtq_u32_f32(hi))));
+   }
+#endif
+   for (; i < band->count; i++) {
+      float pix = src[i];
+
+      if (dark != NULL) {
+	 pix -= dark[i];
+      }
+      if (flat != NULL) {
+	 pix *= flat[i];
+      }
+      pix += 0.5f;
+      dst[i] = (pix <= 0.0f) ? 0 : 
+	 (pix >= 65535.0f) ? 65535 : (unsigned short)pix;
+   }
+
+   return NULL;
+}
+
+
+/*
+ * Calibrate a whole image into 'dst', split over CONVERT_THREADS threads
+ */
+static void
+calibrateImage(unsigned short *dst, const unsigned short *image, 
+	       const float *dark, const float *flat, size_t npixels)
+{
+   pthread_t thread[CONVERT_THREADS];
+   int started[CONVERT_THREADS];
+   calib_band_t band[CONVERT_THREADS];
+   size_t first = 0;
+   int i;
+
+   for (i = 0; i < CONVERT_THREADS; i++) {
+      band[i].src = image;
+      band[i].dst = dst;
+      band[i].dark = dark;
+      band[i].flat = flat;
+      band[i].first = first;
+      band[i].count = (npixels - first) / (CONVERT_THREADS - i) / 8 * 8;
+      if (i == CONVERT_THREADS - 1) {
+	 band[i].count = npixels - first;
+      }
+      first += band[i].count;
+
+      started[i] = (pthread_create(&thread[i], NULL, calibrateBand, 
+				   &band[i]) == 0);
+      if (!started[i]) {
+	 calibrateBand(&band[i]);
+      }
+   }
+   for (i = 0; i < CONVERT_THREADS; i++) {
+      if (started[i]) {
+	 pthread_join(thread[i], NULL);
+      }
+   }
+}
+
+
+/*
+ * Get the exposure's pixels corrected with the master dark and flat for
+ * the current settings, for the clients that asked for it with
+ * CALIBRATE.  They are calibrated once per exposure, into calib_image,
+ * which writeFITSImage() notes in the header.  Without either master the
+ * pixels are given back as they are.
+ */
+static unsigned short *
+calibratePixels(unsigned short *pixels)
+{
+   char path[CALIB_PATH_SIZE];
+   size_t npixels = (size_t)serv_info->image_width * serv_info->image_height;
+   const float *dark;
+   const float *flat;
+
+   if (serv_info->calib_pixels != NULL) {
+      return serv_info->calib_pixels;
+   }
+
+   masterPath(path, CALIB_DARK);
+   dark = mapMaster(path, npixels);
+   strcpy(serv_info->calib_dark, 
+	  dark ? path + strlen(CALIB_DIR) + 1 : "NONE");
+   masterPath(path, CALIB_FLAT);
+   flat = mapMaster(path, npixels);
+   strcpy(serv_info->calib_flat, 
+	  flat ? path + strlen(CALIB_DIR) + 1 : "NONE");
+
+   serv_info->calib_pixels = pixels;
+   if ((dark != NULL) || (flat != NULL)) {
+      calibrateImage(serv_info->calib_image, pixels, dark, flat, npixels);
+      serv_info->calib_pixels = serv_info->calib_image;
+   }
+
+   return serv_info->calib_pixels;
+}
+
+
+/*
+ * Drop the master being built
+ */
+static void
+endCalibration(void)
+{
+   free(serv_info->calib_sum);
+   serv_info->calib_sum = NULL;
+   serv_info->calib_kind = CALIB_NONE;
+   serv_info->calib_remaining = 0;
+   calib_client = NULL;
+}
+
+
+/*
+ * Give up on the master being built, telling the client that asked for
+ * it why
+ */
+static void
+abortCalibration(const char *reason)
+{
+   const char *cmd = (serv_info->calib_kind == CALIB_DARK) ? 
+      DARK_CMD : FLAT_CMD;
+
+   cfht_logv(CFHT_MAIN, CFHT_WARN, "(%s:%d) %s not built: %s", 
+	     __FILE__, __LINE__, serv_info->calib_path, reason);
+   if (calib_client != NULL) {
+      snprintf(calib_client->reply, REPLY_SIZE, "%c %s \"%s\"", FAIL_CHAR, 
+	       cmd, reason);
+   }
+   endCalibration();
+}
+
+
+/*
+ * Turn the sum of the exposures into the master and save it.  A dark is
+ * their mean.  A flat is kept as the factors that even out the mean
+ * field, less the dark taken with the same settings, so that applying it
+ * takes a multiply instead of a divide.
+ */
+static void
+finishCalibration(void)
+{
+   const char *cmd = (serv_info->calib_kind == CALIB_DARK) ? 
+      DARK_CMD : FLAT_CMD;
+   size_t npixels = (size_t)serv_info->image_width * serv_info->image_height;
+   float *master = serv_info->calib_sum;
+   const float *dark;
+   double mean = 0;
+   size_t i;
+
+   for (i = 0; i < npixels; i++) {
+      master[i] /= serv_info->calib_count;
+   }
+   if (serv_info->calib_kind == CALIB_FLAT) {
+      dark = mapMaster(serv_info->calib_key, npixels);
+      for (i = 0; i < npixels; i++) {
+	 if (dark != NULL) {
+	    master[i] -= dark[i];
+	 }
+	 mean += master[i];
+      }
+      mean /= npixels;
+      if (mean <= 0) {
+	 abortCalibration("The flat field is empty");
+	 return;
+      }
+      for (i = 0; i < npixels; i++) {
+	 master[i] = (master[i] > 0) ? mean / master[i] : 1.0f;
+      }
+   }
+   if (writeMaster(serv_info->calib_path, master, npixels) != PASS) {
+      abortCalibration("Unable to save the master");
+      return;
+   }
+
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY, "(%s:%d) saved %s from %d exposures",
+	     __FILE__, __LINE__, serv_info->calib_path, 
+	     serv_info->calib_count);
+   if (calib_client != NULL) {
+      snprintf(calib_client->reply, REPLY_SIZE, "%c %s DONE %s", PASS_CHAR,
+	       cmd, serv_info->calib_path + strlen(CALIB_DIR) + 1);
+   }
+   endCalibration();
+}
+
+
+/*
+ * Add an exposure taken for the master being built, or give up on it if
+ * the exposure failed or the camera settings changed under it.  The
+ * master is saved once the last exposure is in.
+ */
+static void
+addCalibrationFrame(const unsigned short *pixels)
+{
+   char key[CALIB_PATH_SIZE];
+   size_t npixels = (size_t)serv_info->image_width * serv_info->image_height;
+   float *sum = serv_info->calib_sum;
+   size_t i;
+
+   if (pixels == NULL) {
+      abortCalibration("Exposure failed");
+      return;
+   }
+   masterPath(key, CALIB_DARK);
+   if (strcmp(key, serv_info->calib_key)) {
+      abortCalibration("Camera settings changed");
+      return;
+   }
+   for (i = 0; i < npixels; i++) {
+      sum[i] += pixels[i];
+   }
+   serv_info->calib_count++;
+   if (--serv_info->calib_remaining == 0) {
+      finishCalibration();
+   }
+}
+
+
+/*
+ * Forget the oldest archived images until there is room in the index for
+ * another, and all those in 'segment' if it is about to be written over
+ */
+static void
+forgetArchived(int segment)
+{
+   archive_index_t *index = archive.index;
+
+   while ((index->first < index->next) &&
+	  ((index->next - index->first >= ARCHIVE_ENTRIES) ||
+	   (index->entry[index->first % ARCHIVE_ENTRIES].segment == segment))) {
+      index->first++;
+   }
+}
+
+
+/*
+ * Set up the rolling archive of the images taken.  The images go into a
+ * ring of segment files allocated in full up front in ARCHIVE_DIR (or
+ * ZWOCAM_ARCHIVE_DIR, a tmpfs or a USB disk, never the SD card), and the
+ * index that finds them is a memory mapped file next to them, so both
+ * outlive the server.  The segments take a lot of room, in memory for a
+ * tmpfs, so there is no archive unless ZWOCAM_ARCHIVE_SEGMENTS asks for
+ * one.  Without it the images are still served, just not kept.
+ */
+static void
+startArchive(void)
+{
+   char path[ARCHIVE_PATH_SIZE + ARCHIVE_FILE_SIZE];
+   const char *env;
+   struct stat st;
+   void *data;
+   int nsegments = ARCHIVE_SEGMENTS;
+   int fd;
+   int rc;
+   int i;
+
+   if ((env = getenv(ARCHIVE_SEGMENTS_ENV)) != NULL) {
+      nsegments = atoi(env);
+   }
+   if (nsegments <= 0) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) the images are not archived, set %s to keep"
+		" them", __FILE__, __LINE__, ARCHIVE_SEGMENTS_ENV);
+      return;
+   }
+   if (nsegments > ARCHIVE_MAX_SEGMENTS) {
+      nsegments = ARCHIVE_MAX_SEGMENTS;
+   }
+   if ((env = getenv(ARCHIVE_DIR_ENV)) == NULL) {
+      env = ARCHIVE_DIR;
+   }
+   snprintf(archive.dir, sizeof(archive.dir), "%s", env);
+   if ((mkdir(archive.dir, 0775) == -1) && (errno != EEXIST)) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+		"(%s:%d) unable to create %s, the images are not archived :"
+		" %s (errno=%d)", __FILE__, __LINE__, archive.dir, 
+		strerror(errno), errno);
+      return;
+   }
+
+   /*
+    * Map the index, starting it over if it was laid out differently
+    */
+   snprintf(path, sizeof(path), "%s/index", archive.dir);
+   if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+		"(%s:%d) unable to open %s, the images are not archived :"
+		" %s (errno=%d)", __FILE__, __LINE__, path, strerror(errno),
+		errno);
+      return;
+   }
+   if ((fstat(fd, &st) == -1) || 
+       (((size_t)st.st_size != sizeof(archive_index_t)) &&
+	(ftruncate(fd, sizeof(archive_index_t)) == -1)) ||
+       ((data = mmap(NULL, sizeof(archive_index_t), PROT_READ | PROT_WRITE,
+		     MAP_SHARED, fd, 0)) == MAP_FAILED)) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+		"(%s:%d) unable to map %s, the images are not archived :"
+		" %s (errno=%d)", __FILE__, __LINE__, path, strerror(errno),
+		errno);
+      close(fd);
+      return;
+   }
+   close(fd);
+   archive.index = (archive_index_t *)data;
+   if ((archive.index->magic != ARCHIVE_MAGIC) ||
+       (archive.index->nsegments != (uint32_t)nsegments) ||
+       (archive.index->first > archive.index->next)) {
+      memset(archive.index, 0, sizeof(archive_index_t));
+      archive.index->magic = ARCHIVE_MAGIC;
+      archive.index->nsegments = nsegments;
+      archive.index->first = 1;
+      archive.index->next = 1;
+   }
+
+   /*
+    * Allocate the segments in full, so that archiving an image never
+    * runs out of room half way through
+    */
+   for (i = 0; i < nsegments; i++) {
+      snprintf(path, sizeof(path), "%s/segment%02d", archive.dir, i);
+      if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1) {
+	 rc = errno;
+      }
+      else if ((rc = posix_fallocate(fd, 0, ARCHIVE_SEGMENT_SIZE)) != 0) {
+	 close(fd);
+      }
+      if ((fd == -1) || (rc != 0)) {
+	 cfht_logv(CFHT_MAIN, CFHT_WARN,
+		   "(%s:%d) unable to allocate %s, the images are not"
+		   " archived : %s (errno=%d)", __FILE__, __LINE__, path,
+		   strerror(rc), rc);
+	 while (--i >= 0) {
+	    close(archive.segment_fd[i]);
+	 }
+	 munmap(archive.index, sizeof(archive_index_t));
+	 archive.index = NULL;
+	 return;
+      }
+      archive.segment_fd[i] = fd;
+   }
+   archive.nsegments = nsegments;
+
+   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+	     "(%s:%d) archiving the images in %d segments of %s, %lu"
+	     " images kept so far", __FILE__, __LINE__, nsegments, 
+	     archive.dir, 
+	     (unsigned long)(archive.index->next - archive.index->first));
+}
+
+
+/*
+ * Add the image just taken to the archive, Rice compressed whatever the
+ * clients asked for.  It is appended where the last one ended, or at the
+ * start of the next segment when it might not fit, writing over the
+ * oldest images.  A segment that an image is still being fetched from is
+ * not written over; the new images are dropped until it is free.
+ */
+static void
+archiveImage(unsigned short *pixels, double timestamp)
+{
+   archive_index_t *index = archive.index;
+   archive_entry_t *entry;
+   metadata_t meta;
+   char *end;
+   off_t bound;
+   off_t offset;
+   off_t size;
+   int segment;
+   int fd;
+
+   if (index == NULL) {
+      return;
+   }
+
+   /*
+    * The compressed image is never more than a little past the raw pixels
+    */
+   bound = ARCHIVE_HEADER_SIZE + (off_t)serv_info->image_height * 
+      (8 + RICE_ROW_BOUND(serv_info->image_width));
+   segment = index->segment;
+   offset = index->offset;
+   if (offset + bound > ARCHIVE_SEGMENT_SIZE) {
+      segment = (segment + 1) % archive.nsegments;
+      if (archive.readers[segment] > 0) {
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		   "(%s:%d) archive segment %d is being fetched from, image"
+		   " not archived", __FILE__, __LINE__, segment);
+	 return;
+      }
+      forgetArchived(segment);
+      index->segment = segment;
+      index->offset = offset = 0;
+   }
+   forgetArchived(-1);
+
+   fd = archive.segment_fd[segment];
+   if ((lseek(fd, offset, SEEK_SET) == -1) ||
+       (writeFITSImage(pixels, fd, timestamp, FALSE, TRUE) != PASS) ||
+       ((size = lseek(fd, 0, SEEK_CUR) - offset) <= 0)) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+		"(%s:%d) unable to archive image in segment %d",
+		__FILE__, __LINE__, segment);
+      return;
+   }
+
+   /*
+    * Index it by time, sequence number and where the dome was pointing.
+    * The entry is filled in before it is counted, so the index is never
+    * left pointing at half an image.
+    */
+   pthread_mutex_lock(&metadata_lock);
+   meta = metadata;
+   pthread_mutex_unlock(&metadata_lock);
+   entry = &index->entry[index->next % ARCHIVE_ENTRIES];
+   entry->serial = index->next;
+   entry->timestamp = timestamp;
+   entry->dome_az = strtod(meta.dome_az, &end);
+   if (end == meta.dome_az) {
+      entry->dome_az = NULL_DBL;
+   }
+   entry->seqnum = serv_info->exposure_info.seqnum;
+   entry->segment = segment;
+   entry->offset = offset;
+   entry->size = size;
+   index->offset = (offset + size + ARCHIVE_ALIGN - 1) / ARCHIVE_ALIGN * 
+      ARCHIVE_ALIGN;
+   index->next++;
+}
+
+
+/*
+ * Start sending a client the archived images taken after 'arg', a
+ * SINCE=<unixtime>, oldest first.  The reply gives the number of images
+ * that follow, each announced like an IMAGE reply.  An image written over
+ * before it goes out is announced by an error reply in its place.
+ */
+static void
+startFetch(client_info_t *cinfo, char *buffer, const char *arg)
+{
+   archive_index_t *index = archive.index;
+   const char *since_arg;
+   double since;
+   uint64_t lo, hi, mid;
+
+   if ((since_arg = stristr(arg, FETCH_SINCE_ARG)) == NULL) {
+      sprintf(buffer, "%c %s \"Use %s since=<unixtime>\"", FAIL_CHAR,
+	      FETCH_CMD, FETCH_CMD);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+   if (index == NULL) {
+      sprintf(buffer, "%c %s \"The images are not archived\"", FAIL_CHAR,
+	      FETCH_CMD);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+   if (cinfo->subscribed || (cinfo->image_wanted != IMAGE_NONE) ||
+       (cinfo->seq_remaining != 0) || (cinfo == calib_client) ||
+       (cinfo->fetch_next < cinfo->fetch_end)) {
+      sprintf(buffer, "%c %s \"An image is already on its way\"", 
+	      FAIL_CHAR, FETCH_CMD);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+   since = atof(since_arg + strlen(FETCH_SINCE_ARG));
+
+   /*
+    * The images are archived in the order they were taken, so the first
+    * one after 'since' is found by bisecting the index
+    */
+   lo = index->first;
+   hi = index->next;
+   while (lo < hi) {
+      mid = lo + (hi - lo) / 2;
+      if (index->entry[mid % ARCHIVE_ENTRIES].timestamp <= since) {
+	 lo = mid + 1;
+      }
+      else {
+	 hi = mid;
+      }
+   }
+
+   /*
+    * Pick up the data connection now, since there won't be a request
+    * to do it with later
+    */
+   if ((cinfo->bulk_token != 0) && (cinfo->data_fd == -1)) {
+      claimDataConnection(cinfo);
+   }
+
+   cinfo->fetch_next = lo;
+   cinfo->fetch_end = index->next;
+   sprintf(buffer, "%c %s %lu", PASS_CHAR, FETCH_CMD, 
+	   (unsigned long)(cinfo->fetch_end - cinfo->fetch_next));
+   if (cinfo->data_fd != -1) {
+      strcat(buffer, " " BULK_CMD);
+   }
+   cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	     "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+}
+#endif
+
+
+/*
+ * Queue up the next image of a FETCH to be sent straight out of its
+ * archive segment, announced by the reply held for the client
+ */
+static void
+sendFetchedImage(client_info_t *cinfo)
+{
+   archive_index_t *index = archive.index;
+   archive_entry_t *entry;
+   uint64_t serial = cinfo->fetch_next++;
+   void *data;
+
+   if (serial < index->first) {
+      sprintf(cinfo->reply, "%c %s \"Image written over before it was"
+	      " sent\"", FAIL_CHAR, FETCH_CMD);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, cinfo->reply);
+      return;
+   }
+   entry = &index->entry[serial % ARCHIVE_ENTRIES];
+
+   releaseImageData(cinfo);
+   data = mmap(NULL, entry->size, PROT_READ, MAP_SHARED, 
+	       archive.segment_fd[entry->segment], entry->offset);
+   if (data == MAP_FAILED) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) unable to map archived image.  %s (errno=%d)",
+		__FILE__, __LINE__, strerror(errno), errno);
+      sprintf(cinfo->reply, "%c %s \"Unable to read archived image\"", 
+	      FAIL_CHAR, FETCH_CMD);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, cinfo->reply);
+      return;
+   }
+   cinfo->image_data = (unsigned char *)data;
+   cinfo->image_size = entry->size;
+   cinfo->archived = TRUE;
+   cinfo->archive_segment = entry->segment;
+   cinfo->archive_offset = entry->offset;
+   archive.readers[entry->segment]++;
+
+   cinfo->send_data = 1;
+   cinfo->data_count = 0;
+   cinfo->total_count = cinfo->image_size;
+   cinfo->send_start_ts = getClockTime();
+   sprintf(cinfo->reply, "%c %ld%s %s", PASS_CHAR, (long)cinfo->image_size,
+	   (cinfo->data_fd != -1) ? " " BULK_CMD : "", COMPRESS_RICE_STRING);
+   cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	     "(%s:%d) SEND> %s", __FILE__, __LINE__, cinfo->reply);
+}
+
+
+#ifndef BENCHMARK
+/*
+ * Drop the connection to the Tau server, and with it any IR image on its
+ * way.  The next DUALIMAGE connects again.
+ */
+static void
+disconnectTau(void)
+{
+   if (serv_info->tau_sock != NULL) {
+      sockclnt_destroy(serv_info->tau_sock);
+      serv_info->tau_sock = NULL;
+   }
+   serv_info->tau_state = TAU_IDLE;
+}
+
+
+/*
+ * Sleep until the pipeline has an image, a command or the IR image comes
+ * in, a bulk transfer can go on, or 'timeout' seconds pass, whichever
+ * comes first.  Without 'commands' only the camera side wakes the loop.
+ */
+static void
+waitEvents(double timeout, int commands)
+{
+   struct epoll_event event[WAKE_EVENTS];
+   struct pollfd pfd[2];
+   uint64_t events;
+   int tau_fd = (serv_info->tau_sock != NULL) ? serv_info->tau_sock->fd : -1;
+   int tau_woke = FALSE;
+   int n, i;
+
+   /*
+    * sockserv isn't run while takeImage() waits for a plain IMAGE, so
+    * the commands and bulk transfers are left for later then
     */
-   serv_info->asi_camera_info 
-      = (ASI_CAMERA_INFO *)cli_malloc(sizeof(ASI_CAMERA_INFO));
-   if ((rc = ASIGetCameraProperty(serv_info->asi_camera_info, 
-				  0)) != ASI_SUCCESS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		"(%s:%d) ASIGetCameraProperty() failed: rc=%d", 
-		__FILE__, __LINE__, rc);
-      return FAIL;
+   if (!commands) {
+      pfd[0].fd = serv_info->event_fd;
+      pfd[0].events = POLLIN;
+      pfd[1].fd = tau_fd;
+      pfd[1].events = POLLIN;
+      if ((poll(pfd, 2, (int)(timeout * 1000) + 1) > 0) &&
+	  (pfd[0].revents & POLLIN) &&
+	  (read(serv_info->event_fd, &events, sizeof(events)) == -1)) {
+	 /* Nothing to collect, another wakeup already did */
+      }
+      tau_woke = (pfd[1].revents != 0);
    }
 
    /*
-    * Set the width and height
+    * Go straight back to sockserv if the last pass handled a command,
+    * since more of them may be waiting behind it
     */
-   serv_info->image_width = serv_info->asi_camera_info->MaxWidth;
-   serv_info->image_height = serv_info->asi_camera_info->MaxHeight;
+   else if (serv_info->commands != serv_info->commands_seen) {
+      serv_info->commands_seen = serv_info->commands;
+   }
+   else {
+      n = epoll_wait(serv_info->wake_fd, event, WAKE_EVENTS, 
+		     (int)(timeout * 1000) + 1);
+      for (i = 0; i < n; i++) {
+	 if ((event[i].data.fd == serv_info->event_fd) &&
+	     (read(serv_info->event_fd, &events, sizeof(events)) == -1)) {
+	    /* Nothing to collect, another wakeup already did */
+	 }
+	 if ((tau_fd != -1) && (event[i].data.fd == tau_fd)) {
+	    tau_woke = TRUE;
+	 }
+      }
+   }
+
+   /*
+    * Only an IR image on its way is read from the Tau server.  Anything
+    * else it sends would be left there and keep waking the loop, and is
+    * usually the connection closing, so the connection is dropped and
+    * made again for the next DUALIMAGE.  An IR image already in is kept.
+    */
+   if (tau_woke && (serv_info->tau_state != TAU_EXPOSING) &&
+       (serv_info->tau_state != TAU_RECEIVING)) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) unexpected data or hangup from the Tau server,"
+		" disconnecting", __FILE__, __LINE__);
+      sockclnt_destroy(serv_info->tau_sock);
+      serv_info->tau_sock = NULL;
+   }
+}
+
+
+/*
+ * How long the server loop can sleep while an exposure is under way.  The
+ * pipeline wakes it when it has an image and the commands do too, so a
+ * single exposure only needs the camera polled once it is due to end.
+ * The ASI library has no completion event of its own.
+ */
+static double
+exposureWait(void)
+{
+   double wait;
+
+   if (serv_info->pipeline_running) {
+      wait = serv_info->exposure_ts + serv_info->etime * PIPELINE_BUFFERS + 
+	 EXPOSE_TIMEOUT - getClockTime();
+   }
+   else {
+      wait = serv_info->exposure_ts + serv_info->etime - getClockTime();
+   }
+
+   return (wait > EXPOSURE_POLL_INTERVAL) ? wait : EXPOSURE_POLL_INTERVAL;
+}
+
+
+/*
+ * Add a socket to the wake_fd set.  It is level triggered, so the loop
+ * doesn't go back to sleep while anything is left to read on it, and it
+ * leaves the set by itself once it is closed.  Returns FALSE if it was
+ * already in the set or can't be added.
+ */
+static int
+watchSocket(int fd)
+{
+   struct epoll_event event;
+
+   event.events = EPOLLIN;
+   event.data.fd = fd;
+   if (epoll_ctl(serv_info->wake_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+      if (errno != EEXIST) {
+	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		   "(%s:%d) unable to watch socket %d : %s (errno=%d)",
+		   __FILE__, __LINE__, fd, strerror(errno), errno);
+      }
+      return FALSE;
+   }
+
+   return TRUE;
+}
+
+
+/*
+ * Add the command connection sockserv has just accepted from 'remote_ip'
+ * to the wake_fd set, with Nagle's algorithm turned off so the short
+ * replies go out at once.  sockserv doesn't hand out its descriptors, so
+ * every one open is looked at through /proc/self/fd, whatever its number,
+ * and the connection is the socket on ZWOSERV_PORT with that peer that isn't
+ * in the set yet.  The ones adopted before it are all in the set already,
+ * and so is the listening socket once the first connection has been.  A
+ * connection that can't be found is logged: it is still served, but
+ * during an exposure its commands wait for the loop to wake up.
+ */
+static void
+adoptCommandSockets(const unsigned char *remote_ip)
+{
+   struct sockaddr_in addr;
+   struct dirent *entry;
+   socklen_t len;
+   int adopted = FALSE;
+   int one = 1;
+   DIR *dir;
+   int fd;
+
+   if ((dir = opendir("/proc/self/fd")) == NULL) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) unable to list the open descriptors : %s (errno=%d)",
+		__FILE__, __LINE__, strerror(errno), errno);
+      return;
+   }
+   while (!adopted && ((entry = readdir(dir)) != NULL)) {
+      if (!isdigit((unsigned char)entry->d_name[0]) ||
+	  ((fd = atoi(entry->d_name)) == dirfd(dir))) {
+	 continue;
+      }
+      len = sizeof(addr);
+      if ((getsockname(fd, (struct sockaddr *)&addr, &len) == -1) ||
+	  (addr.sin_family != AF_INET) || 
+	  (addr.sin_port != htons(atoi(ZWOSERV_PORT)))) {
+	 continue;
+      }
+      len = sizeof(addr);
+      if (getpeername(fd, (struct sockaddr *)&addr, &len) == -1) {
+	 watchSocket(fd);
+      }
+      else if ((memcmp(&addr.sin_addr, remote_ip, 4) == 0) && 
+	       watchSocket(fd)) {
+	 setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	 adopted = TRUE;
+      }
+   }
+   closedir(dir);
+
+   if (!adopted) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+		"(%s:%d) no command socket found for %d.%d.%d.%d, its"
+		" commands are only read when the server loop wakes up",
+		__FILE__, __LINE__, remote_ip[0], remote_ip[1], remote_ip[2],
+		remote_ip[3]);
+   }
+}
+
+
+/*
+ * Have the Tau server start an IR image now, for the exposure about to be
+ * started here.  The Tau server is found the way taugrab finds it, and
+ * the connection is kept for the next one.  On failure the error reply
+ * for 'cmd' is left in 'buffer'.
+ */
+static PASSFAIL
+requestTauImage(char *buffer, const char *cmd)
+{
+   char ip_address[80];
+   char port[20];
+   char host[sizeof(ip_address) + sizeof(port)];
+   int one = 1;
+   PASSFAIL rc;
+
+   if (serv_info->tau_sock == NULL) {
+      pthread_mutex_lock(&ss_lock);
+      rc = ((ssGetString(SS_TAU_IPADDRESS, ip_address, 
+			 sizeof(ip_address) - 1) == PASS) &&
+	    (ssGetString(SS_TAU_PORT, port, sizeof(port) - 1) == PASS)) ? 
+	 PASS : FAIL;
+      if (rc != PASS) {
+	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		   "(%s:%d) unable to look up the Tau server: %s",
+		   __FILE__, __LINE__, ssGetStrError());
+      }
+      pthread_mutex_unlock(&ss_lock);
+      if (rc == PASS) {
+	 snprintf(host, sizeof(host), "%s:%s", ip_address, port);
+	 serv_info->tau_sock = sockclnt_create(host, TAU_SOCKET_TIMEOUT);
+      }
+      if (serv_info->tau_sock == NULL) {
+	 sprintf(buffer, "%c %s \"Unable to reach the IR camera server\"",
+		 FAIL_CHAR, cmd);
+	 return FAIL;
+      }
+      sockclnt_set_mode(serv_info->tau_sock, SOCKCLNT_MODE_BINARY);
+      setsockopt(serv_info->tau_sock->fd, IPPROTO_TCP, TCP_NODELAY, &one,
+		 sizeof(one));
+      watchSocket(serv_info->tau_sock->fd);
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) connected to the Tau server at %s",
+		__FILE__, __LINE__, host);
+   }
+
+   sockclnt_send(serv_info->tau_sock, IMAGE_CMD " " IMAGE_ASYNC_STRING);
+   serv_info->tau_state = TAU_EXPOSING;
+   serv_info->tau_request_ts = getClockTime();
+   serv_info->tau_count = 0;
+
+   return PASS;
+}
+
+
+/*
+ * Read in whatever has arrived of the IR image, without waiting.  Returns
+ * TRUE once it is all in or there won't be one.
+ */
+static int
+receiveTauImage(void)
+{
+   struct pollfd pfd;
+   const char *reply;
+   char status = FAIL_CHAR;
+   ssize_t nread;
+
+   if (serv_info->tau_state == TAU_IDLE) {
+      serv_info->tau_state = TAU_FAILED;
+      serv_info->tau_error = "No IR image was asked for";
+   }
+   if ((serv_info->tau_state == TAU_DONE) || 
+       (serv_info->tau_state == TAU_FAILED)) {
+      return TRUE;
+   }
+   if (getClockTime() > serv_info->tau_request_ts + TAU_IMAGE_TIMEOUT) {
+      disconnectTau();
+      serv_info->tau_state = TAU_FAILED;
+      serv_info->tau_error = "Timed out waiting for the IR image";
+      return TRUE;
+   }
+
+   pfd.fd = serv_info->tau_sock->fd;
+   pfd.events = POLLIN;
+   while (poll(&pfd, 1, 0) > 0) {
+
+      /*
+       * The image is announced with its size, the way taugrab reads it,
+       * after the acknowledgement of the request
+       */
+      if (serv_info->tau_state == TAU_EXPOSING) {
+	 reply = sockclnt_recv(serv_info->tau_sock);
+	 if (reply && !strncasecmp(reply, TAU_ASYNC_REPLY, 
+				   strlen(TAU_ASYNC_REPLY))) {
+	    continue;
+	 }
+	 if (!reply || (sscanf(reply, "%c %ld", &status, 
+			       &serv_info->tau_size) != 2) ||
+	     (status != PASS_CHAR) || (serv_info->tau_size <= 0) ||
+	     (serv_info->tau_size > TAU_IMAGE_MAX)) {
+	    cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		      "(%s:%d) no IR image from the Tau server: %s", 
+		      __FILE__, __LINE__, reply ? reply : "disconnected");
+	    if (!reply || (status == PASS_CHAR)) {
+	       disconnectTau();
+	    }
+	    serv_info->tau_state = TAU_FAILED;
+	    serv_info->tau_error = "The IR camera server failed the image";
+	    return TRUE;
+	 }
+	 serv_info->tau_state = TAU_RECEIVING;
+	 continue;
+      }
+
+      nread = read(pfd.fd, serv_info->tau_image + serv_info->tau_count,
+		   serv_info->tau_size - serv_info->tau_count);
+      if ((nread == -1) && (errno == EINTR || errno == EAGAIN)) {
+	 continue;
+      }
+      if (nread <= 0) {
+	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		   "(%s:%d) lost the Tau server reading the IR image",
+		   __FILE__, __LINE__);
+	 disconnectTau();
+	 serv_info->tau_state = TAU_FAILED;
+	 serv_info->tau_error = "Lost the IR camera server";
+	 return TRUE;
+      }
+      serv_info->tau_count += nread;
+      if (serv_info->tau_count == serv_info->tau_size) {
+	 serv_info->tau_state = TAU_DONE;
+	 return TRUE;
+      }
+   }
+
+   return FALSE;
+}
 
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	     "(%s:%d) width=%d, height=%d",
-	     __FILE__, __LINE__, serv_info->image_width, 
-	     serv_info->image_height);
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	      "(%s:%d) bit depth=%d",
-	      __FILE__, __LINE__, serv_info->asi_camera_info->BitDepth);
+
+/*
+ * Check whether the subscribers are ready for another image: there are
+ * some, they are done sending the last one and no retry is pending
+ */
+static int
+subscribersReady(void)
+{
+   int i;
+
+   if ((shared_image[0].refs != 0) || (shared_image[1].refs != 0) ||
+       (getClockTime() < serv_info->subscribe_retry_ts)) {
+      return FALSE;
+   }
+   for (i = 0; i < MAX_SUBSCRIBERS; i++) {
+      if (subscriber[i] != NULL) {
+	 return TRUE;
+      }
+   }
+
+   return FALSE;
+}
+
+
+/*
+ * Start the next exposure if a client is waiting for an image, the
+ * subscribers are ready for one or a master is being built.  The clients
+ * queued up until now are the ones it is taken for.  On failure the error
+ * reply is left in 'buffer' and given to every one of them.
+ */
+static PASSFAIL
+startNextExposure(char *buffer)
+{
+   int queued = FALSE;
+   int dual = FALSE;
+   int calib = (serv_info->calib_remaining != 0);
+   int ready;
+   int i;
+
+   for (i = 0; i < MAX_IMAGE_CLIENTS; i++) {
+      if (image_client[i] != NULL) {
+	 queued = TRUE;
+	 dual |= image_client[i]->dual;
+      }
+   }
+   ready = subscribersReady();
+   if (!queued && !ready && !calib) {
+      return PASS;
+   }
 
    /*
-    * Open the camera connection
+    * For a DUALIMAGE the IR image is asked for first, and this exposure is
+    * started right after it.  If the Tau server can't be reached the
+    * clients that want it get the error, and the others still get their
+    * image.
     */
-   if ((rc = ASIOpenCamera(serv_info->asi_camera_info->CameraID)) 
-       != ASI_SUCCESS) {
+   if (dual && (requestTauImage(buffer, DUALIMAGE_CMD) != PASS)) {
+      queued = FALSE;
+      dual = FALSE;
+      for (i = 0; i < MAX_IMAGE_CLIENTS; i++) {
+	 if ((image_client[i] != NULL) && image_client[i]->dual) {
+	    strcpy(image_client[i]->reply, buffer);
+	    image_client[i]->image_wanted = IMAGE_NONE;
+	    image_client[i] = NULL;
+	 }
+	 else if (image_client[i] != NULL) {
+	    queued = TRUE;
+	 }
+      }
+      if (!queued && !ready && !calib) {
+	 return FAIL;
+      }
+   }
+
+   if (startExposure(buffer, IMAGE_CMD) != PASS) {
+      if (dual) {
+	 disconnectTau();
+      }
+      for (i = 0; i < MAX_IMAGE_CLIENTS; i++) {
+	 if (image_client[i] != NULL) {
+	    strcpy(image_client[i]->reply, buffer);
+	    image_client[i]->image_wanted = IMAGE_NONE;
+	    image_client[i] = NULL;
+	 }
+      }
+      if (ready) {
+	 serv_info->subscribe_retry_ts = getClockTime() + SUBSCRIBE_RETRY;
+      }
+      if (calib) {
+	 abortCalibration("Unable to start exposure");
+      }
+      return FAIL;
+   }
+   for (i = 0; i < MAX_IMAGE_CLIENTS; i++) {
+      if (image_client[i] != NULL) {
+	 image_client[i]->image_wanted = IMAGE_EXPOSING;
+      }
+   }
+   serv_info->exposure_subscribed = ready;
+   serv_info->exposure_dual = dual;
+   serv_info->exposure_calib = calib;
+
+   return PASS;
+}
+
+
+/*
+ * Write the IR image read from the Tau server to 'fd' as an image
+ * extension.  Its primary header only needs its first card turned into
+ * an XTENSION card, since it already has PCOUNT and GCOUNT.
+ */
+static PASSFAIL
+writeTauExtension(int fd)
+{
+   char card[81];
+
+   if ((serv_info->tau_size < 2880) ||
+       strncmp((char *)serv_info->tau_image, "SIMPLE  =", 9)) {
       cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		"(%s:%d) ASIOpenCamera() failed: rc=%d",
-		__FILE__, __LINE__, rc);
+		"(%s:%d) the IR image is not a FITS image", 
+		__FILE__, __LINE__);
+      return FAIL;
+   }
+   snprintf(card, sizeof(card), "%-80s", 
+	    "XTENSION= 'IMAGE   '           / Image extension");
+   if ((writeAll(fd, card, 80) != PASS) ||
+       (writeAll(fd, serv_info->tau_image + 80, 
+		 serv_info->tau_size - 80) != PASS)) {
+      return FAIL;
+   }
+
+   return PASS;
+}
+
+
+/*
+ * Write a DUALIMAGE to 'fd': a primary header, then the visible image
+ * taken here and the IR image taken by the Tau server with it as its two
+ * extensions
+ */
+static PASSFAIL
+writeDualImage(unsigned short *pixels, int fd, double timestamp, 
+	       int compress)
+{
+   if ((writeFITSPrimary(2, fd) != PASS) ||
+       (writeFITSImage(pixels, fd, timestamp, TRUE, compress) != PASS) ||
+       (writeTauExtension(fd) != PASS)) {
       return FAIL;
    }
-
-   /*
-    * Initialize the camera 
-    */
-   if ((rc = ASIInitCamera(serv_info->asi_camera_info->CameraID)) 
-       != ASI_SUCCESS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		"(%s:%d) ASIInitCamera() failed: rc=%d",
-		__FILE__, __LINE__, rc);
-      return FAIL;
+
+   return PASS;
+}
+
+
+/*
+ * Build the image a client asked for out of the exposure's pixels and
+ * queue it up to be sent, announced by the reply held for the client
+ */
+static void
+deliverImage(client_info_t *cinfo, unsigned short *pixels, double timestamp)
+{
+   const char *cmd = cinfo->dual ? DUALIMAGE_CMD : IMAGE_CMD;
+   double start_ts;
+   int fd;
+   int rc;
+
+   /*
+    * A DUALIMAGE is no good without the IR image
+    */
+   if (cinfo->dual && (serv_info->tau_state != TAU_DONE)) {
+      sprintf(cinfo->reply, "%c %s \"%s\"", FAIL_CHAR, cmd, 
+	      serv_info->tau_error);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG, "(%s:%d) SEND> %s", __FILE__, __LINE__,
+		cinfo->reply);
+      return;
+   }
+
+   /*
+    * Rewind the in-memory file to build the FITS image in
+    */
+   start_ts = getClockTime();
+   fd = openImageFile(cinfo);
+   cinfo->io_time = getClockTime() - start_ts;
+   if (fd == -1) {
+      sprintf(cinfo->reply,
+	      "%c %s \"Unable to create in-memory image on the camera"
+	      " server\"", FAIL_CHAR, cmd);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG, "(%s:%d) SEND> %s", __FILE__, __LINE__,
+		cinfo->reply);
+      return;
+   }
+
+   /*
+    * Create a FITS image from the pixel data and build it in the in-memory
+    * file
+    */
+   start_ts = getClockTime();
+   if (cinfo->calibrate) {
+      pixels = calibratePixels(pixels);
+   }
+   if (cinfo->dual) {
+      rc = writeDualImage(pixels, fd, timestamp, cinfo->compress);
+   }
+   else {
+      rc = writeFITSImage(pixels, fd, timestamp, FALSE, cinfo->compress);
+   }
+   recordStage(STAGE_ENCODE, getClockTime() - start_ts);
+   if (rc != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		"(%s:%d) unable to create FITS file", __FILE__, __LINE__);
+      sprintf(cinfo->reply, "%c %s \"Unable to create in-memory image on"
+	      " the camera server\"", FAIL_CHAR, cmd);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, cinfo->reply);
+      return;
+   }
+   
+   /*
+    * Queue the image up to be sent to the client
+    */
+   replyWithImage(cinfo, cinfo->reply, cmd);
+}
+
+
+/*
+ * Forget the images a client is waiting for, when it goes away
+ */
+static void
+dropImageRequest(client_info_t *cinfo)
+{
+   int i;
+
+   for (i = 0; i < MAX_IMAGE_CLIENTS; i++) {
+      if (image_client[i] == cinfo) {
+	 image_client[i] = NULL;
+      }
+   }
+   for (i = 0; i < MAX_SEQUENCES; i++) {
+      if (sequence_client[i] == cinfo) {
+	 sequence_client[i] = NULL;
+      }
+   }
+   cinfo->image_wanted = IMAGE_NONE;
+   cinfo->seq_remaining = 0;
+}
+
+
+/*
+ * Start a sequence of 'nimages' images for a client, one exposure every
+ * 'interval' seconds, or back to back if it is 0.  The images are sent
+ * one after the other over the connection, each announced by the usual
+ * IMAGE reply, with the settings the client has already made.
+ */
+static void
+startSequence(client_info_t *cinfo, char *buffer, int nimages, 
+	      double interval)
+{
+   int i;
+
+   if ((nimages < 1) || (interval < 0)) {
+      sprintf(buffer, "%c %s \"Use %s <n> [<interval>]\"", FAIL_CHAR, 
+	      SEQUENCE_CMD, SEQUENCE_CMD);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+   if (cinfo->subscribed || (cinfo->image_wanted != IMAGE_NONE) ||
+       (cinfo->seq_remaining != 0) || (cinfo == calib_client) ||
+       (cinfo->fetch_next < cinfo->fetch_end)) {
+      sprintf(buffer, "%c %s \"An image is already on its way\"", 
+	      FAIL_CHAR, SEQUENCE_CMD);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
    }
-
-   /*
-    * Set the ROI format
-    */
-   if ((rc = ASISetROIFormat(serv_info->asi_camera_info->CameraID,
-			     serv_info->image_width, 
-			     serv_info->image_height,
-			     1, ASI_IMG_RAW16)) != ASI_SUCCESS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		"(%s:%d) ASISetROIFormat() failed: rc=%d", 
-		__FILE__, __LINE__, rc);
-      return FAIL;
+   for (i = 0; (i < MAX_SEQUENCES) && (sequence_client[i] != NULL) &&
+	   (sequence_client[i] != cinfo); i++) {
    }
-
-   /*
-    * Get the ROI format
-    */
-   ASI_IMG_TYPE img_type;
-   int width, height, bin;
-   if ((rc = ASIGetROIFormat(serv_info->asi_camera_info->CameraID,
-			     &width, &height, &bin, 
-			     &img_type)) != ASI_SUCCESS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		"(%s:%d) ASIGetROIFormat() failed: rc=%d", 
-		__FILE__, __LINE__, rc);
-      return FAIL;
+   if (i == MAX_SEQUENCES) {
+      sprintf(buffer, "%c %s \"Too many sequences\"", FAIL_CHAR, 
+	      SEQUENCE_CMD);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
    }
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	     "(%s:%d) ROI width=%d, ROI height=%d, ROI bin=%d, type=%d",
-	     __FILE__, __LINE__, width, height, bin, img_type);
 
    /*
-    * Set the high speed mode to be off
+    * Pick up the data connection now, since there won't be a request
+    * to do it with later
     */
-   if ((rc = ASISetControlValue(serv_info->asi_camera_info->CameraID,
-				ASI_HIGH_SPEED_MODE, 0,
-				ASI_FALSE)) != ASI_SUCCESS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		"(%s:%d) Unable to set high speed mode to be 0: rc=%d",
-		__FILE__, __LINE__, rc);
-      return FAIL;
+   if ((cinfo->bulk_token != 0) && (cinfo->data_fd == -1)) {
+      claimDataConnection(cinfo);
    }
 
-   /*
-    * Get the camera properties
-    */
-   num_controls = 0;
-   if (ASIGetNumOfControls(serv_info->asi_camera_info->CameraID, 
-			   &num_controls) != ASI_SUCCESS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		"(%s:%d) Error getting number of controls of camera #0",
-		__FILE__, __LINE__);
-      return FAIL;
+   sequence_client[i] = cinfo;
+   cinfo->seq_remaining = nimages;
+   cinfo->seq_interval = interval;
+   cinfo->seq_next_ts = getClockTime();
+
+   sprintf(buffer, "%c %s %d %.3f", PASS_CHAR, SEQUENCE_CMD, nimages, 
+	   interval);
+   if (cinfo->data_fd != -1) {
+      strcat(buffer, " " BULK_CMD);
    }
-   
-   asi_control_caps 
-      = (ASI_CONTROL_CAPS *)cli_malloc(sizeof(ASI_CONTROL_CAPS));
-   for (i = 0; i < num_controls; i++) {
-      if ((rc = ASIGetControlCaps(serv_info->asi_camera_info->CameraID, i, 
-				  asi_control_caps)) == ASI_SUCCESS) {
-	 
-	 /*
-	  * Print out the camera properties
-	  */
-	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		   "(%s:%d) Property %s: [%ld, %ld] = %ld%s - %s",
-		   __FILE__, __LINE__,
-		   asi_control_caps->Name,
-		   asi_control_caps->MinValue,
-		   asi_control_caps->MaxValue,
-		   asi_control_caps->DefaultValue,
-		   asi_control_caps->IsWritable == 1 ? " (set)" : "",
-		   asi_control_caps->Description
-	    );
+   cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	     "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+}
+
+
+/*
+ * Queue up the sequence clients whose next image is due and who are done
+ * with the last one.  Returns TRUE if one of them is idle but its next
+ * image isn't due yet, so the server loop has to keep an eye on the time.
+ */
+static int
+queueSequences(void)
+{
+   double now = getClockTime();
+   int waiting = FALSE;
+   int i, j;
+
+   for (i = 0; i < MAX_SEQUENCES; i++) {
+      client_info_t *cinfo = sequence_client[i];
+
+      if ((cinfo == NULL) || (cinfo->seq_remaining == 0) ||
+	  (cinfo->image_wanted != IMAGE_NONE) || cinfo->send_data ||
+	  (cinfo->reply[0] != '\0')) {
+	 continue;
+      }
+      if (now < cinfo->seq_next_ts) {
+	 waiting = TRUE;
+	 continue;
+      }
+      for (j = 0; (j < MAX_IMAGE_CLIENTS) && (image_client[j] != NULL); 
+	   j++) {
+      }
+      if (j == MAX_IMAGE_CLIENTS) {
+	 break;
+      }
+      image_client[j] = cinfo;
+      cinfo->image_wanted = IMAGE_QUEUED;
+      cinfo->dual = FALSE;
+      if (--cinfo->seq_remaining == 0) {
+	 sequence_client[i] = NULL;
+	 continue;
+      }
+
+      /*
+       * Keep to the cadence, but don't try to catch up on images that
+       * couldn't be taken in time
+       */
+      cinfo->seq_next_ts += cinfo->seq_interval;
+      if (cinfo->seq_next_ts < now) {
+	 cinfo->seq_next_ts = now;
       }
    }
 
-   return PASS;
+   return waiting;
 }
 
 
 /*
- * Set the exposure time
+ * How long sockserv may wait for activity on each pass of the server
+ * loop: it is only polled while an exposure or a bulk transfer is under
+ * way, or while a sequence needs its next image within the idle poll
+ * interval
  */
-static PASSFAIL
-com_etime(const char *arg)
+static int
+loopTimeout(void)
 {
-   double new_etime;
-   char *s = cli_arg1(arg);
-   char *colon = strchr(s, ':');
-   double tgt_min = 0.001, tgt_max = 600.0, tgt_stp = 0.001;
-
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	     "(%s:%d) com_etime (args=%s)", __FILE__, __LINE__, arg);
+   double soon = getClockTime() + SOCKSERV_IDLE_POLL_INTERVAL;
+   int i;
 
-   if (colon) {
-      new_etime = atoi(s) * 60.0 + atof(colon+1);
+   if (serv_info->exposing || (serv_info->bulk_sends > 0)) {
+      return 0;
    }
-   else {
-      new_etime = atof(s);
+   for (i = 0; i < MAX_SEQUENCES; i++) {
+      if ((sequence_client[i] != NULL) && 
+	  (sequence_client[i]->seq_remaining != 0) &&
+	  (sequence_client[i]->seq_next_ts < soon)) {
+	 return 0;
+      }
    }
-   free(s);
 
-   if (new_etime != 0) {
+   return SOCKSERV_IDLE_POLL_INTERVAL;
+}
 
-      /*
-       * Round to nearest tgt_stp
-       */
-      new_etime += tgt_stp/2.;
-      new_etime = (int)(new_etime / tgt_stp) * tgt_stp;
-      if (new_etime > tgt_max) new_etime = tgt_max;
-      if (new_etime < tgt_min) new_etime = tgt_min;
 
-      if (fabs(serv_info->etime - new_etime) > 0.0001) {
-	 serv_info->etime = new_etime;
-      }
-   }
+/*
+ * Start building a master dark or flat out of the next 'nframes'
+ * exposures, taken with the settings already made.  Darks have to be
+ * taken with the camera covered and flats of an evenly lit field.  The
+ * request is acknowledged at once, and the client is told once the
+ * master has been saved, or why it couldn't be built.
+ */
+static void
+startCalibration(client_info_t *cinfo, char *buffer, calib_kind_t kind,
+		 int nframes)
+{
+   const char *cmd = (kind == CALIB_DARK) ? DARK_CMD : FLAT_CMD;
+   size_t npixels = (size_t)serv_info->image_width * serv_info->image_height;
 
-   if (ssPutPrintf(SS_ETIME, 
-		   "%.4f", serv_info->etime) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-		"(%s:%d) ssPutPrintf of %s failed: %s", 
-		__FILE__, __LINE__, SS_ETIME, 
-		ssGetStrError());
+   if ((nframes < 1) || (nframes > MAX_CALIB_FRAMES)) {
+      sprintf(buffer, "%c %s \"Use %s <n>, with n up to %d\"", FAIL_CHAR, 
+	      cmd, cmd, MAX_CALIB_FRAMES);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+   if (serv_info->calib_kind != CALIB_NONE) {
+      sprintf(buffer, "%c %s \"A master is already being built\"", 
+	      FAIL_CHAR, cmd);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+   if (cinfo->subscribed || (cinfo->image_wanted != IMAGE_NONE) ||
+       (cinfo->seq_remaining != 0) || 
+       (cinfo->fetch_next < cinfo->fetch_end)) {
+      sprintf(buffer, "%c %s \"An image is already on its way\"", 
+	      FAIL_CHAR, cmd);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+   if ((serv_info->calib_sum = (float *)calloc(npixels, 
+					       sizeof(float))) == NULL) {
+      sprintf(buffer, "%c %s \"Not enough memory for the master\"", 
+	      FAIL_CHAR, cmd);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
    }
 
+   serv_info->calib_kind = kind;
+   serv_info->calib_remaining = nframes;
+   serv_info->calib_count = 0;
+   masterPath(serv_info->calib_path, kind);
+   masterPath(serv_info->calib_key, CALIB_DARK);
+   calib_client = cinfo;
    cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	     "(%s:%d) etime set to %.3f", 
-	     __FILE__, __LINE__, serv_info->etime);
+	     "(%s:%d) building %s from %d exposures", __FILE__, __LINE__,
+	     serv_info->calib_path, nframes);
 
-   sprintf(serv_info->response_buffer, ". etime %.3f", serv_info->etime);
+   if (!serv_info->exposing && (startNextExposure(buffer) != PASS) &&
+       (calib_client != cinfo)) {
+      strcpy(buffer, cinfo->reply);
+      cinfo->reply[0] = '\0';
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
 
-   return PASS;
+   sprintf(buffer, "%c %s %d", PASS_CHAR, cmd, nframes);
+   cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	     "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
 }
 
 
 /*
- * Set the gain value
+ * Add a client to the subscribers, which are sent every image taken for
+ * them without asking.  Each image arrives as an IMAGE reply line followed
+ * by its data, and the subscription lasts until the client disconnects.
  */
-static PASSFAIL
-com_gain(const char *arg)
+static void
+subscribe(client_info_t *cinfo, char *buffer)
 {
-   char *s = cli_arg1(arg);
-   int gain = 0;
-
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	     "(%s:%d) com_gain (args=%s)", __FILE__, __LINE__, arg);
+   int i;
 
-   gain = atoi(s);
-   if (gain < MIN_GAIN || gain > MAX_GAIN) {
+   if (cinfo == calib_client) {
+      sprintf(buffer, "%c %s \"A master is being built\"", FAIL_CHAR, 
+	      SUBSCRIBE_CMD);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+   if (cinfo->fetch_next < cinfo->fetch_end) {
+      sprintf(buffer, "%c %s \"Images are being fetched\"", FAIL_CHAR, 
+	      SUBSCRIBE_CMD);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+   if (!cinfo->subscribed) {
+      for (i = 0; (i < MAX_SUBSCRIBERS) && (subscriber[i] != NULL); i++) {
+      }
+      if (i == MAX_SUBSCRIBERS) {
+	 sprintf(buffer, "%c %s \"Too many subscribers\"", FAIL_CHAR, 
+		 SUBSCRIBE_CMD);
+	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		   "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+	 return;
+      }
+      subscriber[i] = cinfo;
+      cinfo->subscribed = TRUE;
       cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		"(%s:%d) Invalid gain specified: %s should be between %d and"
-		" %d", __FILE__, __LINE__, s, MIN_GAIN, MAX_GAIN);
-      free(s);
-      sprintf(serv_info->response_buffer, "! gain \"invalid value\"");
-      return PASS;
+		"(%s:%d) %s subscribed to the images",
+		__FILE__, __LINE__, cinfo->hostname);
    }
-   free(s);
-   serv_info->gain = gain;
 
    /*
-    * Store the new gain value in the Status Server
+    * Pick up the data connection now, since there won't be a request
+    * to do it with later
     */
-   if (ssPutPrintf(SS_GAIN, 
-		   "%d", serv_info->gain) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-	 	"(%s:%d) ssPutPrintf of %s failed: %s", 
-		__FILE__, __LINE__, SS_GAIN, 
-		ssGetStrError());
+   if ((cinfo->bulk_token != 0) && (cinfo->data_fd == -1)) {
+      claimDataConnection(cinfo);
    }
 
-   cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	     "(%s:%d) gain set to %d", 
-	     __FILE__, __LINE__, serv_info->gain);
+   sprintf(buffer, "%c %s", PASS_CHAR, SUBSCRIBE_CMD);
+   if (cinfo->data_fd != -1) {
+      strcat(buffer, " " BULK_CMD);
+   }
+   cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	     "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+}
 
-   sprintf(serv_info->response_buffer, ". gain %d", serv_info->gain);
 
-   return PASS;
+/*
+ * Remove a client from the subscribers
+ */
+static void
+unsubscribe(client_info_t *cinfo)
+{
+   int i;
+
+   for (i = 0; i < MAX_SUBSCRIBERS; i++) {
+      if (subscriber[i] == cinfo) {
+	 subscriber[i] = NULL;
+      }
+   }
+   cinfo->subscribed = FALSE;
 }
 
 
 /*
- * Take a pointer to image data and create a FITS image using this data
- * and send it to the specified file descriptor
+ * Send the subscribers the exposure just read out.  It is built once for
+ * each format the subscribers asked for; every subscriber then sends the
+ * shared image from its own offset.
  */
-static PASSFAIL
-writeFITSImage(unsigned short *image_p, int fd) 
+static void
+serveSubscribers(unsigned short *pixels, double timestamp)
 {
+   double start_ts;
+   int wanted[2] = { FALSE, FALSE };
+   int built[2] = { FALSE, FALSE };
+   int fd;
+   int i;
 
-   HeaderUnit hu;
-   time_t date = time(NULL);
-   char fitscard[FH_MAX_STRLEN];
-   struct timeval tv;
-   struct timezone tz;
-   fh_result fh_error;
-   char dome_az[255];
-
-   // Get dome azimuth 
-   if (ssGetString(SS_DOME_AZ, dome_az, sizeof(dome_az) - 1) == FAIL) {
-      fprintf(stderr, "ssGet `%s' failed: %s\n", SS_DOME_AZ, ssGetStrError());
-      exit(EXIT_FAILURE);
+   for (i = 0; i < MAX_SUBSCRIBERS; i++) {
+      if (subscriber[i] != NULL) {
+	 wanted[subscriber[i]->compress ? 1 : 0] = TRUE;
+      }
+   }
+   for (i = 0; i < 2; i++) {
+      if (!wanted[i]) {
+	 continue;
+      }
+      start_ts = getClockTime();
+      if ((fd = openImageFile(&shared_image[i])) != -1) {
+	 built[i] = (writeFITSImage(pixels, fd, timestamp, FALSE, i) == PASS) &&
+	    (mapImageFile(&shared_image[i]) == PASS);
+      }
+      recordStage(STAGE_ENCODE, getClockTime() - start_ts);
+      if (!built[i]) {
+	 cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		   "(%s:%d) unable to create FITS file for the subscribers",
+		   __FILE__, __LINE__);
+      }
    }
-   /*
-    * Create the header unit
-    */
-   hu = fh_create();
 
    /*
-    * Populate the headers 
+    * Queue the image up on every subscriber that isn't still busy with
+    * an image it asked for itself
     */
-   fh_set_bool(hu, FH_AUTO, "SIMPLE", FH_TRUE, "Standard FITS");
-   fh_set_int(hu,  FH_AUTO, "BITPIX", 16,"16-bit data");
-   fh_set_int(hu,  FH_AUTO, "NAXIS",  2, "Number of axes");
-   fh_set_int(hu,  FH_AUTO, "NAXIS1", serv_info->image_width, 
-	 "Number of pixel columns");
-   fh_set_int(hu,  FH_AUTO, "NAXIS2", serv_info->image_height, 
-	 "Number of pixel rows");
-   fh_set_int(hu,  FH_AUTO, "PCOUNT", 0, "No 'random' parameters");
-   fh_set_int(hu,  FH_AUTO, "GCOUNT", 1, "Only one group");
+   start_ts = getClockTime();
+   for (i = 0; i < MAX_SUBSCRIBERS; i++) {
+      client_info_t *cinfo = subscriber[i];
+      client_info_t *shared;
 
-   strftime(fitscard, sizeof(fitscard)-1, "%Y-%m-%dT%T", gmtime(&date));
-   fh_set_str(hu, FH_AUTO, "DATE", fitscard, "UTC Date of file creation");
-   strftime(fitscard, sizeof(fitscard)-1, "%a %b %d %H:%M:%S %Z %Y", 
-	 localtime(&date));
-   fh_set_str(hu, FH_AUTO, "HSTTIME", fitscard, "Local time in Hawaii");
-   gettimeofday(&tv, &tz);
-   fh_set_flt(hu, FH_AUTO, "UNIXTIME", getClockTime(), 
-	 13, "Fractional UNIX timestamp when image was taken");
-   fh_set_str(hu, FH_AUTO, "ORIGIN", "CFHT", "Canada-France-Hawaii Telescope");
-   fh_set_str(hu, FH_AUTO, "INSTRUME", "ZWOCam", "Instrument Name");
-   fh_set_flt(hu, FH_AUTO, "BZERO", 32768.0, 6,	"Zero factor");
-   fh_set_flt(hu, FH_AUTO, "BSCALE", 1.0, 2, "Scale factor");
+      if ((cinfo == NULL) || cinfo->send_data) {
+	 continue;
+      }
+      shared = &shared_image[cinfo->compress ? 1 : 0];
+      if (!built[shared->compress]) {
+	 continue;
+      }
+      releaseImageData(cinfo);
+      cinfo->shared = shared;
+      shared->refs++;
+      cinfo->image_data = shared->image_data;
+      cinfo->image_size = shared->image_size;
+      cinfo->send_data = 1;
+      cinfo->data_count = 0;
+      cinfo->total_count = cinfo->image_size;
+      cinfo->width = serv_info->image_width;
+      cinfo->height = serv_info->image_height;
+      cinfo->send_start_ts = start_ts;
+      imageReply(cinfo, cinfo->reply);
+   }
+}
 
-   fh_set_str(hu, FH_AUTO, "DOMEAZ", dome_az, "Dome Azimuth");
-   fh_set_str(hu, FH_AUTO, "CAMMODEL", ZWO_MODEL, "Camera Model");
-   fh_set_str(hu, FH_AUTO, "CCDNAME", CCD_SENSOR, "CCD Sensor");
-   fh_set_flt(hu, FH_AUTO, "ETIME", serv_info->etime, 5, 
-	      "Integration time");
-   fh_set_int(hu, FH_AUTO, "GAIN", serv_info->gain, 
-	      "Camera Gain [0..510]");
-   fh_set_flt(hu, FH_AUTO, "PIXSIZE", PIXEL_SIZE, 5, "Pixel size (micron)");
-   fh_set_int(hu, FH_AUTO, "SEQNUM", ++(serv_info->frame_sequence), 
-	 "Frame sequence number");
 
-   /* 
-    * Add space to allow for additional headers 
-    */
-   if ((fh_error = fh_reserve(hu, 220)) != FH_SUCCESS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-	      "(%s:%d) unable to add padding to FITS header:"
-		" (fh_error=%d)", __FILE__, __LINE__, fh_error);
-      fh_destroy(hu);
-      return FAIL;
+/*
+ * Shrink an image into a stretched 8-bit thumbnail for the encoder, by
+ * averaging blocks of pixels until it fits in PREVIEW_SIZE.  NEON adds
+ * up the rows of a block eight pixels at a time, and the sums of the
+ * columns are then averaged.  The black and white points are taken
+ * PREVIEW_BLACK and PREVIEW_WHITE up the histogram of the thumbnail, with
+ * a square root stretch in between to bring up the faint sky.  The
+ * thumbnail is flipped like the FITS image and turned upside down, since
+ * a JPEG starts at the top.  It is skipped if the encoder is still busy
+ * with the last one.
+ */
+static void
+makePreview(const unsigned short *pixels)
+{
+   static unsigned char lut[65536];
+   unsigned int histogram[PREVIEW_BINS];
+   int width = serv_info->image_width;
+   int height = serv_info->image_height;
+   int factor, tw, th, x, y, i;
+   unsigned int rank, count, sum;
+   unsigned int black, white;
+   unsigned int v;
+   int busy;
+
+   if (preview.row_sum == NULL) {
+      return;
+   }
+   pthread_mutex_lock(&preview.lock);
+   busy = preview.pending;
+   pthread_mutex_unlock(&preview.lock);
+   if (busy) {
+      return;
    }
 
-   /* 
-    * Write out the FITS header 
-    */
-   if ((fh_error = fh_write(hu, fd)) != FH_SUCCESS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		"(%s:%d) unable to write FITS header"
-		" (fh_error = %d)", __FILE__, __LINE__,
-		fh_error);
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY, 
-		"%s (errno=%d)", strerror(errno), errno);
-      fh_destroy(hu);
-      return FAIL;
+   factor = ((width > height ? width : height) + PREVIEW_SIZE - 1) / 
+      PREVIEW_SIZE;
+   tw = width / factor;
+   th = height / factor;
+   if ((tw == 0) || (th == 0)) {
+      return;
    }
-   
+
    /*
-    * Write out the image data
+    * Average the blocks
     */
-   if ((fh_error = fh_write_padded_image(hu, fd,
-					 (unsigned short *)image_p, 
-					 serv_info->image_width *
-					 serv_info->image_height *
-					 sizeof(uint16_t), FH_TYPESIZE_16U)) 
-       != FH_SUCCESS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		"(%s:%d) unable to write FITS image data"
-		" (fh_error = %d)", __FILE__, __LINE__,
-		fh_error);
-      fh_destroy(hu);
-      return FAIL;
+   memset(histogram, 0, sizeof(histogram));
+   for (y = 0; y < th; y++) {
+      memset(preview.row_sum, 0, tw * factor * sizeof(unsigned int));
+      for (i = 0; i < factor; i++) {
+	 const unsigned short *row = pixels + 
+	    (size_t)(y * factor + i) * width;
+
+	 x = 0;
+#ifdef __ARM_NEON
+	 for (; x + 8 <= tw * factor; x += 8) {
+	    uint16x8_t pix = vld1q_u16(row + x);
+
+	    vst1q_u32(preview.row_sum + x, 
+		      vaddw_u16(vld1q_u32(preview.row_sum + x), 
+				vget_low_u16(pix)));
+	    vst1q_u32(preview.row_sum + x + 4, 
+		      vaddw_u16(vld1q_u32(preview.row_sum + x + 4), 
+				vget_high_u16(pix)));
+	 }
+#endif
+	 for (; x < tw * factor; x++) {
+	    preview.row_sum[x] += row[x];
+	 }
+      }
+      for (x = 0; x < tw; x++) {
+	 sum = 0;
+	 for (i = 0; i < factor; i++) {
+	    sum += preview.row_sum[x * factor + i];
+	 }
+	 v = (sum + (factor * factor) / 2) / (factor * factor);
+	 preview.thumb[y * tw + x] = (unsigned short)v;
+	 histogram[v * PREVIEW_BINS / 65536]++;
+      }
    }
-   
+
    /*
-    * Free up the memory for the FITS header
+    * Find the black and white points and stretch between them
     */
-   fh_destroy(hu);
-   
-   return PASS;
+   count = tw * th;
+   rank = (unsigned int)(count * PREVIEW_BLACK);
+   for (black = 0; black < PREVIEW_BINS - 1; black++) {
+      if (histogram[black] > rank) {
+	 break;
+      }
+      rank -= histogram[black];
+   }
+   rank = (unsigned int)(count * PREVIEW_WHITE);
+   for (white = 0; white < PREVIEW_BINS - 1; white++) {
+      if (histogram[white] > rank) {
+	 break;
+      }
+      rank -= histogram[white];
+   }
+   black = black * 65536 / PREVIEW_BINS;
+   white = (white + 1) * 65536 / PREVIEW_BINS;
+   memset(lut, 0, black);
+   for (v = black; v < white; v++) {
+      lut[v] = (unsigned char)(255.0 * sqrt((double)(v - black) / 
+					    (white - black)) + 0.5);
+   }
+   memset(lut + white, 255, 65536 - white);
+   for (y = 0; y < th; y++) {
+      const unsigned short *src = preview.thumb + (size_t)y * tw;
+      unsigned char *dst = preview.pixels + (size_t)(th - 1 - y) * tw;
+
+      for (x = 0; x < tw; x++) {
+	 dst[FLIP_COLUMN(x, tw)] = lut[src[x]];
+      }
+   }
+
+   /*
+    * Hand it to the encoder
+    */
+   pthread_mutex_lock(&preview.lock);
+   preview.width = tw;
+   preview.height = th;
+   preview.pending = TRUE;
+   pthread_cond_signal(&preview.cond);
+   pthread_mutex_unlock(&preview.lock);
+}
+
+
+/*
+ * Background thread that encodes each thumbnail handed over by
+ * makePreview() into a JPEG, which replaces the one kept for PREVIEW
+ */
+static void *
+previewThread(void *arg)
+{
+   struct jpeg_compress_struct jpeg;
+   struct jpeg_error_mgr jerr;
+   unsigned char *data;
+   unsigned long size;
+   JSAMPROW row;
+
+   jpeg.err = jpeg_std_error(&jerr);
+   jpeg_create_compress(&jpeg);
+   for (;;) {
+      pthread_mutex_lock(&preview.lock);
+      while (!preview.pending) {
+	 pthread_cond_wait(&preview.cond, &preview.lock);
+      }
+      pthread_mutex_unlock(&preview.lock);
+
+      /*
+       * makePreview() leaves the thumbnail alone while it is pending
+       */
+      data = NULL;
+      size = 0;
+      jpeg_mem_dest(&jpeg, &data, &size);
+      jpeg.image_width = preview.width;
+      jpeg.image_height = preview.height;
+      jpeg.input_components = 1;
+      jpeg.in_color_space = JCS_GRAYSCALE;
+      jpeg_set_defaults(&jpeg);
+      jpeg_set_quality(&jpeg, PREVIEW_QUALITY, TRUE);
+      jpeg_start_compress(&jpeg, TRUE);
+      while (jpeg.next_scanline < jpeg.image_height) {
+	 row = preview.pixels + (size_t)jpeg.next_scanline * preview.width;
+	 jpeg_write_scanlines(&jpeg, &row, 1);
+      }
+      jpeg_finish_compress(&jpeg);
+
+      pthread_mutex_lock(&preview.lock);
+      free(preview.jpeg);
+      preview.jpeg = data;
+      preview.jpeg_size = size;
+      preview.pending = FALSE;
+      pthread_mutex_unlock(&preview.lock);
+   }
+
+   return NULL;
 }
 
 
 /*
- * Take an image and save the contents of the buffer into memory where it 
- * can be sent to the client at the first opportunity.
+ * Set up the buffers for the previews, for the largest image the camera
+ * takes, and start the encoder
  */
 static void
-takeImage(client_info_t *cinfo, char *buffer)
+startPreview(void)
+{
+   pthread_t thread;
+   int width = serv_info->asi_camera_info->MaxWidth;
+
+   pthread_mutex_init(&preview.lock, NULL);
+   pthread_cond_init(&preview.cond, NULL);
+   preview.thumb = (unsigned short *)
+      cli_malloc(PREVIEW_SIZE * PREVIEW_SIZE * sizeof(unsigned short));
+   preview.pixels = (unsigned char *)cli_malloc(PREVIEW_SIZE * PREVIEW_SIZE);
+   if (pthread_create(&thread, NULL, previewThread, NULL) != 0) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		"(%s:%d) unable to start the preview encoder, PREVIEW will"
+		" not be available", __FILE__, __LINE__);
+      return;
+   }
+   pthread_detach(thread);
+   preview.row_sum = (unsigned int *)cli_malloc(width * sizeof(unsigned int));
+}
+
+
+/*
+ * Send the client the preview of the last image taken
+ */
+static void
+sendPreview(client_info_t *cinfo, char *buffer)
 {
-   struct stat file_stat;
-   ASI_EXPOSURE_STATUS asi_exp_status;
    int fd;
    int rc;
-   int read_count;
-   int count;
-   int size;
 
-   /*
-    * Open up a temporary file to write the FITS image to
-    */
-   if ((fd = open(TEMP_FILE, O_CREAT | O_RDWR | O_TRUNC,
-		  S_IRUSR | S_IRGRP | S_IROTH | S_IWUSR | S_IWGRP | S_IWOTH))
-       == -1) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		"(%s:%d) unable to open temporary file %s.  %s (errno=%d)",
-		__FILE__, __LINE__, TEMP_FILE, strerror(errno), errno);
-      sprintf(buffer,
-	      "%c %s \"Unable to save temporary file on the camera"
-	      " server\"", FAIL_CHAR, IMAGE_CMD);
-      cfht_logv(CFHT_MAIN, CFHT_DEBUG, "(%s:%d) SEND> %s", __FILE__, __LINE__,
-		buffer);
+   if (cinfo->subscribed || (cinfo->image_wanted != IMAGE_NONE) ||
+       (cinfo->seq_remaining != 0) || (cinfo == calib_client) ||
+       (cinfo->fetch_next < cinfo->fetch_end)) {
+      sprintf(buffer, "%c %s \"An image is already on its way\"", 
+	      FAIL_CHAR, PREVIEW_CMD);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+   if ((fd = openImageFile(cinfo)) == -1) {
+      sprintf(buffer, "%c %s \"Unable to create in-memory image on the"
+	      " camera server\"", FAIL_CHAR, PREVIEW_CMD);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
       return;
    }
 
    /*
-    * Check if there is an exposure already in progress.  If so, wait until 
-    * the exposure is done.
-    */
-   do {
-      ASIGetExpStatus(serv_info->asi_camera_info->CameraID,
-		      &asi_exp_status);
-      usleep(5000);
-   } while (asi_exp_status == ASI_EXP_WORKING);
-
-   /*
-    * Set the exposure time
+    * Copy the JPEG out, so the encoder can replace it while it is sent
     */
-   if ((rc = ASISetControlValue(serv_info->asi_camera_info->CameraID,
-				ASI_EXPOSURE, 
-				(long)(serv_info->etime * 1000000),
-				ASI_FALSE)) != ASI_SUCCESS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		"(%s:%d) Unable to set exposure time to %f seconds: rc=%d",
-		__FILE__, __LINE__, serv_info->etime, rc);
-      sprintf(buffer,
-	      "%c %s \"Unable to set exposure time\"", FAIL_CHAR, IMAGE_CMD);
+   pthread_mutex_lock(&preview.lock);
+   rc = (preview.jpeg == NULL) ? FAIL : 
+      writeAll(fd, preview.jpeg, preview.jpeg_size);
+   pthread_mutex_unlock(&preview.lock);
+   if (rc != PASS) {
+      sprintf(buffer, "%c %s \"No preview available\"", FAIL_CHAR, 
+	      PREVIEW_CMD);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
       return;
    }
 
    /*
-    * Set the gain value
+    * It goes out like an image, but the reply names it as a JPEG
     */
-   if ((rc = ASISetControlValue(serv_info->asi_camera_info->CameraID,
-				ASI_GAIN, serv_info->gain,
-				ASI_FALSE)) != ASI_SUCCESS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		"(%s:%d) Unable to set gain to be %d: rc=%d",
-		__FILE__, __LINE__, serv_info->gain, rc);
-      sprintf(buffer,
-	      "%c %s \"Unable to set gain\"", FAIL_CHAR, IMAGE_CMD);
+   cinfo->io_time = 0;
+   replyWithImage(cinfo, buffer, PREVIEW_CMD);
+   if (cinfo->send_data) {
+      sprintf(buffer, "%c %ld%s %s", PASS_CHAR, (long)cinfo->image_size,
+	      (cinfo->data_fd != -1) ? " " BULK_CMD : "", 
+	      PREVIEW_JPEG_STRING);
+   }
+   cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	     "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+}
+
+
+/*
+ * Drive the exposures from the server loop, so that commands keep being
+ * answered while one is under way.  Once the camera is done the image is
+ * built for every client that asked for it and for the subscribers, and
+ * the next exposure is started if anyone is waiting for one.  'commands'
+ * is cleared when takeImage() drives them instead, and is passed on to
+ * waitEvents().
+ */
+static void
+serveExposures(int commands)
+{
+   unsigned short *pixels;
+   char reply[256];
+   double timestamp = 0;
+   int waiting;
+   int i;
+
+   checkCamera();
+   waiting = queueSequences();
+   if (serv_info->exposing) {
+      if (!exposureDone() || 
+	  (serv_info->exposure_dual && !receiveTauImage())) {
+	 waitEvents(exposureWait(), commands);
+	 return;
+      }
+      pixels = readExposure(reply, IMAGE_CMD, &timestamp);
+      serv_info->calib_pixels = NULL;
+      if (serv_info->exposure_calib && 
+	  (serv_info->calib_kind != CALIB_NONE)) {
+	 addCalibrationFrame(pixels);
+      }
+      for (i = 0; i < MAX_IMAGE_CLIENTS; i++) {
+	 client_info_t *cinfo = image_client[i];
+
+	 if ((cinfo == NULL) || (cinfo->image_wanted != IMAGE_EXPOSING)) {
+	    continue;
+	 }
+	 if (pixels == NULL) {
+	    strcpy(cinfo->reply, reply);
+	 }
+	 else {
+	    deliverImage(cinfo, pixels, timestamp);
+	 }
+	 cinfo->image_wanted = IMAGE_NONE;
+	 image_client[i] = NULL;
+      }
+      if (serv_info->exposure_subscribed) {
+	 if (pixels == NULL) {
+	    cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		      "(%s:%d) no image for the subscribers: %s",
+		      __FILE__, __LINE__, reply);
+	    serv_info->subscribe_retry_ts = getClockTime() + SUBSCRIBE_RETRY;
+	 }
+	 else {
+	    serveSubscribers(pixels, timestamp);
+	 }
+      }
+
+      /*
+       * Settle the exposure for the next image, but not in the middle of
+       * a master, which needs the same settings
+       */
+      if (serv_info->auto_exposure && (pixels != NULL) && 
+	  (serv_info->calib_kind == CALIB_NONE)) {
+	 autoExposure(pixels);
+      }
+      if (pixels != NULL) {
+	 makePreview(pixels);
+      }
+
+      /*
+       * Keep the image for clients that missed it, but not the exposures
+       * of a master
+       */
+      if ((pixels != NULL) && !serv_info->exposure_calib) {
+	 archiveImage(pixels, timestamp);
+      }
+      releaseExposure();
+      if (serv_info->exposure_dual) {
+	 serv_info->tau_state = TAU_IDLE;
+      }
+   }
+
+   startNextExposure(reply);
+   if (!serv_info->exposing && (waiting || (serv_info->bulk_sends > 0))) {
+      waitEvents(EXPOSURE_POLL_INTERVAL, commands);
+   }
+}
+
+
+/*
+ * Queue a client up for an image, or with 'dual' set for a DUALIMAGE.  The
+ * exposure is started right away unless one is already under way, in
+ * which case the client gets the next one.  Either way the image is
+ * announced with the usual reply once it has been read out.  With 'async'
+ * set (IMAGE ASYNC or DUALIMAGE ASYNC) the request is acknowledged at
+ * once and the reply follows on its own, like the images of a SEQUENCE;
+ * otherwise that reply is the answer to the request.
+ */
+static void
+takeImage(client_info_t *cinfo, char *buffer, int dual, int async)
+{
+   const char *cmd = dual ? DUALIMAGE_CMD : IMAGE_CMD;
+   int i;
+
+   if (cinfo->subscribed || (cinfo->image_wanted != IMAGE_NONE) ||
+       (cinfo->seq_remaining != 0) || (cinfo == calib_client) ||
+       (cinfo->fetch_next < cinfo->fetch_end) || 
+       (cinfo->reply[0] != '\0')) {
+      sprintf(buffer, "%c %s \"An image is already on its way\"", 
+	      FAIL_CHAR, cmd);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
       return;
    }
 
    /*
-    * Trigger the exposure
+    * The pipeline takes its exposures on its own time, so they can't be
+    * lined up with the IR one
     */
-   if ((rc = ASIStartExposure(serv_info->asi_camera_info->CameraID, 
-			      ASI_FALSE)) != ASI_SUCCESS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		"(%s:%d) Unable to start exposure: rc=%d",
-		__FILE__, __LINE__, rc);
-      sprintf(buffer,
-	      "%c %s \"Unable to start exposure\"", FAIL_CHAR, IMAGE_CMD);
+   if (dual && serv_info->pipeline_running) {
+      sprintf(buffer, "%c %s \"Not available while the pipeline is on\"", 
+	      FAIL_CHAR, cmd);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
       return;
    }
-   
-   /*
-    * Wait for the image to be ready
-    */
-   ASIGetExpStatus(serv_info->asi_camera_info->CameraID, &asi_exp_status);
-   while (asi_exp_status == ASI_EXP_WORKING) {
-      usleep(5000);
-      ASIGetExpStatus(serv_info->asi_camera_info->CameraID, &asi_exp_status);
+   for (i = 0; (i < MAX_IMAGE_CLIENTS) && (image_client[i] != NULL); i++) {
    }
-   if (asi_exp_status != ASI_EXP_SUCCESS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		"(%s:%d) Exposure request failed: rc=%d",
-		__FILE__, __LINE__, rc);
-      sprintf(buffer,
-	      "%c %s \"Exposure request failed\"", FAIL_CHAR, IMAGE_CMD);
+   if (i == MAX_IMAGE_CLIENTS) {
+      sprintf(buffer, "%c %s \"Too many clients waiting for an image\"", 
+	      FAIL_CHAR, cmd);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
       return;
    }
 
    /*
-    * Allocate memory for the image, if necessary
+    * Pick up the data connection if the client negotiated a bulk transfer.
+    * If it doesn't show up the image goes out through the chunked path.
     */
-   size = serv_info->asi_camera_info->MaxWidth * 
-      serv_info->asi_camera_info->MaxHeight * sizeof(short);
-   if (serv_info->image_data == NULL) {
-      serv_info->image_data = 
-	 (unsigned char *)cli_malloc(size);
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		"(%s:%d) Allocate memory for image (size=%d bytes)",
-		__FILE__, __LINE__, size);
+   if ((cinfo->bulk_token != 0) && (cinfo->data_fd == -1)) {
+      claimDataConnection(cinfo);
    }
-   
-   /*
-    * Read out the image
-    */
-   if ((rc = ASIGetDataAfterExp(serv_info->asi_camera_info->CameraID, 
-				serv_info->image_data, size)) != ASI_SUCCESS) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		"(%s:%d) Unable to read out image: rc=%d",
-		__FILE__, __LINE__, rc);
-      sprintf(buffer,
-	      "%c %s \"Unable to read out image\"", FAIL_CHAR, IMAGE_CMD);
+
+   image_client[i] = cinfo;
+   cinfo->image_wanted = IMAGE_QUEUED;
+   cinfo->dual = dual;
+   if (!serv_info->exposing && (startNextExposure(buffer) != PASS)) {
+      cinfo->reply[0] = '\0';
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+
+   if (async) {
+      sprintf(buffer, "%c %s %s", PASS_CHAR, cmd, IMAGE_ASYNC_STRING);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
       return;
    }
 
    /*
-    * Set the time for when the exposure was completed
+    * The clients that send a plain IMAGE expect nothing but the reply
+    * announcing the image.  sockserv answers a command as soon as it has
+    * been handled and an empty answer closes the connection, so for them
+    * the exposures are served from here, and other commands wait, until
+    * the image has been read out.
     */
-   serv_info->exp_readout_done_ts = getClockTime();
-   serv_info->exp_cycle_time 
-      = serv_info->exp_readout_done_ts - serv_info->exp_start_ts;
-   time(&(serv_info->last_exp_completion));
+   while (cinfo->image_wanted != IMAGE_NONE) {
+      serveExposures(FALSE);
+   }
+
+   strcpy(buffer, cinfo->reply);
+   cinfo->reply[0] = '\0';
+}
+
+
+/*
+ * Build a FITS image out of the newest frames in the free-running capture
+ * ring.  A single frame (LATEST) goes out like an IMAGE reply; several
+ * (FRAMES n) go out oldest first as the extensions of one FITS file.
+ */
+static void
+sendVideoFrames(client_info_t *cinfo, char *buffer, const char *cmd,
+		int nframes)
+{
+   video_frame_t *frames[VIDEO_RING_SLOTS];
+   video_frame_t *newest;
+   unsigned int below;
+   double stop_ts, start_ts;
+   int count;
+   int fd;
+   int rc;
+   int i, j;
+
+   if (!serv_info->video_running) {
+      sprintf(buffer, "%c %s \"Video capture is not running\"", 
+	      FAIL_CHAR, cmd);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+   if ((nframes < 1) || (nframes > VIDEO_RING_SLOTS)) {
+      sprintf(buffer, "%c %s \"Number of frames must be 1 to %d\"", 
+	      FAIL_CHAR, cmd, VIDEO_RING_SLOTS);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
 
    /*
-    * Create a FITS image from the pixel data and send it to the file
+    * Pin the newest frames, newest first, so the capture thread leaves
+    * them alone.  Right after video mode is turned on there may not be
+    * a frame yet, so wait for the first one.
     */
-   if (writeFITSImage((unsigned short *)(serv_info->image_data), fd) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_ERROR,
-		"(%s:%d) unable to create FITS file", __FILE__, __LINE__);
-      sprintf(buffer, "%c %s \"Unable to save temporary file on the guide"
-	      " server\"", FAIL_CHAR, IMAGE_CMD);
+   stop_ts = getClockTime() + serv_info->etime * 2 + EXPOSE_TIMEOUT;
+   for (;;) {
+      pthread_mutex_lock(&serv_info->video_lock);
+      below = ~0U;
+      for (count = 0; count < nframes; count++) {
+	 newest = NULL;
+	 for (i = 0; i < VIDEO_RING_SLOTS; i++) {
+	    if ((serv_info->video_ring[i].sequence != 0) &&
+		(serv_info->video_ring[i].sequence < below) &&
+		((newest == NULL) || 
+		 (serv_info->video_ring[i].sequence > newest->sequence))) {
+	       newest = &serv_info->video_ring[i];
+	    }
+	 }
+	 if (newest == NULL) {
+	    break;
+	 }
+	 newest->readers++;
+	 frames[count] = newest;
+	 below = newest->sequence;
+      }
+      pthread_mutex_unlock(&serv_info->video_lock);
+      if ((count != 0) || (getClockTime() > stop_ts)) {
+	 break;
+      }
+      usleep(5000);
+   }
+   if (count == 0) {
+      sprintf(buffer, "%c %s \"No video frames received\"", FAIL_CHAR, cmd);
       cfht_logv(CFHT_MAIN, CFHT_DEBUG,
 		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
-      close(fd);
       return;
    }
    
    /*
-    * Take the FITS image that was written to disk and determine the size of
-    * it.
+    * Build the FITS image in the in-memory file straight from the pinned
+    * slots, then hand the slots back to the capture thread
     */
-   if (fstat(fd, &file_stat) == -1) {
-      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		"(%s:%d) unable to retrieve the size of the temporary FITS"
-		" file", __FILE__, __LINE__);
-      sprintf(buffer, "%c %s \"Unable to save temporary file on the guide"
-	      " server\"", FAIL_CHAR, IMAGE_CMD);
+   rc = FAIL;
+   start_ts = getClockTime();
+   fd = openImageFile(cinfo);
+   cinfo->io_time = getClockTime() - start_ts;
+   if (fd != -1) {
+      start_ts = getClockTime();
+      if (count == 1) {
+	 noteExposure();
+	 rc = writeFITSImage((unsigned short *)frames[0]->data, fd, 
+			     frames[0]->timestamp, FALSE, cinfo->compress);
+      }
+      else {
+	 rc = writeFITSPrimary(count, fd);
+	 for (j = count - 1; (j >= 0) && (rc == PASS); j--) {
+	    noteExposure();
+	    rc = writeFITSImage((unsigned short *)frames[j]->data, fd,
+				frames[j]->timestamp, TRUE, cinfo->compress);
+	 }
+      }
+      recordStage(STAGE_ENCODE, getClockTime() - start_ts);
+   }
+   pthread_mutex_lock(&serv_info->video_lock);
+   for (j = 0; j < count; j++) {
+      frames[j]->readers--;
+   }
+   pthread_mutex_unlock(&serv_info->video_lock);
+   if (rc != PASS) {
+      sprintf(buffer, "%c %s \"Unable to create in-memory image on the"
+	      " camera server\"", FAIL_CHAR, cmd);
       cfht_logv(CFHT_MAIN, CFHT_DEBUG,
 		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
-      close(fd);
       return;
    }
 
    /*
-    * Copy the image data to the client structure
+    * Send it out the same way an IMAGE reply goes
     */
-   cinfo->image_data = (unsigned char *)cli_malloc(file_stat.st_size);
-   read_count = 0;
-   lseek(fd, 0, SEEK_SET);
-   while (read_count < file_stat.st_size) {
-      count = read(fd, cinfo->image_data + read_count,
-		   file_stat.st_size - read_count);
-      if (count < 0) {
-	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
-		   "(%s:%d) unable to retrieve FITS image data from tmpfs"
-		   " file.  %s (errno=%d)", __FILE__, __LINE__,
-		   strerror(errno), errno);
-	 sprintf(buffer, "%c %s \"Unable to retrieve FITS image data"
-		 " from tmpfs\"", FAIL_CHAR, IMAGE_CMD);
-	 cfht_logv(CFHT_MAIN, CFHT_DEBUG,
-		   "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
-	 close(fd);
-	 return;
-      }
-      read_count += count;
+   replyWithImage(cinfo, buffer, cmd);
+}
+
+
+/*
+ * Choose whether the images for a client are Rice tile compressed
+ */
+static void
+setCompression(client_info_t *cinfo, char *buffer, const char *arg)
+{
+   while (isspace((unsigned char)*arg)) {
+      arg++;
+   }
+   if (!strncasecmp(arg, COMPRESS_RICE_STRING, strlen(COMPRESS_RICE_STRING))) {
+      cinfo->compress = TRUE;
+   }
+   else if (!strncasecmp(arg, COMPRESS_NONE_STRING, 
+			 strlen(COMPRESS_NONE_STRING))) {
+      cinfo->compress = FALSE;
+   }
+   else {
+      sprintf(buffer, "%c %s \"Invalid compress argument specified\"", 
+	      FAIL_CHAR, COMPRESS_CMD);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
+   }
+
+   sprintf(buffer, "%c %s %s", PASS_CHAR, COMPRESS_CMD, 
+	   cinfo->compress ? COMPRESS_RICE_STRING : COMPRESS_NONE_STRING);
+   cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	     "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+}
+
+
+/*
+ * Choose whether the images sent to a client are dark and flat corrected
+ * with the masters for the settings they are taken with
+ */
+static void
+setCalibration(client_info_t *cinfo, char *buffer, const char *arg)
+{
+   while (isspace((unsigned char)*arg)) {
+      arg++;
+   }
+   if (!strncasecmp(arg, CALIBRATE_ON_STRING, 
+		    strlen(CALIBRATE_ON_STRING))) {
+      cinfo->calibrate = TRUE;
+   }
+   else if (!strncasecmp(arg, CALIBRATE_OFF_STRING, 
+			 strlen(CALIBRATE_OFF_STRING))) {
+      cinfo->calibrate = FALSE;
+   }
+   else {
+      sprintf(buffer, "%c %s \"Invalid calibrate argument specified\"", 
+	      FAIL_CHAR, CALIBRATE_CMD);
+      cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+		"(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+      return;
    }
 
-   /*
-    * Set up the flags to trigger data being sent
-    */
-   cinfo->send_data = 1;
-   cinfo->data_count = 0;
-   cinfo->total_count = file_stat.st_size;
-   cinfo->width = serv_info->image_width;
-   cinfo->height = serv_info->image_height;
+   sprintf(buffer, "%c %s %s", PASS_CHAR, CALIBRATE_CMD, 
+	   cinfo->calibrate ? CALIBRATE_ON_STRING : CALIBRATE_OFF_STRING);
+   cfht_logv(CFHT_MAIN, CFHT_DEBUG,
+	     "(%s:%d) SEND> %s", __FILE__, __LINE__, buffer);
+}
 
-   /*
-    * If we made it this far, send back a response with the number of bytes
-    * of binary data that can be expected to be received from the server.
-    */
-   sprintf(buffer, "%c %ld", PASS_CHAR, file_stat.st_size);
-   close(fd);
 
-   return;
+/*
+ * Report the progress of the exposure under way, if any, and how many
+ * clients are waiting for an image
+ */
+static PASSFAIL
+com_status(const char *arg)
+{
+   int waiting = 0;
+   int i;
+
+   for (i = 0; i < MAX_IMAGE_CLIENTS; i++) {
+      if (image_client[i] != NULL) {
+	 waiting++;
+      }
+   }
+   if (serv_info->exposing) {
+      sprintf(serv_info->response_buffer, 
+	      ". status exposing elapsed=%.3f etime=%.3f waiting=%d", 
+	      getClockTime() - serv_info->exposure_ts, serv_info->etime,
+	      waiting);
+   }
+   else {
+      sprintf(serv_info->response_buffer, ". status idle etime=%.3f", 
+	      serv_info->etime);
+   }
+   if (serv_info->calib_kind != CALIB_NONE) {
+      sprintf(serv_info->response_buffer + 
+	      strlen(serv_info->response_buffer), " %s=%d/%d",
+	      (serv_info->calib_kind == CALIB_DARK) ? "dark" : "flat",
+	      serv_info->calib_count, 
+	      serv_info->calib_count + serv_info->calib_remaining);
+   }
+
+   return PASS;
 }
 
 
@@ -897,6 +6772,12 @@ com_exit(const char* arg)
 static Command comlist[] = {
    { "etime <sec>",	 com_etime,	 "Set exposure time; <sec> can be a floating point number" },
    { "gain <0..510>",    com_gain,       "Set camera gain [0..510]" },
+   { "auto <on [sec]|off>", com_auto,    "Set etime and gain from each image, exposing up to <sec> before adding gain" },
+   { "video <on|off>",   com_video,      "Free-running capture for latest/frames" },
+   { "pipeline <on|off>", com_pipeline,  "Back to back exposures for image" },
+   { "bin <1..4>",	 com_bin,	 "Set the binning factor" },
+   { "roi [x y w h]",	 com_roi,	 "Read out a region (unbinned pixels); full frame without arguments" },
+   { "status",		 com_status,	 "Report the progress of the exposure" },
    { "exit",		 com_exit,	 "Exit connection" },
    { "quit",		 com_exit,	 "(Synonym for exit)" },
    { "bye",		 com_exit,	 "(Synonym for exit)" },
@@ -917,6 +6798,8 @@ client_add(unsigned char remote_ip[4])
    cinfo = (client_info_t *)cli_malloc(sizeof(*cinfo));
    memset(cinfo, 0, sizeof(client_info_t));
    memcpy(cinfo->remote_ip, remote_ip, sizeof (cinfo->remote_ip));
+   cinfo->image_fd = -1;
+   cinfo->data_fd = -1;
 
    /* 
     * Determine the hostname from the IP address 
@@ -943,6 +6826,11 @@ client_add(unsigned char remote_ip[4])
     */
    appendDataToList(cinfo, serv_info->client_list, cli_malloc);
 
+   /*
+    * Have its commands wake the server loop
+    */
+   adoptCommandSockets(remote_ip);
+
    return cinfo;
 }
 
@@ -950,23 +6838,153 @@ client_add(unsigned char remote_ip[4])
 static void
 client_del(void* cinfo, char* buffer)
 {
+   unsubscribe((client_info_t *)cinfo);
+   dropImageRequest((client_info_t *)cinfo);
+   if (calib_client == cinfo) {
+      calib_client = NULL;
+   }
    if ((((client_info_t *)cinfo)->hostname) != NULL) {
       free(((client_info_t *)cinfo)->hostname);
    }
+   releaseImageData((client_info_t *)cinfo);
+   if (((client_info_t *)cinfo)->image_fd != -1) {
+      close(((client_info_t *)cinfo)->image_fd);
+   }
+   closeDataConnection((client_info_t *)cinfo);
    free(cinfo);
 }
 
 static void
 client_recv(void *cinfo, char* buffer)
 {
+   char *frames_arg;
+   char *compress_arg;
+   char *sequence_arg;
+   char *calib_arg;
+   char *fetch_arg;
+
    serv_info->response_buffer = buffer;
+   serv_info->commands++;
+
+   /*
+    * A subscription is kept with the client
+    */
+   if (stristr(buffer, SUBSCRIBE_CMD) != NULL) {
+      subscribe((client_info_t *)cinfo, buffer);
+
+      return;
+   }
+
+   /*
+    * So is a sequence of images
+    */
+   if ((sequence_arg = stristr(buffer, SEQUENCE_CMD)) != NULL) {
+      int nimages = 0;
+      double interval = 0;
+
+      sscanf(sequence_arg + strlen(SEQUENCE_CMD), "%d %lf", &nimages, 
+	     &interval);
+      startSequence((client_info_t *)cinfo, buffer, nimages, interval);
+
+      return;
+   }
+
+   /*
+    * Requests for frames from the free-running capture need the client
+    * as well, and are answered straight from the ring
+    */
+   if (stristr(buffer, LATEST_CMD) != NULL) {
+      sendVideoFrames((client_info_t *)cinfo, buffer, LATEST_CMD, 1);
+
+      return;
+   }
+   if ((frames_arg = stristr(buffer, FRAMES_CMD)) != NULL) {
+      sendVideoFrames((client_info_t *)cinfo, buffer, FRAMES_CMD, 
+		      atoi(frames_arg + strlen(FRAMES_CMD)));
+
+      return;
+   }
+
+   /*
+    * So is the preview of the last image
+    */
+   if (stristr(buffer, PREVIEW_CMD) != NULL) {
+      sendPreview((client_info_t *)cinfo, buffer);
+
+      return;
+   }
+
+   /*
+    * And the images fetched from the archive, which follow one another
+    */
+   if ((fetch_arg = stristr(buffer, FETCH_CMD)) != NULL) {
+      startFetch((client_info_t *)cinfo, buffer, 
+		 fetch_arg + strlen(FETCH_CMD));
+
+      return;
+   }
+
+   /*
+    * A DUALIMAGE also takes an IR image from the Tau server.  It has to be
+    * picked out before IMAGE, which it contains.
+    */
+   if (stristr(buffer, DUALIMAGE_CMD) != NULL) {
+      takeImage((client_info_t *)cinfo, buffer, TRUE,
+		stristr(buffer, IMAGE_ASYNC_STRING) != NULL);
+
+      return;
+   }
 
    /*
     * If this is an "image" request handle this in a special way.  Any time
     * images are requested, any video currently in progress must be stopped.
     */
    if (stristr(buffer, IMAGE_CMD) != NULL) {
-      takeImage((client_info_t *)cinfo, buffer);
+      takeImage((client_info_t *)cinfo, buffer, FALSE,
+		stristr(buffer, IMAGE_ASYNC_STRING) != NULL);
+
+      return;
+   }
+
+   /*
+    * So does the choice of compression, which is made per client
+    */
+   if ((compress_arg = stristr(buffer, COMPRESS_CMD)) != NULL) {
+      setCompression((client_info_t *)cinfo, buffer, 
+		     compress_arg + strlen(COMPRESS_CMD));
+
+      return;
+   }
+
+   /*
+    * As do the calibration masters: building them, and applying them to
+    * the images sent to the client
+    */
+   if ((calib_arg = stristr(buffer, DARK_CMD)) != NULL) {
+      startCalibration((client_info_t *)cinfo, buffer, CALIB_DARK,
+		       atoi(calib_arg + strlen(DARK_CMD)));
+
+      return;
+   }
+   if ((calib_arg = stristr(buffer, FLAT_CMD)) != NULL) {
+      startCalibration((client_info_t *)cinfo, buffer, CALIB_FLAT,
+		       atoi(calib_arg + strlen(FLAT_CMD)));
+
+      return;
+   }
+   if ((calib_arg = stristr(buffer, CALIBRATE_CMD)) != NULL) {
+      setCalibration((client_info_t *)cinfo, buffer, 
+		     calib_arg + strlen(CALIBRATE_CMD));
+
+      return;
+   }
+
+   /*
+    * A bulk transfer request needs the client, so it can't go through the
+    * command table either.
+    */
+   if (stristr(buffer, BULK_CMD) != NULL) {
+      negotiateBulk((client_info_t *)cinfo, buffer);
 
       return;
    }
@@ -980,6 +6998,7 @@ client_recv(void *cinfo, char* buffer)
       strcpy(buffer, "! Error");
    }
 }
+#endif
 
 /*
  * Send out binary image data to a client
@@ -989,6 +7008,26 @@ client_send_binary(void *client, char *buffer, int *len)
 {
    client_info_t *cinfo = (client_info_t *)client;
 
+   /*
+    * The images of a FETCH are queued up one at a time, once the one
+    * before has gone out
+    */
+   if ((cinfo->fetch_next < cinfo->fetch_end) && !cinfo->send_data &&
+       (cinfo->reply[0] == '\0')) {
+      sendFetchedImage(cinfo);
+   }
+
+   /*
+    * A reply held back until an exposure was done goes out first, ahead
+    * of the image data it announces
+    */
+   if (cinfo->reply[0] != '\0') {
+      sprintf(buffer, "%s\n", cinfo->reply);
+      *len = strlen(buffer);
+      cinfo->reply[0] = '\0';
+      return;
+   }
+
    /*
     * Check whether this client has any data to be sent.
     */
@@ -996,6 +7035,24 @@ client_send_binary(void *client, char *buffer, int *len)
 
       int send_count;
 
+      /*
+       * With a bulk data connection the image goes out on it a part at a
+       * time, and nothing is passed back through the sockserv buffer
+       */
+      if (cinfo->data_fd != -1) {
+	 *len = 0;
+	 if ((sendImageBulk(cinfo) == PASS) && 
+	     (cinfo->data_count < cinfo->total_count)) {
+	    return;
+	 }
+	 cinfo->send_data = 0;
+	 cinfo->data_count = 0;
+	 releaseImageData(cinfo);
+	 recordStage(STAGE_SEND, getClockTime() - cinfo->send_start_ts);
+	 publishStats();
+	 return;
+      }
+
       /* 
        * If all the data has been sent, send out a final summary 
        */
@@ -1003,10 +7060,9 @@ client_send_binary(void *client, char *buffer, int *len)
 	 *len = 0;
 	 cinfo->send_data = 0;
 	 cinfo->data_count = 0;
-	 if (cinfo->image_data != NULL) {
-	    free(cinfo->image_data);
-	    cinfo->image_data = NULL;
-	 }
+	 releaseImageData(cinfo);
+	 recordStage(STAGE_SEND, getClockTime() - cinfo->send_start_ts);
+	 publishStats();
 	 return;
       }
 
@@ -1024,6 +7080,25 @@ client_send_binary(void *client, char *buffer, int *len)
 }
 
 
+#ifndef BENCHMARK
+/*
+ * Block the termination signals in the calling thread, keeping the mask
+ * it had in 'saved'.  Worker threads are started with them blocked, so a
+ * signal is only ever taken by the server loop and never interrupts a
+ * thread holding ss_lock.
+ */
+static void
+blockSignals(sigset_t *saved) {
+
+   sigset_t signals;
+
+   sigemptyset(&signals);
+   sigaddset(&signals, SIGTERM);
+   sigaddset(&signals, SIGINT);
+   pthread_sigmask(SIG_BLOCK, &signals, saved);
+}
+
+
 /*
  * Handle a cleanup of the socket resources and make sure the shutter is 
  * closed.
@@ -1031,17 +7106,48 @@ client_send_binary(void *client, char *buffer, int *len)
 static void
 cleanup(void) {
 
+   static atomic_flag cleaned = ATOMIC_FLAG_INIT;
+   PASSFAIL rc;
+   int tries;
+
+   /*
+    * Only clean up once.  exit() runs this again through atexit(), and a
+    * signal may come in while it is already under way.
+    */
+   if (atomic_flag_test_and_set(&cleaned)) {
+      return;
+   }
+
    cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
 	     "(%s:%d) cleanup()", __FILE__, __LINE__);
 
    /*
-    * Mark the server as no longer running
+    * Mark the server as no longer running.  A Status Server call under way
+    * in another thread is given a moment to finish, but the lock is never
+    * waited on for good, and it is let go before exiting.
     */
-   if (ssPutBoolean(SS_SERVER_RUNNING, FALSE) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_ERROR,
-		"(%s:%d) ssPutBoolean on %s failed: %s",
-		__FILE__, __LINE__, SS_SERVER_RUNNING, ssGetStrError());
-      exit(EXIT_FAILURE);
+   for (tries = 0; tries < CLEANUP_LOCK_TRIES; tries++) {
+      if (pthread_mutex_trylock(&ss_lock) == 0) {
+	 break;
+      }
+      usleep(CLEANUP_LOCK_WAIT);
+   }
+   if (tries == CLEANUP_LOCK_TRIES) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+		"(%s:%d) Status Server busy, %s left as it is",
+		__FILE__, __LINE__, SS_SERVER_RUNNING);
+   }
+   else {
+      rc = ssPutBoolean(SS_SERVER_RUNNING, FALSE);
+      if (rc != PASS) {
+	 cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		   "(%s:%d) ssPutBoolean on %s failed: %s",
+		   __FILE__, __LINE__, SS_SERVER_RUNNING, ssGetStrError());
+      }
+      pthread_mutex_unlock(&ss_lock);
+      if (rc != PASS) {
+	 exit(EXIT_FAILURE);
+      }
    }
 
    /*
@@ -1051,16 +7157,206 @@ cleanup(void) {
       sockserv_destroy(serv_info->zwo_serv);
       serv_info->zwo_serv = NULL;
    }
+   if (serv_info->data_listen_fd != -1) {
+      close(serv_info->data_listen_fd);
+      serv_info->data_listen_fd = -1;
+   }
+   if (serv_info->wake_fd != -1) {
+      close(serv_info->wake_fd);
+      serv_info->wake_fd = -1;
+   }
+
+   /*
+    * Take the camera out of video mode and stop any background exposures
+    */
+   stopVideoCapture();
+   stopPipeline();
+
+   exit(EXIT_SUCCESS);
+}
+#endif
+
+
+#ifdef BENCHMARK
+
+#define BENCH_LOOPS 10 /* Frames or images timed for each benchmark */
+
+/*
+ * Get a monotonic timestamp for timing the benchmarks
+ */
+static double
+benchClockTime(void) {
+
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (double)(ts.tv_sec + ts.tv_nsec / 1000000000.0);
+}
+
+
+/*
+ * Set up the readout and image sizes for a frame of 'width' x 'height'
+ * binned in software by 'bin'
+ */
+static void
+benchSetFormat(int width, int height, int bin)
+{
+   serv_info->readout_width = width;
+   serv_info->readout_height = height;
+   serv_info->bin = bin;
+   serv_info->soft_bin = (bin > 1);
+   serv_info->image_width = width / bin;
+   serv_info->image_height = height / bin;
+   serv_info->roi_width = width;
+   serv_info->roi_height = height;
+}
+
+
+/*
+ * Time software binning of a full frame
+ */
+static void
+benchBin(int width, int height, int bin)
+{
+   unsigned short *frame, *work;
+   double start, bin_time = 0;
+   int i;
+
+   frame = (unsigned short *)cli_malloc(width * height * sizeof(uint16_t));
+   work = (unsigned short *)cli_malloc(width * height * sizeof(uint16_t));
+   fillSyntheticFrame(frame, width, height, MOCK_BITS, 1);
+   benchSetFormat(width, height, bin);
+   for (i = 0; i < BENCH_LOOPS; i++) {
+      memcpy(work, frame, width * height * sizeof(uint16_t));
+      start = benchClockTime();
+      binFrame(work);
+      bin_time += benchClockTime() - start;
+   }
+   printf("%4dx%-4d bin %d  %8.3f ms/frame  %8.1f frames/s\n", width, 
+	  height, bin, bin_time * 1000.0 / BENCH_LOOPS, 
+	  BENCH_LOOPS / bin_time);
+
+   free(frame);
+   free(work);
+}
+
+
+/*
+ * Time writeFITSImage() on one frame, then pull the result through
+ * client_send_binary() in SEND_BUF_SIZE pieces the way sockserv does.
+ * The header metadata is read from the Status Server once beforehand.
+ */
+static void
+benchEncode(int width, int height, int compress)
+{
+   client_info_t cinfo;
+   unsigned short *frame;
+   char *buffer;
+   double start, encode_time = 0, send_time = 0;
+   long calls = 0;
+   int len;
+   int fd;
+   int i;
+
+   frame = (unsigned short *)cli_malloc(width * height * sizeof(uint16_t));
+   fillSyntheticFrame(frame, width, height, MOCK_BITS, 1);
+   benchSetFormat(width, height, 1);
+   buffer = (char *)cli_malloc(SEND_BUF_SIZE);
+   memset(&cinfo, 0, sizeof(cinfo));
+   cinfo.image_fd = -1;
+   cinfo.data_fd = -1;
+   cinfo.compress = compress;
+   noteExposure();
+
+   for (i = 0; i < BENCH_LOOPS; i++) {
+      if ((fd = openImageFile(&cinfo)) == -1) {
+	 break;
+      }
+      start = benchClockTime();
+      if (writeFITSImage(frame, fd, getClockTime(), FALSE, compress) 
+	  != PASS) {
+	 break;
+      }
+      encode_time += benchClockTime() - start;
+      if (mapImageFile(&cinfo) != PASS) {
+	 break;
+      }
+
+      cinfo.send_data = 1;
+      cinfo.data_count = 0;
+      cinfo.total_count = cinfo.image_size;
+      start = benchClockTime();
+      while (cinfo.send_data) {
+	 client_send_binary(&cinfo, buffer, &len);
+	 calls++;
+      }
+      send_time += benchClockTime() - start;
+   }
+   if (i == 0) {
+      printf("%4dx%-4d encode failed\n", width, height);
+   }
+   else {
+      printf("%4dx%-4d encode %-4s %8.3f ms/image  send %8.3f ms/image"
+	     " (%ld calls)  %8.1f images/s\n", width, height,
+	     compress ? COMPRESS_RICE_STRING : COMPRESS_NONE_STRING,
+	     encode_time * 1000.0 / i, send_time * 1000.0 / i, calls / i,
+	     i / (encode_time + send_time));
+   }
+
+   releaseImageData(&cinfo);
+   if (cinfo.image_fd != -1) {
+      close(cinfo.image_fd);
+   }
+   free(frame);
+   free(buffer);
+}
+
 
+/*
+ * Micro-benchmarks of the image path.  Build the server with -DBENCHMARK
+ * to run these in place of the server itself.  The end to end benchmark
+ * is imagebench, run against a server built with -DMOCK_CAMERA.
+ */
+int
+main(int argc, const char* argv[])
+{
+   cfht_log(CFHT_MAIN, CFHT_LOG_ID, argv[0]);
+   cli_malloc_retry(TRUE);
+   serv_info = (server_info_t *)cli_malloc(sizeof(server_info_t));
+   memset(serv_info, 0, sizeof(server_info_t));
+   serv_info->data_listen_fd = -1;
+   serv_info->event_fd = -1;
+   serv_info->wake_fd = -1;
+   allocateBuffers(3096, 2080);
+
+   benchBin(3096, 2080, 2);
+   benchBin(3096, 2080, 3);
+   benchBin(3096, 2080, 4);
+
+   if (ssLogon(argv[0]) != PASS) {
+      printf("No Status Server, skipping writeFITSImage and"
+	     " client_send_binary: %s\n", ssGetStrError());
+      exit(EXIT_SUCCESS);
+   }
+   refreshMetadata();
+   benchEncode(640, 512, FALSE);
+   benchEncode(640, 512, TRUE);
+   benchEncode(3096, 2080, FALSE);
+   benchEncode(3096, 2080, TRUE);
    exit(EXIT_SUCCESS);
 }
 
+#else
 
 int
 main(int argc, const char* argv[])
 {
+   struct epoll_event wake_event;
+   sigset_t saved_signals;
    char hostname[255];
    const char *ip_address;
+   int wait;
+   int i;
 
    /*
     * Set up the environment variable used by the cfht_log system to 
@@ -1087,21 +7383,88 @@ main(int argc, const char* argv[])
     */
    serv_info = (server_info_t *)cli_malloc(sizeof(server_info_t));
    memset(serv_info, 0, sizeof(server_info_t));
+   serv_info->data_listen_fd = -1;
+   serv_info->event_fd = -1;
+   serv_info->wake_fd = -1;
    serv_info->response_buffer = (char *)cli_malloc(256);
+   serv_info->auto_max_etime = AUTO_MAX_ETIME;
+   pthread_mutex_init(&serv_info->video_lock, NULL);
+   pthread_mutex_init(&serv_info->pipeline_lock, NULL);
+   pthread_cond_init(&serv_info->pipeline_cond, NULL);
+   pthread_mutex_init(&serv_info->camera_lock, NULL);
+   pthread_cond_init(&serv_info->camera_cond, NULL);
+   serv_info->asi_camera_info 
+      = (ASI_CAMERA_INFO *)cli_malloc(sizeof(ASI_CAMERA_INFO));
+
+   /*
+    * Set up the wakeups of the server loop, for the images of the pipeline
+    * here and for the commands as they connect
+    */
+   if ((serv_info->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR, 
+		"(%s:%d) unable to create the image eventfd : %s"
+		" (errno=%d)", __FILE__, __LINE__, strerror(errno), errno);
+      exit(EXIT_FAILURE);
+   }
+   wake_event.events = EPOLLIN;
+   wake_event.data.fd = serv_info->event_fd;
+   if (((serv_info->wake_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) ||
+       (epoll_ctl(serv_info->wake_fd, EPOLL_CTL_ADD, serv_info->event_fd,
+		  &wake_event) == -1)) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR, 
+		"(%s:%d) unable to set up the server loop wakeups : %s"
+		" (errno=%d)", __FILE__, __LINE__, strerror(errno), errno);
+      exit(EXIT_FAILURE);
+   }
    
    /*
     * Create a linked list to hold client entries
     */
    serv_info->client_list = createList(cli_malloc);
 
+   /*
+    * Set up the images shared by the subscribers
+    */
+   for (i = 0; i < 2; i++) {
+      shared_image[i].image_fd = -1;
+      shared_image[i].data_fd = -1;
+      shared_image[i].compress = i;
+   }
+
+   /*
+    * Make sure there is somewhere to keep the calibration masters and the
+    * camera cache
+    */
+   if ((mkdir(CALIB_DIR, 0775) == -1) && (errno != EEXIST)) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+		"(%s:%d) unable to create %s : %s (errno=%d)",
+		__FILE__, __LINE__, CALIB_DIR, strerror(errno), errno);
+   }
+
+   /*
+    * Look for the camera in the background while the Status Server is
+    * connected to.  With the camera cached the buffers can be sized now,
+    * and the server starts whether or not the camera is there yet.
+    */
+   if (loadCameraCache() == PASS) {
+      setCameraSize();
+   }
+   blockSignals(&saved_signals);
+   startCamera();
+   pthread_sigmask(SIG_SETMASK, &saved_signals, NULL);
+
    /* 
-    * Connect to the Status Server
+    * Connect to the Status Server, waiting twice as long after each
+    * failure
     */
+   wait = LOGON_RETRY_MIN;
    while (ssLogon(argv[0]) != PASS) {
       cfht_logv(CFHT_MAIN, CFHT_WARN,
 		"(%s:%d): connection to Status Server failed...retry in"
-		" progress: %s", __FILE__, __LINE__, ssGetStrError());
-      sleep(60);
+		" %d seconds: %s", __FILE__, __LINE__, wait, 
+		ssGetStrError());
+      sleep(wait);
+      wait = (wait * 2 < LOGON_RETRY_MAX) ? wait * 2 : LOGON_RETRY_MAX;
    }
 
    /*
@@ -1127,14 +7490,18 @@ main(int argc, const char* argv[])
    cli_signal(SIGINT, cleanup);
 
    /*
-    * Try to initialize the camera connection.  If the connection can not
-    * be established, exit.
+    * Without a cache the size of the camera isn't known until it is
+    * found, so wait for it
     */
-   if (initCameraConnection() != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_ERROR, 
-		"(%s:%d) Unable to establish connection to"
-		" the ZWO camera", __FILE__, __LINE__);
-      exit(EXIT_FAILURE);
+   if (serv_info->pool.base == NULL) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) waiting for the ZWO camera", __FILE__, __LINE__);
+      pthread_mutex_lock(&serv_info->camera_lock);
+      while (serv_info->camera_state == CAMERA_LOST) {
+	 pthread_cond_wait(&serv_info->camera_cond, &serv_info->camera_lock);
+      }
+      pthread_mutex_unlock(&serv_info->camera_lock);
+      setCameraSize();
    }
 
    /* 
@@ -1148,6 +7515,21 @@ main(int argc, const char* argv[])
       exit(EXIT_FAILURE);
    }
 
+   /*
+    * Set up the port for bulk data connections.  Without it clients are
+    * still served through the chunked transfer.
+    */
+   for (i = 0; i < MAX_PENDING_DATA; i++) {
+      serv_info->pending_data_fd[i] = -1;
+   }
+   if ((serv_info->data_listen_fd 
+	= createDataListener(ZWOSERV_DATA_PORT)) == -1) {
+      cfht_logv(CFHT_MAIN, CFHT_WARN,
+		"(%s:%d) bulk data port %s unavailable, only chunked"
+		" transfers will be offered", __FILE__, __LINE__,
+		ZWOSERV_DATA_PORT);
+   }
+
    /*
     * Establish the hostname where the server is currently running
     */
@@ -1192,6 +7574,24 @@ main(int argc, const char* argv[])
       exit(EXIT_FAILURE);
    }
 
+   /*
+    * Read the FITS header metadata from the Status Server, and keep it
+    * fresh from here on in the background
+    */
+   blockSignals(&saved_signals);
+   startMetadata();
+
+   /*
+    * Previews are encoded in the background as the images are taken
+    */
+   startPreview();
+   pthread_sigmask(SIG_SETMASK, &saved_signals, NULL);
+
+   /*
+    * Keep an archive of the images taken
+    */
+   startArchive();
+
    /* 
     * Cleanup camera and socket resources before exiting 
     */
@@ -1210,17 +7610,22 @@ main(int argc, const char* argv[])
 	     __FILE__, __LINE__);
 
    /* 
-    * Go through a loop processing any commands sent by the client.
+    * Go through a loop processing any commands sent by the client.  While
+    * an exposure is under way or a sequence is about to need one sockserv
+    * is only polled, and the pacing is left to serveExposures().
     */
    for (;;) {
 
       cli_signal_block(SIGTERM);
       cli_signal_block(SIGINT);
 
-      sockserv_run(serv_info->zwo_serv, SOCKSERV_IDLE_POLL_INTERVAL);
+      sockserv_run(serv_info->zwo_serv, loopTimeout());
+      serveExposures(TRUE);
 
       cli_signal_unblock(SIGTERM);
       cli_signal_unblock(SIGINT);
    }
    exit(EXIT_SUCCESS);
 }
+
+#endif
@@ -12,7 +12,7 @@
  *    downloaded as binary data.
  *
  *********************************************************************!*/
-
+#define _GNU_SOURCE		/* splice(), O_DIRECT */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,6 +22,10 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <ctype.h>
 
 #include "sockio/sockclnt.h" 
@@ -35,6 +39,23 @@
 
 #define BINARY_CMD "binary"
 #define IMAGE_CMD "image"
+#define ASYNC_ARG "async"
+#define BULK_CMD "bulk"
+#define LATEST_CMD "latest"
+#define FRAMES_CMD "frames"
+#define DUALIMAGE_CMD "dualimage"
+#define SEQUENCE_CMD "sequence"
+#define FETCH_CMD "fetch"
+#define SINCE_ARG "since"
+#define BULK_REPLY "BULK"
+#define RICE_REPLY "RICE"
+#define RICE_SUFFIX ".fz"
+#define BULK_RCVBUF (4 * 1024 * 1024)
+#define RECV_BUF_SIZE (4 * 1024 * 1024) /* Largest read of image data */
+#define SPLICE_PIPE_SIZE (1024 * 1024) /* Pipe the image is spliced through */
+#define DIRECT_ALIGN 4096	/* Buffer and block alignment for O_DIRECT */
+#define VERBOSE_ARG "verbose"
+#define DIRECT_ARG "direct"
 
 #define SS_PATH "/i/dualcam/visible"
 #define SS_IP_ADDRESS SS_PATH"/ipAddress"
@@ -50,10 +71,357 @@
 static void
 usage(void)
 {
-   fprintf(stderr, "usage: zwograb [rootdir=] [etime=<sec>] [gain=[0..510]] > stdout\n");
+   fprintf(stderr, "usage: zwograb [rootdir=] [etime=<sec>] [gain=[0..510]] [auto=on|off] [bulk] [compress=rice|none] [calibrate=on|off] [verbose] [direct] [sequence=<n>[,<interval>]] [video=on|off] [latest|frames=<n>|dualimage|since=<unixtime>] > stdout\n");
+}
+
+
+/*
+ * Open the bulk data connection negotiated with the bulk command and
+ * identify it to the camera server with the token from the reply.
+ */
+static int
+connectDataChannel(const char *host, const char *port, const char *token)
+{
+   struct addrinfo hints;
+   struct addrinfo *res;
+   char line[40];
+   int rcvbuf = BULK_RCVBUF;
+   int fd;
+   int rc;
+
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_INET;
+   hints.ai_socktype = SOCK_STREAM;
+   if ((rc = getaddrinfo(host, port, &hints, &res)) != 0) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		"(%s:%d) unable to resolve data port %s:%s : %s",
+		__FILE__, __LINE__, host, port, gai_strerror(rc));
+      return -1;
+   }
+   if ((fd = socket(res->ai_family, res->ai_socktype, 
+		    res->ai_protocol)) == -1) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		"(%s:%d) unable to create data socket : %s (errno=%d)",
+		__FILE__, __LINE__, strerror(errno), errno);
+      freeaddrinfo(res);
+      return -1;
+   }
+   setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+   if (connect(fd, res->ai_addr, res->ai_addrlen) == -1) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		"(%s:%d) unable to connect to data port %s:%s : %s"
+		" (errno=%d)", __FILE__, __LINE__, host, port, 
+		strerror(errno), errno);
+      close(fd);
+      freeaddrinfo(res);
+      return -1;
+   }
+   freeaddrinfo(res);
+
+   snprintf(line, sizeof(line), "%s\n", token);
+   if (write(fd, line, strlen(line)) != (ssize_t)strlen(line)) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		"(%s:%d) unable to send token on data connection : %s"
+		" (errno=%d)", __FILE__, __LINE__, strerror(errno), errno);
+      close(fd);
+      return -1;
+   }
+
+   return fd;
+}
+
+
+/*
+ * Write all of 'len' bytes to 'fd', picking up after partial writes
+ */
+static PASSFAIL
+writeAll(int fd, const char *buf, size_t len)
+{
+   ssize_t nwrite;
+
+   while (len > 0) {
+      nwrite = write(fd, buf, len);
+      if (nwrite == -1) {
+	 if (errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN) {
+	    usleep(1000);
+	    continue;
+	 }
+	 cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		   "(%s:%d) write to image file failed : %s (errno=%d)",
+		   __FILE__, __LINE__, strerror(errno), errno);
+	 return FAIL;
+      }
+      if (nwrite == 0) {
+	 cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		   "(%s:%d) unexpected EOF on image file write",
+		   __FILE__, __LINE__);
+	 return FAIL;
+      }
+      buf += nwrite;
+      len -= nwrite;
+   }
+
+   return PASS;
+}
+
+
+/*
+ * Move the image data from the socket to the file inside the kernel,
+ * through a pipe.  Returns the number of bytes moved, which falls short of
+ * 'nbytes' only when splice() can't be used on these descriptors and the
+ * data has to be copied instead, or -1 on errors.
+ */
+static int
+spliceImage(int in_fd, int out_fd, int nbytes, int verbose)
+{
+   int pipe_fd[2];
+   int count = 0;
+   ssize_t nin, nout;
+
+   if (pipe(pipe_fd) == -1) {
+      return 0;
+   }
+   fcntl(pipe_fd[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+   while (count < nbytes) {
+      nin = splice(in_fd, NULL, pipe_fd[1], NULL, nbytes - count,
+		   SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (nin == -1) {
+	 if (errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN) {
+	    usleep(1000);
+	    continue;
+	 }
+	 if ((errno == EINVAL) && (count == 0)) {
+	    break;
+	 }
+	 cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		   "(%s:%d) splice from socket failed : %s (errno=%d)",
+		   __FILE__, __LINE__, strerror(errno), errno);
+	 count = -1;
+	 break;
+      }
+      if (nin == 0) {
+	 cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		   "(%s:%d) unexpected EOF on socket read",
+		   __FILE__, __LINE__);
+	 count = -1;
+	 break;
+      }
+      while (nin > 0) {
+	 nout = splice(pipe_fd[0], NULL, out_fd, NULL, nin,
+		       SPLICE_F_MOVE | SPLICE_F_MORE);
+	 if (nout == -1 && errno == EINTR) {
+	    continue;
+	 }
+	 if (nout <= 0) {
+	    cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		      "(%s:%d) splice to image file failed : %s (errno=%d)",
+		      __FILE__, __LINE__, strerror(errno), errno);
+	    close(pipe_fd[0]);
+	    close(pipe_fd[1]);
+	    return -1;
+	 }
+	 nin -= nout;
+	 count += nout;
+      }
+      if (verbose) {
+	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		   "(%s:%d) bytes spliced total = %d of %d",
+		   __FILE__, __LINE__, count, nbytes);
+      }
+   }
+   close(pipe_fd[0]);
+   close(pipe_fd[1]);
+
+   return count;
+}
+
+
+/*
+ * Copy the rest of the image data, from byte 'count' on, from the socket
+ * to the file through a large buffer, reading whatever has arrived each
+ * time.  An O_DIRECT file is only written whole aligned blocks from an
+ * aligned buffer, and cut back to the size of the image at the end.
+ */
+static PASSFAIL
+copyImage(int in_fd, int out_fd, int nbytes, int count, int verbose, 
+	  int direct)
+{
+   char *buf;
+   size_t filled = 0;
+   size_t len;
+   ssize_t nread;
+
+   if (posix_memalign((void **)&buf, DIRECT_ALIGN, RECV_BUF_SIZE) != 0) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		"(%s:%d) unable to allocate the receive buffer",
+		__FILE__, __LINE__);
+      return FAIL;
+   }
+   while (count < nbytes) {
+      len = RECV_BUF_SIZE - filled;
+      if (len > (size_t)(nbytes - count)) {
+	 len = nbytes - count;
+      }
+      nread = read(in_fd, buf + filled, len);
+      if (nread == -1) {
+	 if (errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN) {
+	    usleep(1000);
+	    continue;
+	 }
+	 cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		   "(%s:%d) read from socket failed : %s (errno=%d)",
+		   __FILE__, __LINE__, strerror(errno), errno);
+	 free(buf);
+	 return FAIL;
+      }
+      if (nread == 0) {
+	 cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		   "(%s:%d) unexpected EOF on socket read",
+		   __FILE__, __LINE__);
+	 free(buf);
+	 return FAIL;
+      }
+      count += nread;
+      filled += nread;
+      if (verbose) {
+	 cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		   "(%s:%d) bytes read = %d, total = %d",
+		   __FILE__, __LINE__, (int)nread, count);
+      }
+      if (direct && (filled < RECV_BUF_SIZE) && (count < nbytes)) {
+	 continue;
+      }
+      len = filled;
+      if (direct) {
+	 len = (filled + DIRECT_ALIGN - 1) & ~(size_t)(DIRECT_ALIGN - 1);
+	 memset(buf + filled, 0, len - filled);
+      }
+      if (writeAll(out_fd, buf, len) != PASS) {
+	 free(buf);
+	 return FAIL;
+      }
+      filled = 0;
+   }
+   free(buf);
+
+   if (direct && (ftruncate(out_fd, nbytes) == -1)) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		"(%s:%d) unable to trim the image file : %s (errno=%d)",
+		__FILE__, __LINE__, strerror(errno), errno);
+      return FAIL;
+   }
+
+   return PASS;
 }
 
 
+/*
+ * Receive 'nbytes' of image data from the socket into the file.  The
+ * space for the image is reserved up front.  Unless the file was opened
+ * with O_DIRECT the data is spliced straight across, and only copied when
+ * splice() isn't available.
+ */
+static PASSFAIL
+receiveImage(int in_fd, int out_fd, int nbytes, int verbose, int direct)
+{
+   int count = 0;
+
+   if ((nbytes > 0) && (posix_fallocate(out_fd, 0, nbytes) != 0)) {
+      cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		"(%s:%d) unable to preallocate %d bytes for the image file",
+		__FILE__, __LINE__, nbytes);
+   }
+   if (!direct && ((count = spliceImage(in_fd, out_fd, nbytes, 
+					verbose)) == -1)) {
+      return FAIL;
+   }
+   if (count == nbytes) {
+      return PASS;
+   }
+
+   return copyImage(in_fd, out_fd, nbytes, count, verbose, direct);
+}
+
+/*
+ * Save the image announced by 'reply' as 'file_name', with the suffix
+ * fpack would give it if it is Rice compressed, and record 'image_name'
+ * as the last image taken.  A bulk reply means the data comes in on the
+ * data connection instead of the command socket.
+ */
+static PASSFAIL
+saveImage(const char *reply, int sock_fd, int data_fd, const char *file_name,
+	  const char *image_name, int verbose, int direct)
+{
+   char path[255];
+   char data_mode[20];
+   char data_format[20];
+   char status;
+   int nbytes;
+   int in_fd;
+   int fd;
+
+   /*
+    * Read the reply to get the resulting image size.
+    */
+   data_mode[0] = '\0';
+   data_format[0] = '\0';
+   if (!reply || sscanf(reply, "%c %d %19s %19s", 
+			&status, &nbytes, data_mode, data_format) < 2) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		"(%s:%d) error received from the ZWO camera server."
+		"  Response = '%s'", __FILE__, __LINE__, reply);
+      return FAIL;
+   }
+
+   /*
+    * A compressed image is a Rice tile compressed FITS file, which is
+    * kept as it is and named the way fpack would name it.
+    */
+   snprintf(path, sizeof(path), "%s", file_name);
+   if (!strcasecmp(data_mode, RICE_REPLY) || 
+       !strcasecmp(data_format, RICE_REPLY)) {
+      strncat(path, RICE_SUFFIX, sizeof(path) - strlen(path) - 1);
+   }
+   printf("Writing to: %s\n", path);
+
+   /*
+    * Open the file for writing.  Not every file system takes O_DIRECT, so
+    * fall back to a normal file when it is refused.
+    */
+   fd = open(path, O_CREAT | O_WRONLY | O_TRUNC | (direct ? O_DIRECT : 0),
+             S_IRUSR | S_IRGRP | S_IROTH | S_IWUSR | S_IWGRP | S_IWOTH);
+   if ((fd == -1) && direct && (errno == EINVAL)) {
+      direct = 0;
+      fd = open(path, O_CREAT | O_WRONLY | O_TRUNC,
+		S_IRUSR | S_IRGRP | S_IROTH | S_IWUSR | S_IWGRP | S_IWOTH);
+   }
+   if (fd == -1) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		"(%s:%d) unable to open %s for writing : %s (errno=%d)",
+		__FILE__, __LINE__, path, strerror(errno), errno);
+      return FAIL;
+   }
+
+   in_fd = sock_fd;
+   if (!strcasecmp(data_mode, BULK_REPLY) && (data_fd != -1)) {
+      in_fd = data_fd;
+   }
+   if (receiveImage(in_fd, fd, nbytes, verbose, direct) != PASS) {
+      close(fd);
+      return FAIL;
+   }
+   close(fd);
+   
+   if (ssPutString(SS_LASTIMAGE, image_name) != PASS) {
+      cfht_logv(CFHT_MAIN, CFHT_ERROR,
+                "(%s:%d) ssPutString on %s with %s failed: %s",
+             __FILE__, __LINE__, SS_LASTIMAGE, image_name, ssGetStrError());
+      return FAIL;
+   }
+
+   return PASS;
+}
+
 int
 main(int argc, char* argv[])
 {
@@ -63,12 +431,20 @@ main(int argc, char* argv[])
    char ip_address[80];
    char port[20];
    int count = 1;
+   int one = 1;
    int i = 1;
-   int nbytes, nread, nwrite;
+   int verbose = 0;
+   int direct = 0;
+   int nimages = 0;
+   int fetch = 0;
+   int async = 1;
+   int failures = 0;
+   int n;
    char status;
    char file_name[255];
    char file_directory[255];
-   int fd;
+   int data_fd = -1;
+   char image_request[40];
    char *args[argc];
   
    time_t rawtime;
@@ -110,7 +486,7 @@ main(int argc, char* argv[])
       }
       count++;
    }
-   if(count == 5) {
+   if(count == argc) {
       //roodir= not found
       usage();
       exit(EXIT_FAILURE);
@@ -140,7 +516,6 @@ main(int argc, char* argv[])
    //strncat(file_name, "/", 255);
    //strncpy(file_name, "image.fits", 255);
    printf("Directory created: %s\n", file_directory);
-   printf("Writing to: %s\n", file_name);
 
 
    //create args removing rootdir
@@ -199,8 +574,16 @@ main(int argc, char* argv[])
 	     __FILE__, __LINE__, buf);
 
    /*
-    * Send parameters given on the command line (see usage).
+    * Turn off Nagle's algorithm, so the short commands go out at once
+    */
+   setsockopt(sock->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+   /*
+    * Send parameters given on the command line (see usage).  A latest,
+    * frames, dualimage or sequence request takes the place of the image
+    * request at the end.
     */
+   strcpy(image_request, IMAGE_CMD " " ASYNC_ARG);
    count = 1;
    while (count < argc -  1) {
       char *equal;
@@ -227,6 +610,61 @@ main(int argc, char* argv[])
 	 *p = ' ';
       }
 
+      if (!strcasecmp(arg, DUALIMAGE_CMD)) {
+	 snprintf(image_request, sizeof(image_request), "%s %s", arg,
+		  ASYNC_ARG);
+	 async = 1;
+	 free(arg);
+	 continue;
+      }
+      if (!strcasecmp(arg, LATEST_CMD) ||
+	  !strncasecmp(arg, FRAMES_CMD, strlen(FRAMES_CMD))) {
+	 snprintf(image_request, sizeof(image_request), "%s", arg);
+	 async = 0;
+	 free(arg);
+	 continue;
+      }
+
+      /*
+       * A sequence of images is asked for instead of a single one
+       */
+      if (!strncasecmp(arg, SEQUENCE_CMD " ", strlen(SEQUENCE_CMD) + 1)) {
+	 nimages = atoi(arg + strlen(SEQUENCE_CMD) + 1);
+	 if (nimages < 1) {
+	    usage();
+	    exit(EXIT_FAILURE);
+	 }
+	 snprintf(image_request, sizeof(image_request), "%s", arg);
+	 free(arg);
+	 continue;
+      }
+
+      /*
+       * So are the images archived by the server since a given time,
+       * however many there turn out to be
+       */
+      if (!strncasecmp(arg, SINCE_ARG " ", strlen(SINCE_ARG) + 1)) {
+	 snprintf(image_request, sizeof(image_request), "%s %s=%s",
+		  FETCH_CMD, SINCE_ARG, arg + strlen(SINCE_ARG) + 1);
+	 fetch = 1;
+	 free(arg);
+	 continue;
+      }
+
+      /*
+       * The receive options are for zwograb itself
+       */
+      if (!strcasecmp(arg, VERBOSE_ARG)) {
+	 verbose = 1;
+	 free(arg);
+	 continue;
+      }
+      if (!strcasecmp(arg, DIRECT_ARG)) {
+	 direct = 1;
+	 free(arg);
+	 continue;
+      }
+
       /*
        * Send the command on to the ZWO camera server
        */
@@ -241,96 +679,89 @@ main(int argc, char* argv[])
 		   "  Response = '%s'", __FILE__, __LINE__, reply);
 	 exit(EXIT_FAILURE);
       }
+
+      /*
+       * A bulk reply carries the data port and token to connect with
+       */
+      if (!strcasecmp(arg, BULK_CMD)) {
+	 char data_port[20];
+	 char token[20];
+
+	 if (sscanf(reply, "%c %*s %19s %19s", &status, data_port,
+		    token) != 3 ||
+	     (data_fd = connectDataChannel(ip_address, data_port, 
+					   token)) == -1) {
+	    cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		      "(%s:%d) unable to set up bulk transfer."
+		      "  Response = '%s'", __FILE__, __LINE__, reply);
+	    exit(EXIT_FAILURE);
+	 }
+      }
    }
 
    /*
-    * Start the exposure.
+    * Start the exposure, a sequence of them, or pick up frames from the
+    * free-running capture or the archive.
     */
-   sockclnt_send(sock, IMAGE_CMD);
+   sockclnt_send(sock, image_request);
    cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
 	     "(%s:%d) send '%s' to the ZWO camera server",
-	     __FILE__, __LINE__, IMAGE_CMD);
+	     __FILE__, __LINE__, image_request);
    sockclnt_set_mode(sock, SOCKCLNT_MODE_BINARY);
    reply = sockclnt_recv(sock);
 
    /*
-    * Read the reply to get the resulting image size.
+    * The fetch reply says how many archived images follow
     */
-   if (!reply || sscanf(reply, "%c %d", 
-			&status, &nbytes) != 2) {
-      cfht_logv(CFHT_MAIN, CFHT_ERROR,
-		"(%s:%d) error received from the ZWO camera server."
-		"  Response = '%s'", __FILE__, __LINE__, reply);
-      exit(EXIT_FAILURE);
+   if (fetch && reply && (*reply != '!')) {
+      sscanf(reply, "%c %*s %d", &status, &nimages);
    }
-   //open file for writing
-   fd = open(file_name, O_CREAT | O_RDWR | O_TRUNC,
-             S_IRUSR | S_IRGRP | S_IROTH | S_IWUSR | S_IWGRP | S_IWOTH);
-   /*
-    * Read the image data from the server.
-    */
-   count = 0;
-   while (count < nbytes) {
-      nread = nbytes;
-      if (nread > sizeof(buf)) {
-	 nread = sizeof(buf);
+
+   if (!fetch && (nimages == 0)) {
+      /*
+       * The image request is acknowledged as soon as the exposure is
+       * queued up, and the image is announced once it has been read out
+       */
+      if (async && reply && (*reply != '!')) {
+	 reply = sockclnt_recv(sock);
       }
-      nread = read(sock->fd, buf, nread);
-#ifdef DEBUG
-      printf("logonly: (%s:%d) bytes read = %d, total = %d\n", 
-	     __FILE__, __LINE__, nread, count + nread);
-#endif
-      switch (nread) {
-	 case 0: 
-	    cfht_logv(CFHT_MAIN, CFHT_ERROR,
-		      "(%s:%d) unexpected EOF on socket read",
-		      __FILE__, __LINE__);
-	    exit(EXIT_FAILURE);
-	 case -1:
-	    if (errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN) {
-	       usleep(1000);
-	       continue;
-	    }
-	    cfht_logv(CFHT_MAIN, CFHT_ERROR,
-		      "(%s:%d) read from socket failed : %s"
-		      " (errno=%d)", __FILE__, __LINE__, strerror(errno),
-		      errno);
-	    exit(EXIT_FAILURE);
-	 default:
-	    count += nread;
-	    nwrite = 0;
-
-	    while (nwrite < nread) {
-	       nwrite = write(fd, buf, nread);
-	       switch (nwrite) {
-		  case 0:
-		     cfht_logv(CFHT_MAIN, CFHT_ERROR, 
-			       "(%s:%d) unexpected EOF on file"
-			       " write to stdout", __FILE__, __LINE__);
-		     exit(EXIT_FAILURE);
-		  case -1:
-			if(errno == EAGAIN) {
-			usleep(1000);
-			continue;
-		     }
-		     cfht_logv(CFHT_MAIN, CFHT_ERROR,
-			       "(%s:%d) write to stdout failed : %s"
-			       " (errno=%d)", __FILE__, __LINE__, 
-			       strerror(errno), errno);
-		     exit(EXIT_FAILURE);
-		  default:
-		     ;
-	       }
-	    }
+      if (saveImage(reply, sock->fd, data_fd, file_name, date_buffer,
+		    verbose, direct) != PASS) {
+	 exit(EXIT_FAILURE);
       }
    }
-   close(fd);
+   else {
+      if (!reply || *reply == '!') {
+	 cfht_logv(CFHT_MAIN, CFHT_ERROR,
+		   "(%s:%d) error received from the ZWO camera server."
+		   "  Response = '%s'", __FILE__, __LINE__, reply);
+	 exit(EXIT_FAILURE);
+      }
 
-   if (ssPutString(SS_LASTIMAGE, date_buffer) != PASS) {
-      cfht_logv(CFHT_MAIN, CFHT_ERROR,
-                "(%s:%d) ssPutString on %s with %s failed: %s",
-             __FILE__, __LINE__, SS_LASTIMAGE, date_buffer, ssGetStrError());
-      exit(EXIT_FAILURE);
+      /*
+       * The images of a sequence follow one another over the connection,
+       * and are numbered after the time the grab started.  An image the
+       * server couldn't take is skipped rather than ending the sequence.
+       */
+      for (n = 1; n <= nimages; n++) {
+	 char image_name[300];
+
+	 reply = sockclnt_recv(sock);
+	 if (reply && *reply == '!') {
+	    cfht_logv(CFHT_MAIN, CFHT_LOGONLY,
+		      "(%s:%d) image %d of %d failed.  Response = '%s'",
+		      __FILE__, __LINE__, n, nimages, reply);
+	    failures++;
+	    continue;
+	 }
+	 snprintf(file_name, sizeof(file_name), "%s_%04d.fits", time_buffer,
+		  n);
+	 snprintf(image_name, sizeof(image_name), "%s_%04d", date_buffer, n);
+	 if (saveImage(reply, sock->fd, data_fd, file_name, image_name,
+		       verbose, direct) != PASS) {
+	    exit(EXIT_FAILURE);
+	 }
+      }
    }
 
    /*
@@ -339,6 +770,9 @@ main(int argc, char* argv[])
    sockclnt_send(sock, "quit");
    reply = sockclnt_recv(sock);
    sockclnt_destroy(sock);
+   if (data_fd != -1) {
+      close(data_fd);
+   }
 
-   exit(EXIT_SUCCESS);
+   exit((failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
 }